@@ -82,6 +82,19 @@ void evr_init_basics(void);
  */
 #define evr_blob_flag_index_rule_claim 0x02
 
+/**
+ * evr_blob_flag_deflated indicates the blob is stored as zlib
+ * stream in its bucket. The flag is internal to the glacier storage
+ * and only visible to clients which explicitly ask for stored blobs.
+ */
+#define evr_blob_flag_deflated 0x80
+
+/**
+ * evr_blob_public_flags removes the storage internal flags from a
+ * blob's flags.
+ */
+#define evr_blob_public_flags(flags) ((flags) & ~evr_blob_flag_deflated)
+
 /**
  * evr_trim will make start and end point to a whitespace trimmed part
  * of s. end points to the character after the last non whitespace
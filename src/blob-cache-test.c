@@ -0,0 +1,146 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "assert.h"
+#include "test.h"
+#include "blob-cache.h"
+#include "errors.h"
+
+void make_key(evr_blob_ref key, size_t i);
+
+void put_blob(struct evr_blob_cache *c, size_t i, size_t size);
+
+void assert_cached(struct evr_blob_cache *c, size_t i, int cached);
+
+void test_put_and_acquire(void){
+    struct evr_blob_cache *c = evr_create_blob_cache(1000, 100);
+    assert(c);
+    evr_blob_ref key;
+    make_key(key, 1);
+    struct evr_blob_cache_entry *e;
+    assert(evr_blob_cache_acquire(c, key, &e) == evr_not_found);
+    assert(is_ok(evr_blob_cache_put(c, key, 3, "hello", 5)));
+    assert(is_ok(evr_blob_cache_acquire(c, key, &e)));
+    assert(e->flags == 3);
+    assert(e->size == 5);
+    assert(memcmp(e->data, "hello", 5) == 0);
+    assert(is_ok(evr_blob_cache_release(c, e)));
+    // blobs bigger than max_blob_size are not cached
+    make_key(key, 2);
+    char big[101];
+    memset(big, 'x', sizeof(big));
+    assert(is_ok(evr_blob_cache_put(c, key, 0, big, sizeof(big))));
+    assert(evr_blob_cache_acquire(c, key, &e) == evr_not_found);
+    struct evr_blob_cache_stats stats;
+    assert(is_ok(evr_blob_cache_get_stats(c, &stats)));
+    assert(stats.hits == 1);
+    assert(stats.misses == 2);
+    assert(stats.entries == 1);
+    assert(stats.bytes == 5);
+    assert(is_ok(evr_free_blob_cache(c)));
+}
+
+void test_scan_resistance(void){
+    struct evr_blob_cache *c = evr_create_blob_cache(1000, 100);
+    assert(c);
+    // blob 0 is read again after it left the in queue and becomes hot
+    put_blob(c, 0, 100);
+    for(size_t i = 1; i <= 10; ++i){
+        put_blob(c, i, 100);
+    }
+    assert_cached(c, 0, 0);
+    put_blob(c, 0, 100);
+    assert_cached(c, 0, 1);
+    // a scan over many blobs which are read only once
+    for(size_t i = 100; i < 200; ++i){
+        put_blob(c, i, 100);
+    }
+    assert_cached(c, 0, 1);
+    assert_cached(c, 199, 1);
+    assert_cached(c, 100, 0);
+    struct evr_blob_cache_stats stats;
+    assert(is_ok(evr_blob_cache_get_stats(c, &stats)));
+    assert(stats.bytes <= 1000);
+    assert(is_ok(evr_free_blob_cache(c)));
+}
+
+void test_release_after_eviction(void){
+    struct evr_blob_cache *c = evr_create_blob_cache(200, 100);
+    assert(c);
+    put_blob(c, 0, 100);
+    evr_blob_ref key;
+    make_key(key, 0);
+    struct evr_blob_cache_entry *e;
+    assert(is_ok(evr_blob_cache_acquire(c, key, &e)));
+    for(size_t i = 1; i < 10; ++i){
+        put_blob(c, i, 100);
+    }
+    // the acquired entry stays readable after it got evicted
+    assert(e->size == 100);
+    assert(e->data[0] == 0);
+    assert(is_ok(evr_blob_cache_release(c, e)));
+    assert_cached(c, 0, 0);
+    assert(is_ok(evr_free_blob_cache(c)));
+}
+
+void make_key(evr_blob_ref key, size_t i){
+    // keys share their leading bytes so that collisions within the
+    // hash table are provoked
+    memset(key, 0, evr_blob_ref_size);
+    memcpy(&key[evr_blob_ref_size - sizeof(i)], &i, sizeof(i));
+    key[0] = i & 0x0f;
+}
+
+void put_blob(struct evr_blob_cache *c, size_t i, size_t size){
+    evr_blob_ref key;
+    make_key(key, i);
+    char data[size];
+    memset(data, (char)i, size);
+    struct evr_blob_cache_entry *e;
+    if(evr_blob_cache_acquire(c, key, &e) == evr_ok){
+        assert(is_ok(evr_blob_cache_release(c, e)));
+        return;
+    }
+    assert(is_ok(evr_blob_cache_put(c, key, 0, data, size)));
+}
+
+void assert_cached(struct evr_blob_cache *c, size_t i, int cached){
+    evr_blob_ref key;
+    make_key(key, i);
+    struct evr_blob_cache_entry *e;
+    int res = evr_blob_cache_acquire(c, key, &e);
+    if(cached){
+        assert_msg(res == evr_ok, "Expected blob %zu to be cached", i);
+        assert(e->data[0] == (char)i);
+        assert(is_ok(evr_blob_cache_release(c, e)));
+    } else {
+        assert_msg(res == evr_not_found, "Expected blob %zu not to be cached", i);
+    }
+}
+
+int main(void){
+    evr_init_basics();
+    run_test(test_put_and_acquire);
+    run_test(test_scan_resistance);
+    run_test(test_release_after_eviction);
+    return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "blob-cache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "basics.h"
+#include "errors.h"
+#include "logger.h"
+
+#define evr_blob_cache_queue_in 1
+#define evr_blob_cache_queue_out 2
+#define evr_blob_cache_queue_hot 3
+
+/**
+ * evr_blob_cache_in_permille is the share of max_bytes which the in
+ * queue may occupy before its entries are evicted.
+ */
+#define evr_blob_cache_in_permille 250
+
+/**
+ * evr_blob_cache_expected_blob_size is used to estimate the number
+ * of cached blobs when sizing the hash table and the out queue.
+ */
+#define evr_blob_cache_expected_blob_size 4096
+
+void evr_blob_cache_push(struct evr_blob_cache_queue *q, struct evr_blob_cache_entry *e);
+
+void evr_blob_cache_unlink(struct evr_blob_cache_queue *q, struct evr_blob_cache_entry *e);
+
+struct evr_blob_cache_entry **evr_blob_cache_bucket(struct evr_blob_cache *c, const evr_blob_ref key);
+
+struct evr_blob_cache_entry *evr_blob_cache_find(struct evr_blob_cache *c, const evr_blob_ref key);
+
+void evr_blob_cache_remove_from_buckets(struct evr_blob_cache *c, struct evr_blob_cache_entry *e);
+
+/**
+ * evr_blob_cache_drop removes e from its queue and the hash
+ * table. The entry is freed right away if nobody acquired it.
+ */
+void evr_blob_cache_drop(struct evr_blob_cache *c, struct evr_blob_cache_queue *q, struct evr_blob_cache_entry *e);
+
+/**
+ * evr_blob_cache_evict drops entries until the cached blob data fits
+ * into max_bytes.
+ */
+int evr_blob_cache_evict(struct evr_blob_cache *c);
+
+struct evr_blob_cache *evr_create_blob_cache(size_t max_bytes, size_t max_blob_size){
+    struct evr_blob_cache *c = malloc(sizeof(struct evr_blob_cache));
+    if(!c){
+        goto out;
+    }
+    c->max_bytes = max_bytes;
+    c->max_blob_size = max_blob_size;
+    const size_t expected_entries = max_bytes / evr_blob_cache_expected_blob_size;
+    c->buckets_len = 256;
+    while(c->buckets_len < expected_entries){
+        c->buckets_len <<= 1;
+    }
+    c->buckets = calloc(c->buckets_len, sizeof(struct evr_blob_cache_entry*));
+    if(!c->buckets){
+        goto out_with_free_c;
+    }
+    memset(&c->in, 0, sizeof(c->in));
+    memset(&c->out, 0, sizeof(c->out));
+    memset(&c->hot, 0, sizeof(c->hot));
+    // 2Q suggests to remember about half as many evicted keys as
+    // the cache can hold blobs
+    c->max_out_len = max(64, expected_entries / 2);
+    c->hits = 0;
+    c->misses = 0;
+    if(mtx_init(&c->lock, mtx_plain) != thrd_success){
+        goto out_with_free_buckets;
+    }
+    return c;
+ out_with_free_buckets:
+    free(c->buckets);
+ out_with_free_c:
+    free(c);
+ out:
+    return NULL;
+}
+
+int evr_free_blob_cache(struct evr_blob_cache *c){
+    if(!c){
+        return evr_ok;
+    }
+    struct evr_blob_cache_queue *queues[] = { &c->in, &c->out, &c->hot };
+    for(size_t i = 0; i < static_len(queues); ++i){
+        struct evr_blob_cache_entry *e = queues[i]->head;
+        while(e){
+            struct evr_blob_cache_entry *next = e->next;
+            if(e->refs > 0){
+                evr_panic("Blob cache freed while an entry is still acquired");
+                return evr_error;
+            }
+            free(e);
+            e = next;
+        }
+    }
+    mtx_destroy(&c->lock);
+    free(c->buckets);
+    free(c);
+    return evr_ok;
+}
+
+int evr_blob_cache_acquire(struct evr_blob_cache *c, const evr_blob_ref key, struct evr_blob_cache_entry **entry){
+    int ret = evr_error;
+    if(mtx_lock(&c->lock) != thrd_success){
+        evr_panic("Unable to lock blob cache");
+        goto out;
+    }
+    struct evr_blob_cache_entry *e = evr_blob_cache_find(c, key);
+    if(!e || e->queue == evr_blob_cache_queue_out){
+        c->misses += 1;
+        ret = evr_not_found;
+        goto out_with_unlock;
+    }
+    if(e->queue == evr_blob_cache_queue_hot){
+        evr_blob_cache_unlink(&c->hot, e);
+        evr_blob_cache_push(&c->hot, e);
+    }
+    // hits on the in queue don't reorder it. otherwise a blob read
+    // twice in a short burst would look hot.
+    e->refs += 1;
+    c->hits += 1;
+    *entry = e;
+    ret = evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&c->lock) != thrd_success){
+        evr_panic("Unable to unlock blob cache");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_blob_cache_release(struct evr_blob_cache *c, struct evr_blob_cache_entry *entry){
+    if(mtx_lock(&c->lock) != thrd_success){
+        evr_panic("Unable to lock blob cache");
+        return evr_error;
+    }
+    entry->refs -= 1;
+    // a queue of 0 indicates the entry got dropped while it was
+    // acquired
+    if(entry->refs == 0 && entry->queue == 0){
+        free(entry);
+    }
+    if(mtx_unlock(&c->lock) != thrd_success){
+        evr_panic("Unable to unlock blob cache");
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_blob_cache_put(struct evr_blob_cache *c, const evr_blob_ref key, int flags, const char *data, size_t size){
+    int ret = evr_error;
+    if(size > c->max_blob_size || size > c->max_bytes){
+        return evr_ok;
+    }
+    struct evr_blob_cache_entry *e = malloc(sizeof(struct evr_blob_cache_entry) + size);
+    if(!e){
+        goto out;
+    }
+    memcpy(e->key, key, evr_blob_ref_size);
+    e->flags = flags;
+    e->size = size;
+    e->refs = 0;
+    memcpy(e->data, data, size);
+    if(mtx_lock(&c->lock) != thrd_success){
+        evr_panic("Unable to lock blob cache");
+        goto out_with_free_e;
+    }
+    struct evr_blob_cache_entry *existing = evr_blob_cache_find(c, key);
+    struct evr_blob_cache_queue *q = &c->in;
+    if(existing){
+        if(existing->queue != evr_blob_cache_queue_out){
+            // another connection cached the blob in the meantime
+            ret = evr_ok;
+            goto out_with_unlock;
+        }
+        // the blob got requested again after it was evicted from in
+        evr_blob_cache_drop(c, &c->out, existing);
+        q = &c->hot;
+    }
+    e->queue = q == &c->hot ? evr_blob_cache_queue_hot : evr_blob_cache_queue_in;
+    evr_blob_cache_push(q, e);
+    struct evr_blob_cache_entry **bucket = evr_blob_cache_bucket(c, key);
+    e->bucket_next = *bucket;
+    *bucket = e;
+    e = NULL;
+    if(evr_blob_cache_evict(c) != evr_ok){
+        goto out_with_unlock;
+    }
+    ret = evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&c->lock) != thrd_success){
+        evr_panic("Unable to unlock blob cache");
+        ret = evr_error;
+    }
+ out_with_free_e:
+    free(e);
+ out:
+    return ret;
+}
+
+int evr_blob_cache_get_stats(struct evr_blob_cache *c, struct evr_blob_cache_stats *stats){
+    if(mtx_lock(&c->lock) != thrd_success){
+        evr_panic("Unable to lock blob cache");
+        return evr_error;
+    }
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->entries = c->in.entries_len + c->hot.entries_len;
+    stats->bytes = c->in.bytes + c->hot.bytes;
+    if(mtx_unlock(&c->lock) != thrd_success){
+        evr_panic("Unable to unlock blob cache");
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_blob_cache_evict(struct evr_blob_cache *c){
+    const size_t max_in_bytes = c->max_bytes / 1000 * evr_blob_cache_in_permille;
+    while(c->in.bytes + c->hot.bytes > c->max_bytes){
+        if(c->in.tail && (c->in.bytes > max_in_bytes || !c->hot.tail)){
+            struct evr_blob_cache_entry *e = c->in.tail;
+            struct evr_blob_cache_entry *ghost = malloc(sizeof(struct evr_blob_cache_entry));
+            if(!ghost){
+                return evr_error;
+            }
+            memcpy(ghost->key, e->key, evr_blob_ref_size);
+            ghost->flags = 0;
+            ghost->size = 0;
+            ghost->refs = 0;
+            evr_blob_cache_drop(c, &c->in, e);
+            ghost->queue = evr_blob_cache_queue_out;
+            evr_blob_cache_push(&c->out, ghost);
+            struct evr_blob_cache_entry **bucket = evr_blob_cache_bucket(c, ghost->key);
+            ghost->bucket_next = *bucket;
+            *bucket = ghost;
+            if(c->out.entries_len > c->max_out_len){
+                evr_blob_cache_drop(c, &c->out, c->out.tail);
+            }
+        } else {
+            evr_blob_cache_drop(c, &c->hot, c->hot.tail);
+        }
+    }
+    return evr_ok;
+}
+
+void evr_blob_cache_push(struct evr_blob_cache_queue *q, struct evr_blob_cache_entry *e){
+    e->prev = NULL;
+    e->next = q->head;
+    if(q->head){
+        q->head->prev = e;
+    } else {
+        q->tail = e;
+    }
+    q->head = e;
+    q->entries_len += 1;
+    q->bytes += e->size;
+}
+
+void evr_blob_cache_unlink(struct evr_blob_cache_queue *q, struct evr_blob_cache_entry *e){
+    if(e->prev){
+        e->prev->next = e->next;
+    } else {
+        q->head = e->next;
+    }
+    if(e->next){
+        e->next->prev = e->prev;
+    } else {
+        q->tail = e->prev;
+    }
+    q->entries_len -= 1;
+    q->bytes -= e->size;
+}
+
+struct evr_blob_cache_entry **evr_blob_cache_bucket(struct evr_blob_cache *c, const evr_blob_ref key){
+    // blob refs are cryptographic hashes so the leading bytes of the
+    // key are used as hash value
+    uint64_t hash;
+    memcpy(&hash, key, sizeof(hash));
+    return &c->buckets[hash & (c->buckets_len - 1)];
+}
+
+struct evr_blob_cache_entry *evr_blob_cache_find(struct evr_blob_cache *c, const evr_blob_ref key){
+    for(struct evr_blob_cache_entry *e = *evr_blob_cache_bucket(c, key); e; e = e->bucket_next){
+        if(memcmp(e->key, key, evr_blob_ref_size) == 0){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void evr_blob_cache_remove_from_buckets(struct evr_blob_cache *c, struct evr_blob_cache_entry *e){
+    for(struct evr_blob_cache_entry **it = evr_blob_cache_bucket(c, e->key); *it; it = &(*it)->bucket_next){
+        if(*it == e){
+            *it = e->bucket_next;
+            return;
+        }
+    }
+}
+
+void evr_blob_cache_drop(struct evr_blob_cache *c, struct evr_blob_cache_queue *q, struct evr_blob_cache_entry *e){
+    evr_blob_cache_unlink(q, e);
+    evr_blob_cache_remove_from_buckets(c, e);
+    e->queue = 0;
+    if(e->refs == 0){
+        free(e);
+    }
+}
@@ -0,0 +1,148 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * blob-cache.h defines an in-memory cache of small blobs' contents
+ * which are read frequently.
+ *
+ * The cache follows the 2Q replacement strategy. Blobs seen for the
+ * first time enter a FIFO queue. Only blobs which are requested
+ * again after they left the FIFO queue get into the LRU queue of hot
+ * blobs. A scan over many blobs therefore can't push the hot blobs
+ * out of the cache.
+ *
+ * Blobs are immutable so cached blobs never need to be invalidated.
+ */
+
+#ifndef blob_cache_h
+#define blob_cache_h
+
+#include "config.h"
+
+#include <threads.h>
+
+#include "keys.h"
+
+/**
+ * struct evr_blob_cache_entry is one cached blob.
+ *
+ * Entries returned by evr_blob_cache_acquire stay valid until they
+ * are passed to evr_blob_cache_release.
+ */
+struct evr_blob_cache_entry {
+    evr_blob_ref key;
+    int flags;
+    size_t size;
+
+    /**
+     * queue is one of evr_blob_cache_queue_*.
+     */
+    int queue;
+    size_t refs;
+    struct evr_blob_cache_entry *prev;
+    struct evr_blob_cache_entry *next;
+    struct evr_blob_cache_entry *bucket_next;
+    char data[];
+};
+
+struct evr_blob_cache_queue {
+    /**
+     * head is the most recently added entry.
+     */
+    struct evr_blob_cache_entry *head;
+    struct evr_blob_cache_entry *tail;
+    size_t entries_len;
+    size_t bytes;
+};
+
+struct evr_blob_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t entries;
+    size_t bytes;
+};
+
+struct evr_blob_cache {
+    mtx_t lock;
+    size_t max_bytes;
+    size_t max_blob_size;
+
+    /**
+     * buckets is a hash table of all entries in in, out and hot
+     * chained via bucket_next. buckets_len is a power of 2.
+     */
+    struct evr_blob_cache_entry **buckets;
+    size_t buckets_len;
+
+    /**
+     * in holds blobs which got requested once.
+     */
+    struct evr_blob_cache_queue in;
+
+    /**
+     * out remembers the keys of blobs which were evicted from in
+     * without their data.
+     */
+    struct evr_blob_cache_queue out;
+    size_t max_out_len;
+
+    /**
+     * hot holds blobs which got requested again after they were
+     * evicted from in. hot is sorted from most to least recently
+     * used.
+     */
+    struct evr_blob_cache_queue hot;
+
+    size_t hits;
+    size_t misses;
+};
+
+/**
+ * evr_create_blob_cache creates a cache holding at most max_bytes
+ * bytes of blob data. Blobs bigger than max_blob_size are never
+ * cached.
+ */
+struct evr_blob_cache *evr_create_blob_cache(size_t max_bytes, size_t max_blob_size);
+
+int evr_free_blob_cache(struct evr_blob_cache *c);
+
+/**
+ * evr_blob_cache_acquire looks up the blob with the given key.
+ *
+ * Returns evr_ok and sets entry if the blob is cached. The entry
+ * must be released using evr_blob_cache_release afterwards. Returns
+ * evr_not_found if the blob is not cached. The lookup is counted as
+ * miss then. Otherwise evr_error.
+ */
+int evr_blob_cache_acquire(struct evr_blob_cache *c, const evr_blob_ref key, struct evr_blob_cache_entry **entry);
+
+int evr_blob_cache_release(struct evr_blob_cache *c, struct evr_blob_cache_entry *entry);
+
+/**
+ * evr_blob_cache_put adds a copy of the blob's data to the
+ * cache. Callers usually put blobs after evr_blob_cache_acquire
+ * reported a miss.
+ *
+ * Blobs bigger than max_blob_size and blobs which are already cached
+ * are ignored.
+ */
+int evr_blob_cache_put(struct evr_blob_cache *c, const evr_blob_ref key, int flags, const char *data, size_t size);
+
+int evr_blob_cache_get_stats(struct evr_blob_cache *c, struct evr_blob_cache_stats *stats);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "assert.h"
+#include "test.h"
+#include "blob-index.h"
+#include "errors.h"
+
+void make_key(evr_blob_ref key, size_t i);
+
+void test_put_and_find(void){
+    struct evr_blob_index *idx = evr_create_blob_index(2);
+    assert(idx);
+    evr_blob_ref key;
+    make_key(key, 1);
+    struct evr_glacier_blob_pos pos;
+    assert(evr_blob_index_find(idx, key, &pos) == evr_not_found);
+    struct evr_glacier_blob_pos put_pos = { 3, 2, 100, 42 };
+    assert(is_ok(evr_blob_index_put(idx, key, &put_pos)));
+    assert(is_ok(evr_blob_index_find(idx, key, &pos)));
+    assert(pos.flags == 3);
+    assert(pos.bucket_index == 2);
+    assert(pos.offset == 100);
+    assert(pos.size == 42);
+    // the first put position is kept
+    struct evr_glacier_blob_pos dup_pos = { 0, 7, 200, 42 };
+    assert(is_ok(evr_blob_index_put(idx, key, &dup_pos)));
+    assert(is_ok(evr_blob_index_find(idx, key, &pos)));
+    assert(pos.bucket_index == 2);
+    assert(idx->entries_used == 1);
+    assert(is_ok(evr_free_blob_index(idx)));
+}
+
+void test_grow(void){
+    const size_t keys_len = 1000;
+    struct evr_blob_index *idx = evr_create_blob_index(2);
+    assert(idx);
+    evr_blob_ref key;
+    struct evr_glacier_blob_pos pos = { 0, 1, 0, 0 };
+    for(size_t i = 0; i < keys_len; ++i){
+        make_key(key, i);
+        pos.offset = i;
+        assert(is_ok(evr_blob_index_put(idx, key, &pos)));
+    }
+    assert(idx->entries_used == keys_len);
+    assert(idx->entries_len >= keys_len);
+    for(size_t i = 0; i < keys_len; ++i){
+        make_key(key, i);
+        assert(is_ok(evr_blob_index_find(idx, key, &pos)));
+        assert_msg(pos.offset == i, "But was %zu", pos.offset);
+    }
+    make_key(key, keys_len);
+    assert(evr_blob_index_find(idx, key, &pos) == evr_not_found);
+    assert(is_ok(evr_free_blob_index(idx)));
+}
+
+void make_key(evr_blob_ref key, size_t i){
+    // keys share their leading bytes so that collisions within the
+    // hash table are provoked
+    memset(key, 0, evr_blob_ref_size);
+    memcpy(&key[evr_blob_ref_size - sizeof(i)], &i, sizeof(i));
+    key[0] = i & 0x0f;
+}
+
+int main(void){
+    evr_init_basics();
+    run_test(test_put_and_find);
+    run_test(test_grow);
+    return 0;
+}
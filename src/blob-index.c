@@ -0,0 +1,166 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "blob-index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "logger.h"
+
+/**
+ * evr_blob_index_max_load_permille defines how many slots out of 1000
+ * may be used before the index grows.
+ */
+#define evr_blob_index_max_load_permille 700
+
+struct evr_blob_index *evr_create_blob_index(size_t entries_len_exp){
+    struct evr_blob_index *idx = malloc(sizeof(struct evr_blob_index));
+    if(!idx){
+        goto out;
+    }
+    idx->entries_len = (size_t)1 << entries_len_exp;
+    idx->entries_used = 0;
+    idx->entries = calloc(idx->entries_len, sizeof(struct evr_blob_index_entry));
+    if(!idx->entries){
+        goto out_with_free_idx;
+    }
+    if(pthread_rwlock_init(&idx->lock, NULL) != 0){
+        goto out_with_free_entries;
+    }
+    return idx;
+ out_with_free_entries:
+    free(idx->entries);
+ out_with_free_idx:
+    free(idx);
+ out:
+    return NULL;
+}
+
+int evr_free_blob_index(struct evr_blob_index *idx){
+    if(!idx){
+        return evr_ok;
+    }
+    int ret = evr_ok;
+    if(pthread_rwlock_destroy(&idx->lock) != 0){
+        evr_panic("Unable to destroy blob index lock");
+        ret = evr_error;
+    }
+    free(idx->entries);
+    free(idx);
+    return ret;
+}
+
+/**
+ * evr_blob_index_slot returns the slot which either contains key or
+ * is the free slot where key should be placed.
+ *
+ * blob refs are cryptographic hashes so the leading bytes of the
+ * key are used as hash value.
+ */
+struct evr_blob_index_entry *evr_blob_index_slot(struct evr_blob_index_entry *entries, size_t entries_len, const evr_blob_ref key);
+
+int evr_blob_index_grow(struct evr_blob_index *idx);
+
+int evr_blob_index_put(struct evr_blob_index *idx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos){
+    int ret = evr_error;
+    if(pthread_rwlock_wrlock(&idx->lock) != 0){
+        goto out;
+    }
+    if((idx->entries_used + 1) * 1000 > idx->entries_len * evr_blob_index_max_load_permille){
+        if(evr_blob_index_grow(idx) != evr_ok){
+            goto out_with_unlock;
+        }
+    }
+    struct evr_blob_index_entry *e = evr_blob_index_slot(idx->entries, idx->entries_len, key);
+    if(!e->used){
+        memcpy(e->key, key, evr_blob_ref_size);
+        e->used = 1;
+        e->flags = pos->flags;
+        e->bucket_index = pos->bucket_index;
+        e->offset = pos->offset;
+        e->size = pos->size;
+        idx->entries_used += 1;
+    }
+    ret = evr_ok;
+ out_with_unlock:
+    if(pthread_rwlock_unlock(&idx->lock) != 0){
+        evr_panic("Unable to unlock blob index");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_blob_index_find(struct evr_blob_index *idx, const evr_blob_ref key, struct evr_glacier_blob_pos *pos){
+    int ret = evr_error;
+    if(pthread_rwlock_rdlock(&idx->lock) != 0){
+        goto out;
+    }
+    struct evr_blob_index_entry *e = evr_blob_index_slot(idx->entries, idx->entries_len, key);
+    if(!e->used){
+        ret = evr_not_found;
+        goto out_with_unlock;
+    }
+    pos->flags = e->flags;
+    pos->bucket_index = e->bucket_index;
+    pos->offset = e->offset;
+    pos->size = e->size;
+    ret = evr_ok;
+ out_with_unlock:
+    if(pthread_rwlock_unlock(&idx->lock) != 0){
+        evr_panic("Unable to unlock blob index");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+struct evr_blob_index_entry *evr_blob_index_slot(struct evr_blob_index_entry *entries, size_t entries_len, const evr_blob_ref key){
+    uint64_t hash;
+    memcpy(&hash, key, sizeof(hash));
+    const size_t mask = entries_len - 1;
+    for(size_t i = hash & mask;; i = (i + 1) & mask){
+        struct evr_blob_index_entry *e = &entries[i];
+        if(!e->used || memcmp(e->key, key, evr_blob_ref_size) == 0){
+            return e;
+        }
+    }
+}
+
+int evr_blob_index_grow(struct evr_blob_index *idx){
+    const size_t entries_len = idx->entries_len << 1;
+    struct evr_blob_index_entry *entries = calloc(entries_len, sizeof(struct evr_blob_index_entry));
+    if(!entries){
+        return evr_error;
+    }
+    struct evr_blob_index_entry *end = &idx->entries[idx->entries_len];
+    for(struct evr_blob_index_entry *it = idx->entries; it != end; ++it){
+        if(!it->used){
+            continue;
+        }
+        struct evr_blob_index_entry *e = evr_blob_index_slot(entries, entries_len, it->key);
+        memcpy(e, it, sizeof(struct evr_blob_index_entry));
+    }
+    free(idx->entries);
+    idx->entries = entries;
+    idx->entries_len = entries_len;
+    log_debug("Blob index grew to %zu slots", entries_len);
+    return evr_ok;
+}
@@ -0,0 +1,95 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * blob-index.h defines an in-memory hash table which maps blob refs
+ * to their position within the glacier buckets.
+ *
+ * The table is shared between many reading threads and usually one
+ * writing thread.
+ */
+
+#ifndef blob_index_h
+#define blob_index_h
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "keys.h"
+#include "glacier.h"
+
+/**
+ * struct evr_blob_index_entry is one slot within the hash table.
+ *
+ * The bucket positions are stored as uint32_t to keep entries
+ * compact. Bucket end offsets are uint32_t anyway.
+ */
+struct evr_blob_index_entry {
+    evr_blob_ref key;
+    uint8_t used;
+    uint8_t flags;
+    uint32_t bucket_index;
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct evr_blob_index {
+    pthread_rwlock_t lock;
+    /**
+     * entries_len is the number of slots in entries. Always a power
+     * of 2.
+     */
+    size_t entries_len;
+    size_t entries_used;
+    struct evr_blob_index_entry *entries;
+};
+
+/**
+ * evr_create_blob_index creates an empty blob index.
+ *
+ * entries_len_exp is the exponent to the base of 2 which defines the
+ * initial number of slots. The index grows automatically.
+ *
+ * The returned index must be freed using evr_free_blob_index.
+ */
+struct evr_blob_index *evr_create_blob_index(size_t entries_len_exp);
+
+int evr_free_blob_index(struct evr_blob_index *idx);
+
+/**
+ * evr_blob_index_put adds the position of the blob with the given
+ * key.
+ *
+ * Adding a key which is already part of the index keeps the existing
+ * position. This matches the index db which keeps the first
+ * persisted copy of a blob.
+ */
+int evr_blob_index_put(struct evr_blob_index *idx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos);
+
+/**
+ * evr_blob_index_find looks up the position of the blob with the
+ * given key.
+ *
+ * Returns evr_ok if the key was found. Returns evr_not_found if no
+ * blob with the given key exists. Otherwise evr_error.
+ */
+int evr_blob_index_find(struct evr_blob_index *idx, const evr_blob_ref key, struct evr_glacier_blob_pos *pos);
+
+#endif
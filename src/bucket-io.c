@@ -0,0 +1,253 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#ifdef EVR_HAS_LIBURING
+#include <liburing.h>
+#endif
+
+#include "bucket-io.h"
+#include "basics.h"
+#include "errors.h"
+#include "files.h"
+#include "logger.h"
+
+/**
+ * evr_bucket_io_ring_entries is big enough for the longest chain
+ * evr_bucket_io_append submits.
+ */
+#define evr_bucket_io_ring_entries 8
+
+int evr_bucket_io_plain_append(int f, off_t offset, struct iovec *iov, size_t iovcnt, const void *header, size_t header_size, off_t header_offset, int sync);
+
+#ifdef EVR_HAS_LIBURING
+
+struct evr_bucket_io {
+    struct io_uring ring;
+
+    /**
+     * failed is set if the ring's state is unknown after an error. A
+     * failed ring is no longer used.
+     */
+    int failed;
+};
+
+struct evr_bucket_io *evr_create_bucket_io(void){
+    struct evr_bucket_io *io = malloc(sizeof(struct evr_bucket_io));
+    if(!io){
+        return NULL;
+    }
+    int init_res = io_uring_queue_init(evr_bucket_io_ring_entries, &io->ring, 0);
+    if(init_res < 0){
+        log_debug("Using plain bucket syscalls because io_uring is not available: %s", strerror(-init_res));
+        free(io);
+        return NULL;
+    }
+    io->failed = 0;
+    return io;
+}
+
+void evr_free_bucket_io(struct evr_bucket_io *io){
+    if(!io){
+        return;
+    }
+    io_uring_queue_exit(&io->ring);
+    free(io);
+}
+
+/**
+ * evr_bucket_io_wait_cqe reaps the next completion. res is set to
+ * the completion's result and data to the completion's user data.
+ */
+int evr_bucket_io_wait_cqe(struct evr_bucket_io *io, int *res, size_t *data);
+
+int evr_bucket_io_uring_append(struct evr_bucket_io *io, int f, off_t offset, struct iovec *iov, size_t iovcnt, const void *header, size_t header_size, off_t header_offset, int sync);
+
+int evr_bucket_io_append(struct evr_bucket_io *io, int f, off_t offset, struct iovec *iov, size_t iovcnt, const void *header, size_t header_size, off_t header_offset, int sync){
+    if(!io || io->failed || iovcnt > IOV_MAX){
+        return evr_bucket_io_plain_append(f, offset, iov, iovcnt, header, header_size, header_offset, sync);
+    }
+    return evr_bucket_io_uring_append(io, f, offset, iov, iovcnt, header, header_size, header_offset, sync);
+}
+
+int evr_bucket_io_wait_cqe(struct evr_bucket_io *io, int *res, size_t *data){
+    struct io_uring_cqe *cqe;
+    int wait_res;
+    do {
+        wait_res = io_uring_wait_cqe(&io->ring, &cqe);
+    } while(wait_res == -EINTR);
+    if(wait_res < 0){
+        log_error("Unable to wait for io_uring completion: %s", strerror(-wait_res));
+        io->failed = 1;
+        return evr_error;
+    }
+    *res = cqe->res;
+    *data = (size_t)(uintptr_t)io_uring_cqe_get_data(cqe);
+    io_uring_cqe_seen(&io->ring, cqe);
+    return evr_ok;
+}
+
+int evr_bucket_io_submit(struct evr_bucket_io *io, unsigned int wait_nr){
+    int submit_res;
+    do {
+        submit_res = io_uring_submit_and_wait(&io->ring, wait_nr);
+    } while(submit_res == -EINTR);
+    if(submit_res < 0){
+        log_error("Unable to submit to io_uring: %s", strerror(-submit_res));
+        io->failed = 1;
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_bucket_io_uring_append(struct evr_bucket_io *io, int f, off_t offset, struct iovec *iov, size_t iovcnt, const void *header, size_t header_size, off_t header_offset, int sync){
+    size_t data_size = 0;
+    for(size_t i = 0; i < iovcnt; ++i){
+        data_size += iov[i].iov_len;
+    }
+    if(data_size > INT_MAX){
+        return evr_bucket_io_plain_append(f, offset, iov, iovcnt, header, header_size, header_offset, sync);
+    }
+    // the chain is data write, data sync, header write and header
+    // sync. a failed or short link cancels the following links.
+    const size_t sqes_len = sync ? 4 : 2;
+    const int expected[4] = { data_size, 0, header_size, 0 };
+    for(size_t i = 0; i < sqes_len; ++i){
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+        if(!sqe){
+            log_error("io_uring has no free submission queue entries");
+            io->failed = 1;
+            return evr_error;
+        }
+        const size_t op = sync ? i : i * 2;
+        switch(op){
+        case 0:
+            io_uring_prep_writev(sqe, f, iov, iovcnt, offset);
+            break;
+        case 1:
+        case 3:
+            io_uring_prep_fsync(sqe, f, IORING_FSYNC_DATASYNC);
+            break;
+        case 2:
+            io_uring_prep_write(sqe, f, header, header_size, header_offset);
+            break;
+        }
+        if(i + 1 < sqes_len){
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        }
+        io_uring_sqe_set_data(sqe, (void*)(uintptr_t)i);
+    }
+    if(evr_bucket_io_submit(io, sqes_len) != evr_ok){
+        return evr_error;
+    }
+    int retry = 0;
+    int failed = 0;
+    for(size_t i = 0; i < sqes_len; ++i){
+        int res;
+        size_t slot;
+        if(evr_bucket_io_wait_cqe(io, &res, &slot) != evr_ok){
+            return evr_error;
+        }
+        const size_t op = sync ? slot : slot * 2;
+        if(res == expected[op]){
+            continue;
+        }
+        if(res >= 0 || res == -ECANCELED || res == -EINTR || res == -EAGAIN){
+            // short writes and interrupted links can be repeated
+            // because every write has a fixed offset.
+            retry = 1;
+        } else {
+            log_error("Unable to %s bucket: %s", op % 2 ? "fdatasync" : "write", strerror(-res));
+            failed = 1;
+        }
+    }
+    if(failed){
+        // a failed fdatasync must not be retried. a second
+        // fdatasync may succeed although the data got lost.
+        return evr_error;
+    }
+    if(retry){
+        return evr_bucket_io_plain_append(f, offset, iov, iovcnt, header, header_size, header_offset, sync);
+    }
+    return evr_ok;
+}
+
+#else
+
+struct evr_bucket_io *evr_create_bucket_io(void){
+    return NULL;
+}
+
+void evr_free_bucket_io(struct evr_bucket_io *io){
+}
+
+int evr_bucket_io_append(struct evr_bucket_io *io, int f, off_t offset, struct iovec *iov, size_t iovcnt, const void *header, size_t header_size, off_t header_offset, int sync){
+    return evr_bucket_io_plain_append(f, offset, iov, iovcnt, header, header_size, header_offset, sync);
+}
+
+#endif
+
+int evr_bucket_io_read(int f, off_t offset, size_t size, char *buffer, size_t buffer_size, int (*on_data)(void *arg, const char *data, size_t data_size), void *arg){
+    for(size_t bytes_read = 0; bytes_read < size;){
+        ssize_t buffer_bytes_read = pread(f, buffer, min(buffer_size, size - bytes_read), offset + bytes_read);
+        if(buffer_bytes_read <= 0){
+            return evr_error;
+        }
+        if(on_data(arg, buffer, buffer_bytes_read)){
+            return evr_error;
+        }
+        bytes_read += buffer_bytes_read;
+    }
+    return evr_ok;
+}
+
+int evr_bucket_io_plain_append(int f, off_t offset, struct iovec *iov, size_t iovcnt, const void *header, size_t header_size, off_t header_offset, int sync){
+    if(lseek(f, offset, SEEK_SET) == -1){
+        return evr_error;
+    }
+    if(writev_n(f, iov, iovcnt) != evr_ok){
+        log_error("Can't write data to bucket");
+        return evr_error;
+    }
+    if(sync && fdatasync(f) != 0){
+        log_error("Can't fsync data in bucket");
+        return evr_error;
+    }
+    for(size_t written = 0; written < header_size;){
+        ssize_t res = pwrite(f, (const char*)header + written, header_size - written, header_offset + written);
+        if(res < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            log_error("Can't write bucket header");
+            return evr_error;
+        }
+        written += res;
+    }
+    if(sync && fdatasync(f) != 0){
+        log_error("Can't fsync bucket header");
+        return evr_error;
+    }
+    return evr_ok;
+}
@@ -0,0 +1,74 @@
+/*
+ * everarch - the hopefully ever lasting archive
+ * Copyright (C) 2021-2022  Markus Peröbner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * bucket-io.h performs the bucket reads and appends of the glacier.
+ *
+ * If everarch is built with liburing the appends are batched through
+ * an io_uring. Otherwise or if the kernel refuses to set up an
+ * io_uring plain writev and fdatasync syscalls are used.
+ *
+ * Reads always use pread. Blobs are served via sendfile and the
+ * remaining reads are too short to gain from overlapping them.
+ */
+
+#ifndef bucket_io_h
+#define bucket_io_h
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * struct evr_bucket_io is the io_uring of one thread.
+ *
+ * All evr_bucket_io_* functions accept a NULL struct evr_bucket_io
+ * and use plain syscalls then.
+ */
+struct evr_bucket_io;
+
+/**
+ * evr_create_bucket_io sets up an io_uring.
+ *
+ * Returns NULL if no io_uring is available. The caller should fall
+ * back to passing NULL into the evr_bucket_io_* functions.
+ */
+struct evr_bucket_io *evr_create_bucket_io(void);
+
+void evr_free_bucket_io(struct evr_bucket_io *io);
+
+/**
+ * evr_bucket_io_read reads size bytes from f at offset and passes
+ * them to on_data in pieces of at most buffer_size bytes.
+ */
+int evr_bucket_io_read(int f, off_t offset, size_t size, char *buffer, size_t buffer_size, int (*on_data)(void *arg, const char *data, size_t data_size), void *arg);
+
+/**
+ * evr_bucket_io_append writes iov to f at offset and then header to
+ * f at header_offset.
+ *
+ * If sync is not zero the data is fdatasynced before the header is
+ * written and the header is fdatasynced afterwards. The io_uring
+ * links the writes and syncs so they are submitted together.
+ *
+ * iov is modified while the data is written.
+ */
+int evr_bucket_io_append(struct evr_bucket_io *io, int f, off_t offset, struct iovec *iov, size_t iovcnt, const void *header, size_t header_size, off_t header_offset, int sync);
+
+#endif
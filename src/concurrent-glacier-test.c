@@ -18,6 +18,7 @@
 
 #include "config.h"
 
+#include <stdatomic.h>
 #include <time.h>
 #include <threads.h>
 
@@ -31,6 +32,14 @@
 
 int evr_glacier_append_blob_result = evr_ok;
 
+/**
+ * failing_blob fails to append even if evr_glacier_append_blob_result
+ * is evr_ok. The other blobs of its batch are appended.
+ */
+struct evr_writing_blob *failing_blob = NULL;
+
+struct evr_glacier_storage_cfg *test_config;
+
 struct timespec short_delay = {
     0,
     10000000
@@ -38,6 +47,14 @@ struct timespec short_delay = {
 
 struct timespec *append_blob_delay = NULL;
 
+atomic_size_t append_blobs_calls = 0;
+
+/**
+ * appended_lanes has the bit 1 << lane set for every bucket lane
+ * which appended blobs.
+ */
+atomic_uint appended_lanes = 0;
+
 int evr_create_glacier_write_ctx(struct evr_glacier_write_ctx **ctx, struct evr_glacier_storage_cfg *config){
     *ctx = (struct evr_glacier_write_ctx*)1;
     return evr_ok;
@@ -47,21 +64,65 @@ int evr_free_glacier_write_ctx(struct evr_glacier_write_ctx *ctx){
     return evr_ok;
 }
 
-int evr_glacier_append_blob(struct evr_glacier_write_ctx *ctx, struct evr_writing_blob *blob, evr_time *last_modified){
+int evr_glacier_append_lane_blobs(struct evr_glacier_write_ctx *ctx, size_t lane, struct evr_writing_blob **blobs, size_t blobs_len, int *results, evr_time *last_modified){
     assert(ctx);
-    assert(blob);
+    assert_msg(lane < test_config->bucket_lanes, "But was %zu", lane);
+    assert(blobs);
+    assert(blobs_len > 0);
     assert(last_modified);
     if(append_blob_delay){
         assert(thrd_sleep(append_blob_delay, NULL) == 0);
     }
+    append_blobs_calls += 1;
+    appended_lanes |= 1u << lane;
     *last_modified = 123;
-    return evr_glacier_append_blob_result;
+    int ret = evr_glacier_append_blob_result;
+    for(size_t i = 0; i < blobs_len; ++i){
+        results[i] = blobs[i] == failing_blob ? evr_error : evr_glacier_append_blob_result;
+        if(results[i] != evr_ok){
+            ret = evr_error;
+        }
+        blobs[i]->pos.flags = 0;
+        blobs[i]->pos.bucket_index = 1;
+        blobs[i]->pos.offset = i;
+        blobs[i]->pos.size = 1;
+    }
+    return ret;
 }
 
-struct evr_glacier_storage_cfg *test_config;
+atomic_size_t aborted_streams = 0;
+
+int evr_glacier_begin_blob_stream(struct evr_glacier_write_ctx *ctx, size_t lane, struct evr_glacier_blob_stream *s){
+    assert(ctx);
+    assert_msg(lane < test_config->bucket_lanes, "But was %zu", lane);
+    s->lane = lane;
+    s->written = 0;
+    return evr_ok;
+}
+
+int evr_glacier_write_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s, const char *data, size_t data_size){
+    assert(s->written + data_size <= s->blob.size);
+    s->written += data_size;
+    return evr_ok;
+}
+
+int evr_glacier_commit_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s, evr_time *last_modified){
+    assert(s->written == s->blob.size);
+    *last_modified = 123;
+    s->blob.pos.flags = 0;
+    s->blob.pos.bucket_index = 2;
+    s->blob.pos.offset = s->lane;
+    s->blob.pos.size = s->blob.size;
+    return evr_ok;
+}
+
+int evr_glacier_abort_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s){
+    aborted_streams += 1;
+    return evr_ok;
+}
 
 void evr_temp_persister_start(void){
-    assert(is_ok(evr_persister_start(test_config)));
+    assert(is_ok(evr_persister_start(test_config, NULL)));
 }
 
 void evr_temp_persister_stop(void){
@@ -97,6 +158,44 @@ void test_queue_one_blob_write_error(void){
     evr_temp_persister_stop();
 }
 
+void test_queue_partially_failing_batch(void){
+    evr_glacier_append_blob_result = evr_ok;
+    append_blob_delay = NULL;
+    test_config->group_commit_latency = 200000;
+    struct evr_blob_index *index = evr_create_blob_index(4);
+    assert(index);
+    assert(is_ok(evr_persister_start(test_config, index)));
+    const size_t blob_count = 3;
+    struct evr_writing_blob blobs[blob_count];
+    struct evr_persister_task tasks[blob_count];
+    for(size_t i = 0; i < blob_count; ++i){
+        memset(blobs[i].key, i + 1, evr_blob_ref_size);
+        assert(is_ok(evr_persister_init_task(&tasks[i], &blobs[i])));
+    }
+    failing_blob = &blobs[1];
+    for(size_t i = 0; i < blob_count; ++i){
+        assert(is_ok(evr_persister_queue_task(&tasks[i])));
+    }
+    // the blobs around the failing blob must be reported as
+    // persisted and must be found in the blob index.
+    struct evr_glacier_blob_pos pos;
+    for(size_t i = 0; i < blob_count; ++i){
+        assert(is_ok(evr_persister_wait_for_task(&tasks[i])));
+        if(i == 1){
+            assert(is_err(tasks[i].result));
+            assert(evr_blob_index_find(index, blobs[i].key, &pos) == evr_not_found);
+        } else {
+            assert(is_ok(tasks[i].result));
+            assert(is_ok(evr_blob_index_find(index, blobs[i].key, &pos)));
+        }
+        assert(is_ok(evr_persister_destroy_task(&tasks[i])));
+    }
+    failing_blob = NULL;
+    evr_temp_persister_stop();
+    test_config->group_commit_latency = 0;
+    assert(is_ok(evr_free_blob_index(index)));
+}
+
 void queue_and_process_many_blobs(struct timespec *queue_delay);
 
 void test_queue_many_blobs_race(void){
@@ -119,6 +218,31 @@ void test_queue_many_blobs_slow_queue(void){
     queue_and_process_many_blobs(&short_delay);
 }
 
+void test_queue_many_blobs_group_commit(void){
+    evr_glacier_append_blob_result = evr_ok;
+    append_blob_delay = NULL;
+    append_blobs_calls = 0;
+    test_config->group_commit_latency = 200000;
+    queue_and_process_many_blobs(NULL);
+    test_config->group_commit_latency = 0;
+    // without group commits the persister might have been fast
+    // enough to append every blob on it's own.
+    assert_msg(append_blobs_calls < 100, "But was %zu", (size_t)append_blobs_calls);
+}
+
+void test_queue_many_blobs_multiple_lanes(void){
+    evr_glacier_append_blob_result = evr_ok;
+    append_blob_delay = &short_delay;
+    appended_lanes = 0;
+    test_config->bucket_lanes = 4;
+    queue_and_process_many_blobs(NULL);
+    test_config->bucket_lanes = 1;
+    // the slow appends keep one lane busy while the queue still
+    // holds tasks for the other lanes.
+    unsigned int lanes = appended_lanes;
+    assert_msg(lanes != 0 && (lanes & (lanes - 1)) != 0, "But appended lanes were %x", lanes);
+}
+
 #define many_blobs_count 100
 
 void queue_and_process_many_blobs(struct timespec *queue_delay){
@@ -156,15 +280,98 @@ void queue_and_process_many_blobs(struct timespec *queue_delay){
     evr_temp_persister_stop();
 }
 
+#define full_queue_blobs_count 2000
+
+void test_queue_blocks_while_full(void){
+    evr_glacier_append_blob_result = evr_ok;
+    append_blob_delay = &short_delay;
+    evr_temp_persister_start();
+    struct evr_writing_blob *blobs = malloc(sizeof(struct evr_writing_blob) * full_queue_blobs_count);
+    assert(blobs);
+    struct evr_persister_task *tasks = malloc(sizeof(struct evr_persister_task) * full_queue_blobs_count);
+    assert(tasks);
+    for(int i = 0; i < full_queue_blobs_count; i++){
+        assert(is_ok(evr_persister_init_task(&tasks[i], &blobs[i])));
+        // the slow appends fill the queue. queueing must wait for
+        // space instead of failing.
+        assert(is_ok(evr_persister_queue_task(&tasks[i])));
+    }
+    for(int i = 0; i < full_queue_blobs_count; i++){
+        assert(is_ok(evr_persister_wait_for_task(&tasks[i])));
+        assert(is_ok(tasks[i].result));
+        assert(is_ok(evr_persister_destroy_task(&tasks[i])));
+    }
+    free(tasks);
+    free(blobs);
+    evr_temp_persister_stop();
+}
+
+void test_stream_blob(void){
+    evr_glacier_append_blob_result = evr_ok;
+    append_blob_delay = NULL;
+    // a single lane is never streamed because the queued tasks need
+    // it.
+    evr_temp_persister_start();
+    struct evr_glacier_blob_stream s1;
+    memset(s1.blob.key, 1, evr_blob_ref_size);
+    s1.blob.flags = 0;
+    s1.blob.size = 3;
+    s1.blob.sync_strategy = evr_sync_strategy_default;
+    assert(evr_persister_begin_stream(&s1) == evr_temporary_occupied);
+    evr_temp_persister_stop();
+    test_config->bucket_lanes = 2;
+    struct evr_blob_index *index = evr_create_blob_index(4);
+    assert(index);
+    assert(is_ok(evr_persister_start(test_config, index)));
+    assert(is_ok(evr_persister_begin_stream(&s1)));
+    struct evr_glacier_blob_stream s2 = s1;
+    memset(s2.blob.key, 2, evr_blob_ref_size);
+    assert(evr_persister_begin_stream(&s2) == evr_temporary_occupied);
+    // queued tasks are appended to the lane which is not streamed
+    appended_lanes = 0;
+    struct evr_writing_blob blob;
+    memset(blob.key, 3, evr_blob_ref_size);
+    blob.flags = 0;
+    struct evr_persister_task task;
+    assert(is_ok(evr_persister_init_task(&task, &blob)));
+    assert(is_ok(evr_persister_queue_task(&task)));
+    assert(is_ok(evr_persister_wait_for_task(&task)));
+    assert(is_ok(task.result));
+    assert(is_ok(evr_persister_destroy_task(&task)));
+    assert_msg(appended_lanes == 1u << (1 - s1.lane), "But appended lanes were %x", appended_lanes);
+    assert(is_ok(evr_persister_write_stream(&s1, "abc", 3)));
+    evr_time last_modified;
+    assert(is_ok(evr_persister_end_stream(&s1, 1, &last_modified)));
+    assert(last_modified == 123);
+    struct evr_glacier_blob_pos pos;
+    assert(is_ok(evr_blob_index_find(index, s1.blob.key, &pos)));
+    assert(pos.bucket_index == 2);
+    // the released lane can be streamed again
+    aborted_streams = 0;
+    assert(is_ok(evr_persister_begin_stream(&s2)));
+    assert(is_ok(evr_persister_write_stream(&s2, "ab", 2)));
+    assert(is_ok(evr_persister_end_stream(&s2, 0, &last_modified)));
+    assert(aborted_streams == 1);
+    assert(evr_blob_index_find(index, s2.blob.key, &pos) == evr_not_found);
+    assert(is_ok(evr_persister_stop()));
+    assert(is_ok(evr_free_blob_index(index)));
+    test_config->bucket_lanes = 1;
+}
+
 int main(void){
     evr_init_basics();
     test_config = create_temp_evr_glacier_storage_cfg();
     assert(test_config);
     run_test(test_queue_one_blob_success);
     run_test(test_queue_one_blob_write_error);
+    run_test(test_queue_partially_failing_batch);
     run_test(test_queue_many_blobs_race);
     run_test(test_queue_many_blobs_slow_append);
     run_test(test_queue_many_blobs_slow_queue);
+    run_test(test_queue_many_blobs_group_commit);
+    run_test(test_queue_many_blobs_multiple_lanes);
+    run_test(test_queue_blocks_while_full);
+    run_test(test_stream_blob);
     evr_free_glacier_storage_cfg(test_config);
     return 0;
 }
@@ -21,12 +21,36 @@
 #include "concurrent-glacier.h"
 
 #include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "errors.h"
 #include "logger.h"
 #include "notify.h"
 
-#define evr_persister_task_queue_length 32
+/**
+ * evr_persister_task_queue_length is the number of tasks which can
+ * wait for a persister worker. Further evr_persister_queue_task calls
+ * block until workers took tasks from the queue.
+ */
+#define evr_persister_task_queue_length 512
+
+/**
+ * evr_persister_batch_len is the maximum number of tasks a persister
+ * worker appends with one glacier transaction.
+ */
+#define evr_persister_batch_len 32
+
+/**
+ * evr_persister_max_watchers is the maximum number of watchers. Only
+ * registered watchers occupy memory.
+ */
+#define evr_persister_max_watchers (16 << 10)
 
 struct evr_persister_ctx {
     struct evr_persister_task *tasks[evr_persister_task_queue_length + 1];
@@ -34,46 +58,129 @@ struct evr_persister_ctx {
     struct evr_persister_task **reading;
     mtx_t worker_lock;
     cnd_t has_tasks;
+
+    /**
+     * has_space is signaled when workers took tasks from a full
+     * queue. space_waiters is the number of evr_persister_queue_task
+     * calls waiting for has_space. Both are guarded by worker_lock.
+     */
+    cnd_t has_space;
+    size_t space_waiters;
+
+    /**
+     * lane_released is signaled when a worker finished appending or a
+     * blob stream released its lane. streaming_lanes is the number of
+     * lanes owned by blob streams. Both are guarded by worker_lock.
+     */
+    cnd_t lane_released;
+    size_t streaming_lanes;
     struct evr_glacier_write_ctx *write_ctx;
     int working;
     struct evr_notify_ctx *watchers;
+    size_t group_commit_latency;
+    struct evr_blob_index *index;
 };
 
 struct evr_persister_ctx evr_persister;
 
-thrd_t evr_persister_thread;
+/**
+ * struct evr_persister_worker_ctx describes one persister worker
+ * thread. Every worker appends its batches to its own bucket lane.
+ *
+ * All workers drain the one shared task queue instead of owning a
+ * share of the keys. So a task is taken by whichever lane becomes
+ * idle first and a lane stuck in a slow fdatasync never holds back
+ * tasks which other lanes could persist.
+ */
+struct evr_persister_worker_ctx {
+    thrd_t thread;
+    size_t lane;
+
+    /**
+     * streaming is set while a blob stream owns the worker's
+     * lane. appending is set while the worker appends a batch to its
+     * lane. Both are guarded by evr_persister.worker_lock.
+     */
+    int streaming;
+    int appending;
+};
+
+struct evr_persister_worker_ctx *evr_persister_workers;
+
+size_t evr_persister_workers_len;
 
 int evr_persister_worker(void *context);
 
-int evr_persister_start(struct evr_glacier_storage_cfg *config){
+/**
+ * evr_persister_join_workers stops and joins all started persister
+ * worker threads.
+ */
+int evr_persister_join_workers(void);
+
+/**
+ * evr_persister_release_lane hands the lane back to its worker after
+ * a blob stream ended.
+ */
+int evr_persister_release_lane(size_t lane);
+
+int evr_persister_start(struct evr_glacier_storage_cfg *config, struct evr_blob_index *index){
     if(mtx_init(&evr_persister.worker_lock, mtx_plain) != thrd_success){
         goto worker_lock_init_fail;
     }
     if(cnd_init(&evr_persister.has_tasks) != thrd_success){
         goto out_with_free_worker_lock;
     }
+    if(cnd_init(&evr_persister.has_space) != thrd_success){
+        goto out_with_free_has_tasks;
+    }
+    if(cnd_init(&evr_persister.lane_released) != thrd_success){
+        goto out_with_free_has_space;
+    }
+    evr_persister.space_waiters = 0;
+    evr_persister.streaming_lanes = 0;
     evr_persister.writing = evr_persister.tasks;
     evr_persister.reading = evr_persister.tasks;
     evr_persister.working = 1;
-    evr_persister.watchers = evr_create_notify_ctx(32, 8, sizeof(struct evr_modified_blob));
+    evr_persister.group_commit_latency = config->group_commit_latency;
+    evr_persister.index = index;
+    evr_persister.watchers = evr_create_notify_ctx(evr_persister_max_watchers, 8, sizeof(struct evr_modified_blob));
     if(!evr_persister.watchers){
-        goto out_with_free_has_tasks;
+        goto out_with_free_lane_released;
     }
     if(evr_create_glacier_write_ctx(&evr_persister.write_ctx, config) != evr_ok){
         goto out_with_free_watchers;
     }
+    evr_persister_workers = malloc(config->bucket_lanes * sizeof(struct evr_persister_worker_ctx));
+    if(!evr_persister_workers){
+        goto out_with_free_write_ctx;
+    }
     atomic_thread_fence(memory_order_release);
-    if(thrd_create(&evr_persister_thread, evr_persister_worker, NULL) != thrd_success){
-        goto thread_create_fail;
+    for(evr_persister_workers_len = 0; evr_persister_workers_len < config->bucket_lanes; ++evr_persister_workers_len){
+        struct evr_persister_worker_ctx *worker = &evr_persister_workers[evr_persister_workers_len];
+        worker->lane = evr_persister_workers_len;
+        worker->streaming = 0;
+        worker->appending = 0;
+        if(thrd_create(&worker->thread, evr_persister_worker, worker) != thrd_success){
+            goto thread_create_fail;
+        }
     }
-    log_debug("evr persister started with glacier %s", config->bucket_dir_path);
+    log_debug("evr persister started with glacier %s and %zu bucket lanes", config->bucket_dir_path, evr_persister_workers_len);
     return evr_ok;
  thread_create_fail:
+    if(evr_persister_join_workers() != evr_ok){
+        evr_panic("Unable to stop persister workers after failed start");
+    }
+    free(evr_persister_workers);
+ out_with_free_write_ctx:
     evr_free_glacier_write_ctx(evr_persister.write_ctx);
  out_with_free_watchers:
     if(evr_free_notify_ctx(evr_persister.watchers) != evr_ok){
         evr_panic("Unable to free notify ctx for glacier persister");
     }
+ out_with_free_lane_released:
+    cnd_destroy(&evr_persister.lane_released);
+ out_with_free_has_space:
+    cnd_destroy(&evr_persister.has_space);
  out_with_free_has_tasks:
     cnd_destroy(&evr_persister.has_tasks);
  out_with_free_worker_lock:
@@ -83,28 +190,15 @@ int evr_persister_start(struct evr_glacier_storage_cfg *config){
 }
 
 int evr_persister_stop(void){
-    evr_persister.working = 0;
-    if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
-        goto fail;
-    }
-    atomic_thread_fence(memory_order_seq_cst);
-    if(cnd_signal(&evr_persister.has_tasks) != thrd_success){
-        goto fail;
-    }
-    atomic_thread_fence(memory_order_seq_cst);
-    if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
-        goto fail;
-    }
-    int worker_result;
-    if(thrd_join(evr_persister_thread, &worker_result) != thrd_success){
-        goto fail;
-    }
-    if(worker_result != evr_ok){
+    if(evr_persister_join_workers() != evr_ok){
         goto fail;
     }
+    free(evr_persister_workers);
     if(evr_free_glacier_write_ctx(evr_persister.write_ctx) != evr_ok){
         goto fail;
     }
+    cnd_destroy(&evr_persister.lane_released);
+    cnd_destroy(&evr_persister.has_space);
     cnd_destroy(&evr_persister.has_tasks);
     mtx_destroy(&evr_persister.worker_lock);
     log_debug("evr persister stopped");
@@ -113,116 +207,222 @@ int evr_persister_stop(void){
     return evr_error;
 }
 
+int evr_persister_join_workers(void){
+    int ret = evr_error;
+    evr_persister.working = 0;
+    if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
+        goto out;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if(cnd_broadcast(&evr_persister.has_tasks) != thrd_success){
+        goto out;
+    }
+    if(cnd_broadcast(&evr_persister.has_space) != thrd_success){
+        goto out;
+    }
+    if(cnd_broadcast(&evr_persister.lane_released) != thrd_success){
+        goto out;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
+        goto out;
+    }
+    ret = evr_ok;
+    for(size_t i = 0; i < evr_persister_workers_len; ++i){
+        int worker_result;
+        if(thrd_join(evr_persister_workers[i].thread, &worker_result) != thrd_success){
+            ret = evr_error;
+            continue;
+        }
+        if(worker_result != evr_ok){
+            ret = evr_error;
+        }
+    }
+ out:
+    return ret;
+}
+
 int evr_persister_init_task(struct evr_persister_task *task, struct evr_writing_blob *blob){
     task->blob = blob;
-    if(mtx_init(&task->done, mtx_plain) != thrd_success){
-        return evr_error;
-    }
+    atomic_init(&task->done, 0);
     return evr_ok;
 }
 
 int evr_persister_destroy_task(struct evr_persister_task *task){
-    mtx_destroy(&task->done);
     return evr_ok;
 }
 
 inline struct evr_persister_task** evr_persister_ctx_step(struct evr_persister_task **p);
 
 int evr_persister_queue_task(struct evr_persister_task *task){
-    int result = evr_ok;
-    // task->done is locked before locking
-    // evr_persister.worker_lock. the goal is to outsource workload
-    // from the part where evr_persister.worker_lock is
-    // locked. (not sure if this argumentation is really valid because
-    // of the CPU's allowance to change execution order).
-    if(mtx_lock(&task->done) != thrd_success){
-        goto fail;
-    }
+    int ret = evr_error;
+    atomic_store_explicit(&task->done, 0, memory_order_relaxed);
     if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
-        goto fail;
+        goto out;
     }
-    atomic_thread_fence(memory_order_seq_cst);
-    struct evr_persister_task **allocated_task = evr_persister.writing;
-    struct evr_persister_task **next_writing = evr_persister_ctx_step(allocated_task);
-    if(next_writing == evr_persister.reading){
-        result = evr_temporary_occupied;
-        if(mtx_unlock(&task->done) != thrd_success){
-            goto fail;
+    struct evr_persister_task **next_writing;
+    while(1){
+        if(!evr_persister.working){
+            goto out_with_unlock;
+        }
+        next_writing = evr_persister_ctx_step(evr_persister.writing);
+        if(next_writing != evr_persister.reading){
+            break;
+        }
+        evr_persister.space_waiters += 1;
+        int wait_res = cnd_wait(&evr_persister.has_space, &evr_persister.worker_lock);
+        evr_persister.space_waiters -= 1;
+        if(wait_res != thrd_success){
+            goto out_with_unlock;
         }
-        goto defined_cleanup;
     }
-    *allocated_task = task;
+    *evr_persister.writing = task;
     evr_persister.writing = next_writing;
- defined_cleanup:
-    atomic_thread_fence(memory_order_seq_cst);
-    if(cnd_signal(&evr_persister.has_tasks) != thrd_success){
-        goto fail;
+    // a signal could wake up a worker whose lane is owned by a blob
+    // stream. that worker would not take the task. so all workers are
+    // woken up while lanes are streamed.
+    if(evr_persister.streaming_lanes > 0){
+        if(cnd_broadcast(&evr_persister.has_tasks) != thrd_success){
+            goto out_with_unlock;
+        }
+    } else if(cnd_signal(&evr_persister.has_tasks) != thrd_success){
+        goto out_with_unlock;
     }
-    atomic_thread_fence(memory_order_seq_cst);
+    ret = evr_ok;
+ out_with_unlock:
     if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
-        goto fail;
+        evr_panic("Unable to unlock evr_persister worker_lock");
+        ret = evr_error;
     }
-    return result;
- fail:
-    return evr_error;
+ out:
+    return ret;
 }
 
+/**
+ * evr_persister_complete_task publishes the task's result and wakes
+ * up the thread waiting for it.
+ *
+ * The task's owner might free task as soon as done is set, so the
+ * futex wake can hit memory which is already reused. This is
+ * harmless. A FUTEX_WAKE_PRIVATE keys the futex only by the
+ * process's address space and task's address. The kernel never reads
+ * the futex word on wake and does not fault on unmapped addresses.
+ * At worst the wake hits an unrelated futex waiter on the reused
+ * address. Futex waiters must tolerate such spurious wake ups anyway,
+ * like evr_persister_wait_for_task does by rechecking done.
+ */
+void evr_persister_complete_task(struct evr_persister_task *task);
+
 int evr_persister_watch_filter(void *ctx, void *obs_ctx, void *entry);
 
+/**
+ * evr_persister_drain_tasks moves queued tasks into batch until batch
+ * holds evr_persister_batch_len tasks.
+ *
+ * evr_persister.worker_lock must be locked while calling this
+ * function.
+ *
+ * Returns the new number of tasks in batch.
+ */
+size_t evr_persister_drain_tasks(struct evr_persister_task **batch, size_t batch_len);
+
+/**
+ * evr_persister_wait_for_batch waits up to the configured group
+ * commit latency for more tasks to be queued into batch.
+ *
+ * evr_persister.worker_lock must be locked while calling this
+ * function.
+ */
+int evr_persister_wait_for_batch(struct evr_persister_task **batch, size_t *batch_len);
+
 int evr_persister_worker(void *context){
-    log_debug("evr_persister_worker starting");
+    struct evr_persister_worker_ctx *worker = context;
+    log_debug("evr_persister_worker for bucket lane %zu starting", worker->lane);
     int result = evr_error;
     if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
         result = evr_error;
         goto out;
     }
-    struct evr_persister_task *task;
-    evr_blob_ref task_key;
-    int task_flags;
-    evr_time task_last_modified;
+    struct evr_persister_task *batch[evr_persister_batch_len];
+    struct evr_writing_blob *blobs[evr_persister_batch_len];
+    int results[evr_persister_batch_len];
+    struct evr_modified_blob mod_blobs[evr_persister_batch_len];
+    evr_time last_modified;
     while(evr_persister.working){
-        while(evr_persister.working) {
-            if(evr_persister.writing == evr_persister.reading){
-                break;
-            } else {
-                task = *evr_persister.reading;
-                evr_persister.reading = evr_persister_ctx_step(evr_persister.reading);
-            }
-            if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
-                evr_panic("Unable to unlock evr_persister_worker worker_lock");
-                goto out;
-            }
-            int task_res = evr_glacier_append_blob(evr_persister.write_ctx, task->blob, &task->last_modified);
-            task->result = task_res;
-            if(task_res == evr_ok){
-                memcpy(task_key, task->blob->key, evr_blob_ref_size);
-                task_flags = task->blob->flags;
-                task_last_modified = task->last_modified;
-            }
-            if(mtx_unlock(&task->done) != thrd_success){
-                evr_panic("Unable to unlock task done lock");
-                goto out;
+        size_t batch_len = 0;
+        if(!worker->streaming){
+            batch_len = evr_persister_drain_tasks(batch, 0);
+        }
+        if(batch_len == 0){
+            // evr_persister_release_lane signals has_tasks when a
+            // blob stream hands back the lane.
+            if(cnd_wait(&evr_persister.has_tasks, &evr_persister.worker_lock) != thrd_success){
+                goto out_with_unlock_worker_lock;
             }
-            if(task_res == evr_ok){
-                struct evr_modified_blob mod_blob;
-                memcpy(mod_blob.key, task_key, evr_blob_ref_size);
-                mod_blob.last_modified = task_last_modified;
-                mod_blob.flags = task_flags;
-                if(evr_notify_send(evr_persister.watchers, &mod_blob, evr_persister_watch_filter, NULL) != evr_ok){
-                    evr_blob_ref_str task_key_str;
-                    evr_fmt_blob_ref(task_key_str, task_key);
-                    log_error("Persister failed to notify watchers about modified blob %s", task_key_str);
-                    goto out;
+            continue;
+        }
+        // appending keeps blob streams away from the lane while
+        // wait_for_batch releases the worker_lock.
+        worker->appending = 1;
+        if(evr_persister_wait_for_batch(batch, &batch_len) != evr_ok){
+            goto out_with_unlock_worker_lock;
+        }
+        if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
+            evr_panic("Unable to unlock evr_persister_worker worker_lock");
+            goto out;
+        }
+        for(size_t i = 0; i < batch_len; ++i){
+            blobs[i] = batch[i]->blob;
+        }
+        // the batch might be persisted only partially. so the
+        // persisted blobs are indexed and reported even if other
+        // blobs of the batch failed.
+        evr_glacier_append_lane_blobs(evr_persister.write_ctx, worker->lane, blobs, batch_len, results, &last_modified);
+        if(evr_persister.index){
+            for(size_t i = 0; i < batch_len; ++i){
+                if(results[i] != evr_ok){
+                    continue;
                 }
+                if(evr_blob_index_put(evr_persister.index, blobs[i]->key, &blobs[i]->pos) != evr_ok){
+                    evr_blob_ref_str key_str;
+                    evr_fmt_blob_ref(key_str, blobs[i]->key);
+                    log_error("Persister failed to add blob %s to blob index", key_str);
+                    // the blob is durable but readers can't find
+                    // it. so the client is told to put it again.
+                    // the other tasks of the batch are completed as
+                    // usual.
+                    results[i] = evr_error;
+                }
+            }
+        }
+        size_t mod_blobs_len = 0;
+        for(size_t i = 0; i < batch_len; ++i){
+            struct evr_persister_task *task = batch[i];
+            task->result = results[i];
+            task->last_modified = last_modified;
+            if(results[i] == evr_ok){
+                struct evr_modified_blob *mod_blob = &mod_blobs[mod_blobs_len++];
+                memcpy(mod_blob->key, task->blob->key, evr_blob_ref_size);
+                mod_blob->last_modified = last_modified;
+                mod_blob->flags = task->blob->flags;
             }
-            if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
+            // task must not be accessed after it got completed
+            // because the task's owner might free it right away.
+            evr_persister_complete_task(task);
+        }
+        for(size_t i = 0; i < mod_blobs_len; ++i){
+            if(evr_notify_send(evr_persister.watchers, &mod_blobs[i], evr_persister_watch_filter, NULL) != evr_ok){
+                evr_blob_ref_str key_str;
+                evr_fmt_blob_ref(key_str, mod_blobs[i].key);
+                log_error("Persister failed to notify watchers about modified blob %s", key_str);
                 goto out;
             }
         }
-        if(!evr_persister.working){
-            break;
+        if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
+            goto out;
         }
-        if(cnd_wait(&evr_persister.has_tasks, &evr_persister.worker_lock) != thrd_success){
+        worker->appending = 0;
+        if(cnd_broadcast(&evr_persister.lane_released) != thrd_success){
             goto out_with_unlock_worker_lock;
         }
     }
@@ -241,6 +441,51 @@ int evr_persister_worker(void *context){
     return result;
 }
 
+size_t evr_persister_drain_tasks(struct evr_persister_task **batch, size_t batch_len){
+    const size_t prev_batch_len = batch_len;
+    while(batch_len < evr_persister_batch_len && evr_persister.writing != evr_persister.reading){
+        batch[batch_len++] = *evr_persister.reading;
+        evr_persister.reading = evr_persister_ctx_step(evr_persister.reading);
+    }
+    if(batch_len > prev_batch_len && evr_persister.space_waiters > 0){
+        if(cnd_broadcast(&evr_persister.has_space) != thrd_success){
+            evr_panic("Unable to signal free space in persister task queue");
+        }
+    }
+    return batch_len;
+}
+
+int evr_persister_wait_for_batch(struct evr_persister_task **batch, size_t *batch_len){
+    const size_t latency = evr_persister.group_commit_latency;
+    if(latency == 0){
+        return evr_ok;
+    }
+    struct timespec deadline;
+    if(timespec_get(&deadline, TIME_UTC) != TIME_UTC){
+        return evr_error;
+    }
+    deadline.tv_sec += latency / 1000000;
+    deadline.tv_nsec += (latency % 1000000) * 1000;
+    if(deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while(evr_persister.working && *batch_len < evr_persister_batch_len){
+        int res = cnd_timedwait(&evr_persister.has_tasks, &evr_persister.worker_lock, &deadline);
+        if(res == thrd_timedout){
+            break;
+        }
+        if(res != thrd_success){
+            return evr_error;
+        }
+        *batch_len = evr_persister_drain_tasks(batch, *batch_len);
+    }
+    // collect tasks which arrived between the last wakeup and the
+    // timeout
+    *batch_len = evr_persister_drain_tasks(batch, *batch_len);
+    return evr_ok;
+}
+
 int evr_persister_watch_filter(void *ctx, void *obs_ctx, void *entry){
     struct evr_blob_filter *f = obs_ctx;
     struct evr_modified_blob *mod_blob = entry;
@@ -255,14 +500,134 @@ inline struct evr_persister_task** evr_persister_ctx_step(struct evr_persister_t
     return p;
 }
 
+void evr_persister_complete_task(struct evr_persister_task *task){
+    atomic_int *done = &task->done;
+    atomic_store_explicit(done, 1, memory_order_release);
+    syscall(SYS_futex, done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 int evr_persister_wait_for_task(struct evr_persister_task *task){
-    if(mtx_lock(&task->done) != thrd_success){
-        return evr_error;
+    while(atomic_load_explicit(&task->done, memory_order_acquire) == 0){
+        if(syscall(SYS_futex, &task->done, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0) != 0 && errno != EAGAIN && errno != EINTR){
+            return evr_error;
+        }
     }
-    atomic_thread_fence(memory_order_acquire);
     return evr_ok;
 }
 
+int evr_persister_begin_stream(struct evr_glacier_blob_stream *s){
+    int ret = evr_error;
+    if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
+        goto out;
+    }
+    struct evr_persister_worker_ctx *worker = NULL;
+    while(1){
+        if(!evr_persister.working){
+            goto out_with_unlock;
+        }
+        if(evr_persister.streaming_lanes + 1 >= evr_persister_workers_len){
+            ret = evr_temporary_occupied;
+            goto out_with_unlock;
+        }
+        for(size_t i = 0; i < evr_persister_workers_len; ++i){
+            struct evr_persister_worker_ctx *w = &evr_persister_workers[i];
+            if(!w->streaming && !w->appending){
+                worker = w;
+                break;
+            }
+        }
+        if(worker){
+            break;
+        }
+        if(cnd_wait(&evr_persister.lane_released, &evr_persister.worker_lock) != thrd_success){
+            goto out_with_unlock;
+        }
+    }
+    worker->streaming = 1;
+    evr_persister.streaming_lanes += 1;
+    if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
+        evr_panic("Unable to unlock evr_persister worker_lock");
+        goto out;
+    }
+    if(evr_glacier_begin_blob_stream(evr_persister.write_ctx, worker->lane, s) != evr_ok){
+        if(evr_persister_release_lane(worker->lane) != evr_ok){
+            evr_panic("Unable to release bucket lane %zu", worker->lane);
+        }
+        goto out;
+    }
+    return evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
+        evr_panic("Unable to unlock evr_persister worker_lock");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_persister_write_stream(struct evr_glacier_blob_stream *s, const char *data, size_t data_size){
+    return evr_glacier_write_blob_stream(evr_persister.write_ctx, s, data, data_size);
+}
+
+int evr_persister_end_stream(struct evr_glacier_blob_stream *s, int commit, evr_time *last_modified){
+    int ret = evr_error;
+    if(!commit){
+        ret = evr_glacier_abort_blob_stream(evr_persister.write_ctx, s);
+        goto out_with_release_lane;
+    }
+    if(evr_glacier_commit_blob_stream(evr_persister.write_ctx, s, last_modified) != evr_ok){
+        goto out_with_release_lane;
+    }
+    if(evr_persister.index){
+        if(evr_blob_index_put(evr_persister.index, s->blob.key, &s->blob.pos) != evr_ok){
+            evr_blob_ref_str key_str;
+            evr_fmt_blob_ref(key_str, s->blob.key);
+            log_error("Persister failed to add streamed blob %s to blob index", key_str);
+            goto out_with_release_lane;
+        }
+    }
+    struct evr_modified_blob mod_blob;
+    memcpy(mod_blob.key, s->blob.key, evr_blob_ref_size);
+    mod_blob.last_modified = *last_modified;
+    mod_blob.flags = s->blob.flags;
+    if(evr_notify_send(evr_persister.watchers, &mod_blob, evr_persister_watch_filter, NULL) != evr_ok){
+        evr_blob_ref_str key_str;
+        evr_fmt_blob_ref(key_str, mod_blob.key);
+        log_error("Persister failed to notify watchers about modified blob %s", key_str);
+        goto out_with_release_lane;
+    }
+    ret = evr_ok;
+ out_with_release_lane:
+    if(evr_persister_release_lane(s->lane) != evr_ok){
+        evr_panic("Unable to release bucket lane %zu", s->lane);
+        ret = evr_error;
+    }
+    return ret;
+}
+
+int evr_persister_release_lane(size_t lane){
+    int ret = evr_error;
+    if(mtx_lock(&evr_persister.worker_lock) != thrd_success){
+        goto out;
+    }
+    evr_persister_workers[lane].streaming = 0;
+    evr_persister.streaming_lanes -= 1;
+    if(cnd_broadcast(&evr_persister.has_tasks) != thrd_success){
+        goto out_with_unlock;
+    }
+    if(cnd_broadcast(&evr_persister.lane_released) != thrd_success){
+        goto out_with_unlock;
+    }
+    ret = evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&evr_persister.worker_lock) != thrd_success){
+        evr_panic("Unable to unlock evr_persister worker_lock");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
 struct evr_queue *evr_persister_add_watcher(struct evr_blob_filter *filter){
     return evr_notify_register(evr_persister.watchers, filter);
 }
@@ -33,8 +33,10 @@
 #define __evr_concurrent_glacier_h__
 
 #include <threads.h>
+#include <stdatomic.h>
 
 #include "glacier.h"
+#include "blob-index.h"
 
 struct evr_modified_blob {
     evr_blob_ref key;
@@ -46,8 +48,13 @@ struct evr_modified_blob {
  * evr_persister_start starts the persister background thread.
  *
  * config must not be freed until evr_persister_stop is called.
+ *
+ * index is updated with the position of every persisted blob before
+ * the blob's task is done. index may be NULL if no in-memory blob
+ * index is maintained. index must not be freed until
+ * evr_persister_stop is called.
  */
-int evr_persister_start(struct evr_glacier_storage_cfg *config);
+int evr_persister_start(struct evr_glacier_storage_cfg *config, struct evr_blob_index *index);
 
 /**
  * evr_persister_stop gracefully stops the persister. Blocks until the
@@ -59,21 +66,23 @@ struct evr_persister_task {
     struct evr_writing_blob *blob;
 
     /**
-     * done is locked by evr_persister_queue_task and released after
-     * the blob has been succesfully persisted or failed to persist.
+     * done is set to 0 by evr_persister_queue_task and to 1 after the
+     * blob has been succesfully persisted or failed to persist. The
+     * persister wakes a waiting evr_persister_wait_for_task through a
+     * futex on done.
      */
-    mtx_t done;
+    atomic_int done;
 
     /**
      * result indicates if the blob could be persisted. Will be set
-     * after done is unlocked. evr_ok indicates blob was
+     * before done is set. evr_ok indicates blob was
      * persisted. evr_error indicated blob could not be persisted.
      */
     int result;
 
     /**
      * last_modified contains the blob's last modification timestamp
-     * after done is unlocked.
+     * after done is set.
      */
     evr_time last_modified;
 
@@ -93,11 +102,13 @@ int evr_persister_destroy_task(struct evr_persister_task *task);
  * evr_persister_queue_task schedules task for writing to glacier
  * storage.
  *
+ * Blocks while the persister's task queue is full.
+ *
  * Returns evr_ok if the task was successfully queued. Otherwise
- * evr_error. task.done locking state is undefined if evr_error is
- * returned.
+ * evr_error, for example if the persister stops while waiting for
+ * space in the queue.
  *
- * task may only be freed after done is unlocked.
+ * task may only be freed after done is set.
  */
 int evr_persister_queue_task(struct evr_persister_task *task);
 
@@ -109,9 +120,44 @@ int evr_persister_queue_task(struct evr_persister_task *task);
  */
 int evr_persister_wait_for_task(struct evr_persister_task *task);
 
+/**
+ * evr_persister_begin_stream reserves a bucket lane for streaming the
+ * blob described by s->blob directly into glacier storage. See
+ * evr_glacier_begin_blob_stream for the fields which must be set.
+ *
+ * Waits while the spare lanes are appending queued tasks. One lane
+ * is always left for the queued tasks. Returns evr_temporary_occupied
+ * if no lane can be spared for streaming. The blob must be queued as
+ * a task then.
+ *
+ * Every successfully begun stream must be ended with
+ * evr_persister_end_stream.
+ */
+int evr_persister_begin_stream(struct evr_glacier_blob_stream *s);
+
+int evr_persister_write_stream(struct evr_glacier_blob_stream *s, const char *data, size_t data_size);
+
+/**
+ * evr_persister_end_stream commits the stream if commit is not zero
+ * and aborts it otherwise. The stream's lane is released in both
+ * cases.
+ *
+ * A committed blob is put into the persister's blob index and
+ * reported to the watchers like a persisted task's blob.
+ * last_modified is set to the blob's last modified timestamp.
+ *
+ * Returns evr_ok if the stream got committed or aborted as
+ * requested.
+ */
+int evr_persister_end_stream(struct evr_glacier_blob_stream *s, int commit, evr_time *last_modified);
+
 /**
  * evr_persister_add_watcher creates a queue which will be filled with
  * struct evr_modified_blob items.
+ *
+ * The queue reports evr_temporary_occupied when the watcher fell
+ * behind. The watcher must then call evr_queue_reset and list the
+ * missed blobs from the index.
  */
 struct evr_queue *evr_persister_add_watcher(struct evr_blob_filter *filter);
 
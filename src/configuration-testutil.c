@@ -50,6 +50,9 @@ struct evr_glacier_storage_cfg *create_temp_evr_glacier_storage_cfg(void){
     config->auth_token_set = 1;
     memset(config->auth_token, 7, sizeof(config->auth_token));
     config->max_bucket_size = 10<<20;
+    config->bucket_lanes = 1;
+    config->reindex_threads = 2;
+    config->reindex_run_len = 1 << 20;
     config->bucket_dir_path = new_temp_dir_path();
     log_info("Using %s as bucket dir", config->bucket_dir_path);
     return config;
@@ -108,6 +108,27 @@ void test_allocate_chunk_set(void){
     evr_free_chunk_set(cs);
 }
 
+void test_chunk_pool(void){
+    assert(is_ok(evr_set_chunk_pool_max_chunks(2)));
+    struct chunk_set *cs = evr_allocate_chunk_set(3);
+    assert(cs);
+    char *second_chunk = cs->chunks[1];
+    evr_free_chunk_set(cs);
+    assert(evr_chunk_pool_retained_chunks() == 2);
+    cs = evr_allocate_chunk_set(1);
+    assert(cs);
+    assert(evr_chunk_pool_retained_chunks() == 1);
+    // chunks are freed from the last to the first one. so the first
+    // chunk did not fit into the pool and the second chunk was
+    // retained last.
+    assert(cs->chunks[0] == second_chunk);
+    memset(cs->chunks[0], 42, evr_chunk_size);
+    evr_free_chunk_set(cs);
+    assert(is_ok(evr_set_chunk_pool_max_chunks(0)));
+    assert(evr_chunk_pool_retained_chunks() == 0);
+    assert(is_ok(evr_set_chunk_pool_max_chunks(evr_chunk_pool_default_max_chunks)));
+}
+
 void test_llbuf(void){
     evr_free_llbuf_chain(NULL, NULL);
     struct evr_llbuf *llb = NULL;
@@ -211,6 +232,7 @@ int main(void){
     run_test(test_grow_dynamic_array_at_least_null);
     run_test(test_dynamic_array_remove);
     run_test(test_allocate_chunk_set);
+    run_test(test_chunk_pool);
     run_test(test_llbuf);
     run_test(test_empty_llbuf_s);
     run_test(test_filled_llbuf_s);
@@ -19,13 +19,37 @@
 #include "dyn-mem.h"
 
 #include <string.h>
+#include <threads.h>
 
 #include "errors.h"
+#include "logger.h"
 
 inline size_t get_dynamic_array_size(size_t data_size);
 char *evr_alloc_chunk(void);
 void evr_free_chunk(char *chunk);
 
+/**
+ * struct evr_chunk_pool keeps freed chunks so they can be reused
+ * without going through malloc and free again. Chunk sized
+ * allocations are usually mmaped by malloc which makes every fresh
+ * chunk cost a mmap, munmap and page faults.
+ *
+ * The free chunks are linked through their first bytes.
+ */
+struct evr_chunk_pool {
+    mtx_t lock;
+    char *free_chunks;
+    size_t free_chunks_len;
+    size_t max_chunks;
+};
+
+static once_flag chunk_pool_initialized = ONCE_FLAG_INIT;
+static struct evr_chunk_pool chunk_pool;
+
+void evr_init_chunk_pool(void);
+void evr_lock_chunk_pool(void);
+void evr_unlock_chunk_pool(void);
+
 struct dynamic_array *alloc_dynamic_array(size_t initial_size){
     size_t da_size;
     if(initial_size == 0){
@@ -164,14 +188,82 @@ void evr_free_chunk_set(struct chunk_set *cs){
 }
 
 char *evr_alloc_chunk(void){
-    // TODO chunks should be organized in a pool in the future.
+    char *chunk = NULL;
+    evr_lock_chunk_pool();
+    if(chunk_pool.free_chunks){
+        chunk = chunk_pool.free_chunks;
+        chunk_pool.free_chunks = *(char**)chunk;
+        chunk_pool.free_chunks_len -= 1;
+    }
+    evr_unlock_chunk_pool();
+    if(chunk){
+        return chunk;
+    }
     return malloc(evr_chunk_size);
 }
 
 void evr_free_chunk(char *chunk){
+    evr_lock_chunk_pool();
+    if(chunk_pool.free_chunks_len < chunk_pool.max_chunks){
+        *(char**)chunk = chunk_pool.free_chunks;
+        chunk_pool.free_chunks = chunk;
+        chunk_pool.free_chunks_len += 1;
+        chunk = NULL;
+    }
+    evr_unlock_chunk_pool();
     free(chunk);
 }
 
+int evr_set_chunk_pool_max_chunks(size_t max_chunks){
+    char *released = NULL;
+    evr_lock_chunk_pool();
+    chunk_pool.max_chunks = max_chunks;
+    while(chunk_pool.free_chunks_len > max_chunks){
+        char *chunk = chunk_pool.free_chunks;
+        chunk_pool.free_chunks = *(char**)chunk;
+        chunk_pool.free_chunks_len -= 1;
+        *(char**)chunk = released;
+        released = chunk;
+    }
+    evr_unlock_chunk_pool();
+    while(released){
+        char *chunk = released;
+        released = *(char**)chunk;
+        free(chunk);
+    }
+    return evr_ok;
+}
+
+size_t evr_chunk_pool_retained_chunks(void){
+    evr_lock_chunk_pool();
+    size_t ret = chunk_pool.free_chunks_len;
+    evr_unlock_chunk_pool();
+    return ret;
+}
+
+void evr_init_chunk_pool(void){
+    if(mtx_init(&chunk_pool.lock, mtx_plain) != thrd_success){
+        evr_panic("Unable to initialize chunk pool lock");
+        return;
+    }
+    chunk_pool.free_chunks = NULL;
+    chunk_pool.free_chunks_len = 0;
+    chunk_pool.max_chunks = evr_chunk_pool_default_max_chunks;
+}
+
+void evr_lock_chunk_pool(void){
+    call_once(&chunk_pool_initialized, evr_init_chunk_pool);
+    if(mtx_lock(&chunk_pool.lock) != thrd_success){
+        evr_panic("Unable to lock chunk pool");
+    }
+}
+
+void evr_unlock_chunk_pool(void){
+    if(mtx_unlock(&chunk_pool.lock) != thrd_success){
+        evr_panic("Unable to unlock chunk pool");
+    }
+}
+
 int evr_chunk_setify(struct chunk_set *cs, char *buf, size_t size){
     int ret = evr_error;
     cs->chunks_len = size / evr_chunk_size + 1;
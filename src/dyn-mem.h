@@ -104,6 +104,30 @@ int evr_grow_chunk_set(struct chunk_set *cs, size_t new_chunks_len);
 
 void evr_free_chunk_set(struct chunk_set *cs);
 
+/**
+ * evr_chunk_pool_default_max_chunks is the default number of free
+ * chunks retained by the chunk pool. It is enough to hold one blob of
+ * evr_max_blob_data_size.
+ */
+#define evr_chunk_pool_default_max_chunks evr_chunk_set_max_chunks
+
+/**
+ * evr_set_chunk_pool_max_chunks sets the maximum number of free
+ * chunks which the chunk pool retains for reuse by the chunk_set
+ * functions. The pool is shared by all threads.
+ *
+ * Retained chunks beyond max_chunks are freed right away. So calling
+ * evr_set_chunk_pool_max_chunks with 0 releases all retained
+ * chunks.
+ */
+int evr_set_chunk_pool_max_chunks(size_t max_chunks);
+
+/**
+ * evr_chunk_pool_retained_chunks returns the number of free chunks
+ * currently retained by the chunk pool.
+ */
+size_t evr_chunk_pool_retained_chunks(void);
+
 /**
  * evr_chunk_setify populates a chunk_set cs so it represents the
  * content of buf. cs in only valid as long buf is allocated.
@@ -68,6 +68,7 @@ static char doc[] =
     "The desc-seed command provides a seed description for the given seed. Expects the seed ref as argument.\n\n"
     "The watch command prints modified blob keys.\n\n"
     "The sync command synchronizes the blobs of two evr-glacier-storage instances either in one or in both directions. Expects the arguments SRC_HOST:SRC_PORT DST_HOST:DST_PORT after the sync argument.\n\n"
+    "The glacier-status command prints the state and progress of the evr-glacier-storage's background consistency check.\n\n"
     // exit code starts here
     "The program's exit code indicates success or failure. The exit code 0 represents a successful execution. The exit code 1 indicates a general no further specificed error. The exit code 2 indicates that the requested data was not found. The exit code 5 indicates that the operation failed because it stumbled over syntactically invalid data once provided by the user."
     ;
@@ -128,6 +129,7 @@ static struct argp_option options[] = {
 #define cli_cmd_get_verify 9
 #define cli_cmd_desc_seed 10
 #define cli_cmd_search 11
+#define cli_cmd_glacier_status 12
 
 struct cli_cfg {
     int cmd;
@@ -334,6 +336,8 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state, void (*us
                 cfg->cmd = cli_cmd_watch_blobs;
             } else if(strcmp("sync", arg) == 0){
                 cfg->cmd = cli_cmd_sync;
+            } else if(strcmp("glacier-status", arg) == 0){
+                cfg->cmd = cli_cmd_glacier_status;
             } else {
                 usage(state);
                 return ARGP_ERR_UNKNOWN;
@@ -413,6 +417,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state, void (*us
         case cli_cmd_sign_put:
         case cli_cmd_post_file:
         case cli_cmd_watch_blobs:
+        case cli_cmd_glacier_status:
             break;
         }
         break;
@@ -460,6 +465,7 @@ int evr_cli_search(struct cli_cfg *cfg);
 int evr_cli_desc_seed(struct cli_cfg *cfg);
 int evr_cli_watch_blobs(struct cli_cfg *cfg);
 int evr_cli_sync(struct cli_cfg *cfg);
+int evr_cli_glacier_status(struct cli_cfg *cfg);
 
 int main(int argc, char **argv){
     int ret = 1;
@@ -561,6 +567,9 @@ int main(int argc, char **argv){
     case cli_cmd_sync:
         ret = evr_cli_sync(&cfg);
         break;
+    case cli_cmd_glacier_status:
+        ret = evr_cli_glacier_status(&cfg);
+        break;
     }
  out_with_free_cfg:
     do {} while(0);
@@ -879,12 +888,35 @@ int evr_cli_sign_put(struct cli_cfg *cfg){
     return ret;
 }
 
+/**
+ * evr_post_file_batch_len is the maximum number of file slices which
+ * are checked against the storage with one round trip.
+ */
+#define evr_post_file_batch_len 32
+
+/**
+ * evr_post_file_batch_max_size limits the number of file slice bytes
+ * which are buffered until they are checked against the storage.
+ */
+#define evr_post_file_batch_max_size (16 << 20)
+
 struct post_file_ctx {
     struct evr_file c;
     struct dynamic_array *slices;
+
+    /**
+     * pending_len is the number of slices at the end of slices which
+     * are not yet checked against the storage. Their data is kept in
+     * pending_data until evr_flush_file_slices is called.
+     */
+    size_t pending_len;
+    size_t pending_size;
+    char *pending_data[evr_post_file_batch_len];
 };
 
 int evr_post_and_collect_file_slice(char* buf, size_t size, void *ctx0);
+int evr_flush_file_slices(struct post_file_ctx *ctx);
+void evr_free_pending_file_slices(struct post_file_ctx *ctx);
 
 int evr_cli_get_file(struct cli_cfg *cfg){
     int ret = evr_error;
@@ -989,6 +1021,8 @@ int evr_cli_post_file(struct cli_cfg *cfg){
         }
     }
     struct post_file_ctx ctx;
+    ctx.pending_len = 0;
+    ctx.pending_size = 0;
     if(evr_connect_to_storage(&ctx.c, cfg, cfg->storage_host, cfg->storage_port) != evr_ok){
         goto out_with_close_f;
     }
@@ -999,6 +1033,9 @@ int evr_cli_post_file(struct cli_cfg *cfg){
     if(evr_rollsum_split(f, SIZE_MAX, evr_post_and_collect_file_slice, &ctx) != evr_end){
         goto out_with_free_slice_keys;
     }
+    if(evr_flush_file_slices(&ctx) != evr_ok){
+        goto out_with_free_slice_keys;
+    }
     struct evr_file_claim fc;
     fc.has_seed = cfg->has_seed;
     if(cfg->has_seed){
@@ -1059,6 +1096,7 @@ int evr_cli_post_file(struct cli_cfg *cfg){
         ret = evr_error;
     }
  out_with_free_slice_keys:
+    evr_free_pending_file_slices(&ctx);
     if(ctx.slices){
         free(ctx.slices);
     }
@@ -1199,17 +1237,60 @@ int evr_post_and_collect_file_slice(char* buf, size_t size, void *ctx0){
     if(evr_calc_blob_ref(fs->ref, size, blob.chunks) != evr_ok){
         goto out;
     }
-    int put_res = evr_stat_and_put(&ctx->c, fs->ref, 0, &blob);
-    if(put_res != evr_ok && put_res != evr_exists){
+    // buf is reused by evr_rollsum_split for the next slices so the
+    // slice must be copied until it is flushed.
+    char *data = malloc(size);
+    if(!data){
         goto out;
     }
+    memcpy(data, buf, size);
     fs->size = size;
     ctx->slices->size_used += sizeof(struct evr_file_slice);
+    ctx->pending_data[ctx->pending_len] = data;
+    ctx->pending_len += 1;
+    ctx->pending_size += size;
+    if(ctx->pending_len == evr_post_file_batch_len || ctx->pending_size >= evr_post_file_batch_max_size){
+        if(evr_flush_file_slices(ctx) != evr_ok){
+            goto out;
+        }
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_flush_file_slices(struct post_file_ctx *ctx){
+    int ret = evr_error;
+    if(ctx->pending_len == 0){
+        return evr_ok;
+    }
+    size_t used_slices_len = ctx->slices->size_used / sizeof(struct evr_file_slice);
+    struct evr_file_slice *fs = &((struct evr_file_slice*)ctx->slices->data)[used_slices_len - ctx->pending_len];
+    evr_blob_ref keys[evr_post_file_batch_len];
+    struct chunk_set blobs[evr_post_file_batch_len];
+    for(size_t i = 0; i < ctx->pending_len; ++i){
+        memcpy(keys[i], fs[i].ref, evr_blob_ref_size);
+        if(evr_chunk_setify(&blobs[i], ctx->pending_data[i], fs[i].size) != evr_ok){
+            goto out;
+        }
+    }
+    if(evr_stat_and_put_blobs(&ctx->c, ctx->pending_len, keys, 0, blobs) != evr_ok){
+        goto out;
+    }
     ret = evr_ok;
  out:
+    evr_free_pending_file_slices(ctx);
     return ret;
 }
 
+void evr_free_pending_file_slices(struct post_file_ctx *ctx){
+    for(size_t i = 0; i < ctx->pending_len; ++i){
+        free(ctx->pending_data[i]);
+    }
+    ctx->pending_len = 0;
+    ctx->pending_size = 0;
+}
+
 int evr_cli_watch_blobs(struct cli_cfg *cfg){
     int ret = evr_error;
     struct evr_blob_filter f;
@@ -1246,6 +1327,48 @@ int evr_cli_watch_blobs(struct cli_cfg *cfg){
     return ret;
 }
 
+int evr_cli_glacier_status(struct cli_cfg *cfg){
+    int ret = evr_error;
+    struct evr_file c;
+    if(evr_connect_to_storage(&c, cfg, cfg->storage_host, cfg->storage_port) != evr_ok){
+        goto out;
+    }
+    struct evr_glacier_status status;
+    if(evr_req_cmd_get_status(&c, &status) != evr_ok){
+        goto out_with_close_c;
+    }
+    const char *check_state;
+    switch(status.check_state){
+    default:
+        check_state = "unknown";
+        break;
+    case evr_glacier_check_state_disabled:
+        check_state = "disabled";
+        break;
+    case evr_glacier_check_state_running:
+        check_state = "running";
+        break;
+    case evr_glacier_check_state_done:
+        check_state = "done";
+        break;
+    case evr_glacier_check_state_corrupt:
+        check_state = "corrupt";
+        break;
+    case evr_glacier_check_state_failed:
+        check_state = "failed";
+        break;
+    }
+    printf("check-state %s\nchecked-blobs %zu\ncheck-blobs %zu\n", check_state, status.checked_blobs, status.check_blobs);
+    ret = evr_ok;
+ out_with_close_c:
+    if(c.close(&c) != 0){
+        evr_panic("Unable to close storage connection");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
 #define sync_dir_src_to_dst 1
 #define sync_dir_dst_to_src 2
 
@@ -61,6 +61,7 @@ static char args_doc[] = "TRANSFORMATION MOUNT_POINT";
 #define arg_allow_other 263
 #define arg_log_path 264
 #define arg_pid_path 265
+#define arg_trust_storage_ranges 266
 
 #define max_traces_len 64
 
@@ -88,6 +89,14 @@ struct evr_fs_cfg {
     gid_t gid;
 
     char *log_path;
+
+    /**
+     * trust_storage_ranges indicates that file reads fetch only the
+     * read byte range of a slice from the glacier storage. The range
+     * is not verified against the slice's key. Otherwise the whole
+     * slice is fetched and verified.
+     */
+    int trust_storage_ranges;
 };
 
 struct evr_fs_cfg cfg;
@@ -109,6 +118,7 @@ static struct argp_option options[] = {
     {"accepted-gpg-key", arg_accepted_gpg_key, "FINGERPRINT", 0, "A GPG key fingerprint of claim signatures which will be accepted as valid. Can be specified multiple times to accept multiple keys. You can call 'gpg --list-public-keys' to see your known keys."},
     {"log", arg_log_path, "FILE", 0, "A file to which log output messages will be appended. By default logs are written to stdout."},
     {"pid", arg_pid_path, "FILE", 0, "A file to which the daemon's pid is written."},
+    {"trust-storage-ranges", arg_trust_storage_ranges, NULL, 0, "File reads fetch only the read byte ranges from the evr-glacier-storage server instead of whole file slices. The fetched ranges can't be verified against their slice's key. Only use with a trusted server."},
     {0},
 };
 
@@ -174,6 +184,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state, void (*us
     case arg_pid_path:
         evr_replace_str(cfg->fuse.pid_path, arg);
         break;
+    case arg_trust_storage_ranges:
+        cfg->trust_storage_ranges = 1;
+        break;
     case ARGP_KEY_ARG:
         switch(state->arg_num){
         default:
@@ -251,6 +264,7 @@ int main(int argc, char *argv[]) {
     cfg.uid = getuid();
     cfg.gid = getgid();
     cfg.log_path = NULL;
+    cfg.trust_storage_ranges = 0;
     cfg.fuse.pid_path = NULL;
     evr_init_verify_cfg(&cfg.verify);
     if(evr_push_cert(&cfg.ssl_certs, evr_glacier_storage_host, to_string(evr_glacier_storage_port), default_storage_ssl_cert_path) != evr_ok){
@@ -884,6 +898,7 @@ static int evr_fs_open_file(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
         goto fail;
     }
     struct evr_open_file *of = &open_files.files[fi->fh];
+    of->trust_ranges = cfg.trust_storage_ranges;
     if(evr_connect_to_storage(&of->gc, &cfg, cfg.storage_host, cfg.storage_port) != evr_ok){
         log_error("Unable to connect to glacier when opening file with inode %d", (int)ino);
         goto fail_with_close_open_file;
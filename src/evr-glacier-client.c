@@ -234,12 +234,52 @@ int evr_fetch_file_claim(struct evr_file_claim **claim, struct evr_file *c, evr_
     return ret;
 }
 
+int evr_stat_and_put_legacy(struct evr_file *c, evr_blob_ref key, int flags, struct chunk_set *blob);
+
 int evr_stat_and_put(struct evr_file *c, evr_blob_ref key, int flags, struct chunk_set *blob){
     int ret = evr_error;
-#ifdef EVR_LOG_DEBUG
-    evr_blob_ref_str fmt_key;
-    evr_fmt_blob_ref(fmt_key, key);
-#endif
+    if(evr_write_cmd_offer_blob(c, key, flags, blob->size_used) != evr_ok){
+        goto out;
+    }
+    struct evr_resp_header resp;
+    if(evr_read_resp_header(c, &resp) != evr_ok){
+        goto out;
+    }
+    if(resp.body_size != 0){
+        goto out;
+    }
+    if(resp.status_code == evr_status_code_ok){
+        log_debug("blob already exists");
+        // TODO :gcflgup: update flags in storage if necessary
+        ret = evr_exists;
+        goto out;
+    }
+    // servers respond to unknown commands with evr_unknown_request
+    // instead of evr_status_code_unknown_cmd
+    if(resp.status_code == evr_status_code_unknown_cmd || resp.status_code == evr_unknown_request){
+        ret = evr_stat_and_put_legacy(c, key, flags, blob);
+        goto out;
+    }
+    if(resp.status_code != evr_status_code_continue){
+        goto out;
+    }
+    log_debug("Storage indicated blob does not yet exist");
+    if(write_chunk_set(c, blob) != evr_ok){
+        goto out;
+    }
+    if(evr_read_resp_header(c, &resp) != evr_ok){
+        goto out;
+    }
+    if(resp.status_code != evr_status_code_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_stat_and_put_legacy(struct evr_file *c, evr_blob_ref key, int flags, struct chunk_set *blob){
+    int ret = evr_error;
     struct evr_resp_header resp;
     if(evr_req_cmd_stat_blob(c, key, &resp) != evr_ok){
         goto out;
@@ -280,6 +320,57 @@ int evr_stat_and_put(struct evr_file *c, evr_blob_ref key, int flags, struct chu
     return ret;
 }
 
+int evr_stat_and_put_blobs(struct evr_file *c, size_t blobs_len, evr_blob_ref *keys, int flags, struct chunk_set *blobs){
+    int ret = evr_error;
+    struct evr_stat_blobs_entry entries[blobs_len];
+    int stat_res = evr_req_cmd_stat_blobs(c, keys, blobs_len, entries);
+    if(stat_res == evr_unknown_request){
+        // servers which don't know the stat blobs command get the
+        // blobs one by one
+        for(size_t i = 0; i < blobs_len; ++i){
+            int put_res = evr_stat_and_put(c, keys[i], flags, &blobs[i]);
+            if(put_res != evr_ok && put_res != evr_exists){
+                goto out;
+            }
+        }
+        ret = evr_ok;
+        goto out;
+    }
+    if(stat_res != evr_ok){
+        goto out;
+    }
+    size_t puts_len = 0;
+    for(size_t i = 0; i < blobs_len; ++i){
+        if(entries[i].status_code == evr_status_code_ok){
+            // TODO :gcflgup: update flags in storage if necessary
+            continue;
+        }
+        if(entries[i].status_code != evr_status_code_blob_not_found){
+            goto out;
+        }
+        if(evr_write_cmd_put_blob(c, keys[i], flags, blobs[i].size_used) != evr_ok){
+            goto out;
+        }
+        if(write_chunk_set(c, &blobs[i]) != evr_ok){
+            goto out;
+        }
+        puts_len += 1;
+    }
+    log_debug("Storage indicated %zu of %zu blobs do not yet exist", puts_len, blobs_len);
+    struct evr_resp_header resp;
+    for(size_t i = 0; i < puts_len; ++i){
+        if(evr_read_resp_header(c, &resp) != evr_ok){
+            goto out;
+        }
+        if(resp.status_code != evr_status_code_ok){
+            goto out;
+        }
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
 int evr_req_cmd_stat_blob(struct evr_file *f, evr_blob_ref key, struct evr_resp_header *resp){
     if(evr_write_cmd_stat_blob(f, key) != evr_ok){
         return evr_error;
@@ -313,6 +404,80 @@ int evr_write_cmd_stat_blob(struct evr_file *f, evr_blob_ref key){
     return evr_ok;
 }
 
+int evr_write_cmd_blobs(struct evr_file *f, int type, evr_blob_ref *keys, size_t keys_len);
+
+int evr_req_cmd_stat_blobs(struct evr_file *f, evr_blob_ref *keys, size_t keys_len, struct evr_stat_blobs_entry *entries){
+    int ret = evr_error;
+    if(evr_write_cmd_stat_blobs(f, keys, keys_len) != evr_ok){
+        goto out;
+    }
+    struct evr_resp_header resp;
+    if(evr_read_resp_header(f, &resp) != evr_ok){
+        goto out;
+    }
+    // servers respond to unknown commands with evr_unknown_request
+    // instead of evr_status_code_unknown_cmd
+    if((resp.status_code == evr_status_code_unknown_cmd || resp.status_code == evr_unknown_request) && resp.body_size == 0){
+        ret = evr_unknown_request;
+        goto out;
+    }
+    if(resp.status_code != evr_status_code_ok){
+        goto out;
+    }
+    if(resp.body_size != keys_len * evr_stat_blobs_entry_n_size){
+        log_error("Server reported stat blobs body size of %zu bytes for %zu keys", resp.body_size, keys_len);
+        goto out;
+    }
+    char buf[evr_max_batch_blobs * evr_stat_blobs_entry_n_size];
+    if(read_n(f, buf, resp.body_size, NULL, NULL) != evr_ok){
+        goto out;
+    }
+    for(size_t i = 0; i < keys_len; ++i){
+        if(evr_parse_stat_blobs_entry(&entries[i], &buf[i * evr_stat_blobs_entry_n_size]) != evr_ok){
+            goto out;
+        }
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_write_cmd_stat_blobs(struct evr_file *f, evr_blob_ref *keys, size_t keys_len){
+    return evr_write_cmd_blobs(f, evr_cmd_type_stat_blobs, keys, keys_len);
+}
+
+int evr_req_cmd_get_status(struct evr_file *f, struct evr_glacier_status *status){
+    int ret = evr_error;
+    char buf[evr_cmd_header_n_size];
+    struct evr_cmd_header cmd;
+    cmd.type = evr_cmd_type_get_status;
+    cmd.body_size = 0;
+    if(evr_format_cmd_header(buf, &cmd) != evr_ok){
+        goto out;
+    }
+    if(write_n(f, buf, sizeof(buf)) != evr_ok){
+        goto out;
+    }
+    struct evr_resp_header resp;
+    if(evr_read_resp_header(f, &resp) != evr_ok){
+        goto out;
+    }
+    if(resp.status_code != evr_status_code_ok || resp.body_size != evr_glacier_status_n_size){
+        log_error("Server responded get status with status code 0x%02x and body size %zu", resp.status_code, resp.body_size);
+        goto out;
+    }
+    char body[evr_glacier_status_n_size];
+    if(read_n(f, body, sizeof(body), NULL, NULL) != evr_ok){
+        goto out;
+    }
+    if(evr_parse_glacier_status(status, body) != evr_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
 int evr_req_cmd_get_blob(struct evr_file *f, evr_blob_ref key, struct evr_resp_header *resp){
     int ret = evr_error;
     if(evr_write_cmd_get_blob(f, key) != evr_ok){
@@ -355,6 +520,83 @@ int evr_write_cmd_get_blob(struct evr_file *f, evr_blob_ref key){
     return ret;
 }
 
+int evr_req_cmd_get_blob_range(struct evr_file *f, struct evr_blob_range *range, struct evr_resp_header *resp, struct evr_stat_blob_resp *stat){
+    int ret = evr_error;
+    if(evr_write_cmd_get_blob_range(f, range) != evr_ok){
+        goto out;
+    }
+    if(evr_read_resp_header(f, resp) != evr_ok){
+        goto out;
+    }
+    if(resp->status_code != evr_status_code_ok){
+        ret = evr_ok;
+        goto out;
+    }
+    if(resp->body_size < evr_stat_blob_resp_n_size || resp->body_size > evr_stat_blob_resp_n_size + range->size){
+        log_error("Server reported illegal body size of %zu bytes for a range of %zu bytes", resp->body_size, range->size);
+        goto out;
+    }
+    char buf[evr_stat_blob_resp_n_size];
+    if(read_n(f, buf, sizeof(buf), NULL, NULL) != evr_ok){
+        goto out;
+    }
+    if(evr_parse_stat_blob_resp(stat, buf) != evr_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_write_cmd_get_blob_range(struct evr_file *f, struct evr_blob_range *range){
+    int ret = evr_error;
+    char buf[evr_cmd_header_n_size + evr_blob_range_n_size];
+    struct evr_cmd_header cmd;
+    cmd.type = evr_cmd_type_get_blob_range;
+    cmd.body_size = evr_blob_range_n_size;
+    if(evr_format_cmd_header(buf, &cmd) != evr_ok){
+        goto out;
+    }
+    if(evr_format_blob_range(&buf[evr_cmd_header_n_size], range) != evr_ok){
+        goto out;
+    }
+#ifdef EVR_LOG_DEBUG
+    {
+        evr_blob_ref_str fmt_key;
+        evr_fmt_blob_ref(fmt_key, range->key);
+        log_debug("Sending get range %s %zu+%zu command to server", fmt_key, range->offset, range->size);
+    }
+#endif
+    if(write_n(f, buf, sizeof(buf)) != evr_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_write_cmd_blobs(struct evr_file *f, int type, evr_blob_ref *keys, size_t keys_len){
+    if(keys_len == 0 || keys_len > evr_max_batch_blobs){
+        log_error("Illegal number of %zu keys for one command", keys_len);
+        return evr_error;
+    }
+    char buf[evr_cmd_header_n_size];
+    struct evr_cmd_header cmd;
+    cmd.type = type;
+    cmd.body_size = keys_len * evr_blob_ref_size;
+    if(evr_format_cmd_header(buf, &cmd) != evr_ok){
+        return evr_error;
+    }
+    log_debug("Sending cmd 0x%02x for %zu keys", type, keys_len);
+    if(write_n(f, buf, sizeof(buf)) != evr_ok){
+        return evr_error;
+    }
+    if(write_n(f, keys, cmd.body_size) != evr_ok){
+        return evr_error;
+    }
+    return evr_ok;
+}
+
 int evr_read_cmd_get_resp_blob(char **blob, struct evr_file *c, size_t resp_body_size, evr_blob_ref expected_ref){
     int ret = evr_error;
     // read flags but ignore them
@@ -449,6 +691,27 @@ int evr_write_cmd_put_blob(struct evr_file *f, evr_blob_ref key, int flags, size
     return evr_ok;
 }
 
+int evr_write_cmd_offer_blob(struct evr_file *f, evr_blob_ref key, int flags, size_t blob_size){
+    char buf[evr_cmd_header_n_size + evr_blob_offer_n_size];
+    struct evr_cmd_header cmd;
+    cmd.type = evr_cmd_type_offer_blob;
+    cmd.body_size = evr_blob_offer_n_size;
+    if(evr_format_cmd_header(buf, &cmd) != evr_ok){
+        return evr_error;
+    }
+    struct evr_blob_offer offer;
+    memcpy(offer.key, key, evr_blob_ref_size);
+    offer.flags = flags;
+    offer.blob_size = blob_size;
+    if(evr_format_blob_offer(&buf[evr_cmd_header_n_size], &offer) != evr_ok){
+        return evr_error;
+    }
+    if(write_n(f, buf, sizeof(buf)) != evr_ok){
+        return evr_error;
+    }
+    return evr_ok;
+}
+
 int evr_req_cmd_watch_blobs(struct evr_file *f, struct evr_blob_filter *filter){
     int ret = evr_error;
     if(evr_write_cmd_watch_blobs(f, filter) != evr_ok){
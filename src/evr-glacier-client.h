@@ -63,26 +63,82 @@ int evr_fetch_file_claim(struct evr_file_claim **claim, struct evr_file *c, evr_
  * evr_stat_and_put checks if the given key exists and puts it if
  * not. Check and put are not one atomic operation.
  *
+ * The blob is offered to the server using evr_cmd_type_offer_blob
+ * so the data is only sent if the server misses the blob. Servers
+ * which don't know the offer command are asked with a stat command
+ * instead.
+ *
  * Returns evr_ok if blob did not exist and was put into
  * storage. Returns evr_exists if stat indicated that the blob already
  * exists.
  */
 int evr_stat_and_put(struct evr_file *c, evr_blob_ref key, int flags, struct chunk_set *blob);
 
+/**
+ * evr_stat_and_put_blobs works like evr_stat_and_put for
+ * blobs_len blobs. The existence of all blobs is checked with one
+ * evr_cmd_type_stat_blobs round trip. The missing blobs are put
+ * afterwards without waiting for the individual put responses.
+ *
+ * Servers which don't know evr_cmd_type_stat_blobs get the blobs
+ * one by one through evr_stat_and_put.
+ *
+ * blobs_len must not be greater than evr_max_batch_blobs.
+ *
+ * Returns evr_ok if every blob exists in the storage afterwards.
+ */
+int evr_stat_and_put_blobs(struct evr_file *c, size_t blobs_len, evr_blob_ref *keys, int flags, struct chunk_set *blobs);
+
 int evr_req_cmd_stat_blob(struct evr_file *f, evr_blob_ref key, struct evr_resp_header *resp);
 
+/**
+ * evr_req_cmd_stat_blobs stats keys_len blobs with one round
+ * trip. The stat result for keys[i] is written to entries[i].
+ *
+ * keys_len must not be greater than evr_max_batch_blobs.
+ *
+ * Returns evr_unknown_request if the server does not know the stat
+ * blobs command. The connection can still be used afterwards.
+ */
+int evr_req_cmd_stat_blobs(struct evr_file *f, evr_blob_ref *keys, size_t keys_len, struct evr_stat_blobs_entry *entries);
+
+int evr_write_cmd_stat_blobs(struct evr_file *f, evr_blob_ref *keys, size_t keys_len);
+
+/**
+ * evr_req_cmd_get_status asks the server for its status.
+ */
+int evr_req_cmd_get_status(struct evr_file *f, struct evr_glacier_status *status);
+
 int evr_write_cmd_stat_blob(struct evr_file *f, evr_blob_ref key);
 
 int evr_req_cmd_get_blob(struct evr_file *f, evr_blob_ref key, struct evr_resp_header *resp);
 
 int evr_write_cmd_get_blob(struct evr_file *f, evr_blob_ref key);
 
+/**
+ * evr_req_cmd_get_blob_range requests a byte range of a blob.
+ *
+ * If resp's status_code is evr_status_code_ok the whole blob's flags
+ * and size are written to stat. resp's body_size minus
+ * evr_stat_blob_resp_n_size range bytes are ready to be read from f
+ * afterwards.
+ *
+ * The range's data can't be verified against the blob's
+ * key. Callers must use evr_req_cmd_get_blob if they need verified
+ * data.
+ */
+int evr_req_cmd_get_blob_range(struct evr_file *f, struct evr_blob_range *range, struct evr_resp_header *resp, struct evr_stat_blob_resp *stat);
+
+int evr_write_cmd_get_blob_range(struct evr_file *f, struct evr_blob_range *range);
+
 int evr_read_cmd_get_resp_blob(char **blob, struct evr_file *c, size_t resp_body_size, evr_blob_ref expected_ref);
 
 int evr_pipe_cmd_get_resp_blob(struct evr_file *dst, struct evr_file *src, size_t resp_body_size, evr_blob_ref expected_ref);
 
 int evr_write_cmd_put_blob(struct evr_file *f, evr_blob_ref key, int flags, size_t blob_size);
 
+int evr_write_cmd_offer_blob(struct evr_file *f, evr_blob_ref key, int flags, size_t blob_size);
+
 int evr_req_cmd_watch_blobs(struct evr_file *f, struct evr_blob_filter *filter);
 
 int evr_write_cmd_watch_blobs(struct evr_file *f, struct evr_blob_filter *filter);
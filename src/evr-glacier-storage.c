@@ -23,6 +23,12 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -40,6 +46,8 @@
 #include "glacier.h"
 #include "files.h"
 #include "concurrent-glacier.h"
+#include "blob-index.h"
+#include "blob-cache.h"
 #include "server.h"
 #include "configurations.h"
 #include "configp.h"
@@ -68,6 +76,30 @@ static char args_doc[] = "";
 #define arg_index_db 260
 #define arg_log_path 261
 #define arg_pid_path 262
+#define arg_group_commit_latency 263
+#define arg_bucket_fd_cache_size 264
+#define arg_read_ctx_pool_size 265
+#define arg_read_buffer_size 266
+#define arg_max_connections 267
+#define arg_max_requests_in_flight 268
+#define arg_max_put_bytes_in_flight 269
+#define arg_bucket_lanes 270
+#define arg_stripe_dir 271
+#define arg_bucket_dir_policy 272
+#define arg_blob_compression 273
+#define arg_bucket_io_backend 274
+#define arg_reindex_threads 275
+#define arg_bucket_preallocation 276
+#define arg_bucket_append_mode 277
+#define arg_blob_cache_size 278
+#define arg_blob_cache_max_blob_size 279
+#define arg_watch_flush_interval 280
+#define arg_index_db_cache_size 281
+#define arg_index_db_mmap_size 282
+#define arg_check_rate 283
+#define arg_io_timeout 284
+#define arg_reindex_run_len 285
+#define arg_put_stream_min_size 286
 
 static struct argp_option options[] = {
     {"host", arg_host, "HOST", 0, "The network interface at which the attr index server will listen on. The default is " default_host "."},
@@ -77,13 +109,48 @@ static struct argp_option options[] = {
     {"auth-token", arg_auth_token, "TOKEN", 0, "An authorization token which must be presented by clients so their requests are accepted. Must be a 64 characters string only containing 0-9 and a-f. Should be hard to guess and secret. You can call 'openssl rand -hex 32' to generate a good token."},
     // TODO max-bucket-size
     {"bucket-dir", 'd', "DIR", 0, "Bucket directory path. This is the place where the data is persisted. Default path is " default_bucket_dir_path "."},
+    {"stripe-dir", arg_stripe_dir, "DIR", 0, "Additional directory which holds buckets. May be given multiple times to spread the buckets over multiple disks. The index db stays within BUCKET_DIR."},
+    {"bucket-dir-policy", arg_bucket_dir_policy, "POLICY", 0, "Decides in which bucket directory a new bucket is created if stripe directories are configured. Either round-robin or free-space. free-space weights the directories by their available disk space. The default is round-robin."},
     {"index-db", arg_index_db, "DB", 0, "Path to the file where the sqlite bucket index DB should be put. The default is to put the index db within BUCKET_DIR" glacier_dir_index_db_path "."},
     {"foreground", 'f', NULL, 0, "The process will not demonize. It will stay in the foreground instead."},
     {"log", arg_log_path, "FILE", 0, "A file to which log output messages will be appended. By default logs are written to stdout."},
     {"pid", arg_pid_path, "FILE", 0, "A file to which the daemon's pid is written."},
+    {"bucket-lanes", arg_bucket_lanes, "N", 0, "Number of buckets which are written in parallel by independent persister threads. Only lower the number after a graceful shutdown. The default is 1."},
+    {"blob-compression", arg_blob_compression, "ALGORITHM", 0, "Compression applied to new blobs which look compressible. Either none or deflate. The default is none."},
+    {"bucket-io", arg_bucket_io_backend, "BACKEND", 0, "Backend used for bucket appends. Either syscalls or io-uring. io-uring is opt-in and falls back to syscalls if it is not available. The default is syscalls."},
+    {"bucket-preallocation", arg_bucket_preallocation, "MODE", 0, "Either none or fallocate. fallocate reserves the maximum bucket size on disk when a bucket is created so buckets don't fragment while they grow. The default is fallocate."},
+    {"bucket-append-mode", arg_bucket_append_mode, "MODE", 0, "Either buffered or uncached. uncached writes appended blobs back to disk right away and drops them from the page cache so bulk ingest does not evict frequently read blobs. The default is buffered."},
+    {"reindex-threads", arg_reindex_threads, "N", 0, "Number of threads which scan buckets in parallel while the index db is rebuilt. The default is 4."},
+    {"reindex-run-len", arg_reindex_run_len, "N", 0, "Number of blob positions which are sorted in memory while the index db is rebuilt. Bigger glaciers are sorted in runs which are merged from temporary files in the bucket dir. Each blob position takes about 64 bytes. The default is 1048576."},
+    {"group-commit-latency", arg_group_commit_latency, "USEC", 0, "Microseconds the persister waits for further blobs so blobs put by concurrent connections are written, synced and indexed together. The default is 0 which persists blobs right away."},
+    {"bucket-fd-cache-size", arg_bucket_fd_cache_size, "N", 0, "Number of bucket files which are kept open for reading blobs. The default is 64."},
+    {"read-ctx-pool-size", arg_read_ctx_pool_size, "N", 0, "Maximum number of index db read contexts shared by all connections. Connections wait for a free read context if all are in use. The default is 16."},
+    {"read-buffer-size", arg_read_buffer_size, "BYTES", 0, "Size of the buffer each pooled read context uses. The default is 65536."},
+    {"max-connections", arg_max_connections, "N", 0, "Maximum number of open client connections. Further connections are closed right after they are accepted. The default is 1024."},
+    {"max-requests-in-flight", arg_max_requests_in_flight, "N", 0, "Number of worker threads which process client requests. This is the maximum number of requests processed in parallel. Watching connections only occupy a worker while blobs are sent. The default is 16."},
+    {"io-timeout", arg_io_timeout, "SEC", 0, "Seconds a worker waits for a client which stalls within a request before the connection is closed. Stalling clients would otherwise occupy the workers. Each stalling client still occupies one worker for up to SEC seconds. So as many stalling clients as there are max-requests-in-flight workers stall all requests for up to SEC seconds. 0 waits forever. The default is 30."},
+    {"blob-cache-size", arg_blob_cache_size, "BYTES", 0, "Bytes of memory used to cache the data of frequently read small blobs. 0 disables the cache. The default is 67108864."},
+    {"blob-cache-max-blob-size", arg_blob_cache_max_blob_size, "BYTES", 0, "Size of the biggest blob which is cached. The default is 65536."},
+    {"watch-flush-interval", arg_watch_flush_interval, "MS", 0, "Minimum number of milliseconds between two blob modification notifications sent to one watching client. Modifications in between are sent together. The default is 0 which notifies right away."},
+    {"index-db-cache-size", arg_index_db_cache_size, "BYTES", 0, "Bytes of page cache each connection to the index db may use. The default is 8388608."},
+    {"index-db-mmap-size", arg_index_db_mmap_size, "BYTES", 0, "Bytes of the index db which are read through memory mapping. 0 disables memory mapping. The default is 1073741824."},
+    {"check-rate", arg_check_rate, "N", 0, "Number of blobs per second which the background consistency check verifies after startup. 0 disables the background check. The default is 16."},
+    {"max-put-bytes-in-flight", arg_max_put_bytes_in_flight, "BYTES", 0, "Maximum sum of blob bytes buffered by put requests which are not yet persisted. Further put requests wait before they read their blob from the client. The default is 268435456."},
+    {"put-stream-min-size", arg_put_stream_min_size, "BYTES", 0, "Blobs of at least this size are written into a bucket while they are received instead of being buffered first. Streaming needs a bucket lane of its own so it only happens with more than one bucket lane and without blob compression. 0 disables streaming. The default is 4194304."},
     {0},
 };
 
+/**
+ * evr_parse_size_opt parses arg as a non negative decimal number
+ * into v. Returns evr_error if arg is empty or no number.
+ */
+static int evr_parse_size_opt(const char *arg, size_t *v){
+    if(arg[0] == '\0' || sscanf(arg, "%zu", v) != 1){
+        return evr_error;
+    }
+    return evr_ok;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state, void (*usage)(const struct argp_state *state)){
     struct evr_glacier_storage_cfg *cfg = (struct evr_glacier_storage_cfg*)state->input;
     switch(key){
@@ -95,6 +162,78 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state, void (*us
     case arg_index_db:
         evr_replace_str(cfg->index_db_path, arg);
         break;
+    case arg_stripe_dir: {
+        char *path = strdup(arg);
+        if(!path){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        if(evr_single_wordexp(&path) != evr_ok){
+            free(path);
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        const size_t path_size = strlen(path) + 1;
+        struct evr_buf_pos bp;
+        if(evr_llbuf_prepend(&cfg->stripe_dir_paths, &bp, path_size) != evr_ok){
+            free(path);
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        evr_push_n(&bp, path, path_size);
+        free(path);
+        break;
+    }
+    case arg_blob_compression:
+        if(strcmp(arg, "none") == 0){
+            cfg->blob_compression = evr_blob_compression_none;
+        } else if(strcmp(arg, "deflate") == 0){
+            cfg->blob_compression = evr_blob_compression_deflate;
+        } else {
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_bucket_io_backend:
+        if(strcmp(arg, "syscalls") == 0){
+            cfg->bucket_io_backend = evr_bucket_io_backend_syscalls;
+        } else if(strcmp(arg, "io-uring") == 0){
+            cfg->bucket_io_backend = evr_bucket_io_backend_io_uring;
+        } else {
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_bucket_preallocation:
+        if(strcmp(arg, "none") == 0){
+            cfg->bucket_preallocation = evr_bucket_preallocation_none;
+        } else if(strcmp(arg, "fallocate") == 0){
+            cfg->bucket_preallocation = evr_bucket_preallocation_fallocate;
+        } else {
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_bucket_append_mode:
+        if(strcmp(arg, "buffered") == 0){
+            cfg->bucket_append_mode = evr_bucket_append_mode_buffered;
+        } else if(strcmp(arg, "uncached") == 0){
+            cfg->bucket_append_mode = evr_bucket_append_mode_uncached;
+        } else {
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_bucket_dir_policy:
+        if(strcmp(arg, "round-robin") == 0){
+            cfg->bucket_dir_policy = evr_bucket_dir_policy_round_robin;
+        } else if(strcmp(arg, "free-space") == 0){
+            cfg->bucket_dir_policy = evr_bucket_dir_policy_free_space;
+        } else {
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
     case arg_host:
         evr_replace_str(cfg->host, arg);
         break;
@@ -116,6 +255,114 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state, void (*us
     case arg_ssl_key_path:
         evr_replace_str(cfg->ssl_key_path, arg);
         break;
+    case arg_reindex_threads:
+        if(evr_parse_size_opt(arg, &cfg->reindex_threads) != evr_ok || cfg->reindex_threads == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_reindex_run_len:
+        if(evr_parse_size_opt(arg, &cfg->reindex_run_len) != evr_ok || cfg->reindex_run_len == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_group_commit_latency:
+        if(evr_parse_size_opt(arg, &cfg->group_commit_latency) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_bucket_fd_cache_size:
+        if(evr_parse_size_opt(arg, &cfg->bucket_fd_cache_size) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_read_ctx_pool_size:
+        if(evr_parse_size_opt(arg, &cfg->read_ctx_pool_size) != evr_ok || cfg->read_ctx_pool_size == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_read_buffer_size:
+        if(evr_parse_size_opt(arg, &cfg->read_buffer_size) != evr_ok || cfg->read_buffer_size == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_max_connections:
+        if(evr_parse_size_opt(arg, &cfg->max_connections) != evr_ok || cfg->max_connections == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_max_requests_in_flight:
+        if(evr_parse_size_opt(arg, &cfg->max_requests_in_flight) != evr_ok || cfg->max_requests_in_flight == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_blob_cache_size:
+        if(evr_parse_size_opt(arg, &cfg->blob_cache_size) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_blob_cache_max_blob_size:
+        if(evr_parse_size_opt(arg, &cfg->blob_cache_max_blob_size) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_watch_flush_interval:
+        if(evr_parse_size_opt(arg, &cfg->watch_flush_interval) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_index_db_cache_size:
+        if(evr_parse_size_opt(arg, &cfg->index_db_cache_size) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_index_db_mmap_size:
+        if(evr_parse_size_opt(arg, &cfg->index_db_mmap_size) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_check_rate:
+        if(evr_parse_size_opt(arg, &cfg->check_rate) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_io_timeout:
+        if(evr_parse_size_opt(arg, &cfg->io_timeout) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_put_stream_min_size:
+        if(evr_parse_size_opt(arg, &cfg->put_stream_min_size) != evr_ok){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_max_put_bytes_in_flight:
+        if(evr_parse_size_opt(arg, &cfg->max_put_bytes_in_flight) != evr_ok || cfg->max_put_bytes_in_flight == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
+    case arg_bucket_lanes:
+        if(evr_parse_size_opt(arg, &cfg->bucket_lanes) != evr_ok || cfg->bucket_lanes == 0){
+            usage(state);
+            return ARGP_ERR_UNKNOWN;
+        }
+        break;
     case arg_auth_token:
         if(evr_parse_auth_token(cfg->auth_token, arg) != evr_ok){
             usage(state);
@@ -133,11 +380,132 @@ static error_t parse_opt_adapter(int key, char *arg, struct argp_state *state){
 
 sig_atomic_t running = 1;
 
+#define evr_connection_state_handshake 1
+#define evr_connection_state_auth 2
+#define evr_connection_state_idle 3
+#define evr_connection_state_watch 4
+
+#define evr_event_src_listen 1
+#define evr_event_src_socket 2
+#define evr_event_src_watch 3
+#define evr_event_src_watch_timer 4
+
+struct evr_connection;
+
+/**
+ * struct evr_event_src is referenced by the registered epoll events
+ * so the server knows which file descriptor became ready.
+ */
+struct evr_event_src {
+    int type;
+    struct evr_connection *connection;
+};
+
 struct evr_connection{
     struct evr_file socket;
     int sync_strategy;
+
+    /**
+     * state is one of evr_connection_state_*.
+     */
+    int state;
+
+    struct evr_event_src socket_src;
+
+    /**
+     * busy indicates that the connection is queued for or processed
+     * by a worker. rerun indicates that another event arrived while
+     * the connection was busy. Both are guarded by server.lock.
+     */
+    int busy;
+    int rerun;
+
+    /**
+     * mod_blobs is the persister watcher queue of a connection in
+     * state evr_connection_state_watch. NULL otherwise.
+     */
+    struct evr_queue *mod_blobs;
+
+    /**
+     * watch_filter is referenced by the persister watcher while
+     * mod_blobs exists.
+     */
+    struct evr_blob_filter watch_filter;
+
+    /**
+     * watch_last_modified is the newest last_modified timestamp
+     * reported to the watching peer. A watch which fell behind
+     * continues listing blobs from the index at this timestamp.
+     */
+    evr_time watch_last_modified;
+
+    /**
+     * watch_fd is an eventfd which is signaled when mod_blobs
+     * receives blobs. -1 if the connection does not watch.
+     */
+    int watch_fd;
+    struct evr_event_src watch_src;
+
+    /**
+     * watch_timer_fd is a timerfd which delays the next notification
+     * frame if cfg->watch_flush_interval is set. -1 otherwise.
+     *
+     * watch_throttled indicates that the connection sent a frame
+     * and waits for watch_timer_fd instead of watch_fd.
+     */
+    int watch_timer_fd;
+    int watch_throttled;
+    struct evr_event_src watch_timer_src;
+
+    /**
+     * next_ready links the connections in server's ready queue and
+     * in server's closed list. A connection is never part of both.
+     */
+    struct evr_connection *next_ready;
 };
 
+/**
+ * struct evr_server holds the epoll instance and the connections
+ * which are ready to be processed by a connection worker.
+ */
+struct evr_server {
+    int epoll_fd;
+    mtx_t lock;
+    cnd_t connection_ready;
+    struct evr_connection *ready_first;
+    struct evr_connection *ready_last;
+
+    /**
+     * closed lists the connections which are closed but not yet
+     * freed. Events of the current epoll_wait batch might still
+     * reference them. So they are freed by the epoll thread after
+     * the batch is processed. Guarded by lock.
+     */
+    struct evr_connection *closed;
+
+    /**
+     * connections_len is the number of open connections including
+     * connections with an unfinished TLS handshake.
+     */
+    size_t connections_len;
+
+    /**
+     * put_bytes_in_flight is the number of blob bytes buffered by put
+     * requests which are not yet persisted. Guarded by lock.
+     */
+    size_t put_bytes_in_flight;
+    cnd_t put_bytes_released;
+
+    /**
+     * serving holds the connection served by each connection
+     * worker. NULL while the worker waits for a ready connection.
+     * Guarded by lock.
+     */
+    struct evr_connection **serving;
+};
+
+struct evr_server server;
+
 /**
  * evr_list_blobs_blobs_len's value tries to fill one IP packet well.
  */
@@ -149,29 +517,236 @@ struct evr_list_blobs_ctx {
     struct evr_modified_blob blobs[evr_list_blobs_blobs_len];
 };
 
+/**
+ * evr_watch_frame_blobs_len is the maximum number of modified blobs
+ * which are written to a watching connection with one write. The
+ * frame fits into one TLS record.
+ */
+#define evr_watch_frame_blobs_len ((16 << 10) / evr_watch_blobs_body_n_size)
+
+/**
+ * evr_watch_catch_up_overlap is the number of milliseconds a watch
+ * which fell behind relists before its newest reported blob.
+ */
+#define evr_watch_catch_up_overlap (10 * 1000)
+
+/**
+ * evr_list_blobs_page_len is the number of blobs a watch lists per
+ * read ctx checkout.
+ */
+#define evr_list_blobs_page_len evr_blob_list_default_page_len
+
 int evr_load_glacier_storage_cfg(int argc, char **argv);
 
 void handle_sigterm(int signum);
+
+/**
+ * evr_glacier_tcp_server serves client connections until running is
+ * cleared.
+ *
+ * Returns only after the epoll loop ended and all connection worker
+ * threads are joined. So nothing accesses the shared server state
+ * like blob_index, bucket_fd_cache or read_ctx_pool anymore.
+ */
 int evr_glacier_tcp_server(const struct evr_glacier_storage_cfg *cfg);
+int evr_set_nonblocking(int fd, int nonblocking);
+
+/**
+ * evr_set_io_timeout makes blocking reads and writes on the socket
+ * fd fail after they could not transfer any byte for timeout
+ * seconds. A worker which serves a stalling peer gets free again
+ * that way. 0 disables the timeout.
+ */
+int evr_set_io_timeout(int fd, size_t timeout);
+int evr_accept_connections(int s);
+void evr_continue_handshake(struct evr_connection *ctx);
+int evr_dispatch_connection(struct evr_connection *ctx);
+int evr_arm_connection(struct evr_connection *ctx);
+
+/**
+ * evr_close_connection releases the resources of ctx and moves ctx
+ * into server's closed list. ctx itself is freed later by
+ * evr_free_closed_connections.
+ */
+int evr_close_connection(struct evr_connection *ctx);
+
+/**
+ * evr_free_closed_connections frees the connections in server's
+ * closed list. Must only be called from the epoll thread while it
+ * processes no epoll_wait batch.
+ */
+int evr_free_closed_connections(void);
+
+int evr_forget_connection(void);
+
+/**
+ * evr_shutdown_served_connections shuts down the sockets of all
+ * connections which are served by a worker right now. Workers blocked
+ * on stalling peers end that way without waiting for the io timeout.
+ */
+int evr_shutdown_served_connections(void);
+
+/**
+ * evr_connection_worker serves ready connections until running is
+ * cleared. context points to the worker's slot in server.serving.
+ */
 int evr_connection_worker(void *context);
+
+/**
+ * evr_serve_connection processes the requests of ctx. serving is
+ * cleared before ctx is handed back to the epoll loop or closed.
+ */
+void evr_serve_connection(struct evr_connection *ctx, struct evr_connection **serving);
+int evr_process_connection(struct evr_connection *ctx);
 int evr_work_unknown_cmd(struct evr_connection *ctx, struct evr_cmd_header *cmd);
 int evr_work_put_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd);
-int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd, struct evr_glacier_read_ctx **rctx);
-int evr_work_watch_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd, struct evr_glacier_read_ctx **rctx);
+int evr_work_offer_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+
+/**
+ * evr_receive_blob reads blob_size bytes of blob data from the
+ * client, persists them and responds to the client.
+ */
+int evr_receive_blob(struct evr_connection *ctx, evr_blob_ref key, int flags, size_t blob_size);
+
+/**
+ * evr_put_stream_buffer_size is the size of the pieces in which a
+ * streamed put is read from the client and written into its bucket.
+ */
+#define evr_put_stream_buffer_size (64 << 10)
+
+/**
+ * evr_stream_blob works like evr_receive_blob but writes the blob
+ * data into a bucket lane while it is read from the client. So the
+ * blob is never buffered as a whole.
+ *
+ * Returns evr_temporary_occupied without reading from the client if
+ * the persister can't spare a bucket lane for the stream.
+ */
+int evr_stream_blob(struct evr_connection *ctx, evr_blob_ref key, int flags, size_t blob_size);
+
+/**
+ * evr_respond_status writes a response header with the given status
+ * code and an empty body.
+ */
+int evr_respond_status(struct evr_connection *ctx, int status_code);
+
+/**
+ * evr_acquire_put_bytes blocks until blob_size bytes fit into the
+ * cfg->max_put_bytes_in_flight budget. A blob bigger than the whole
+ * budget waits until no other put is in flight.
+ *
+ * Returns evr_end if the server shuts down while waiting.
+ */
+int evr_acquire_put_bytes(size_t blob_size);
+
+int evr_release_put_bytes(size_t blob_size);
+int evr_work_get_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+
+int evr_work_get_stored_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+int evr_work_get_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+int evr_send_blob(struct evr_connection *ctx, evr_blob_ref key);
+
+/**
+ * evr_send_cached_blob sends the blob at pos from the blob cache. The
+ * blob is read into the cache if it is small enough but not yet
+ * cached.
+ *
+ * Returns evr_not_found if the blob is too big for the cache. The
+ * caller must send the blob itself then.
+ */
+int evr_send_cached_blob(struct evr_connection *ctx, evr_blob_ref key, const struct evr_glacier_blob_pos *pos);
+int evr_work_get_blob_range(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+int evr_work_stat_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+int evr_work_watch_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+/**
+ * evr_list_watched_blobs sends the blobs from the index which pass f
+ * to the watching peer.
+ */
+int evr_list_watched_blobs(struct evr_connection *ctx, struct evr_blob_filter *f);
+
+/**
+ * evr_catch_up_watch_blobs recovers the notifications lost because
+ * the connection's mod_blobs queue overflowed by listing them from
+ * the index.
+ */
+int evr_catch_up_watch_blobs(struct evr_connection *ctx);
+
+int evr_continue_watch_blobs(struct evr_connection *ctx);
 int evr_work_configure_connection(struct evr_connection *ctx, struct evr_cmd_header *cmd);
+int evr_work_get_status(struct evr_connection *ctx, struct evr_cmd_header *cmd);
 int evr_handle_blob_list(void *ctx, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob);
 int evr_flush_list_blobs_ctx(struct evr_list_blobs_ctx *ctx);
-int evr_ensure_worker_rctx_exists(struct evr_glacier_read_ctx **rctx, struct evr_connection *ctx);
 int send_get_response(void *arg, int exists, int flags, size_t blob_size);
-int pipe_data(void *arg, const char *data, size_t data_size);
+
+struct evr_get_range_response_ctx {
+    struct evr_file *f;
+    size_t range_size;
+};
+
+int send_get_range_response(void *arg, int exists, int flags, size_t blob_size);
+int evr_load_blob_index(void);
+int evr_load_blob_index_visit(void *ctx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos);
 
 /**
  * cfg exists until the program is terminated.
  */
 struct evr_glacier_storage_cfg *cfg;
 
+/**
+ * blob_index is used by the connection workers to locate blobs
+ * without querying the index db. It is filled on startup and updated
+ * by the persister.
+ */
+struct evr_blob_index *blob_index;
+
+struct evr_bucket_fd_cache *bucket_fd_cache;
+
+/**
+ * blob_cache holds the data of small blobs which are read
+ * frequently. NULL if the cache is disabled.
+ */
+struct evr_blob_cache *blob_cache = NULL;
+
+/**
+ * read_ctx_pool provides the index db read contexts for the
+ * connection workers. A connection only holds a read context while it
+ * queries the index db.
+ */
+struct evr_glacier_read_ctx_pool *read_ctx_pool;
+
 SSL_CTX *ssl_ctx;
 
+/**
+ * evr_background_check_latest_blobs is the number of latest blobs
+ * which are verified. The quick check on startup already verified
+ * the evr_glacier_quick_check_latest_blobs latest of them.
+ */
+#define evr_background_check_latest_blobs 1024
+
+/**
+ * evr_background_check_random_blobs is the number of randomly picked
+ * blobs which are verified after the latest blobs.
+ */
+#define evr_background_check_random_blobs 1024
+
+/**
+ * check holds the background consistency check which verifies a
+ * sample of blobs while the server already serves connections. The
+ * fields are guarded by lock.
+ */
+struct {
+    mtx_t lock;
+    cnd_t stop_requested;
+    int stop;
+    thrd_t thread;
+    struct evr_glacier_status status;
+} check;
+
+int evr_start_background_check(void);
+int evr_stop_background_check(void);
+int evr_background_check_worker(void *arg);
+
 int main(int argc, char **argv){
     int ret = evr_error;
     evr_log_app = "g";
@@ -181,6 +756,12 @@ int main(int argc, char **argv){
     if(evr_load_glacier_storage_cfg(argc, argv) != evr_ok){
         goto out_with_tls_free;
     }
+    // the put budget roughly bounds the chunks in use by put
+    // requests. retaining that many free chunks avoids reallocating
+    // chunks under ingest load.
+    if(evr_set_chunk_pool_max_chunks(cfg->max_put_bytes_in_flight / evr_chunk_size) != evr_ok){
+        goto out_with_free_configuration;
+    }
     ssl_ctx = evr_create_ssl_server_ctx(cfg->ssl_cert_path, cfg->ssl_key_path);
     if(!ssl_ctx){
         log_error("Unable to configure SSL context");
@@ -203,30 +784,81 @@ int main(int argc, char **argv){
         log_error("Glacier quick check failed");
         goto out_with_free_ssl_ctx;
     }
+    if(evr_load_blob_index() != evr_ok){
+        log_error("Failed to load blob index");
+        goto out_with_free_ssl_ctx;
+    }
+    bucket_fd_cache = evr_create_bucket_fd_cache(cfg, cfg->bucket_fd_cache_size);
+    if(!bucket_fd_cache){
+        goto out_with_free_blob_index;
+    }
+    read_ctx_pool = evr_create_glacier_read_ctx_pool(cfg, cfg->read_ctx_pool_size, cfg->read_buffer_size);
+    if(!read_ctx_pool){
+        goto out_with_free_bucket_fd_cache;
+    }
+    if(cfg->blob_cache_size > 0){
+        blob_cache = evr_create_blob_cache(cfg->blob_cache_size, cfg->blob_cache_max_blob_size);
+        if(!blob_cache){
+            goto out_with_free_read_ctx_pool;
+        }
+    }
     if(!cfg->foreground){
         if(evr_daemonize(cfg->pid_path) != evr_ok){
-            goto out_with_free_ssl_ctx;
+            goto out_with_free_blob_cache;
         }
     }
-    if(evr_persister_start(cfg) != evr_ok){
+    if(evr_persister_start(cfg, blob_index) != evr_ok){
         log_error("Failed to start glacier persister thread");
-        goto out_with_free_ssl_ctx;
+        goto out_with_free_blob_cache;
+    }
+    if(evr_start_background_check() != evr_ok){
+        log_error("Failed to start background check thread");
+        goto out_with_stop_persister;
     }
     int tcpret = evr_glacier_tcp_server(cfg);
     if(tcpret != evr_ok && tcpret != evr_end){
         log_error("TCP server failed");
-        goto out_with_stop_persister;
+        goto out_with_stop_background_check;
     }
     ret = evr_ok;
+ out_with_stop_background_check:
+    if(evr_stop_background_check() != evr_ok){
+        log_error("Failed to stop background check thread");
+        ret = evr_error;
+    }
  out_with_stop_persister:
     if(evr_persister_stop() != evr_ok){
         log_error("Failed to stop glacier persister thread");
         ret = evr_error;
     }
+ out_with_free_blob_cache:
+    if(blob_cache){
+        struct evr_blob_cache_stats stats;
+        if(evr_blob_cache_get_stats(blob_cache, &stats) == evr_ok){
+            log_info("Blob cache served %zu hits and %zu misses", stats.hits, stats.misses);
+        }
+        if(evr_free_blob_cache(blob_cache) != evr_ok){
+            ret = evr_error;
+        }
+    }
+ out_with_free_read_ctx_pool:
+    if(evr_free_glacier_read_ctx_pool(read_ctx_pool) != evr_ok){
+        ret = evr_error;
+    }
+ out_with_free_bucket_fd_cache:
+    // evr_glacier_tcp_server joined the connection workers and the
+    // persister and background check are stopped. so no thread uses
+    // the shared state anymore.
+    if(evr_free_bucket_fd_cache(bucket_fd_cache) != evr_ok){
+        ret = evr_error;
+    }
+ out_with_free_blob_index:
+    if(evr_free_blob_index(blob_index) != evr_ok){
+        ret = evr_error;
+    }
  out_with_free_ssl_ctx:
     SSL_CTX_free(ssl_ctx);
  out_with_free_configuration:
-    // TODO we should wait for the worker threads to be finished before freeing config or maybe free config by OS when program ends?
     evr_free_glacier_storage_cfg(cfg);
  out_with_tls_free:
     evr_tls_free();
@@ -247,7 +879,31 @@ int evr_load_glacier_storage_cfg(int argc, char **argv){
     memset(cfg->auth_token, 0, sizeof(cfg->auth_token));
     cfg->max_bucket_size = 1024 << 20;
     cfg->bucket_dir_path = strdup(default_bucket_dir_path);
+    cfg->stripe_dir_paths = NULL;
+    cfg->bucket_dir_policy = evr_bucket_dir_policy_round_robin;
     cfg->index_db_path = NULL;
+    cfg->index_db_cache_size = 8 << 20;
+    cfg->index_db_mmap_size = 1024 << 20;
+    cfg->bucket_lanes = 1;
+    cfg->blob_compression = evr_blob_compression_none;
+    cfg->bucket_io_backend = evr_bucket_io_backend_syscalls;
+    cfg->bucket_preallocation = evr_bucket_preallocation_fallocate;
+    cfg->bucket_append_mode = evr_bucket_append_mode_buffered;
+    cfg->reindex_threads = 4;
+    cfg->reindex_run_len = 1 << 20;
+    cfg->group_commit_latency = 0;
+    cfg->bucket_fd_cache_size = 64;
+    cfg->read_ctx_pool_size = 16;
+    cfg->read_buffer_size = 64 << 10;
+    cfg->max_connections = 1024;
+    cfg->max_requests_in_flight = 16;
+    cfg->io_timeout = 30;
+    cfg->max_put_bytes_in_flight = 256 << 20;
+    cfg->put_stream_min_size = 4 << 20;
+    cfg->blob_cache_size = 64 << 20;
+    cfg->blob_cache_max_blob_size = 64 << 10;
+    cfg->watch_flush_interval = 0;
+    cfg->check_rate = 16;
     cfg->foreground = 0;
     cfg->log_path = NULL;
     cfg->pid_path = NULL;
@@ -293,178 +949,617 @@ int evr_glacier_tcp_server(const struct evr_glacier_storage_cfg *cfg){
         log_error("Failed to create socket");
         goto out;
     }
-    if(listen(s, 7) != 0){
+    if(evr_set_nonblocking(s, 1) != evr_ok){
+        goto out_with_close_s;
+    }
+    if(listen(s, 128) != 0){
         log_error("Failed to listen on %s:%s", cfg->host, cfg->port);
         goto out_with_close_s;
     }
     log_info("Listening on %s:%s", cfg->host, cfg->port);
-    fd_set active_fd_set;
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(server.epoll_fd < 0){
+        goto out_with_close_s;
+    }
+    struct evr_event_src listen_src;
+    listen_src.type = evr_event_src_listen;
+    listen_src.connection = NULL;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_src;
+    if(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, s, &ev) != 0){
+        goto out_with_close_epoll;
+    }
+    if(mtx_init(&server.lock, mtx_plain) != thrd_success){
+        goto out_with_close_epoll;
+    }
+    if(cnd_init(&server.connection_ready) != thrd_success){
+        goto out_with_destroy_lock;
+    }
+    if(cnd_init(&server.put_bytes_released) != thrd_success){
+        goto out_with_destroy_connection_ready;
+    }
+    server.ready_first = NULL;
+    server.ready_last = NULL;
+    server.closed = NULL;
+    server.connections_len = 0;
+    server.put_bytes_in_flight = 0;
+    server.serving = calloc(cfg->max_requests_in_flight, sizeof(struct evr_connection*));
+    if(!server.serving){
+        goto out_with_destroy_put_bytes_released;
+    }
+    thrd_t *workers = malloc(cfg->max_requests_in_flight * sizeof(thrd_t));
+    if(!workers){
+        goto out_with_free_serving;
+    }
+    size_t workers_len = 0;
+    for(; workers_len < cfg->max_requests_in_flight; ++workers_len){
+        if(thrd_create(&workers[workers_len], evr_connection_worker, &server.serving[workers_len]) != thrd_success){
+            evr_panic("Failed to start connection worker thread");
+            goto out_with_join_workers;
+        }
+    }
+    struct epoll_event events[64];
     while(running){
-        FD_ZERO(&active_fd_set);
-        FD_SET(s, &active_fd_set);
-        const int fd_limit = s + 1;
-        int sret = select(fd_limit, &active_fd_set, NULL, NULL, NULL);
-        if(sret == -1){
-            // select returns -1 on sigint.
-            ret = evr_end;
-            goto out_with_close_s;
-        } else if(sret < 0){
-            goto out_with_close_s;
-        }
-        for(int i = 0; i < fd_limit; ++i){
-            if(FD_ISSET(i, &active_fd_set)){
-                if(i == s){
-                    struct evr_connection *ctx = malloc(sizeof(struct evr_connection));
-                    if(!ctx){
-                        continue;
-                    }
-                    ctx->sync_strategy = evr_sync_strategy_default;
-                    if(evr_tls_accept(&ctx->socket, s, ssl_ctx) != evr_ok){
-                        goto out_with_free_ctx;
-                    }
-                    thrd_t t;
-                    if(thrd_create(&t, evr_connection_worker, ctx) != thrd_success){
-                        goto out_with_close_socket;
-                    }
-                    if(thrd_detach(t) != thrd_success){
-                        evr_panic("Failed to detach connection worker thread");
-                        goto out_with_close_socket;
-                    }
-                    continue;
-                out_with_close_socket:
-                    if(ctx->socket.close(&ctx->socket) != 0){
-                        evr_panic("Unable to close connection socket");
-                        free(ctx);
-                        goto out_with_close_s;
-                    }
-                out_with_free_ctx:
-                    free(ctx);
+        int events_len = epoll_wait(server.epoll_fd, events, static_len(events), 1000);
+        if(events_len < 0){
+            if(errno == EINTR){
+                // epoll_wait is interrupted on sigint.
+                continue;
+            }
+            goto out_with_join_workers;
+        }
+        for(int i = 0; i < events_len; ++i){
+            struct evr_event_src *src = events[i].data.ptr;
+            if(src->type == evr_event_src_listen){
+                if(evr_accept_connections(s) != evr_ok){
+                    goto out_with_join_workers;
                 }
+            } else if(src->connection->state == evr_connection_state_handshake){
+                evr_continue_handshake(src->connection);
+            } else if(evr_dispatch_connection(src->connection) != evr_ok){
+                goto out_with_join_workers;
             }
         }
+        if(evr_free_closed_connections() != evr_ok){
+            goto out_with_join_workers;
+        }
     }
     ret = evr_ok;
- out_with_close_s:
-    if(close(s) != 0){
-        evr_panic("Unable to close listen socket.");
+ out_with_join_workers:
+    running = 0;
+    if(cnd_broadcast(&server.connection_ready) != thrd_success){
+        evr_panic("Unable to wake up connection workers");
+        ret = evr_error;
+    }
+    if(cnd_broadcast(&server.put_bytes_released) != thrd_success){
+        evr_panic("Unable to wake up waiting put requests");
+        ret = evr_error;
+    }
+    // without the shutdown a worker would wait up to io-timeout
+    // seconds for a stalling peer. or forever if no io timeout is
+    // set.
+    if(evr_shutdown_served_connections() != evr_ok){
+        ret = evr_error;
+    }
+    for(size_t i = 0; i < workers_len; ++i){
+        if(thrd_join(workers[i], NULL) != thrd_success){
+            evr_panic("Unable to join connection worker thread");
+            ret = evr_error;
+        }
+    }
+    free(workers);
+    if(evr_free_closed_connections() != evr_ok){
+        ret = evr_error;
+    }
+    // connections which are not processed by a worker at this point
+    // are closed when the process terminates.
+ out_with_free_serving:
+    free(server.serving);
+ out_with_destroy_put_bytes_released:
+    cnd_destroy(&server.put_bytes_released);
+ out_with_destroy_connection_ready:
+    cnd_destroy(&server.connection_ready);
+ out_with_destroy_lock:
+    mtx_destroy(&server.lock);
+ out_with_close_epoll:
+    if(close(server.epoll_fd) != 0){
+        evr_panic("Unable to close epoll instance");
+        ret = evr_error;
+    }
+ out_with_close_s:
+    if(close(s) != 0){
+        evr_panic("Unable to close listen socket.");
         ret = evr_error;
     }
  out:
     return ret;
 }
 
-int evr_authenticate_client(struct evr_file *c);
+int evr_set_nonblocking(int fd, int nonblocking){
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0){
+        return evr_error;
+    }
+    if(nonblocking){
+        flags |= O_NONBLOCK;
+    } else {
+        flags &= ~O_NONBLOCK;
+    }
+    if(fcntl(fd, F_SETFL, flags) != 0){
+        return evr_error;
+    }
+    return evr_ok;
+}
 
-int evr_connection_worker(void *context){
-    int result = evr_error;
-    struct evr_connection ctx = *(struct evr_connection*)context;
-    free(context);
-    const int worker = ctx.socket.get_fd(&ctx.socket);
-    log_debug("Started worker %d", worker);
-    int auth_res = evr_authenticate_client(&ctx.socket);
-    if(auth_res == evr_user_data_invalid){
-        result = evr_ok;
-        goto out_with_close_socket;
-    } else if(auth_res != evr_ok) {
-        goto out_with_close_socket;
-    }
-    struct evr_glacier_read_ctx *rctx = NULL;
-    char buffer[evr_cmd_header_n_size];
-    struct evr_cmd_header cmd;
-    while(running){
-        const int header_result = read_n(&ctx.socket, buffer, evr_cmd_header_n_size, NULL, NULL);
-        if(header_result == evr_end){
-            log_debug("Worker %d ends because of remote termination", ctx.socket.get_fd(&ctx.socket));
-            result = evr_ok;
-            goto out_with_free_rctx;
-        } else if (header_result != evr_ok){
-            goto out_with_free_rctx;
+int evr_set_io_timeout(int fd, size_t timeout){
+    struct timeval tv;
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0){
+        return evr_error;
+    }
+    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0){
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_accept_connections(int s){
+    while(1){
+        struct sockaddr_in client_addr;
+        socklen_t size = sizeof(client_addr);
+        int fd = accept4(s, (struct sockaddr*)&client_addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR){
+                return evr_ok;
+            }
+            if(errno == EMFILE || errno == ENFILE){
+                log_error("Unable to accept connection because of too many open files");
+                return evr_ok;
+            }
+            evr_panic("Unable to accept connection from socket %d", s);
+            return evr_error;
         }
-        if(evr_parse_cmd_header(&cmd, buffer) != evr_ok){
-            goto out_with_free_rctx;
+        if(mtx_lock(&server.lock) != thrd_success){
+            evr_panic("Unable to lock server");
+            close(fd);
+            return evr_error;
         }
-        log_debug("Worker %d retrieved cmd 0x%02x with body size %d", ctx.socket.get_fd(&ctx.socket), cmd.type, cmd.body_size);
-        switch(cmd.type){
-        default:
-            if(evr_work_unknown_cmd(&ctx, &cmd) != evr_ok){
-                goto out_with_free_rctx;
-            }
-            break;
-        case evr_cmd_type_get_blob: {
-            size_t body_size = evr_blob_ref_size;
-            if(cmd.body_size != body_size){
-                goto out_with_free_rctx;
+        const int accepted = server.connections_len < cfg->max_connections;
+        if(accepted){
+            server.connections_len += 1;
+        }
+        if(mtx_unlock(&server.lock) != thrd_success){
+            evr_panic("Unable to unlock server");
+            close(fd);
+            return evr_error;
+        }
+        if(!accepted){
+            log_info("Rejected connection from %s:%d because %zu connections are already open", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), cfg->max_connections);
+            if(close(fd) != 0){
+                evr_panic("Unable to close rejected connection");
+                return evr_error;
             }
-            evr_blob_ref key;
-            const int body_result = read_n(&ctx.socket, (char*)&key, body_size, NULL, NULL);
-            if(body_result != evr_ok){
-                goto out_with_free_rctx;
+            continue;
+        }
+        log_debug("Connection from %s:%d accepted (will be worker %d)", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), fd);
+        struct evr_connection *ctx = malloc(sizeof(struct evr_connection));
+        if(!ctx){
+            close(fd);
+            goto fail_with_forget_connection;
+        }
+        ctx->sync_strategy = evr_sync_strategy_default;
+        ctx->state = evr_connection_state_handshake;
+        ctx->socket_src.type = evr_event_src_socket;
+        ctx->socket_src.connection = ctx;
+        ctx->busy = 0;
+        ctx->rerun = 0;
+        ctx->mod_blobs = NULL;
+        ctx->watch_fd = -1;
+        ctx->watch_src.type = evr_event_src_watch;
+        ctx->watch_src.connection = ctx;
+        ctx->watch_timer_fd = -1;
+        ctx->watch_throttled = 0;
+        ctx->watch_timer_src.type = evr_event_src_watch_timer;
+        ctx->watch_timer_src.connection = ctx;
+        ctx->next_ready = NULL;
+        if(evr_tls_start_accept(&ctx->socket, fd, ssl_ctx) != evr_ok){
+            goto fail_with_free_ctx;
+        }
+        // the client starts the TLS handshake so we wait for it
+        // before calling evr_tls_continue_accept.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = &ctx->socket_src;
+        if(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0){
+            evr_tls_free_accept(&ctx->socket);
+            goto fail_with_free_ctx;
+        }
+        continue;
+    fail_with_free_ctx:
+        free(ctx);
+    fail_with_forget_connection:
+        if(evr_forget_connection() != evr_ok){
+            return evr_error;
+        }
+    }
+}
+
+void evr_continue_handshake(struct evr_connection *ctx){
+    const int fd = ctx->socket.get_fd(&ctx->socket);
+    int want_write;
+    int res = evr_tls_continue_accept(&ctx->socket, &want_write);
+    if(res == evr_temporary_occupied){
+        struct epoll_event ev;
+        ev.events = (want_write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+        ev.data.ptr = &ctx->socket_src;
+        if(epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0){
+            goto fail;
+        }
+        return;
+    } else if(res != evr_ok){
+        goto fail;
+    }
+    // the request handlers rely on blocking reads and writes.
+    if(evr_set_nonblocking(fd, 0) != evr_ok){
+        goto fail;
+    }
+    if(evr_set_io_timeout(fd, cfg->io_timeout) != evr_ok){
+        goto fail;
+    }
+    ctx->state = evr_connection_state_auth;
+    if(ctx->socket.pending(&ctx->socket) > 0){
+        if(evr_dispatch_connection(ctx) != evr_ok){
+            evr_panic("Unable to dispatch connection %d", fd);
+        }
+        return;
+    }
+    if(evr_arm_connection(ctx) != evr_ok){
+        // the connection is not referenced by epoll anymore. it will
+        // never be processed again.
+        if(evr_close_connection(ctx) != evr_ok){
+            evr_panic("Unable to close connection %d", fd);
+        }
+    }
+    return;
+ fail:
+    if(epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0){
+        evr_panic("Unable to remove connection %d from epoll", fd);
+    }
+    evr_tls_free_accept(&ctx->socket);
+    free(ctx);
+    if(evr_forget_connection() != evr_ok){
+        evr_panic("Unable to forget connection %d", fd);
+    }
+}
+
+int evr_dispatch_connection(struct evr_connection *ctx){
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        return evr_error;
+    }
+    if(ctx->busy){
+        ctx->rerun = 1;
+    } else {
+        ctx->busy = 1;
+        ctx->next_ready = NULL;
+        if(server.ready_last){
+            server.ready_last->next_ready = ctx;
+        } else {
+            server.ready_first = ctx;
+        }
+        server.ready_last = ctx;
+        if(cnd_signal(&server.connection_ready) != thrd_success){
+            evr_panic("Unable to signal ready connection");
+            mtx_unlock(&server.lock);
+            return evr_error;
+        }
+    }
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_arm_connection(struct evr_connection *ctx){
+    struct epoll_event ev;
+    ev.data.ptr = &ctx->socket_src;
+    if(ctx->state == evr_connection_state_watch){
+        // a watching connection only expects the peer to hang up.
+        ev.events = EPOLLRDHUP | EPOLLONESHOT;
+    } else {
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    }
+    if(epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, ctx->socket.get_fd(&ctx->socket), &ev) != 0){
+        return evr_error;
+    }
+    if(ctx->state == evr_connection_state_watch){
+        if(ctx->watch_throttled){
+            // modified blobs are collected in mod_blobs until the
+            // flush interval passed.
+            struct itimerspec timeout;
+            timeout.it_interval.tv_sec = 0;
+            timeout.it_interval.tv_nsec = 0;
+            timeout.it_value.tv_sec = cfg->watch_flush_interval / 1000;
+            timeout.it_value.tv_nsec = (cfg->watch_flush_interval % 1000) * 1000000;
+            if(timerfd_settime(ctx->watch_timer_fd, 0, &timeout, NULL) != 0){
+                return evr_error;
             }
-#ifdef EVR_LOG_DEBUG
-            {
-                evr_blob_ref_str fmt_key;
-                evr_fmt_blob_ref(fmt_key, key);
-                log_debug("Worker %d retrieved cmd get %s", ctx.socket.get_fd(&ctx.socket), fmt_key);
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = &ctx->watch_timer_src;
+            if(epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, ctx->watch_timer_fd, &ev) != 0){
+                return evr_error;
             }
-#endif
-            if(evr_ensure_worker_rctx_exists(&rctx, &ctx) != evr_ok){
-                goto out_with_free_rctx;
+        } else {
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = &ctx->watch_src;
+            if(epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, ctx->watch_fd, &ev) != 0){
+                return evr_error;
             }
-            int read_res = evr_glacier_read_blob(rctx, key, send_get_response, pipe_data, &ctx.socket);
-#ifdef EVR_LOG_DEBUG
-            if(read_res == evr_not_found) {
-                evr_blob_ref_str fmt_key;
-                evr_fmt_blob_ref(fmt_key, key);
-                log_debug("Worker %d did not find key %s", ctx.socket.get_fd(&ctx.socket), fmt_key);
+        }
+    }
+    return evr_ok;
+}
+
+int evr_close_connection(struct evr_connection *ctx){
+    int ret = evr_ok;
+    const int worker = ctx->socket.get_fd(&ctx->socket);
+    if(ctx->mod_blobs && evr_persister_rm_watcher(ctx->mod_blobs) != evr_ok){
+        evr_panic("Worker %d is unable to remove a persister watcher", worker);
+        ret = evr_error;
+    }
+    if(ctx->watch_fd >= 0 && close(ctx->watch_fd) != 0){
+        evr_panic("Unable to close watch eventfd of worker %d", worker);
+        ret = evr_error;
+    }
+    if(ctx->watch_timer_fd >= 0 && close(ctx->watch_timer_fd) != 0){
+        evr_panic("Unable to close watch timerfd of worker %d", worker);
+        ret = evr_error;
+    }
+    if(epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, worker, NULL) != 0){
+        evr_panic("Unable to remove worker %d from epoll", worker);
+        ret = evr_error;
+    }
+    if(ctx->socket.close(&ctx->socket) != 0){
+        evr_panic("Unable to close socket of worker %d", worker);
+        ret = evr_error;
+    }
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        return evr_error;
+    }
+    // a busy connection is never dispatched again. so events from
+    // the current epoll_wait batch only mark it for a rerun.
+    ctx->busy = 1;
+    ctx->next_ready = server.closed;
+    server.closed = ctx;
+    server.connections_len -= 1;
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        ret = evr_error;
+    }
+    return ret;
+}
+
+int evr_free_closed_connections(void){
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        return evr_error;
+    }
+    struct evr_connection *ctx = server.closed;
+    server.closed = NULL;
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        return evr_error;
+    }
+    while(ctx){
+        struct evr_connection *next = ctx->next_ready;
+        free(ctx);
+        ctx = next;
+    }
+    return evr_ok;
+}
+
+int evr_forget_connection(void){
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        return evr_error;
+    }
+    server.connections_len -= 1;
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_authenticate_client(struct evr_file *c);
+
+int evr_shutdown_served_connections(void){
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        return evr_error;
+    }
+    for(size_t i = 0; i < cfg->max_requests_in_flight; ++i){
+        struct evr_connection *ctx = server.serving[i];
+        if(!ctx){
+            continue;
+        }
+        // the worker only closes the socket after it cleared its
+        // serving slot. so the fd still belongs to ctx.
+        const int fd = ctx->socket.get_fd(&ctx->socket);
+        if(shutdown(fd, SHUT_RDWR) != 0 && errno != ENOTCONN){
+            log_error("Unable to shut down connection of worker %d: %s", fd, strerror(errno));
+        }
+    }
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_connection_worker(void *context){
+    struct evr_connection **serving = context;
+    struct evr_connection *ctx;
+    while(1){
+        if(mtx_lock(&server.lock) != thrd_success){
+            evr_panic("Unable to lock server");
+            return evr_error;
+        }
+        while(running && !server.ready_first){
+            struct timespec timeout;
+            if(timespec_get(&timeout, TIME_UTC) != TIME_UTC){
+                evr_panic("Unable to get current time");
+                mtx_unlock(&server.lock);
+                return evr_error;
             }
-#endif
-            if(read_res != evr_ok && read_res != evr_not_found){
-                // TODO should we send a server error here?
-                goto out_with_free_rctx;
+            timeout.tv_sec += 1;
+            // a timeout lets the worker notice the end of running.
+            cnd_timedwait(&server.connection_ready, &server.lock, &timeout);
+        }
+        if(!running){
+            if(mtx_unlock(&server.lock) != thrd_success){
+                evr_panic("Unable to unlock server");
+                return evr_error;
             }
             break;
         }
-        case evr_cmd_type_put_blob:
-            if(evr_work_put_blob(&ctx, &cmd) != evr_ok){
-                goto out_with_free_rctx;
-            }
+        ctx = server.ready_first;
+        server.ready_first = ctx->next_ready;
+        if(!server.ready_first){
+            server.ready_last = NULL;
+        }
+        *serving = ctx;
+        if(mtx_unlock(&server.lock) != thrd_success){
+            evr_panic("Unable to unlock server");
+            return evr_error;
+        }
+        evr_serve_connection(ctx, serving);
+    }
+    return evr_ok;
+}
+
+void evr_serve_connection(struct evr_connection *ctx, struct evr_connection **serving){
+    const int worker = ctx->socket.get_fd(&ctx->socket);
+    int result;
+    while(1){
+        result = evr_process_connection(ctx);
+        if(result != evr_ok){
             break;
-        case evr_cmd_type_stat_blob:
-            if(evr_work_stat_blob(&ctx, &cmd, &rctx) != evr_ok){
-                goto out_with_free_rctx;
-            }
+        }
+        if(ctx->state != evr_connection_state_watch && ctx->socket.pending(&ctx->socket) > 0){
+            // the next request is already buffered by the TLS layer
+            // and epoll would not report it.
+            continue;
+        }
+        // the connection is armed while it is still busy. events
+        // which arrive in the meantime only mark it for a
+        // rerun. otherwise another worker could process and close
+        // the connection while this worker still arms the watch
+        // sources.
+        if(evr_arm_connection(ctx) != evr_ok){
+            evr_panic("Unable to arm worker %d", worker);
+            result = evr_error;
             break;
-        case evr_cmd_type_watch_blobs:
-            if(evr_work_watch_blobs(&ctx, &cmd, &rctx) != evr_ok){
-                goto out_with_free_rctx;
-            } else {
-                // evr_work_watch_blobs must close connection on end
-                // to indicate no more blobs to client.
-                result = evr_ok;
-                goto out_with_free_rctx;
-            }
+        }
+        if(mtx_lock(&server.lock) != thrd_success){
+            evr_panic("Unable to lock server");
+            result = evr_error;
             break;
-        case evr_cmd_type_configure_connection:
-            if(evr_work_configure_connection(&ctx, &cmd) != evr_ok){
-                goto out_with_free_rctx;
-            }
+        }
+        const int rerun = ctx->rerun;
+        ctx->rerun = 0;
+        if(!rerun){
+            ctx->busy = 0;
+            *serving = NULL;
+        }
+        if(mtx_unlock(&server.lock) != thrd_success){
+            evr_panic("Unable to unlock server");
+            result = evr_error;
             break;
         }
+        if(rerun){
+            continue;
+        }
+        // ctx must not be accessed anymore because it might
+        // already be processed by another worker.
+        return;
     }
-    result = evr_ok;
- out_with_free_rctx:
-    if(rctx){
-        if(evr_free_glacier_read_ctx(rctx) != evr_ok){
-            result = evr_error;
+    if(result == evr_end){
+        log_debug("Worker %d ends", worker);
+    } else {
+        log_debug("Worker %d ends with error", worker);
+    }
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        return;
+    }
+    *serving = NULL;
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        return;
+    }
+    if(evr_close_connection(ctx) != evr_ok){
+        evr_panic("Unable to close worker %d", worker);
+    }
+}
+
+int evr_process_connection(struct evr_connection *ctx){
+    if(ctx->state == evr_connection_state_auth){
+        int auth_res = evr_authenticate_client(&ctx->socket);
+        if(auth_res == evr_user_data_invalid){
+            return evr_end;
+        } else if(auth_res != evr_ok){
+            return evr_error;
         }
+        ctx->state = evr_connection_state_idle;
+        return evr_ok;
     }
- out_with_close_socket:
-    if(ctx.socket.close(&ctx.socket) != 0){
-        evr_panic("Unable to close socket of worker %d", worker);
-        result = evr_error;
+    if(ctx->state == evr_connection_state_watch){
+        return evr_continue_watch_blobs(ctx);
+    }
+    char buffer[evr_cmd_header_n_size];
+    struct evr_cmd_header cmd;
+    const int header_result = read_n(&ctx->socket, buffer, evr_cmd_header_n_size, NULL, NULL);
+    if(header_result == evr_end){
+        log_debug("Worker %d ends because of remote termination", ctx->socket.get_fd(&ctx->socket));
+        return evr_end;
+    } else if (header_result != evr_ok){
+        return evr_error;
+    }
+    if(evr_parse_cmd_header(&cmd, buffer) != evr_ok){
+        return evr_error;
+    }
+    log_debug("Worker %d retrieved cmd 0x%02x with body size %d", ctx->socket.get_fd(&ctx->socket), cmd.type, cmd.body_size);
+    switch(cmd.type){
+    default:
+        return evr_work_unknown_cmd(ctx, &cmd);
+    case evr_cmd_type_get_blob:
+        return evr_work_get_blob(ctx, &cmd);
+    case evr_cmd_type_put_blob:
+        return evr_work_put_blob(ctx, &cmd);
+    case evr_cmd_type_offer_blob:
+        return evr_work_offer_blob(ctx, &cmd);
+    case evr_cmd_type_stat_blob:
+        return evr_work_stat_blob(ctx, &cmd);
+    case evr_cmd_type_get_blobs:
+        return evr_work_get_blobs(ctx, &cmd);
+    case evr_cmd_type_stat_blobs:
+        return evr_work_stat_blobs(ctx, &cmd);
+    case evr_cmd_type_get_blob_range:
+        return evr_work_get_blob_range(ctx, &cmd);
+    case evr_cmd_type_get_stored_blob:
+        return evr_work_get_stored_blob(ctx, &cmd);
+    case evr_cmd_type_watch_blobs:
+        return evr_work_watch_blobs(ctx, &cmd);
+    case evr_cmd_type_configure_connection:
+        return evr_work_configure_connection(ctx, &cmd);
+    case evr_cmd_type_get_status:
+        return evr_work_get_status(ctx, &cmd);
     }
-    log_debug("Ended worker %d with result %d", worker, result);
-    return result;
 }
 
 int evr_authenticate_client(struct evr_file *c){
@@ -502,91 +1597,561 @@ int evr_work_unknown_cmd(struct evr_connection *ctx, struct evr_cmd_header *cmd)
     if(evr_format_resp_header(buf, &resp) != evr_ok){
         return evr_error;
     }
-    if(write_n(&ctx->socket, buf, evr_resp_header_n_size) != evr_ok){
+    if(write_n(&ctx->socket, buf, evr_resp_header_n_size) != evr_ok){
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_work_put_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+    int ret = evr_error;
+    if(cmd->body_size < evr_blob_ref_size + sizeof(uint8_t)){
+        goto out;
+    }
+    size_t blob_size = cmd->body_size - evr_blob_ref_size - sizeof(uint8_t);
+    if(blob_size > evr_max_blob_data_size){
+        // TODO should we send a client error here?
+        goto out;
+    }
+    evr_blob_ref key;
+    if(read_n(&ctx->socket, (char*)&key, evr_blob_ref_size, NULL, NULL) != evr_ok){
+        goto out;
+    }
+    uint8_t flags;
+    if(read_n(&ctx->socket, (char*)&flags, sizeof(flags), NULL, NULL) != evr_ok){
+        goto out;
+    }
+#ifdef EVR_LOG_DEBUG
+    {
+        evr_blob_ref_str fmt_key;
+        evr_fmt_blob_ref(fmt_key, key);
+        log_debug("Worker %d retrieved cmd put %s with flags 0x%02x and %d bytes blob", ctx->socket.get_fd(&ctx->socket), fmt_key, flags, blob_size);
+    }
+#endif
+    struct evr_glacier_blob_pos pos;
+    int find_res = evr_blob_index_find(blob_index, key, &pos);
+    if(find_res == evr_ok){
+        // the client sends the blob anyway. skipping the blob's data
+        // saves buffering, hashing and persisting it again.
+        log_debug("Worker %d skips put of already stored blob", ctx->socket.get_fd(&ctx->socket));
+        if(dump_n(&ctx->socket, blob_size, NULL, NULL) != evr_ok){
+            goto out;
+        }
+        if(evr_respond_status(ctx, evr_status_code_ok) != evr_ok){
+            goto out;
+        }
+    } else if(find_res == evr_not_found){
+        if(evr_receive_blob(ctx, key, flags, blob_size) != evr_ok){
+            goto out;
+        }
+    } else {
+        log_error("evr_blob_index_find failed with error code %d", find_res);
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_work_offer_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+    int ret = evr_error;
+    if(cmd->body_size != evr_blob_offer_n_size){
+        goto out;
+    }
+    char buf[evr_blob_offer_n_size];
+    if(read_n(&ctx->socket, buf, sizeof(buf), NULL, NULL) != evr_ok){
+        goto out;
+    }
+    struct evr_blob_offer offer;
+    if(evr_parse_blob_offer(&offer, buf) != evr_ok){
+        goto out;
+    }
+    if(offer.blob_size > evr_max_blob_data_size){
+        goto out;
+    }
+#ifdef EVR_LOG_DEBUG
+    {
+        evr_blob_ref_str fmt_key;
+        evr_fmt_blob_ref(fmt_key, offer.key);
+        log_debug("Worker %d retrieved cmd offer %s with flags 0x%02x and %zu bytes blob", ctx->socket.get_fd(&ctx->socket), fmt_key, offer.flags, offer.blob_size);
+    }
+#endif
+    struct evr_glacier_blob_pos pos;
+    int find_res = evr_blob_index_find(blob_index, offer.key, &pos);
+    if(find_res == evr_ok){
+        if(evr_respond_status(ctx, evr_status_code_ok) != evr_ok){
+            goto out;
+        }
+    } else if(find_res == evr_not_found){
+        if(evr_respond_status(ctx, evr_status_code_continue) != evr_ok){
+            goto out;
+        }
+        if(evr_receive_blob(ctx, offer.key, offer.flags, offer.blob_size) != evr_ok){
+            goto out;
+        }
+    } else {
+        log_error("evr_blob_index_find failed with error code %d", find_res);
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_receive_blob(struct evr_connection *ctx, evr_blob_ref key, int flags, size_t blob_size){
+    int ret = evr_error;
+    // blob compression needs the whole blob. so compressed glaciers
+    // don't stream.
+    if(cfg->put_stream_min_size > 0 && blob_size >= cfg->put_stream_min_size && cfg->blob_compression == evr_blob_compression_none){
+        // streamed puts don't buffer the blob. so they don't take
+        // from the put bytes in flight budget.
+        int stream_res = evr_stream_blob(ctx, key, flags, blob_size);
+        if(stream_res != evr_temporary_occupied){
+            return stream_res;
+        }
+    }
+    if(evr_acquire_put_bytes(blob_size) != evr_ok){
+        goto out;
+    }
+    evr_blob_ref_hd hd;
+    if(evr_blob_ref_open(&hd) != evr_ok){
+        goto out_with_release_put_bytes;
+    }
+    struct chunk_set *blob = read_into_chunks(&ctx->socket, blob_size, evr_blob_ref_write_se, hd);
+    if(!blob){
+        goto out_with_close_hd;
+    }
+    if(evr_blob_ref_hd_match(hd, key) != evr_ok){
+        goto out_free_blob;
+    }
+    struct evr_writing_blob wblob;
+    memcpy(wblob.key, key, evr_blob_ref_size);
+    struct evr_persister_task task;
+    wblob.flags = flags;
+    wblob.size = blob_size;
+    wblob.chunks = blob->chunks;
+    wblob.sync_strategy = ctx->sync_strategy == evr_sync_strategy_default ? evr_sync_strategy_per_blob : ctx->sync_strategy;
+    if(evr_persister_init_task(&task, &wblob) != evr_ok){
+        goto out_free_blob;
+    }
+    if(evr_persister_queue_task(&task) != evr_ok){
+        goto out_destroy_task;
+    }
+    if(evr_persister_wait_for_task(&task) != evr_ok){
+        goto out_destroy_task;
+    }
+    if(task.result != evr_ok){
+        goto out_destroy_task;
+    }
+    if(evr_respond_status(ctx, evr_status_code_ok) != evr_ok){
+        goto out_destroy_task;
+    }
+    ret = evr_ok;
+ out_destroy_task:
+    if(evr_persister_destroy_task(&task) != evr_ok){
+        ret = evr_error;
+    }
+ out_free_blob:
+    evr_free_chunk_set(blob);
+ out_with_close_hd:
+    evr_blob_ref_close(hd);
+ out_with_release_put_bytes:
+    if(evr_release_put_bytes(blob_size) != evr_ok){
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_stream_blob(struct evr_connection *ctx, evr_blob_ref key, int flags, size_t blob_size){
+    int ret = evr_error;
+    struct evr_glacier_blob_stream s;
+    memcpy(s.blob.key, key, evr_blob_ref_size);
+    s.blob.flags = flags;
+    s.blob.size = blob_size;
+    s.blob.sync_strategy = ctx->sync_strategy == evr_sync_strategy_default ? evr_sync_strategy_per_blob : ctx->sync_strategy;
+    int begin_res = evr_persister_begin_stream(&s);
+    if(begin_res != evr_ok){
+        ret = begin_res;
+        goto out;
+    }
+    log_debug("Worker %d streams put into bucket lane %zu", ctx->socket.get_fd(&ctx->socket), s.lane);
+    int commit = 0;
+    evr_time last_modified;
+    char *buf = malloc(evr_put_stream_buffer_size);
+    if(!buf){
+        goto out_with_end_stream;
+    }
+    evr_blob_ref_hd hd;
+    if(evr_blob_ref_open(&hd) != evr_ok){
+        goto out_with_free_buf;
+    }
+    for(size_t remaining = blob_size; remaining > 0;){
+        const size_t piece_size = min(remaining, evr_put_stream_buffer_size);
+        if(read_n(&ctx->socket, buf, piece_size, evr_blob_ref_write_se, hd) != evr_ok){
+            goto out_with_close_hd;
+        }
+        if(evr_persister_write_stream(&s, buf, piece_size) != evr_ok){
+            goto out_with_close_hd;
+        }
+        remaining -= piece_size;
+    }
+    if(evr_blob_ref_hd_match(hd, key) != evr_ok){
+        goto out_with_close_hd;
+    }
+    commit = 1;
+ out_with_close_hd:
+    evr_blob_ref_close(hd);
+ out_with_free_buf:
+    free(buf);
+ out_with_end_stream:
+    if(evr_persister_end_stream(&s, commit, &last_modified) != evr_ok){
+        goto out;
+    }
+    if(!commit){
+        goto out;
+    }
+    if(evr_respond_status(ctx, evr_status_code_ok) != evr_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_work_get_status(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+    if(cmd->body_size != 0){
+        return evr_error;
+    }
+    struct evr_glacier_status status;
+    if(mtx_lock(&check.lock) != thrd_success){
+        evr_panic("Unable to lock background check");
+        return evr_error;
+    }
+    status = check.status;
+    if(mtx_unlock(&check.lock) != thrd_success){
+        evr_panic("Unable to unlock background check");
+        return evr_error;
+    }
+    struct evr_resp_header resp;
+    resp.status_code = evr_status_code_ok;
+    resp.body_size = evr_glacier_status_n_size;
+    char buf[evr_resp_header_n_size + evr_glacier_status_n_size];
+    if(evr_format_resp_header(buf, &resp) != evr_ok){
+        return evr_error;
+    }
+    if(evr_format_glacier_status(&buf[evr_resp_header_n_size], &status) != evr_ok){
+        return evr_error;
+    }
+    return write_n(&ctx->socket, buf, sizeof(buf));
+}
+
+int evr_respond_status(struct evr_connection *ctx, int status_code){
+    struct evr_resp_header resp;
+    resp.status_code = status_code;
+    resp.body_size = 0;
+    char buffer[evr_resp_header_n_size];
+    if(evr_format_resp_header(buffer, &resp) != evr_ok){
+        return evr_error;
+    }
+    return write_n(&ctx->socket, buffer, evr_resp_header_n_size);
+}
+
+int evr_acquire_put_bytes(size_t blob_size){
+    int ret = evr_error;
+    const size_t size = min(blob_size, cfg->max_put_bytes_in_flight);
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        goto out;
+    }
+    while(running && server.put_bytes_in_flight + size > cfg->max_put_bytes_in_flight){
+        if(cnd_wait(&server.put_bytes_released, &server.lock) != thrd_success){
+            evr_panic("Unable to wait for released put bytes");
+            goto out_with_unlock;
+        }
+    }
+    if(!running){
+        ret = evr_end;
+        goto out_with_unlock;
+    }
+    server.put_bytes_in_flight += size;
+    ret = evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_release_put_bytes(size_t blob_size){
+    int ret = evr_error;
+    const size_t size = min(blob_size, cfg->max_put_bytes_in_flight);
+    if(mtx_lock(&server.lock) != thrd_success){
+        evr_panic("Unable to lock server");
+        goto out;
+    }
+    server.put_bytes_in_flight -= size;
+    if(cnd_broadcast(&server.put_bytes_released) != thrd_success){
+        evr_panic("Unable to signal released put bytes");
+        goto out_with_unlock;
+    }
+    ret = evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&server.lock) != thrd_success){
+        evr_panic("Unable to unlock server");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_work_get_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+    int ret = evr_error;
+    if(cmd->body_size != evr_blob_ref_size){
+        goto out;
+    }
+    evr_blob_ref key;
+    if(read_n(&ctx->socket, (char*)&key, evr_blob_ref_size, NULL, NULL) != evr_ok){
+        goto out;
+    }
+#ifdef EVR_LOG_DEBUG
+    {
+        evr_blob_ref_str fmt_key;
+        evr_fmt_blob_ref(fmt_key, key);
+        log_debug("Worker %d retrieved cmd get %s", ctx->socket.get_fd(&ctx->socket), fmt_key);
+    }
+#endif
+    ret = evr_send_blob(ctx, key);
+ out:
+    return ret;
+}
+
+int evr_work_get_stored_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+    int ret = evr_error;
+    if(cmd->body_size != evr_blob_ref_size){
+        goto out;
+    }
+    evr_blob_ref key;
+    if(read_n(&ctx->socket, (char*)&key, evr_blob_ref_size, NULL, NULL) != evr_ok){
+        goto out;
+    }
+#ifdef EVR_LOG_DEBUG
+    {
+        evr_blob_ref_str fmt_key;
+        evr_fmt_blob_ref(fmt_key, key);
+        log_debug("Worker %d retrieved cmd get stored %s", ctx->socket.get_fd(&ctx->socket), fmt_key);
+    }
+#endif
+    struct evr_glacier_blob_pos pos;
+    int find_res = evr_blob_index_find(blob_index, key, &pos);
+    if(find_res == evr_not_found){
+        if(send_get_response(&ctx->socket, 0, 0, 0) != evr_ok){
+            goto out;
+        }
+        ret = evr_ok;
+        goto out;
+    } else if(find_res != evr_ok){
+        goto out;
+    }
+    if(evr_glacier_send_stored_blob_at(bucket_fd_cache, &pos, &ctx->socket, send_get_response, &ctx->socket) != evr_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_work_get_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+    int ret = evr_error;
+    const size_t keys_len = cmd->body_size / evr_blob_ref_size;
+    if(keys_len == 0 || keys_len > evr_max_batch_blobs || cmd->body_size % evr_blob_ref_size != 0){
+        log_error("Worker %d retrieved cmd get blobs with illegal body size %zu", ctx->socket.get_fd(&ctx->socket), cmd->body_size);
+        goto out;
+    }
+    evr_blob_ref keys[evr_max_batch_blobs];
+    if(read_n(&ctx->socket, (char*)keys, cmd->body_size, NULL, NULL) != evr_ok){
+        goto out;
+    }
+    log_debug("Worker %d retrieved cmd get blobs for %zu keys", ctx->socket.get_fd(&ctx->socket), keys_len);
+    for(size_t i = 0; i < keys_len; ++i){
+        if(evr_send_blob(ctx, keys[i]) != evr_ok){
+            goto out;
+        }
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_send_blob(struct evr_connection *ctx, evr_blob_ref key){
+    int ret = evr_error;
+    struct evr_glacier_blob_pos pos;
+    int find_res = evr_blob_index_find(blob_index, key, &pos);
+    if(find_res == evr_not_found){
+#ifdef EVR_LOG_DEBUG
+        evr_blob_ref_str fmt_key;
+        evr_fmt_blob_ref(fmt_key, key);
+        log_debug("Worker %d did not find key %s", ctx->socket.get_fd(&ctx->socket), fmt_key);
+#endif
+        if(send_get_response(&ctx->socket, 0, 0, 0) != evr_ok){
+            goto out;
+        }
+        ret = evr_ok;
+        goto out;
+    } else if(find_res != evr_ok){
+        goto out;
+    }
+    if(blob_cache){
+        int cache_res = evr_send_cached_blob(ctx, key, &pos);
+        if(cache_res == evr_ok){
+            ret = evr_ok;
+            goto out;
+        } else if(cache_res != evr_not_found){
+            goto out;
+        }
+    }
+    if(evr_glacier_send_blob_at(bucket_fd_cache, &pos, &ctx->socket, send_get_response, &ctx->socket) != evr_ok){
+        // TODO should we send a server error here?
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+/**
+ * evr_blob_cache_read_buffer_size is the size of the buffer used to
+ * read blobs from their buckets into the blob cache.
+ */
+#define evr_blob_cache_read_buffer_size (16*1024)
+
+struct evr_blob_cache_fill {
+    int flags;
+    char *data;
+    size_t size;
+    size_t max_size;
+};
+
+int evr_blob_cache_fill_status(void *arg, int exists, int flags, size_t blob_size);
+
+int evr_blob_cache_fill_data(void *arg, const char *data, size_t data_size);
+
+int evr_send_cached_blob(struct evr_connection *ctx, evr_blob_ref key, const struct evr_glacier_blob_pos *pos){
+    int ret = evr_error;
+    struct evr_blob_cache_entry *entry;
+    int acquire_res = evr_blob_cache_acquire(blob_cache, key, &entry);
+    if(acquire_res == evr_ok){
+        ret = evr_ok;
+        if(send_get_response(&ctx->socket, 1, entry->flags, entry->size) != evr_ok || write_n(&ctx->socket, entry->data, entry->size) != evr_ok){
+            ret = evr_error;
+        }
+        if(evr_blob_cache_release(blob_cache, entry) != evr_ok){
+            ret = evr_error;
+        }
+        goto out;
+    } else if(acquire_res != evr_not_found){
+        goto out;
+    }
+    if(pos->size > cfg->blob_cache_max_blob_size){
+        ret = evr_not_found;
+        goto out;
+    }
+    struct evr_blob_cache_fill fill;
+    fill.flags = 0;
+    fill.size = 0;
+    fill.max_size = pos->size;
+    fill.data = malloc(max(1, pos->size));
+    if(!fill.data){
+        goto out;
+    }
+    char read_buffer[evr_blob_cache_read_buffer_size];
+    if(evr_glacier_read_blob_at(bucket_fd_cache, pos, read_buffer, sizeof(read_buffer), evr_blob_cache_fill_status, evr_blob_cache_fill_data, &fill) != evr_ok){
+        goto out_with_free_data;
+    }
+    if(fill.size != pos->size){
+        goto out_with_free_data;
+    }
+    if(evr_blob_cache_put(blob_cache, key, fill.flags, fill.data, fill.size) != evr_ok){
+        goto out_with_free_data;
+    }
+    if(send_get_response(&ctx->socket, 1, fill.flags, fill.size) != evr_ok){
+        goto out_with_free_data;
+    }
+    if(write_n(&ctx->socket, fill.data, fill.size) != evr_ok){
+        goto out_with_free_data;
+    }
+    ret = evr_ok;
+ out_with_free_data:
+    free(fill.data);
+ out:
+    return ret;
+}
+
+int evr_blob_cache_fill_status(void *arg, int exists, int flags, size_t blob_size){
+    struct evr_blob_cache_fill *fill = arg;
+    if(!exists || blob_size != fill->max_size){
+        return evr_error;
+    }
+    fill->flags = flags;
+    return evr_ok;
+}
+
+int evr_blob_cache_fill_data(void *arg, const char *data, size_t data_size){
+    struct evr_blob_cache_fill *fill = arg;
+    if(fill->size + data_size > fill->max_size){
         return evr_error;
     }
+    memcpy(&fill->data[fill->size], data, data_size);
+    fill->size += data_size;
     return evr_ok;
 }
 
-int evr_work_put_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+int evr_work_get_blob_range(struct evr_connection *ctx, struct evr_cmd_header *cmd){
     int ret = evr_error;
-    if(cmd->body_size < evr_blob_ref_size){
-        goto out;
-    }
-    size_t blob_size = cmd->body_size - evr_blob_ref_size - sizeof(uint8_t);
-    if(blob_size > evr_max_blob_data_size){
-        // TODO should we send a client error here?
+    if(cmd->body_size != evr_blob_range_n_size){
         goto out;
     }
-    struct evr_writing_blob wblob;
-    if(read_n(&ctx->socket, (char*)&wblob.key, evr_blob_ref_size, NULL, NULL) != evr_ok){
+    char buf[evr_blob_range_n_size];
+    if(read_n(&ctx->socket, buf, sizeof(buf), NULL, NULL) != evr_ok){
         goto out;
     }
-    uint8_t flags;
-    if(read_n(&ctx->socket, (char*)&flags, sizeof(flags), NULL, NULL) != evr_ok){
+    struct evr_blob_range range;
+    if(evr_parse_blob_range(&range, buf) != evr_ok){
         goto out;
     }
 #ifdef EVR_LOG_DEBUG
     {
         evr_blob_ref_str fmt_key;
-        evr_fmt_blob_ref(fmt_key, wblob.key);
-        log_debug("Worker %d retrieved cmd put %s with flags 0x%02x and %d bytes blob", ctx->socket.get_fd(&ctx->socket), fmt_key, flags, blob_size);
+        evr_fmt_blob_ref(fmt_key, range.key);
+        log_debug("Worker %d retrieved cmd get range %s %zu+%zu", ctx->socket.get_fd(&ctx->socket), fmt_key, range.offset, range.size);
     }
 #endif
-    evr_blob_ref_hd hd;
-    if(evr_blob_ref_open(&hd) != evr_ok){
+    struct evr_glacier_blob_pos pos;
+    int find_res = evr_blob_index_find(blob_index, range.key, &pos);
+    if(find_res == evr_not_found){
+        if(send_get_response(&ctx->socket, 0, 0, 0) != evr_ok){
+            goto out;
+        }
+        ret = evr_ok;
+        goto out;
+    } else if(find_res != evr_ok){
         goto out;
     }
-    struct chunk_set *blob = read_into_chunks(&ctx->socket, blob_size, evr_blob_ref_write_se, hd);
-    if(!blob){
-        goto out_with_close_hd;
-    }
-    if(evr_blob_ref_hd_match(hd, wblob.key) != evr_ok){
-        goto out_free_blob;
-    }
-    // TODO final check here if blob is already in store to reduce
-    // duplicate blobs
-    struct evr_persister_task task;
-    wblob.flags = flags;
-    wblob.size = blob_size;
-    wblob.chunks = blob->chunks;
-    wblob.sync_strategy = ctx->sync_strategy == evr_sync_strategy_default ? evr_sync_strategy_per_blob : ctx->sync_strategy;
-    if(evr_persister_init_task(&task, &wblob) != evr_ok){
-        goto out_free_blob;
-    }
-    if(evr_persister_queue_task(&task) != evr_ok){
-        goto out_destroy_task;
-    }
-    if(evr_persister_wait_for_task(&task) != evr_ok){
-        goto out_destroy_task;
-    }
-    if(task.result != evr_ok){
-        goto out_destroy_task;
-    }
-    struct evr_resp_header resp;
-    resp.status_code = evr_status_code_ok;
-    resp.body_size = 0;
-    char buffer[evr_resp_header_n_size];
-    if(evr_format_resp_header(buffer, &resp) != evr_ok){
-        goto out_destroy_task;
-    }
-    if(write_n(&ctx->socket, buffer, evr_resp_header_n_size) != evr_ok){
-        goto out_destroy_task;
+    size_t range_offset = min(range.offset, pos.size);
+    struct evr_get_range_response_ctx resp_ctx;
+    resp_ctx.f = &ctx->socket;
+    resp_ctx.range_size = min(range.size, pos.size - range_offset);
+    if(evr_glacier_send_blob_range_at(bucket_fd_cache, &pos, range_offset, resp_ctx.range_size, &ctx->socket, send_get_range_response, &resp_ctx) != evr_ok){
+        goto out;
     }
     ret = evr_ok;
- out_destroy_task:
-    if(evr_persister_destroy_task(&task) != evr_ok){
-        ret = evr_error;
-    }
- out_free_blob:
-    evr_free_chunk_set(blob);
- out_with_close_hd:
-    evr_blob_ref_close(hd);
  out:
     return ret;
 }
 
-int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd, struct evr_glacier_read_ctx **rctx){
+int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd){
     int ret = evr_error;
     if(cmd->body_size != evr_blob_ref_size){
         goto out;
@@ -602,11 +2167,8 @@ int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd, s
         log_debug("Worker %d retrieved cmd stat %s", ctx->socket.get_fd(&ctx->socket), fmt_key);
     }
 #endif
-    if(evr_ensure_worker_rctx_exists(rctx, ctx) != evr_ok){
-        goto out;
-    }
-    struct evr_glacier_blob_stat stat;
-    int stat_ret = evr_glacier_stat_blob(*rctx, key, &stat);
+    struct evr_glacier_blob_pos stat;
+    int stat_ret = evr_blob_index_find(blob_index, key, &stat);
     struct evr_resp_header resp;
     if(stat_ret == evr_not_found){
         resp.status_code = evr_status_code_blob_not_found;
@@ -629,8 +2191,8 @@ int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd, s
         }
         p += evr_resp_header_n_size;
         struct evr_stat_blob_resp stat_resp;
-        stat_resp.flags = stat.flags;
-        stat_resp.blob_size = stat.blob_size;
+        stat_resp.flags = evr_blob_public_flags(stat.flags);
+        stat_resp.blob_size = stat.size;
         if(evr_format_stat_blob_resp(p, &stat_resp) != evr_ok){
             goto out;
         }
@@ -638,7 +2200,57 @@ int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd, s
             goto out;
         }
     } else {
-        log_error("evr_glacier_stat_blob failed with error code %d", stat_ret);
+        log_error("evr_blob_index_find failed with error code %d", stat_ret);
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_work_stat_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd){
+    int ret = evr_error;
+    const size_t keys_len = cmd->body_size / evr_blob_ref_size;
+    if(keys_len == 0 || keys_len > evr_max_batch_blobs || cmd->body_size % evr_blob_ref_size != 0){
+        log_error("Worker %d retrieved cmd stat blobs with illegal body size %zu", ctx->socket.get_fd(&ctx->socket), cmd->body_size);
+        goto out;
+    }
+    evr_blob_ref keys[evr_max_batch_blobs];
+    if(read_n(&ctx->socket, (char*)keys, cmd->body_size, NULL, NULL) != evr_ok){
+        goto out;
+    }
+    log_debug("Worker %d retrieved cmd stat blobs for %zu keys", ctx->socket.get_fd(&ctx->socket), keys_len);
+    char buf[evr_resp_header_n_size + evr_max_batch_blobs * evr_stat_blobs_entry_n_size];
+    char *p = buf;
+    struct evr_resp_header resp;
+    resp.status_code = evr_status_code_ok;
+    resp.body_size = keys_len * evr_stat_blobs_entry_n_size;
+    if(evr_format_resp_header(p, &resp) != evr_ok){
+        goto out;
+    }
+    p += evr_resp_header_n_size;
+    struct evr_glacier_blob_pos pos;
+    struct evr_stat_blobs_entry entry;
+    for(size_t i = 0; i < keys_len; ++i){
+        int find_res = evr_blob_index_find(blob_index, keys[i], &pos);
+        if(find_res == evr_ok){
+            entry.status_code = evr_status_code_ok;
+            entry.flags = evr_blob_public_flags(pos.flags);
+            entry.blob_size = pos.size;
+        } else if(find_res == evr_not_found){
+            entry.status_code = evr_status_code_blob_not_found;
+            entry.flags = 0;
+            entry.blob_size = 0;
+        } else {
+            log_error("evr_blob_index_find failed with error code %d", find_res);
+            goto out;
+        }
+        if(evr_format_stat_blobs_entry(p, &entry) != evr_ok){
+            goto out;
+        }
+        p += evr_stat_blobs_entry_n_size;
+    }
+    if(write_n(&ctx->socket, buf, p - buf) != evr_ok){
         goto out;
     }
     ret = evr_ok;
@@ -646,20 +2258,20 @@ int evr_work_stat_blob(struct evr_connection *ctx, struct evr_cmd_header *cmd, s
     return ret;
 }
 
-int evr_work_watch_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd, struct evr_glacier_read_ctx **rctx){
+int evr_work_watch_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd){
     int ret = evr_error;
     if(cmd->body_size != evr_blob_filter_n_size){
         goto out;
     }
-    char buf[max(max(evr_blob_filter_n_size, evr_resp_header_n_size), evr_blob_ref_size + sizeof(uint64_t) + sizeof(uint8_t))];
+    char buf[max(evr_blob_filter_n_size, evr_resp_header_n_size)];
     if(read_n(&ctx->socket, buf, evr_blob_filter_n_size, NULL, NULL) != evr_ok){
         goto out;
     }
-    struct evr_blob_filter f;
-    if(evr_parse_blob_filter(&f, buf) != evr_ok){
+    struct evr_blob_filter *f = &ctx->watch_filter;
+    if(evr_parse_blob_filter(f, buf) != evr_ok){
         goto out;
     }
-    log_debug("Worker %d retrieved cmd watch with sort_order 0x%02x, flags_filter 0x%02x and last_modified_after %llu", ctx->socket.get_fd(&ctx->socket), f.sort_order, f.flags_filter, f.last_modified_after);
+    log_debug("Worker %d retrieved cmd watch with sort_order 0x%02x, flags_filter 0x%02x and last_modified_after %llu", ctx->socket.get_fd(&ctx->socket), f->sort_order, f->flags_filter, f->last_modified_after);
     struct evr_resp_header resp;
     resp.status_code = evr_status_code_ok;
     resp.body_size = 0;
@@ -669,81 +2281,181 @@ int evr_work_watch_blobs(struct evr_connection *ctx, struct evr_cmd_header *cmd,
     if(write_n(&ctx->socket, buf, evr_resp_header_n_size) != evr_ok){
         goto out;
     }
-    const int live_watch = f.sort_order == evr_cmd_watch_sort_order_last_modified;
-    struct evr_queue *mod_blobs = NULL;
+    const int live_watch = f->sort_order == evr_cmd_watch_sort_order_last_modified;
     if(live_watch){
-        mod_blobs = evr_persister_add_watcher(&f);
-        if(!mod_blobs){
+        ctx->mod_blobs = evr_persister_add_watcher(f);
+        if(!ctx->mod_blobs){
             log_error("Worker %d can't add watcher because list full", ctx->socket.get_fd(&ctx->socket));
             goto out;
         }
+        // the initial eventfd value of 1 makes sure blobs modified
+        // before the eventfd got attached to the queue are sent.
+        ctx->watch_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(ctx->watch_fd < 0){
+            goto out;
+        }
+        if(evr_queue_set_signal_fd(ctx->mod_blobs, ctx->watch_fd) != evr_ok){
+            goto out;
+        }
+        if(cfg->watch_flush_interval > 0){
+            ctx->watch_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if(ctx->watch_timer_fd < 0){
+                goto out;
+            }
+        }
+    }
+    ctx->watch_last_modified = f->last_modified_after;
+    if(evr_list_watched_blobs(ctx, f) != evr_ok){
+        goto out;
+    }
+    if(!live_watch){
+        // closing the connection indicates the client that no more
+        // blobs will follow.
+        ret = evr_end;
+        goto out;
+    }
+    // the watch eventfd is registered disarmed. evr_arm_connection
+    // arms it as soon as the worker is done with the connection.
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT;
+    ev.data.ptr = &ctx->watch_src;
+    if(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, ctx->watch_fd, &ev) != 0){
+        goto out;
     }
-    if(evr_ensure_worker_rctx_exists(rctx, ctx) != evr_ok){
-        goto out_with_rm_watcher;
+    if(ctx->watch_timer_fd >= 0){
+        ev.data.ptr = &ctx->watch_timer_src;
+        if(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, ctx->watch_timer_fd, &ev) != 0){
+            goto out;
+        }
     }
+    ctx->state = evr_connection_state_watch;
+    ret = evr_ok;
+ out:
+    log_debug("Worker %d watch starts with status %d", ctx->socket.get_fd(&ctx->socket), ret);
+    return ret;
+}
+
+int evr_list_watched_blobs(struct evr_connection *ctx, struct evr_blob_filter *f){
     struct evr_list_blobs_ctx lctx;
     lctx.connection = ctx;
     lctx.blobs_used = 0;
-    if(evr_glacier_list_blobs(*rctx, evr_handle_blob_list, &f, &lctx) != evr_ok){
-        goto out_with_rm_watcher;
+    struct evr_blob_list_cursor cursor;
+    evr_init_blob_list_cursor(&cursor, f);
+    while(1){
+        // the read ctx is returned after every page so a slow
+        // watching peer does not keep it from other connections.
+        struct evr_glacier_read_ctx *rctx = evr_glacier_checkout_read_ctx(read_ctx_pool);
+        if(!rctx){
+            return evr_error;
+        }
+        int list_res = evr_glacier_list_blobs_page(rctx, evr_handle_blob_list, f, &cursor, evr_list_blobs_page_len, &lctx);
+        if(evr_glacier_return_read_ctx(read_ctx_pool, rctx) != evr_ok){
+            return evr_error;
+        }
+        if(list_res == evr_end){
+            break;
+        } else if(list_res != evr_ok){
+            return evr_error;
+        }
     }
-    if(evr_flush_list_blobs_ctx(&lctx) != evr_ok){
-        goto out_with_rm_watcher;
+    return evr_flush_list_blobs_ctx(&lctx);
+}
+
+int evr_catch_up_watch_blobs(struct evr_connection *ctx){
+    log_debug("Worker %d watch fell behind and catches up from index starting at %llu", ctx->socket.get_fd(&ctx->socket), (unsigned long long)ctx->watch_last_modified);
+    // blobs modified from now on are queued again. they may also be
+    // part of the following listing and then are reported twice.
+    if(evr_queue_reset(ctx->mod_blobs) != evr_ok){
+        return evr_error;
     }
-    if(live_watch){
-        struct evr_modified_blob blob;
-        while(running){
-            if(ctx->socket.received_shutdown(&ctx->socket) == 1){
-                log_debug("Worker %d retrieved shutdown request from peer", ctx->socket.get_fd(&ctx->socket));
-                ret = evr_end;
-                goto out_with_rm_watcher;
-            }
-            while(running){
-                int take_res = evr_queue_take(mod_blobs, &blob);
-                if(take_res == evr_not_found){
-                    break;
-                } else if(take_res != evr_ok){
-                    goto out_with_rm_watcher;
-                }
-#ifdef EVR_LOG_DEBUG
-                {
-                    evr_blob_ref_str fmt_key;
-                    evr_fmt_blob_ref(fmt_key, blob.key);
-                    log_debug("Worker %d watch indicates blob with key %s modified", ctx->socket.get_fd(&ctx->socket), fmt_key);
-                }
-#endif
-                struct evr_buf_pos bp;
-                evr_init_buf_pos(&bp, buf);
-                memcpy(bp.pos, blob.key, evr_blob_ref_size);
-                bp.pos += evr_blob_ref_size;
-                evr_push_map(&bp, &blob.last_modified, uint64_t, htobe64);
-                int flags = evr_watch_flag_eob;
-                evr_push_as(&bp, &flags, uint8_t);
-                if(write_n(&ctx->socket, buf, evr_blob_ref_size + sizeof(uint64_t) + sizeof(uint8_t)) != evr_ok){
-                    goto out_with_rm_watcher;
+    struct evr_blob_filter f = ctx->watch_filter;
+    // persister lanes notify independently from each other. so a
+    // lost blob may be a little older than the newest reported one.
+    f.last_modified_after = ctx->watch_last_modified;
+    if(f.last_modified_after > evr_watch_catch_up_overlap){
+        f.last_modified_after -= evr_watch_catch_up_overlap;
+    } else {
+        f.last_modified_after = 0;
+    }
+    return evr_list_watched_blobs(ctx, &f);
+}
+
+int evr_continue_watch_blobs(struct evr_connection *ctx){
+    uint64_t signals;
+    if(read(ctx->watch_fd, &signals, sizeof(signals)) < 0 && errno != EAGAIN){
+        return evr_error;
+    }
+    if(ctx->watch_timer_fd >= 0 && read(ctx->watch_timer_fd, &signals, sizeof(signals)) < 0 && errno != EAGAIN){
+        return evr_error;
+    }
+    if(ctx->socket.received_shutdown(&ctx->socket) == 1){
+        log_debug("Worker %d retrieved shutdown request from peer", ctx->socket.get_fd(&ctx->socket));
+        return evr_end;
+    }
+    int hang_up_res = evr_peer_hang_up(&ctx->socket);
+    if(hang_up_res != evr_ok){
+        return hang_up_res;
+    }
+    // all blobs queued at this point are sent as one frame. only the
+    // frame's last blob is flagged with evr_watch_flag_eob.
+    char frame[evr_watch_frame_blobs_len * evr_watch_blobs_body_n_size];
+    size_t frame_blobs = 0;
+    int sent_frame = 0;
+    struct evr_modified_blob blob;
+    while(1){
+        int take_res = evr_queue_take_nowait(ctx->mod_blobs, &blob);
+        if(take_res == evr_not_found){
+            break;
+        } else if(take_res == evr_temporary_occupied){
+            if(frame_blobs > 0){
+                frame[frame_blobs * evr_watch_blobs_body_n_size - 1] = evr_watch_flag_eob;
+                if(write_n(&ctx->socket, frame, frame_blobs * evr_watch_blobs_body_n_size) != evr_ok){
+                    return evr_error;
                 }
+                frame_blobs = 0;
             }
-            if(!running){
-                break;
+            if(evr_catch_up_watch_blobs(ctx) != evr_ok){
+                return evr_error;
             }
-            int hang_up_res = evr_peer_hang_up(&ctx->socket);
-            if(hang_up_res == evr_end){
-                ret = evr_end;
-                goto out_with_rm_watcher;
-            } else if(hang_up_res != evr_ok){
-                goto out_with_rm_watcher;
+            sent_frame = 1;
+            continue;
+        } else if(take_res != evr_ok){
+            return evr_error;
+        }
+#ifdef EVR_LOG_DEBUG
+        {
+            evr_blob_ref_str fmt_key;
+            evr_fmt_blob_ref(fmt_key, blob.key);
+            log_debug("Worker %d watch indicates blob with key %s modified", ctx->socket.get_fd(&ctx->socket), fmt_key);
+        }
+#endif
+        if(frame_blobs == evr_watch_frame_blobs_len){
+            if(write_n(&ctx->socket, frame, sizeof(frame)) != evr_ok){
+                return evr_error;
             }
+            frame_blobs = 0;
+        }
+        struct evr_buf_pos bp;
+        evr_init_buf_pos(&bp, &frame[frame_blobs * evr_watch_blobs_body_n_size]);
+        memcpy(bp.pos, blob.key, evr_blob_ref_size);
+        bp.pos += evr_blob_ref_size;
+        evr_push_map(&bp, &blob.last_modified, uint64_t, htobe64);
+        int flags = 0;
+        evr_push_as(&bp, &flags, uint8_t);
+        ++frame_blobs;
+        if(blob.last_modified > ctx->watch_last_modified){
+            ctx->watch_last_modified = blob.last_modified;
         }
     }
-    ret = evr_ok;
- out_with_rm_watcher:
-    if(mod_blobs && evr_persister_rm_watcher(mod_blobs) != evr_ok){
-        evr_panic("Worker %d is unable to remove a persister watcher", ctx->socket.get_fd(&ctx->socket));
-        ret = evr_error;
+    if(frame_blobs > 0){
+        frame[frame_blobs * evr_watch_blobs_body_n_size - 1] = evr_watch_flag_eob;
+        if(write_n(&ctx->socket, frame, frame_blobs * evr_watch_blobs_body_n_size) != evr_ok){
+            return evr_error;
+        }
+        sent_frame = 1;
     }
- out:
-    log_debug("Worker %d watch ends with status %d", ctx->socket.get_fd(&ctx->socket), ret);
-    return ret;
+    ctx->watch_throttled = sent_frame && ctx->watch_timer_fd >= 0;
+    return evr_ok;
 }
 
 int evr_work_configure_connection(struct evr_connection *ctx, struct evr_cmd_header *cmd){
@@ -789,6 +2501,9 @@ int evr_handle_blob_list(void *ctx0, const evr_blob_ref key, int flags, evr_time
             goto out;
         }
     }
+    if(last_modified > ctx->connection->watch_last_modified){
+        ctx->connection->watch_last_modified = last_modified;
+    }
     struct evr_modified_blob *b = &ctx->blobs[ctx->blobs_used];
     memcpy(b->key, key, evr_blob_ref_size);
     b->last_modified = last_modified;
@@ -822,18 +2537,6 @@ int evr_flush_list_blobs_ctx(struct evr_list_blobs_ctx *ctx){
     return ret;
 }
 
-int evr_ensure_worker_rctx_exists(struct evr_glacier_read_ctx **rctx, struct evr_connection *ctx){
-    if(*rctx){
-        return evr_ok;
-    }
-    log_debug("Worker %d creates a glacier read ctx", ctx->socket.get_fd(&ctx->socket));
-    *rctx = evr_create_glacier_read_ctx(cfg);
-    if(!*rctx){
-        return evr_error;
-    }
-    return evr_ok;
-}
-
 int send_get_response(void *arg, int exists, int flags, size_t blob_size){
     int ret = evr_error;
     struct evr_file *f = arg;
@@ -860,7 +2563,258 @@ int send_get_response(void *arg, int exists, int flags, size_t blob_size){
     return ret;
 }
 
-int pipe_data(void *arg, const char *data, size_t data_size){
-    struct evr_file *f = arg;
-    return write_n(f, data, data_size);
+int send_get_range_response(void *arg, int exists, int flags, size_t blob_size){
+    int ret = evr_error;
+    struct evr_get_range_response_ctx *ctx = arg;
+    char buffer[evr_resp_header_n_size + evr_stat_blob_resp_n_size];
+    struct evr_resp_header resp;
+    resp.status_code = evr_status_code_ok;
+    resp.body_size = evr_stat_blob_resp_n_size + ctx->range_size;
+    if(evr_format_resp_header(buffer, &resp) != evr_ok){
+        goto out;
+    }
+    struct evr_stat_blob_resp stat;
+    stat.flags = flags;
+    stat.blob_size = blob_size;
+    if(evr_format_stat_blob_resp(&buffer[evr_resp_header_n_size], &stat) != evr_ok){
+        goto out;
+    }
+    if(write_n(ctx->f, buffer, sizeof(buffer)) != evr_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_load_blob_index(void){
+    int ret = evr_error;
+    blob_index = evr_create_blob_index(16);
+    if(!blob_index){
+        goto out;
+    }
+    struct evr_glacier_read_ctx *rctx = evr_create_glacier_read_ctx(cfg);
+    if(!rctx){
+        goto out_with_free_blob_index;
+    }
+    if(evr_glacier_walk_blob_positions(rctx, evr_load_blob_index_visit, blob_index) != evr_ok){
+        goto out_with_free_rctx;
+    }
+    log_debug("Loaded %zu blobs into blob index", blob_index->entries_used);
+    ret = evr_ok;
+ out_with_free_rctx:
+    if(evr_free_glacier_read_ctx(rctx) != evr_ok){
+        ret = evr_error;
+    }
+ out_with_free_blob_index:
+    if(ret != evr_ok){
+        if(evr_free_blob_index(blob_index) != evr_ok){
+            evr_panic("Unable to free blob index");
+        }
+        blob_index = NULL;
+    }
+ out:
+    return ret;
+}
+
+int evr_load_blob_index_visit(void *ctx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos){
+    struct evr_blob_index *idx = ctx;
+    return evr_blob_index_put(idx, key, pos);
+}
+
+int evr_start_background_check(void){
+    check.stop = 0;
+    check.status.checked_blobs = 0;
+    check.status.check_blobs = 0;
+    check.status.check_state = evr_glacier_check_state_disabled;
+    if(mtx_init(&check.lock, mtx_plain) != thrd_success){
+        goto fail;
+    }
+    if(cnd_init(&check.stop_requested) != thrd_success){
+        goto fail_with_destroy_lock;
+    }
+    if(cfg->check_rate == 0){
+        return evr_ok;
+    }
+    check.status.check_state = evr_glacier_check_state_running;
+    check.status.check_blobs = evr_background_check_latest_blobs - evr_glacier_quick_check_latest_blobs + evr_background_check_random_blobs;
+    if(thrd_create(&check.thread, evr_background_check_worker, NULL) != thrd_success){
+        goto fail_with_destroy_stop_requested;
+    }
+    return evr_ok;
+ fail_with_destroy_stop_requested:
+    cnd_destroy(&check.stop_requested);
+ fail_with_destroy_lock:
+    mtx_destroy(&check.lock);
+ fail:
+    return evr_error;
+}
+
+int evr_stop_background_check(void){
+    int ret = evr_error;
+    if(cfg->check_rate > 0){
+        if(mtx_lock(&check.lock) != thrd_success){
+            evr_panic("Unable to lock background check");
+            goto out;
+        }
+        check.stop = 1;
+        if(cnd_signal(&check.stop_requested) != thrd_success){
+            evr_panic("Unable to signal background check stop");
+            goto out;
+        }
+        if(mtx_unlock(&check.lock) != thrd_success){
+            evr_panic("Unable to unlock background check");
+            goto out;
+        }
+        int worker_res;
+        if(thrd_join(check.thread, &worker_res) != thrd_success){
+            evr_panic("Unable to join background check thread");
+            goto out;
+        }
+        if(worker_res != evr_ok){
+            goto out;
+        }
+    }
+    cnd_destroy(&check.stop_requested);
+    mtx_destroy(&check.lock);
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+/**
+ * evr_background_check_pause waits until the next blob may be
+ * checked according to cfg->check_rate.
+ *
+ * Returns evr_end if the check should stop.
+ */
+int evr_background_check_pause(struct timespec *next);
+
+/**
+ * evr_finish_background_check records state as the check's final
+ * state.
+ */
+int evr_finish_background_check(int state);
+
+int evr_background_check_worker(void *arg){
+    int ret = evr_error;
+    int state = evr_glacier_check_state_failed;
+    struct evr_glacier_read_ctx *rctx = evr_create_glacier_read_ctx(cfg);
+    if(!rctx){
+        goto out;
+    }
+    log_info("Background check of up to %zu blobs started", check.status.check_blobs);
+    struct timespec next;
+    if(timespec_get(&next, TIME_UTC) != TIME_UTC){
+        goto out_with_free_rctx;
+    }
+    size_t latest_index = evr_glacier_quick_check_latest_blobs;
+    size_t random_blobs = 0;
+    state = evr_glacier_check_state_done;
+    while(random_blobs < evr_background_check_random_blobs){
+        int pause_res = evr_background_check_pause(&next);
+        if(pause_res == evr_end){
+            state = evr_glacier_check_state_running;
+            break;
+        } else if(pause_res != evr_ok){
+            state = evr_glacier_check_state_failed;
+            goto out_with_free_rctx;
+        }
+        int check_res;
+        if(latest_index < evr_background_check_latest_blobs){
+            check_res = evr_glacier_check_latest_blob(rctx, latest_index);
+            if(check_res == evr_not_found){
+                // the glacier has less than
+                // evr_background_check_latest_blobs blobs.
+                latest_index = evr_background_check_latest_blobs;
+                continue;
+            }
+            ++latest_index;
+        } else {
+            check_res = evr_glacier_check_random_blob(rctx);
+            if(check_res == evr_not_found){
+                // the glacier is empty
+                break;
+            }
+            ++random_blobs;
+        }
+        if(check_res == evr_glacier_index_db_corrupt){
+            log_error("Background check found a blob which does not match the index db. Restart evr-glacier-storage to rebuild the index db.");
+            state = evr_glacier_check_state_corrupt;
+            break;
+        } else if(check_res != evr_ok){
+            log_error("Background check failed with error code %d", check_res);
+            state = evr_glacier_check_state_failed;
+            break;
+        }
+        if(mtx_lock(&check.lock) != thrd_success){
+            evr_panic("Unable to lock background check");
+            state = evr_glacier_check_state_failed;
+            goto out_with_free_rctx;
+        }
+        check.status.checked_blobs += 1;
+        if(mtx_unlock(&check.lock) != thrd_success){
+            evr_panic("Unable to unlock background check");
+            state = evr_glacier_check_state_failed;
+            goto out_with_free_rctx;
+        }
+    }
+    ret = evr_ok;
+ out_with_free_rctx:
+    if(evr_free_glacier_read_ctx(rctx) != evr_ok){
+        ret = evr_error;
+    }
+ out:
+    if(evr_finish_background_check(state) != evr_ok){
+        ret = evr_error;
+    }
+    return ret;
+}
+
+int evr_background_check_pause(struct timespec *next){
+    int ret = evr_error;
+    const long interval = 1000000000L / cfg->check_rate;
+    next->tv_nsec += interval;
+    while(next->tv_nsec >= 1000000000L){
+        next->tv_sec += 1;
+        next->tv_nsec -= 1000000000L;
+    }
+    if(mtx_lock(&check.lock) != thrd_success){
+        evr_panic("Unable to lock background check");
+        goto out;
+    }
+    while(!check.stop){
+        int wait_res = cnd_timedwait(&check.stop_requested, &check.lock, next);
+        if(wait_res == thrd_timedout){
+            break;
+        } else if(wait_res != thrd_success){
+            evr_panic("Unable to wait for background check stop");
+            goto out_with_unlock;
+        }
+    }
+    ret = check.stop ? evr_end : evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&check.lock) != thrd_success){
+        evr_panic("Unable to unlock background check");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_finish_background_check(int state){
+    if(mtx_lock(&check.lock) != thrd_success){
+        evr_panic("Unable to lock background check");
+        return evr_error;
+    }
+    check.status.check_state = state;
+    if(state == evr_glacier_check_state_done){
+        check.status.check_blobs = check.status.checked_blobs;
+        log_info("Background check verified %zu blobs", check.status.checked_blobs);
+    }
+    if(mtx_unlock(&check.lock) != thrd_success){
+        evr_panic("Unable to unlock background check");
+        return evr_error;
+    }
+    return evr_ok;
 }
@@ -21,6 +21,9 @@
 #include <threads.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include "evr-tls.h"
 #include "files.h"
@@ -40,6 +43,7 @@ struct client_server_ctx {
 
 int client_worker(void *context);
 int server_worker(void *context);
+void accept_nonblocking(struct evr_file *c, int s, SSL_CTX *ssl_ctx);
 
 void test_tls_accept_connect(void){
     struct client_server_ctx ctx;
@@ -65,7 +69,11 @@ int server_worker(void *context){
     assert(ssl_ctx);
     struct evr_file c;
     for(int i = 0; i < 2; ++i){
-        assert(is_ok(evr_tls_accept(&c, s, ssl_ctx)));
+        if(i == 0){
+            assert(is_ok(evr_tls_accept(&c, s, ssl_ctx)));
+        } else {
+            accept_nonblocking(&c, s, ssl_ctx);
+        }
         char buf[strlen(test_payload_a)];
         log_debug("tls server reading");
         assert(is_ok(read_n(&c, buf, strlen(test_payload_a), NULL, NULL)));
@@ -80,6 +88,28 @@ int server_worker(void *context){
     return evr_ok;
 }
 
+void accept_nonblocking(struct evr_file *c, int s, SSL_CTX *ssl_ctx){
+    int fd = accept(s, NULL, NULL);
+    assert(fd >= 0);
+    int flags = fcntl(fd, F_GETFL);
+    assert(flags >= 0);
+    assert(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+    assert(is_ok(evr_tls_start_accept(c, fd, ssl_ctx)));
+    while(1){
+        int want_write;
+        int res = evr_tls_continue_accept(c, &want_write);
+        if(res == evr_ok){
+            break;
+        }
+        assert(res == evr_temporary_occupied);
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = want_write ? POLLOUT : POLLIN;
+        assert(poll(&pfd, 1, -1) == 1);
+    }
+    assert(fcntl(fd, F_SETFL, flags) == 0);
+}
+
 void client_worker_tls_connect(struct evr_cert_cfg *ssl_cfg);
 void client_worker_tls_connect_once(struct evr_cert_cfg *ssl_cfg);
 
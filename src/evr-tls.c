@@ -113,6 +113,13 @@ SSL_CTX *evr_create_ssl_server_ctx(char *cert_path, char *key_path){
     if(!ctx){
         return NULL;
     }
+#ifdef SSL_OP_ENABLE_KTLS
+    // kernel TLS allows evr_file_ssl_sendfile to pass blob data from
+    // the bucket files to the socket without copying it through user
+    // space. OpenSSL falls back to user space TLS if the kernel does
+    // not support the negotiated cipher.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
     if(SSL_CTX_use_certificate_file(ctx, cert_path, SSL_FILETYPE_PEM) != 1) {
         log_error("Unable to use SSL certificate file %s", cert_path);
         evr_tls_log_global_ssl_errors(evr_log_level_error);
@@ -162,6 +169,8 @@ SSL_CTX *evr_create_ssl_ctx(void){
 
 void evr_file_bind_ssl(struct evr_file *f, SSL *s);
 
+#define evr_file_get_ssl(f) ((SSL*)(f)->ctx.p)
+
 int evr_tls_accept(struct evr_file *f, int s, SSL_CTX *ssl_ctx){
     evr_file_bind_ssl(f, NULL);
     struct sockaddr_in client_addr;
@@ -172,6 +181,22 @@ int evr_tls_accept(struct evr_file *f, int s, SSL_CTX *ssl_ctx){
         return evr_error;
     }
     log_debug("Connection from %s:%d accepted (will be worker %d)", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), fd);
+    if(evr_tls_start_accept(f, fd, ssl_ctx) != evr_ok){
+        return evr_error;
+    }
+    if(SSL_accept(evr_file_get_ssl(f)) != 1){
+        log_debug("Unable to accept SSL connection for socket %d", fd);
+#ifdef EVR_LOG_DEBUG
+        evr_tls_log_ssl_errors(f, evr_log_level_debug);
+#endif
+        evr_tls_free_accept(f);
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_tls_start_accept(struct evr_file *f, int fd, SSL_CTX *ssl_ctx){
+    evr_file_bind_ssl(f, NULL);
     SSL *ssl = SSL_new(ssl_ctx);
     if(!ssl){
         goto out_with_close_fd;
@@ -179,15 +204,6 @@ int evr_tls_accept(struct evr_file *f, int s, SSL_CTX *ssl_ctx){
     if(SSL_set_fd(ssl, fd) != 1){
         goto out_with_free_ssl;
     }
-    if(SSL_accept(ssl) != 1){
-        log_debug("Unable to accept SSL connection for socket %d", fd);
-        struct evr_file err;
-        evr_file_bind_ssl(&err, ssl);
-#ifdef EVR_LOG_DEBUG
-        evr_tls_log_ssl_errors(&err, evr_log_level_debug);
-#endif
-        goto out_with_free_ssl;
-    }
     evr_file_bind_ssl(f, ssl);
     return evr_ok;
  out_with_free_ssl:
@@ -199,6 +215,37 @@ int evr_tls_accept(struct evr_file *f, int s, SSL_CTX *ssl_ctx){
     return evr_error;
 }
 
+int evr_tls_continue_accept(struct evr_file *f, int *want_write){
+    SSL *ssl = evr_file_get_ssl(f);
+    int accept_res = SSL_accept(ssl);
+    if(accept_res == 1){
+        return evr_ok;
+    }
+    switch(SSL_get_error(ssl, accept_res)){
+    case SSL_ERROR_WANT_READ:
+        *want_write = 0;
+        return evr_temporary_occupied;
+    case SSL_ERROR_WANT_WRITE:
+        *want_write = 1;
+        return evr_temporary_occupied;
+    }
+    log_debug("Unable to accept SSL connection for socket %d", SSL_get_fd(ssl));
+#ifdef EVR_LOG_DEBUG
+    evr_tls_log_ssl_errors(f, evr_log_level_debug);
+#endif
+    return evr_error;
+}
+
+void evr_tls_free_accept(struct evr_file *f){
+    SSL *ssl = evr_file_get_ssl(f);
+    int fd = SSL_get_fd(ssl);
+    SSL_free(ssl);
+    evr_file_bind_ssl(f, NULL);
+    if(close(fd) != 0){
+        evr_panic("Unable to close client connection");
+    }
+}
+
 void evr_tls_log_ssl_errors(struct evr_file *f, char *log_level){
     int fd = f->get_fd(f);
     char buf[256];
@@ -320,6 +367,7 @@ size_t evr_file_ssl_pending(struct evr_file *f);
 int evr_file_ssl_received_shutdown(struct evr_file *f);
 ssize_t evr_file_ssl_read(struct evr_file *f, void *buf, size_t count);
 ssize_t evr_file_ssl_write(struct evr_file *f, const void *buf, size_t count);
+ssize_t evr_file_ssl_sendfile(struct evr_file *f, int in_fd, off_t offset, size_t count);
 int evr_file_ssl_close(struct evr_file *f);
 
 void evr_file_bind_ssl(struct evr_file *f, SSL *s){
@@ -330,11 +378,10 @@ void evr_file_bind_ssl(struct evr_file *f, SSL *s){
     f->received_shutdown = evr_file_ssl_received_shutdown;
     f->read = evr_file_ssl_read;
     f->write = evr_file_ssl_write;
+    f->sendfile = evr_file_ssl_sendfile;
     f->close = evr_file_ssl_close;
 }
 
-#define evr_file_get_ssl(f) ((SSL*)(f)->ctx.p)
-
 int evr_file_ssl_get_fd(struct evr_file *f){
     return SSL_get_fd(evr_file_get_ssl(f));
 }
@@ -370,6 +417,16 @@ ssize_t evr_file_ssl_write(struct evr_file *f, const void *buf, size_t count){
     return SSL_write(evr_file_get_ssl(f), buf, count);
 }
 
+ssize_t evr_file_ssl_sendfile(struct evr_file *f, int in_fd, off_t offset, size_t count){
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL *ssl = evr_file_get_ssl(f);
+    if(BIO_get_ktls_send(SSL_get_wbio(ssl))){
+        return SSL_sendfile(ssl, in_fd, offset, count, 0);
+    }
+#endif
+    return evr_file_copy_sendfile(f, in_fd, offset, count);
+}
+
 int evr_file_ssl_close(struct evr_file *f){
     SSL *ssl = evr_file_get_ssl(f);
     if(!ssl){
@@ -76,6 +76,34 @@ SSL_CTX *evr_create_ssl_client_ctx(char *host, char *port, struct evr_cert_cfg *
 
 int evr_tls_accept(struct evr_file *f, int s, SSL_CTX *ssl_ctx);
 
+/**
+ * evr_tls_start_accept binds f to a new server side SSL connection
+ * on the already accepted socket fd. The TLS handshake is not
+ * performed. Call evr_tls_continue_accept until it succeeds.
+ *
+ * fd is closed if evr_error is returned.
+ */
+int evr_tls_start_accept(struct evr_file *f, int fd, SSL_CTX *ssl_ctx);
+
+/**
+ * evr_tls_continue_accept continues the TLS handshake started with
+ * evr_tls_start_accept. It is intended for non blocking sockets.
+ *
+ * Returns evr_ok if the handshake is finished. Returns
+ * evr_temporary_occupied if the handshake must be continued as soon
+ * as the socket is readable or, if want_write is set to 1,
+ * writable. Returns evr_error if the handshake failed. f must be
+ * freed using evr_tls_free_accept if the handshake did not finish.
+ */
+int evr_tls_continue_accept(struct evr_file *f, int *want_write);
+
+/**
+ * evr_tls_free_accept frees the SSL connection and closes the socket
+ * of an evr_file which has not finished its TLS handshake. Use
+ * f->close for connections which finished their handshake.
+ */
+void evr_tls_free_accept(struct evr_file *f);
+
 /**
  * evr_tls_connect_once does the same thing as
  * evr_tls_connect. evr_tls_connect_once just creates a new SSL_CTX
@@ -55,6 +55,7 @@ void evr_file_bind_file_mem(struct evr_file *f, struct evr_file_mem *fm){
     f->received_shutdown = evr_file_mem_received_shutdown;
     f->read = evr_file_mem_read;
     f->write = evr_file_mem_write;
+    f->sendfile = evr_file_copy_sendfile;
     f->close = evr_file_mem_close;
 }
 
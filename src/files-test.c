@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "assert.h"
@@ -80,6 +81,36 @@ void test_append_into_chunk_set_with_small_file(void){
     evr_free_chunk_set(cs);
 }
 
+void test_sendfile_n(void){
+    int in = open("../etc/configuration/empty.json", O_RDONLY);
+    assert(in >= 0);
+    struct evr_file f;
+    {
+        log_info("sendfile into memory file copies the data");
+        struct evr_file_mem fm;
+        assert(is_ok(evr_init_file_mem(&fm, 1, 16)));
+        evr_file_bind_file_mem(&f, &fm);
+        assert(is_ok(sendfile_n(&f, in, 1, 2)));
+        assert(fm.used_size == 2);
+        assert(memcmp(fm.data, "}\n", 2) == 0);
+        evr_destroy_file_mem(&fm);
+    }
+    {
+        log_info("sendfile into pipe");
+        int p[2];
+        assert(pipe(p) == 0);
+        evr_file_bind_fd(&f, p[1]);
+        assert(is_ok(sendfile_n(&f, in, 0, 3)));
+        char buf[3];
+        assert(read(p[0], buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, "{}\n", sizeof(buf)) == 0);
+        assert(close(p[0]) == 0);
+        assert(f.close(&f) == 0);
+    }
+    assert(lseek(in, 0, SEEK_CUR) == 0);
+    assert(close(in) == 0);
+}
+
 int slice_counter;
 int small_slices_counter;
 size_t slice_size_sum;
@@ -202,6 +233,7 @@ int main(void){
     run_test(test_read_fd_partial_file);
     run_test(test_read_into_chunks_with_small_file);
     run_test(test_append_into_chunk_set_with_small_file);
+    run_test(test_sendfile_n);
     run_test(test_rollsum_split_infinite_file);
     run_test(test_rollsum_split_tiny_file);
     run_test(test_buf_read_bytes_ready);
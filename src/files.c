@@ -22,11 +22,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <poll.h>
+#include <limits.h>
 
 #include "basics.h"
 #include "errors.h"
@@ -54,6 +57,7 @@ size_t evr_file_fd_pending(struct evr_file *f);
 int evr_file_fd_received_shutdown(struct evr_file *f);
 ssize_t evr_file_fd_read(struct evr_file *f, void *buf, size_t count);
 ssize_t evr_file_fd_write(struct evr_file *f, const void *buf, size_t count);
+ssize_t evr_file_fd_sendfile(struct evr_file *f, int in_fd, off_t offset, size_t count);
 int evr_file_fd_close(struct evr_file *f);
 
 void evr_file_bind_fd(struct evr_file *f, int fd){
@@ -64,6 +68,7 @@ void evr_file_bind_fd(struct evr_file *f, int fd){
     f->received_shutdown = evr_file_fd_received_shutdown;
     f->read = evr_file_fd_read;
     f->write = evr_file_fd_write;
+    f->sendfile = evr_file_fd_sendfile;
     f->close = evr_file_fd_close;
 }
 
@@ -112,6 +117,10 @@ ssize_t evr_file_fd_write(struct evr_file *f, const void *buf, size_t count){
     return write(evr_file_get_fd(f), buf, count);
 }
 
+ssize_t evr_file_fd_sendfile(struct evr_file *f, int in_fd, off_t offset, size_t count){
+    return sendfile(evr_file_get_fd(f), in_fd, &offset, count);
+}
+
 int evr_file_fd_close(struct evr_file *f){
     return close(evr_file_get_fd(f));
 }
@@ -126,6 +135,7 @@ void evr_file_unbound(struct evr_file *f){
     f->received_shutdown = evr_file_fd_received_shutdown;
     f->read = evr_file_fd_read;
     f->write = evr_file_fd_write;
+    f->sendfile = evr_file_fd_sendfile;
     f->close = evr_file_unbound_close;
 }
 
@@ -195,6 +205,71 @@ int write_n(struct evr_file *f, const void *buffer, size_t size){
     return evr_ok;
 }
 
+int writev_n(int f, struct iovec *iov, size_t iovcnt){
+    while(iovcnt > 0){
+        int cnt = min(iovcnt, IOV_MAX);
+        ssize_t written = writev(f, iov, cnt);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return evr_error;
+        }
+        // skip the fully written iovecs and trim the partially
+        // written one
+        while(iovcnt > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if(written > 0){
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return evr_ok;
+}
+
+/**
+ * evr_copy_sendfile_buffer_size is the size of the stack buffer used
+ * by evr_file_copy_sendfile.
+ */
+#define evr_copy_sendfile_buffer_size (64 << 10)
+
+ssize_t evr_file_copy_sendfile(struct evr_file *f, int in_fd, off_t offset, size_t count){
+    char buf[evr_copy_sendfile_buffer_size];
+    ssize_t bytes_read = pread(in_fd, buf, min(count, sizeof(buf)), offset);
+    if(bytes_read <= 0){
+        return -1;
+    }
+    int write_res = write_n(f, buf, bytes_read);
+    if(write_res == evr_end){
+        errno = EPIPE;
+        return -1;
+    }
+    if(write_res != evr_ok){
+        return -1;
+    }
+    return bytes_read;
+}
+
+int sendfile_n(struct evr_file *f, int in_fd, off_t offset, size_t count){
+    size_t remaining = count;
+    while(remaining > 0){
+        ssize_t written = f->sendfile(f, in_fd, offset, remaining);
+        if(written <= 0){
+            if(errno == EPIPE){
+                log_debug("sendfile_n detected a broken pipe with file %d", f->get_fd(f));
+                return evr_end;
+            }
+            return evr_error;
+        }
+        offset += written;
+        remaining -= written;
+    }
+    return evr_ok;
+}
+
 int write_chunk_set(struct evr_file *f, const struct chunk_set *cs){
     size_t remaining = cs->size_used;
     char * const *c = cs->chunks;
@@ -22,6 +22,7 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "dyn-mem.h"
 
@@ -88,6 +89,16 @@ struct evr_file {
     ssize_t (*read)(struct evr_file *f, void *buf, size_t count);
     ssize_t (*write)(struct evr_file *f, const void *buf, size_t count);
 
+    /**
+     * sendfile writes up to count bytes from in_fd starting at
+     * offset into f. Implementations should avoid copying the data
+     * through user space if possible. in_fd's file offset is not
+     * modified so in_fd may be shared between threads.
+     *
+     * Returns the number of bytes written. Returns -1 on error.
+     */
+    ssize_t (*sendfile)(struct evr_file *f, int in_fd, off_t offset, size_t count);
+
     /**
      * close must close the underlying file and free resources
      * allocated by ctx.
@@ -119,8 +130,34 @@ int read_n(struct evr_file *f, char *buffer, size_t bytes, int (*side_effect)(vo
  */
 int write_n(struct evr_file *f, const void *buffer, size_t size);
 
+/**
+ * writev_n writes all iovcnt buffers in iov to the file descriptor f.
+ *
+ * Partial writes are continued. iov is modified while the data is
+ * written.
+ *
+ * Returns evr_ok if all bytes got written. Otherwise evr_error.
+ */
+int writev_n(int f, struct iovec *iov, size_t iovcnt);
+
 int write_chunk_set(struct evr_file *f, const struct chunk_set *cs);
 
+/**
+ * evr_file_copy_sendfile is a struct evr_file sendfile implementation
+ * for files which can't avoid copying. It preads from in_fd and
+ * writes the data using f's write function.
+ */
+ssize_t evr_file_copy_sendfile(struct evr_file *f, int in_fd, off_t offset, size_t count);
+
+/**
+ * sendfile_n writes count bytes from in_fd starting at offset into
+ * f.
+ *
+ * Returns evr_ok if bytes got written. Returns evr_end if f signals
+ * an EPIPE on write. Returns evr_error on errors.
+ */
+int sendfile_n(struct evr_file *f, int in_fd, off_t offset, size_t count);
+
 /**
  * pipe_n will pipe n bytes from src to dest.
  *
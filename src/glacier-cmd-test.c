@@ -16,6 +16,8 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include "glacier-cmd.h"
 #include "test.h"
 #include "assert.h"
@@ -44,9 +46,76 @@ void test_format_parse_resp_header(void){
     assert(out.body_size == 666);
 }
 
+void test_format_parse_stat_blobs_entries(void){
+    struct evr_stat_blobs_entry in[2];
+    in[0].status_code = evr_status_code_ok;
+    in[0].flags = 3;
+    in[0].blob_size = 70000;
+    in[1].status_code = evr_status_code_blob_not_found;
+    in[1].flags = 0;
+    in[1].blob_size = 0;
+    char buffer[2 * evr_stat_blobs_entry_n_size];
+    assert(is_ok(evr_format_stat_blobs_entry(buffer, &in[0])));
+    assert(is_ok(evr_format_stat_blobs_entry(&buffer[evr_stat_blobs_entry_n_size], &in[1])));
+    struct evr_stat_blobs_entry out;
+    assert(is_ok(evr_parse_stat_blobs_entry(&out, buffer)));
+    assert(out.status_code == evr_status_code_ok);
+    assert(out.flags == 3);
+    assert(out.blob_size == 70000);
+    assert(is_ok(evr_parse_stat_blobs_entry(&out, &buffer[evr_stat_blobs_entry_n_size])));
+    assert(out.status_code == evr_status_code_blob_not_found);
+    assert(out.blob_size == 0);
+}
+
+void test_format_parse_blob_range(void){
+    struct evr_blob_range in;
+    memset(in.key, 7, evr_blob_ref_size);
+    in.offset = 100000;
+    in.size = 4096;
+    char buffer[evr_blob_range_n_size];
+    assert(is_ok(evr_format_blob_range(buffer, &in)));
+    struct evr_blob_range out;
+    assert(is_ok(evr_parse_blob_range(&out, buffer)));
+    assert(memcmp(out.key, in.key, evr_blob_ref_size) == 0);
+    assert(out.offset == 100000);
+    assert(out.size == 4096);
+}
+
+void test_format_parse_blob_offer(void){
+    struct evr_blob_offer in;
+    memset(in.key, 9, evr_blob_ref_size);
+    in.flags = evr_blob_flag_claim;
+    in.blob_size = 70000;
+    char buffer[evr_blob_offer_n_size];
+    assert(is_ok(evr_format_blob_offer(buffer, &in)));
+    struct evr_blob_offer out;
+    assert(is_ok(evr_parse_blob_offer(&out, buffer)));
+    assert(memcmp(out.key, in.key, evr_blob_ref_size) == 0);
+    assert(out.flags == evr_blob_flag_claim);
+    assert(out.blob_size == 70000);
+}
+
+void test_format_parse_glacier_status(void){
+    struct evr_glacier_status in;
+    in.check_state = evr_glacier_check_state_running;
+    in.checked_blobs = 100;
+    in.check_blobs = 1984;
+    char buffer[evr_glacier_status_n_size];
+    assert(is_ok(evr_format_glacier_status(buffer, &in)));
+    struct evr_glacier_status out;
+    assert(is_ok(evr_parse_glacier_status(&out, buffer)));
+    assert(out.check_state == evr_glacier_check_state_running);
+    assert(out.checked_blobs == 100);
+    assert(out.check_blobs == 1984);
+}
+
 int main(void){
     evr_init_basics();
     run_test(test_format_parse_cmd_header);
     run_test(test_format_parse_resp_header);
+    run_test(test_format_parse_stat_blobs_entries);
+    run_test(test_format_parse_blob_range);
+    run_test(test_format_parse_blob_offer);
+    run_test(test_format_parse_glacier_status);
     return 0;
 }
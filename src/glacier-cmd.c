@@ -70,6 +70,78 @@ int evr_format_stat_blob_resp(char *buf, const struct evr_stat_blob_resp *resp){
     return evr_ok;
 }
 
+int evr_parse_stat_blobs_entry(struct evr_stat_blobs_entry *entry, char *buf){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_pull_as(&bp, &entry->status_code, uint8_t);
+    evr_pull_as(&bp, &entry->flags, uint8_t);
+    evr_pull_map(&bp, &entry->blob_size, uint32_t, be32toh);
+    return evr_ok;
+}
+
+int evr_format_stat_blobs_entry(char *buf, const struct evr_stat_blobs_entry *entry){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_push_as(&bp, &entry->status_code, uint8_t);
+    evr_push_as(&bp, &entry->flags, uint8_t);
+    evr_push_map(&bp, &entry->blob_size, uint32_t, htobe32);
+    return evr_ok;
+}
+
+int evr_parse_blob_range(struct evr_blob_range *range, char *buf){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_pull_n(&bp, range->key, evr_blob_ref_size);
+    evr_pull_map(&bp, &range->offset, uint32_t, be32toh);
+    evr_pull_map(&bp, &range->size, uint32_t, be32toh);
+    return evr_ok;
+}
+
+int evr_format_blob_range(char *buf, const struct evr_blob_range *range){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_push_n(&bp, range->key, evr_blob_ref_size);
+    evr_push_map(&bp, &range->offset, uint32_t, htobe32);
+    evr_push_map(&bp, &range->size, uint32_t, htobe32);
+    return evr_ok;
+}
+
+int evr_parse_blob_offer(struct evr_blob_offer *offer, char *buf){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_pull_n(&bp, offer->key, evr_blob_ref_size);
+    evr_pull_as(&bp, &offer->flags, uint8_t);
+    evr_pull_map(&bp, &offer->blob_size, uint32_t, be32toh);
+    return evr_ok;
+}
+
+int evr_format_blob_offer(char *buf, const struct evr_blob_offer *offer){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_push_n(&bp, offer->key, evr_blob_ref_size);
+    evr_push_as(&bp, &offer->flags, uint8_t);
+    evr_push_map(&bp, &offer->blob_size, uint32_t, htobe32);
+    return evr_ok;
+}
+
+int evr_parse_glacier_status(struct evr_glacier_status *status, char *buf){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_pull_as(&bp, &status->check_state, uint8_t);
+    evr_pull_map(&bp, &status->checked_blobs, uint32_t, be32toh);
+    evr_pull_map(&bp, &status->check_blobs, uint32_t, be32toh);
+    return evr_ok;
+}
+
+int evr_format_glacier_status(char *buf, const struct evr_glacier_status *status){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_push_as(&bp, &status->check_state, uint8_t);
+    evr_push_map(&bp, &status->checked_blobs, uint32_t, htobe32);
+    evr_push_map(&bp, &status->check_blobs, uint32_t, htobe32);
+    return evr_ok;
+}
+
 int evr_parse_blob_filter(struct evr_blob_filter *f, char *buf){
     struct evr_buf_pos bp;
     evr_init_buf_pos(&bp, buf);
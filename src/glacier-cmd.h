@@ -94,6 +94,97 @@
 
 #define evr_cmd_type_configure_connection 0x05
 
+/**
+ * evr_cmd_type_get_blobs asks for many blobs with one command.
+ *
+ * Expected cmd body is:
+ * - evr_blob_ref keys[n] with 0 < n <= evr_max_batch_blobs
+ *
+ * Expected response is one complete evr_cmd_type_get_blob response,
+ * including its struct evr_resp_header, for every key. The responses
+ * are sent in the order of the keys.
+ */
+#define evr_cmd_type_get_blobs 0x06
+
+/**
+ * evr_cmd_type_stat_blobs asks for metadata about many blobs with
+ * one command.
+ *
+ * Expected cmd body is:
+ * - evr_blob_ref keys[n] with 0 < n <= evr_max_batch_blobs
+ *
+ * Expected response body is:
+ * - struct evr_stat_blobs_entry entries[n] in the order of the keys
+ */
+#define evr_cmd_type_stat_blobs 0x07
+
+/**
+ * evr_cmd_type_get_blob_range asks for a byte range of a blob.
+ *
+ * Expected cmd body is struct evr_blob_range:
+ * - evr_blob_ref key
+ * - uint32_t offset
+ * - uint32_t size
+ *
+ * Expected response body is:
+ * - struct evr_stat_blob_resp of the whole blob
+ * - char *data with the range's bytes. The range is truncated at the
+ *   blob's end and is empty if offset lies beyond the blob's end.
+ *
+ * The range's data can't be verified against the key. Clients which
+ * don't trust the server must get the whole blob.
+ */
+#define evr_cmd_type_get_blob_range 0x08
+
+/**
+ * evr_cmd_type_get_stored_blob asks for a blob the way the server
+ * stores it. Clients which can inflate zlib streams save the
+ * server's work and transfer less bytes.
+ *
+ * Expected cmd body is:
+ * - evr_blob_ref key
+ *
+ * Expected response body is:
+ * - uint8_t flags as stored. May contain evr_blob_flag_deflated.
+ * - char *data as stored. The data is a zlib stream which inflates
+ *   to the blob if flags contain evr_blob_flag_deflated.
+ */
+#define evr_cmd_type_get_stored_blob 0x09
+
+/**
+ * evr_cmd_type_offer_blob announces a blob before its data is
+ * sent. The server tells the client if it needs the data at all.
+ *
+ * Expected cmd body is struct evr_blob_offer:
+ * - evr_blob_ref key
+ * - uint8_t flags
+ * - uint32_t blob_size
+ *
+ * The server responds with evr_status_code_ok and body size 0 if it
+ * already stores the blob. The command is finished then.
+ *
+ * Otherwise the server responds with evr_status_code_continue and
+ * body size 0. The client must send the blob_size bytes of blob data
+ * afterwards. The server responds to the data like it responds to
+ * an evr_cmd_type_put_blob command.
+ */
+#define evr_cmd_type_offer_blob 0x0a
+
+/**
+ * evr_cmd_type_get_status asks for the server's status.
+ *
+ * Expected cmd body is empty.
+ *
+ * Expected response body is struct evr_glacier_status.
+ */
+#define evr_cmd_type_get_status 0x0b
+
+/**
+ * evr_max_batch_blobs is the maximum number of keys within one
+ * evr_cmd_type_get_blobs or evr_cmd_type_stat_blobs command.
+ */
+#define evr_max_batch_blobs 1024
+
 struct evr_cmd_header {
     int type;
     size_t body_size;
@@ -108,6 +199,11 @@ struct evr_cmd_header {
 int evr_parse_cmd_header(struct evr_cmd_header *header, char *buffer);
 int evr_format_cmd_header(char *buffer, const struct evr_cmd_header *header);
 
+/**
+ * evr_status_code_continue tells the client to send the data
+ * announced by an evr_cmd_type_offer_blob command.
+ */
+#define evr_status_code_continue 0x10
 #define evr_status_code_ok 0x20
 #define evr_status_code_client_error 0x40
 #define evr_status_code_unknown_cmd 0x44
@@ -139,6 +235,91 @@ struct evr_stat_blob_resp {
 int evr_parse_stat_blob_resp(struct evr_stat_blob_resp *resp, char *buf);
 int evr_format_stat_blob_resp(char *buf, const struct evr_stat_blob_resp *resp);
 
+/**
+ * struct evr_stat_blobs_entry is the stat result for one key of an
+ * evr_cmd_type_stat_blobs command.
+ *
+ * status_code is evr_status_code_ok or
+ * evr_status_code_blob_not_found. flags and blob_size are 0 if the
+ * blob was not found.
+ */
+struct evr_stat_blobs_entry {
+    int status_code;
+    int flags;
+    size_t blob_size;
+};
+
+#define evr_stat_blobs_entry_n_size (sizeof(uint8_t) + evr_stat_blob_resp_n_size)
+
+int evr_parse_stat_blobs_entry(struct evr_stat_blobs_entry *entry, char *buf);
+int evr_format_stat_blobs_entry(char *buf, const struct evr_stat_blobs_entry *entry);
+
+struct evr_blob_range {
+    evr_blob_ref key;
+    size_t offset;
+    size_t size;
+};
+
+#define evr_blob_range_n_size (evr_blob_ref_size + sizeof(uint32_t) + sizeof(uint32_t))
+
+int evr_parse_blob_range(struct evr_blob_range *range, char *buf);
+int evr_format_blob_range(char *buf, const struct evr_blob_range *range);
+
+struct evr_blob_offer {
+    evr_blob_ref key;
+    int flags;
+    size_t blob_size;
+};
+
+#define evr_blob_offer_n_size (evr_blob_ref_size + evr_blob_flags_n_size + sizeof(uint32_t))
+
+int evr_parse_blob_offer(struct evr_blob_offer *offer, char *buf);
+int evr_format_blob_offer(char *buf, const struct evr_blob_offer *offer);
+
+/**
+ * evr_glacier_check_state_* describe the progress of the background
+ * consistency check which samples blobs after the server started.
+ */
+#define evr_glacier_check_state_disabled 0
+#define evr_glacier_check_state_running 1
+#define evr_glacier_check_state_done 2
+
+/**
+ * evr_glacier_check_state_corrupt indicates that a checked blob did
+ * not match the index db. The index db is rebuilt on the next start.
+ */
+#define evr_glacier_check_state_corrupt 3
+
+/**
+ * evr_glacier_check_state_failed indicates that the check stopped
+ * because of an error other than a mismatching blob.
+ */
+#define evr_glacier_check_state_failed 4
+
+struct evr_glacier_status {
+    /**
+     * check_state is one of evr_glacier_check_state_*.
+     */
+    int check_state;
+
+    /**
+     * checked_blobs is the number of blobs the background check
+     * already verified.
+     */
+    size_t checked_blobs;
+
+    /**
+     * check_blobs is the number of blobs the background check
+     * verifies in total.
+     */
+    size_t check_blobs;
+};
+
+#define evr_glacier_status_n_size (sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t))
+
+int evr_parse_glacier_status(struct evr_glacier_status *status, char *buf);
+int evr_format_glacier_status(char *buf, const struct evr_glacier_status *status);
+
 #define evr_blob_filter_n_size (sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint64_t))
 
 int evr_parse_blob_filter(struct evr_blob_filter *f, char *buf);
@@ -147,6 +328,10 @@ int evr_format_blob_filter(char *buf, const struct evr_blob_filter *f);
 /**
  * evr_watch_flag_eob indicates the responded blob key is the end of a
  * batch of responded blob keys.
+ *
+ * The initial listing of a watch is one batch. Afterwards every batch
+ * contains the blobs modified since the previous batch. Clients may
+ * defer processing the blobs of a batch until its end.
  */
 #define evr_watch_flag_eob 0x01
 
@@ -42,5 +42,6 @@ void evr_free_glacier_storage_cfg(struct evr_glacier_storage_cfg *cfg){
             free(*it);
         }
     }
+    evr_free_llbuf_chain(cfg->stripe_dir_paths, NULL);
     free(cfg);
 }
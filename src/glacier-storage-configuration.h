@@ -24,6 +24,69 @@
 #include <stddef.h>
 
 #include "auth.h"
+#include "dyn-mem.h"
+
+/**
+ * evr_bucket_dir_policy_round_robin places bucket n into bucket
+ * directory n modulo the number of bucket directories.
+ */
+#define evr_bucket_dir_policy_round_robin 0
+
+/**
+ * evr_bucket_dir_policy_free_space places new buckets into bucket
+ * directories weighted by the directories' available disk space.
+ */
+#define evr_bucket_dir_policy_free_space 1
+
+/**
+ * evr_blob_compression_none stores blobs as they are.
+ */
+#define evr_blob_compression_none 0
+
+/**
+ * evr_blob_compression_deflate stores compressible blobs as zlib
+ * stream.
+ */
+#define evr_blob_compression_deflate 1
+
+/**
+ * evr_bucket_io_backend_syscalls appends to buckets using plain
+ * writev and fdatasync syscalls. It is the default backend.
+ */
+#define evr_bucket_io_backend_syscalls 0
+
+/**
+ * evr_bucket_io_backend_io_uring batches bucket appends through an
+ * io_uring. It falls back to plain syscalls if everarch
+ * was built without liburing or the kernel refuses the io_uring.
+ */
+#define evr_bucket_io_backend_io_uring 1
+
+/**
+ * evr_bucket_preallocation_none lets buckets grow with every
+ * append.
+ */
+#define evr_bucket_preallocation_none 0
+
+/**
+ * evr_bucket_preallocation_fallocate reserves max_bucket_size bytes
+ * of disk space for every new bucket. The reserved space lies beyond
+ * the bucket file's size so the file still ends with the last blob.
+ */
+#define evr_bucket_preallocation_fallocate 1
+
+/**
+ * evr_bucket_append_mode_buffered appends blobs through the page
+ * cache.
+ */
+#define evr_bucket_append_mode_buffered 0
+
+/**
+ * evr_bucket_append_mode_uncached writes appended blobs back to disk
+ * right away and drops them from the page cache afterwards. Bulk
+ * ingest then does not evict blobs which are read frequently.
+ */
+#define evr_bucket_append_mode_uncached 1
 
 /**
  * evr_glacier_storage_cfg aggregates configuration options
@@ -58,6 +121,24 @@ struct evr_glacier_storage_cfg {
      */
     char *bucket_dir_path;
 
+    /**
+     * stripe_dir_paths contains additional directories which hold
+     * buckets. Buckets are spread over bucket_dir_path and the
+     * stripe directories so that reads and writes are served by
+     * multiple disks. The index db and lock file always stay in
+     * bucket_dir_path.
+     *
+     * The llbuf data points to a path string. May be NULL if
+     * bucket_dir_path is the only bucket directory.
+     */
+    struct evr_llbuf *stripe_dir_paths;
+
+    /**
+     * bucket_dir_policy is one of evr_bucket_dir_policy_* and decides
+     * in which bucket directory new buckets are created.
+     */
+    int bucket_dir_policy;
+
     /**
      * index_db_path may specify an alternative path for the sqlite
      * bucket index DB. The default path within the bucket directory
@@ -65,6 +146,154 @@ struct evr_glacier_storage_cfg {
      */
     char *index_db_path;
 
+    /**
+     * index_db_cache_size is the number of bytes of page cache every
+     * connection to the index db may use. 0 keeps sqlite's default.
+     */
+    size_t index_db_cache_size;
+
+    /**
+     * index_db_mmap_size is the number of bytes of the index db which
+     * are read through memory mapping. 0 disables memory mapping.
+     */
+    size_t index_db_mmap_size;
+
+    /**
+     * group_commit_latency is the number of microseconds the
+     * persister waits for further blobs before it persists a batch
+     * of queued blobs. Waiting allows blobs from concurrent
+     * connections to share one disk sync and index transaction. 0
+     * persists the queued blobs right away.
+     */
+    size_t group_commit_latency;
+
+    /**
+     * bucket_lanes is the number of buckets which are written in
+     * parallel. Every lane has its own current bucket and persister
+     * thread. Must be at least 1.
+     *
+     * On startup the lanes continue the bucket_lanes buckets with the
+     * highest indices. Only these buckets are quick checked. So
+     * bucket_lanes should only be lowered after a graceful shutdown.
+     */
+    size_t bucket_lanes;
+
+    /**
+     * blob_compression is one of evr_blob_compression_* and decides
+     * how new blobs are stored in buckets. Blobs which look already
+     * compressed or which don't shrink enough are stored as they are
+     * anyway.
+     */
+    int blob_compression;
+
+    /**
+     * bucket_io_backend is one of evr_bucket_io_backend_*.
+     */
+    int bucket_io_backend;
+
+    /**
+     * bucket_preallocation is one of evr_bucket_preallocation_*.
+     */
+    int bucket_preallocation;
+
+    /**
+     * bucket_append_mode is one of evr_bucket_append_mode_*.
+     */
+    int bucket_append_mode;
+
+    /**
+     * reindex_threads is the number of threads which scan buckets
+     * in parallel while the index db is rebuilt.
+     */
+    size_t reindex_threads;
+
+    /**
+     * reindex_run_len is the number of blob positions which are
+     * sorted in memory while the index db is rebuilt. More blob
+     * positions are sorted in runs which are merged from temporary
+     * files.
+     */
+    size_t reindex_run_len;
+
+    /**
+     * bucket_fd_cache_size is the number of bucket files which are
+     * kept open for reading blobs.
+     */
+    size_t bucket_fd_cache_size;
+
+    /**
+     * read_ctx_pool_size is the maximum number of index db read
+     * contexts shared by all connections.
+     */
+    size_t read_ctx_pool_size;
+
+    /**
+     * read_buffer_size is the size in bytes of the buffer each pooled
+     * read context owns.
+     */
+    size_t read_buffer_size;
+
+    /**
+     * max_connections is the maximum number of open client
+     * connections.
+     */
+    size_t max_connections;
+
+    /**
+     * max_requests_in_flight is the number of connection worker
+     * threads and therefore the maximum number of client requests
+     * processed in parallel.
+     */
+    size_t max_requests_in_flight;
+
+    /**
+     * io_timeout is the number of seconds a connection worker waits
+     * for a peer which neither sends nor receives any data before
+     * the connection is closed. 0 waits forever.
+     */
+    size_t io_timeout;
+
+    /**
+     * max_put_bytes_in_flight limits the sum of blob bytes which are
+     * buffered by put requests until they are persisted.
+     */
+    size_t max_put_bytes_in_flight;
+
+    /**
+     * put_stream_min_size is the size of the smallest blob which is
+     * streamed into a bucket lane instead of being buffered. 0
+     * disables streaming.
+     */
+    size_t put_stream_min_size;
+
+    /**
+     * blob_cache_size is the number of bytes of blob data kept in
+     * memory for blobs which are read frequently. 0 disables the
+     * cache.
+     */
+    size_t blob_cache_size;
+
+    /**
+     * blob_cache_max_blob_size is the size of the biggest blob which
+     * is kept in the blob cache.
+     */
+    size_t blob_cache_max_blob_size;
+
+    /**
+     * watch_flush_interval is the minimum number of milliseconds
+     * between two notification frames sent to one watching
+     * connection. Blobs modified in between are collected and sent
+     * with the next frame. 0 sends every frame right away.
+     */
+    size_t watch_flush_interval;
+
+    /**
+     * check_rate is the number of blobs per second which the
+     * background consistency check verifies after the server
+     * started. 0 disables the background check.
+     */
+    size_t check_rate;
+
     /**
      * foreground's indicates if the process should stay in the
      * started process or fork into a daemon.
@@ -21,6 +21,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "assert.h"
 #include "configuration-testutil.h"
@@ -49,9 +51,9 @@ void test_evr_glacier_open_same_empty_glacier_twice(void){
         struct evr_glacier_write_ctx *ctx;
         assert(is_ok(evr_create_glacier_write_ctx(&ctx, round_config)));
         assert(ctx);
-        assert(ctx->current_bucket_index == 1);
-        assert(ctx->current_bucket_f >= 0);
-        assert_msg(ctx->current_bucket_pos == evr_bucket_header_size, "But was %zu", ctx->current_bucket_pos);
+        assert(ctx->lanes[0].current_bucket_index == 1);
+        assert(ctx->lanes[0].current_bucket_f >= 0);
+        assert_msg(ctx->lanes[0].current_bucket_pos == evr_bucket_header_size, "But was %zu", ctx->lanes[0].current_bucket_pos);
         free_glacier_ctx(ctx);
     }
     evr_free_glacier_storage_cfg(config);
@@ -103,8 +105,8 @@ void test_evr_glacier_write_smal_blobs(void){
         wb->size = data_len;
         wb->sync_strategy = evr_sync_strategy_per_blob;
         assert(is_ok(evr_glacier_append_blob(write_ctx, wb, &first_last_modified)));
-        assert(write_ctx->current_bucket_index == 1);
-        assert_msg(write_ctx->current_bucket_pos == evr_bucket_header_size + 53, "current_bucket_pos was %zu", write_ctx->current_bucket_pos);
+        assert(write_ctx->lanes[0].current_bucket_index == 1);
+        assert_msg(write_ctx->lanes[0].current_bucket_pos == evr_bucket_header_size + 53, "current_bucket_pos was %zu", write_ctx->lanes[0].current_bucket_pos);
         assert(first_last_modified > 1644937656);
         free(buffer);
     }
@@ -135,8 +137,8 @@ void test_evr_glacier_write_smal_blobs(void){
         wb->size = data_len;
         wb->sync_strategy = evr_sync_strategy_avoid;
         assert(is_ok(evr_glacier_append_blob(write_ctx, wb, &second_last_modified)));
-        assert(write_ctx->current_bucket_index == 1);
-        assert_msg(write_ctx->current_bucket_pos == evr_bucket_header_size + 98, "current_bucket_pos was %zu", write_ctx->current_bucket_pos);
+        assert(write_ctx->lanes[0].current_bucket_index == 1);
+        assert_msg(write_ctx->lanes[0].current_bucket_pos == evr_bucket_header_size + 98, "current_bucket_pos was %zu", write_ctx->lanes[0].current_bucket_pos);
         assert(second_last_modified > 1644937656);
         free(buffer);
     }
@@ -270,7 +272,7 @@ void test_evr_glacier_write_big_blob(void){
         free(wb->chunks[1]);
         free(buffer);
     }
-    assert(ctx->current_bucket_index == 1);
+    assert(ctx->lanes[0].current_bucket_index == 1);
     free_glacier_ctx(ctx);
 }
 
@@ -300,8 +302,41 @@ struct evr_glacier_storage_cfg* clone_config(struct evr_glacier_storage_cfg *con
     clone->auth_token_set = config->auth_token_set;
     memcpy(clone->auth_token, config->auth_token, sizeof(clone->auth_token));
     clone->max_bucket_size = config->max_bucket_size;
+    clone->bucket_lanes = config->bucket_lanes;
+    clone->blob_compression = config->blob_compression;
+    clone->bucket_io_backend = config->bucket_io_backend;
+    clone->bucket_preallocation = config->bucket_preallocation;
+    clone->bucket_append_mode = config->bucket_append_mode;
+    clone->reindex_threads = config->reindex_threads;
+    clone->reindex_run_len = config->reindex_run_len;
     clone->bucket_dir_path = clone_string(config->bucket_dir_path);
+    clone->stripe_dir_paths = NULL;
+    struct evr_llbuf **stripe_end = &clone->stripe_dir_paths;
+    for(struct evr_llbuf *it = config->stripe_dir_paths; it; it = it->next){
+        const size_t path_size = strlen(it->data) + 1;
+        struct evr_buf_pos bp;
+        *stripe_end = evr_create_llbuf(&bp, path_size);
+        assert(*stripe_end);
+        evr_push_n(&bp, it->data, path_size);
+        stripe_end = &(*stripe_end)->next;
+    }
+    clone->bucket_dir_policy = config->bucket_dir_policy;
     clone->index_db_path = clone_string(config->index_db_path);
+    clone->group_commit_latency = config->group_commit_latency;
+    clone->bucket_fd_cache_size = config->bucket_fd_cache_size;
+    clone->read_ctx_pool_size = config->read_ctx_pool_size;
+    clone->read_buffer_size = config->read_buffer_size;
+    clone->max_connections = config->max_connections;
+    clone->max_requests_in_flight = config->max_requests_in_flight;
+    clone->max_put_bytes_in_flight = config->max_put_bytes_in_flight;
+    clone->put_stream_min_size = config->put_stream_min_size;
+    clone->blob_cache_size = config->blob_cache_size;
+    clone->blob_cache_max_blob_size = config->blob_cache_max_blob_size;
+    clone->watch_flush_interval = config->watch_flush_interval;
+    clone->index_db_cache_size = config->index_db_cache_size;
+    clone->index_db_mmap_size = config->index_db_mmap_size;
+    clone->check_rate = config->check_rate;
+    clone->io_timeout = config->io_timeout;
     clone->foreground = config->foreground;
     clone->log_path = clone_string(config->log_path);
     clone->pid_path = clone_string(config->pid_path);
@@ -409,6 +444,110 @@ void test_reindex_glacier(void){
     evr_free_glacier_storage_cfg(config);
 }
 
+void test_reindex_glacier_in_parallel(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    // every blob ends up in its own bucket
+    config->max_bucket_size = 64;
+    config->reindex_threads = 3;
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    const int blob_count = 20;
+    evr_blob_ref refs[blob_count];
+    char data_buf[32];
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "parallel%d", i) >= 0);
+        write_one_blob(write_ctx, refs[i], data_buf, 0);
+    }
+    free_glacier_ctx(write_ctx);
+    delete_glacier_index(config);
+    // quick check should reindex
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "parallel%d", i) >= 0);
+        struct evr_glacier_blob_stat stat;
+        assert(is_ok(evr_glacier_stat_blob(read_ctx, refs[i], &stat)));
+        assert(stat.flags == 0);
+        assert(stat.blob_size == strlen(data_buf));
+    }
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    // appending after the reindex must continue with the last bucket
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    evr_blob_ref appended_ref;
+    write_one_blob(write_ctx, appended_ref, "appended", 0);
+    free_glacier_ctx(write_ctx);
+    read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    struct evr_glacier_blob_stat stat;
+    assert(is_ok(evr_glacier_stat_blob(read_ctx, appended_ref, &stat)));
+    assert(stat.blob_size == strlen("appended"));
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+void test_reindex_glacier_with_spilled_runs(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    // every blob ends up in its own bucket and every few buckets
+    // are spilled into a run file
+    config->max_bucket_size = 64;
+    config->reindex_threads = 2;
+    config->reindex_run_len = 4;
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    const int blob_count = 20;
+    evr_blob_ref refs[blob_count];
+    char data_buf[32];
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "spilled%d", i) >= 0);
+        write_one_blob(write_ctx, refs[i], data_buf, 0);
+    }
+    // the second copy lands in a later run than the first one
+    evr_blob_ref dup_ref;
+    write_one_blob(write_ctx, dup_ref, "spilled0", 0);
+    free_glacier_ctx(write_ctx);
+    delete_glacier_index(config);
+    // quick check should reindex
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "spilled%d", i) >= 0);
+        struct evr_glacier_blob_stat stat;
+        assert(is_ok(evr_glacier_stat_blob(read_ctx, refs[i], &stat)));
+        assert(stat.blob_size == strlen(data_buf));
+    }
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    {
+        const size_t path_size = strlen(config->bucket_dir_path) + 30;
+        char index_db_path[path_size];
+        assert(snprintf(index_db_path, path_size, "%s/index.db", config->bucket_dir_path) >= 0);
+        sqlite3 *db;
+        assert(sqlite3_open(index_db_path, &db) == SQLITE_OK);
+        sqlite3_stmt *stmt;
+        assert(sqlite3_prepare_v2(db, "select count(*) from blob_position", -1, &stmt, NULL) == SQLITE_OK);
+        assert(sqlite3_step(stmt) == SQLITE_ROW);
+        assert(sqlite3_column_int(stmt, 0) == blob_count);
+        assert(sqlite3_finalize(stmt) == SQLITE_OK);
+        // the first copy of the duplicate blob wins
+        assert(sqlite3_prepare_v2(db, "select (select bucket_index from blob_position where key = ?1) < (select bucket_index from blob_position where key = ?2)", -1, &stmt, NULL) == SQLITE_OK);
+        assert(sqlite3_bind_blob(stmt, 1, refs[0], evr_blob_ref_size, SQLITE_TRANSIENT) == SQLITE_OK);
+        assert(sqlite3_bind_blob(stmt, 2, refs[1], evr_blob_ref_size, SQLITE_TRANSIENT) == SQLITE_OK);
+        assert(sqlite3_step(stmt) == SQLITE_ROW);
+        assert(sqlite3_column_int(stmt, 0) == 1);
+        assert(sqlite3_finalize(stmt) == SQLITE_OK);
+        // the last_modified index is recreated after the load
+        assert(sqlite3_prepare_v2(db, "select count(*) from sqlite_master where type = 'index' and name = 'blob_position_last_modified' and tbl_name = 'blob_position'", -1, &stmt, NULL) == SQLITE_OK);
+        assert(sqlite3_step(stmt) == SQLITE_ROW);
+        assert(sqlite3_column_int(stmt, 0) == 1);
+        assert(sqlite3_finalize(stmt) == SQLITE_OK);
+        assert(sqlite3_close(db) == SQLITE_OK);
+    }
+    evr_free_glacier_storage_cfg(config);
+}
+
 void corrupt_bucket_at_offset(struct evr_glacier_storage_cfg *config, size_t offset);
 
 void test_reindex_glacier_first_blob_header_corrupt(void){
@@ -565,6 +704,993 @@ void test_many_small_buckets(void){
     evr_free_glacier_storage_cfg(config);
 }
 
+void test_check_sampled_blobs(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    {
+        // an empty glacier has no blobs to check
+        struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+        assert(read_ctx);
+        assert(evr_glacier_check_latest_blob(read_ctx, 0) == evr_not_found);
+        assert(evr_glacier_check_random_blob(read_ctx) == evr_not_found);
+        assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    }
+    const int blob_count = 5;
+    evr_blob_ref refs[blob_count];
+    char data_buf[32];
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "sampled%d", i) >= 0);
+        write_one_blob(write_ctx, refs[i], data_buf, i);
+    }
+    free_glacier_ctx(write_ctx);
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    for(int i = 0; i < blob_count; ++i){
+        assert(is_ok(evr_glacier_check_latest_blob(read_ctx, i)));
+        assert(is_ok(evr_glacier_check_random_blob(read_ctx)));
+    }
+    assert(evr_glacier_check_latest_blob(read_ctx, blob_count) == evr_not_found);
+    // blobs written within the same time tick share their
+    // last_modified. so the corrupt blob is searched among all
+    // latest blobs.
+    corrupt_bucket_at_offset(config, evr_bucket_header_size + evr_bucket_blob_header_size + 1);
+    int corrupt_blobs = 0;
+    for(int i = 0; i < blob_count; ++i){
+        int res = evr_glacier_check_latest_blob(read_ctx, i);
+        if(res == evr_glacier_index_db_corrupt){
+            ++corrupt_blobs;
+        } else {
+            assert(is_ok(res));
+        }
+    }
+    assert(corrupt_blobs == 1);
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+void exec_index_db_sql(struct evr_glacier_storage_cfg *config, const char *sql);
+
+void test_migrate_index_db_v1(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    const int blob_count = 10;
+    evr_blob_ref refs[blob_count];
+    char data_buf[32];
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "migrated%d", i) >= 0);
+        write_one_blob(write_ctx, refs[i], data_buf, i);
+    }
+    free_glacier_ctx(write_ctx);
+    // turn the index db back into a version 1 index db which was
+    // interrupted while migrating the first blob position. the
+    // synthetic blob positions make the migration take more than
+    // one batch.
+    exec_index_db_sql(config, "create table blob_position_v1 (key blob primary key not null, flags integer not null, bucket_index integer not null, bucket_blob_offset integer not null, blob_size integer not null, last_modified integer not null);"
+                      "insert into blob_position_v1 select * from blob_position;"
+                      "drop table blob_position;"
+                      "drop table v2;"
+                      "alter table blob_position_v1 rename to blob_position;"
+                      "create index blob_position_last_modified on blob_position (last_modified, key);"
+                      "with recursive n(i) as (select 1 union all select i + 1 from n where i < 10000) insert into blob_position select randomblob(" to_string(evr_blob_ref_size) "), 0, 1, 0, 1, 0 from n;"
+                      "create table blob_position_v2 (key blob primary key not null, flags integer not null, bucket_index integer not null, bucket_blob_offset integer not null, blob_size integer not null, last_modified integer not null) without rowid;"
+                      "insert into blob_position_v2 select * from blob_position order by key limit 1;");
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    evr_blob_ref appended_ref;
+    write_one_blob(write_ctx, appended_ref, "appended", blob_count);
+    // freeing the write ctx may interrupt the migration
+    free_glacier_ctx(write_ctx);
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    struct evr_glacier_blob_stat stat;
+    assert(is_ok(evr_glacier_stat_blob(read_ctx, appended_ref, &stat)));
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    assert(is_ok(evr_glacier_join_index_db_migration(write_ctx)));
+    free_glacier_ctx(write_ctx);
+    exec_index_db_sql(config, "select 1 from v2");
+    {
+        const size_t path_size = strlen(config->bucket_dir_path) + 30;
+        char index_db_path[path_size];
+        assert(snprintf(index_db_path, path_size, "%s/index.db", config->bucket_dir_path) >= 0);
+        sqlite3 *db;
+        assert(sqlite3_open(index_db_path, &db) == SQLITE_OK);
+        // the migrated blob_position table has no rowid
+        assert(sqlite3_exec(db, "select rowid from blob_position", NULL, NULL, NULL) != SQLITE_OK);
+        assert(sqlite3_exec(db, "select 1 from blob_position_v2", NULL, NULL, NULL) != SQLITE_OK);
+        assert(sqlite3_exec(db, "select 1 from blob_position_v1", NULL, NULL, NULL) != SQLITE_OK);
+        sqlite3_stmt *stmt;
+        assert(sqlite3_prepare_v2(db, "select count(*) from blob_position", -1, &stmt, NULL) == SQLITE_OK);
+        assert(sqlite3_step(stmt) == SQLITE_ROW);
+        assert(sqlite3_column_int(stmt, 0) == blob_count + 10000 + 1);
+        assert(sqlite3_finalize(stmt) == SQLITE_OK);
+        // the migrated table keeps the last_modified index it got
+        // during the migration. the version 1 index is gone.
+        assert(sqlite3_prepare_v2(db, "select name from sqlite_master where type = 'index' and tbl_name = 'blob_position' and sql is not null", -1, &stmt, NULL) == SQLITE_OK);
+        assert(sqlite3_step(stmt) == SQLITE_ROW);
+        assert(strcmp((const char*)sqlite3_column_text(stmt, 0), "blob_position_v2_last_modified") == 0);
+        assert(sqlite3_step(stmt) == SQLITE_DONE);
+        assert(sqlite3_finalize(stmt) == SQLITE_OK);
+        assert(sqlite3_prepare_v2(db, "select count(*) from sqlite_master where name = 'blob_position_last_modified'", -1, &stmt, NULL) == SQLITE_OK);
+        assert(sqlite3_step(stmt) == SQLITE_ROW);
+        assert(sqlite3_column_int(stmt, 0) == 0);
+        assert(sqlite3_finalize(stmt) == SQLITE_OK);
+        assert(sqlite3_close(db) == SQLITE_OK);
+    }
+    read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "migrated%d", i) >= 0);
+        assert(is_ok(evr_glacier_stat_blob(read_ctx, refs[i], &stat)));
+        assert(stat.blob_size == strlen(data_buf));
+    }
+    assert(is_ok(evr_glacier_stat_blob(read_ctx, appended_ref, &stat)));
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+int collect_seal_entry(void *ctx, struct evr_glacier_bucket_seal_entry *entry);
+
+void test_reindex_sealed_buckets(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    // every blob ends up in its own bucket
+    config->max_bucket_size = 64;
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    const int blob_count = 4;
+    evr_blob_ref refs[blob_count];
+    char data_buf[32];
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "sealed%d", i) >= 0);
+        write_one_blob(write_ctx, refs[i], data_buf, 0);
+    }
+    free_glacier_ctx(write_ctx);
+    const size_t path_size = strlen(config->bucket_dir_path) + 30;
+    char bucket_path[path_size];
+    const size_t first_end_offset = evr_bucket_header_size + evr_bucket_blob_header_size + strlen("sealed0");
+    // the first bucket got sealed when the second bucket was created
+    assert(snprintf(bucket_path, path_size, "%s/00001.evb", config->bucket_dir_path) >= 0);
+    struct evr_glacier_bucket_seal_entry entry;
+    entry.size = 0;
+    assert(is_ok(evr_glacier_read_bucket_seal(bucket_path, first_end_offset, collect_seal_entry, &entry)));
+    assert(memcmp(entry.ref, refs[0], evr_blob_ref_size) == 0);
+    assert(entry.offset == evr_bucket_header_size + evr_bucket_blob_header_size);
+    assert(entry.stored_size == strlen("sealed0"));
+    assert(entry.size == strlen("sealed0"));
+    // seals for another bucket end are ignored
+    assert(evr_glacier_read_bucket_seal(bucket_path, first_end_offset + 1, collect_seal_entry, &entry) == evr_not_found);
+    // the current bucket is not sealed
+    assert(snprintf(bucket_path, path_size, "%s/%05x.evb", config->bucket_dir_path, blob_count) >= 0);
+    assert(evr_glacier_read_bucket_seal(bucket_path, first_end_offset, collect_seal_entry, &entry) == evr_not_found);
+    {
+        // truncate the second bucket's seal
+        char seal_path[path_size];
+        assert(snprintf(seal_path, path_size, "%s/00002.evs", config->bucket_dir_path) >= 0);
+        assert(truncate(seal_path, evr_bucket_seal_header_size + 3) == 0);
+        assert(snprintf(bucket_path, path_size, "%s/00002.evb", config->bucket_dir_path) >= 0);
+        assert(evr_glacier_read_bucket_seal(bucket_path, first_end_offset, collect_seal_entry, &entry) == evr_not_found);
+    }
+    {
+        // corrupt the third bucket's blob data behind its valid seal
+        assert(snprintf(bucket_path, path_size, "%s/00003.evb", config->bucket_dir_path) >= 0);
+        int f = open(bucket_path, O_WRONLY);
+        assert(f >= 0);
+        assert(pwrite(f, "X", 1, evr_bucket_header_size + evr_bucket_blob_header_size) == 1);
+        assert(close(f) == 0);
+        assert(evr_glacier_read_bucket_seal(bucket_path, first_end_offset, collect_seal_entry, &entry) == evr_not_found);
+    }
+    delete_glacier_index(config);
+    // quick check should reindex sealed buckets from their seals and
+    // the others by walking them. walking skips the corrupt blob.
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "sealed%d", i) >= 0);
+        struct evr_glacier_blob_stat stat;
+        if(i == 2){
+            assert(evr_glacier_stat_blob(read_ctx, refs[i], &stat) == evr_not_found);
+            continue;
+        }
+        assert(is_ok(evr_glacier_stat_blob(read_ctx, refs[i], &stat)));
+        assert(stat.flags == 0);
+        assert(stat.blob_size == strlen(data_buf));
+    }
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+int collect_seal_entry(void *ctx, struct evr_glacier_bucket_seal_entry *entry){
+    struct evr_glacier_bucket_seal_entry *collected = ctx;
+    // only buckets with one blob are expected
+    assert(collected->size == 0);
+    *collected = *entry;
+    return evr_ok;
+}
+
+void test_striped_buckets(int policy){
+    const int blob_count = 6;
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    const int max_data_size = 8;
+    // each bucket can hold one blob
+    config->max_bucket_size = evr_bucket_header_size + evr_bucket_blob_header_size + max_data_size;
+    config->bucket_dir_policy = policy;
+    const char stripe_name[] = "/stripe";
+    const size_t bucket_dir_path_len = strlen(config->bucket_dir_path);
+    char stripe_path[bucket_dir_path_len + sizeof(stripe_name)];
+    memcpy(stripe_path, config->bucket_dir_path, bucket_dir_path_len);
+    memcpy(&stripe_path[bucket_dir_path_len], stripe_name, sizeof(stripe_name));
+    assert(mkdir(stripe_path, 0755) == 0);
+    struct evr_buf_pos bp;
+    assert(is_ok(evr_llbuf_prepend(&config->stripe_dir_paths, &bp, sizeof(stripe_path))));
+    evr_push_n(&bp, stripe_path, sizeof(stripe_path));
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, config)));
+    assert(write_ctx);
+    evr_blob_ref refs[blob_count];
+    char data_buf[max_data_size + 1];
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "stripe%d", i) >= 0);
+        write_one_blob(write_ctx, refs[i], data_buf, 0);
+    }
+    assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+    if(policy == evr_bucket_dir_policy_round_robin){
+        char bucket_path[sizeof(stripe_path) + 20];
+        assert(snprintf(bucket_path, sizeof(bucket_path), "%s/00001.evb", stripe_path) >= 0);
+        assert(access(bucket_path, F_OK) == 0);
+        assert(snprintf(bucket_path, sizeof(bucket_path), "%s/00002.evb", config->bucket_dir_path) >= 0);
+        assert(access(bucket_path, F_OK) == 0);
+    }
+    // the reindex proves that the buckets in all bucket directories
+    // are walked
+    delete_glacier_index(config);
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    status_mock_ret = evr_ok;
+    status_mock_expected_exists = 1;
+    status_mock_expected_flags = 0;
+    for(int i = 0; i < blob_count; ++i){
+        assert(snprintf(data_buf, sizeof(data_buf), "stripe%d", i) >= 0);
+        status_mock_expected_blob_size = strlen(data_buf);
+        struct dynamic_array *data_buffer = alloc_dynamic_array(128);
+        assert(data_buffer);
+        assert(is_ok(evr_glacier_read_blob(read_ctx, refs[i], status_mock, store_into_dynamic_array, &data_buffer)));
+        assert(data_buffer->size_used == strlen(data_buf));
+        assert(memcmp(data_buf, data_buffer->data, data_buffer->size_used) == 0);
+        free(data_buffer);
+    }
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+void test_striped_buckets_round_robin(void){
+    test_striped_buckets(evr_bucket_dir_policy_round_robin);
+}
+
+void test_striped_buckets_free_space(void){
+    test_striped_buckets(evr_bucket_dir_policy_free_space);
+}
+
+struct walk_positions_ctx {
+    struct evr_writing_blob *blobs;
+    size_t blobs_len;
+    size_t visited;
+};
+
+int visit_blob_position(void *ctx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos);
+
+void test_append_blobs_batch(void){
+    const size_t blob_count = 5;
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    const size_t data_size = 8;
+    // each bucket can hold two blobs
+    config->max_bucket_size = evr_bucket_header_size + 2 * (evr_bucket_blob_header_size + data_size);
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, config)));
+    assert(write_ctx);
+    char data[blob_count][data_size + 1];
+    char *chunks[blob_count][1];
+    struct evr_writing_blob wbs[blob_count];
+    struct evr_writing_blob *blobs[blob_count];
+    for(size_t i = 0; i < blob_count; ++i){
+        assert(snprintf(data[i], sizeof(data[i]), "blob-%03zu", i) == (int)data_size);
+        chunks[i][0] = data[i];
+        wbs[i].flags = 0;
+        wbs[i].chunks = chunks[i];
+        wbs[i].size = data_size;
+        wbs[i].sync_strategy = i == 1 ? evr_sync_strategy_per_blob : evr_sync_strategy_avoid;
+        assert(is_ok(evr_calc_blob_ref(wbs[i].key, wbs[i].size, chunks[i])));
+        blobs[i] = &wbs[i];
+    }
+    evr_time last_modified;
+    assert(is_ok(evr_glacier_append_blobs(write_ctx, blobs, blob_count, NULL, &last_modified)));
+    assert_msg(write_ctx->lanes[0].current_bucket_index == 3, "But was %lu", write_ctx->lanes[0].current_bucket_index);
+    assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+    // the reindex proves that the blob headers on disk are valid
+    delete_glacier_index(config);
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    struct evr_glacier_blob_stat stat;
+    for(size_t i = 0; i < blob_count; ++i){
+        assert(is_ok(evr_glacier_stat_blob(read_ctx, wbs[i].key, &stat)));
+        assert(stat.blob_size == data_size);
+    }
+    struct walk_positions_ctx walk_ctx = { wbs, blob_count, 0 };
+    assert(is_ok(evr_glacier_walk_blob_positions(read_ctx, visit_blob_position, &walk_ctx)));
+    assert(walk_ctx.visited == blob_count);
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    {
+        log_info("Read blobs through a bucket fd cache");
+        // the cache can only hold one of the three buckets
+        struct evr_bucket_fd_cache *cache = evr_create_bucket_fd_cache(config, 1);
+        assert(cache);
+        // a small read buffer forces many preads per blob
+        char read_buffer[3];
+        status_mock_ret = evr_ok;
+        status_mock_expected_exists = 1;
+        status_mock_expected_flags = 0;
+        status_mock_expected_blob_size = data_size;
+        for(size_t i = 0; i < blob_count; ++i){
+            struct dynamic_array *data_buffer = alloc_dynamic_array(128);
+            assert(data_buffer);
+            assert(is_ok(evr_glacier_read_blob_at(cache, &wbs[i].pos, read_buffer, sizeof(read_buffer), status_mock, store_into_dynamic_array, &data_buffer)));
+            assert(data_buffer->size_used == data_size);
+            assert(memcmp(data[i], data_buffer->data, data_size) == 0);
+            free(data_buffer);
+        }
+        {
+            log_info("Send blob through the bucket fd cache");
+            int p[2];
+            assert(pipe(p) == 0);
+            struct evr_file dest;
+            evr_file_bind_fd(&dest, p[1]);
+            assert(is_ok(evr_glacier_send_blob_at(cache, &wbs[4].pos, &dest, status_mock, NULL)));
+            char buf[data_size];
+            assert(read(p[0], buf, sizeof(buf)) == (ssize_t)data_size);
+            assert(memcmp(data[4], buf, data_size) == 0);
+            log_info("Send blob range through the bucket fd cache");
+            assert(is_ok(evr_glacier_send_blob_range_at(cache, &wbs[3].pos, 5, 3, &dest, status_mock, NULL)));
+            assert(read(p[0], buf, sizeof(buf)) == 3);
+            assert(memcmp("003", buf, 3) == 0);
+            assert(is_ok(evr_glacier_send_blob_range_at(cache, &wbs[3].pos, data_size, 0, &dest, status_mock, NULL)));
+            assert(is_err(evr_glacier_send_blob_range_at(cache, &wbs[3].pos, 5, 4, &dest, status_mock, NULL)));
+            assert(close(p[0]) == 0);
+            assert(dest.close(&dest) == 0);
+        }
+        int f1 = evr_bucket_fd_cache_acquire(cache, 1);
+        assert(f1 >= 0);
+        int f2 = evr_bucket_fd_cache_acquire(cache, 2);
+        assert(f2 >= 0);
+        assert(f1 != f2);
+        assert(is_ok(evr_bucket_fd_cache_release(cache, 2, f2)));
+        assert(is_ok(evr_bucket_fd_cache_release(cache, 1, f1)));
+        assert(evr_bucket_fd_cache_acquire(cache, 1) == f1);
+        assert(is_ok(evr_bucket_fd_cache_release(cache, 1, f1)));
+        assert(evr_bucket_fd_cache_acquire(cache, 99) == -1);
+        f2 = evr_bucket_fd_cache_acquire(cache, 2);
+        assert(f2 >= 0);
+        f1 = evr_bucket_fd_cache_acquire(cache, 1);
+        assert(f1 >= 0);
+        assert(f1 != f2);
+        assert(evr_bucket_fd_cache_acquire(cache, 2) == f2);
+        assert(is_ok(evr_bucket_fd_cache_release(cache, 1, f1)));
+        assert(is_ok(evr_bucket_fd_cache_release(cache, 2, f2)));
+        assert(is_ok(evr_bucket_fd_cache_release(cache, 2, f2)));
+        assert(is_ok(evr_free_bucket_fd_cache(cache)));
+    }
+    evr_free_glacier_storage_cfg(config);
+}
+
+void test_append_blobs_batch_with_oversized_blob(void){
+    const size_t blob_count = 3;
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    const size_t data_size = 8;
+    config->max_bucket_size = evr_bucket_header_size + 2 * (evr_bucket_blob_header_size + data_size);
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    char big_data[config->max_bucket_size];
+    memset(big_data, 'x', sizeof(big_data));
+    char data[blob_count][data_size + 1];
+    char *chunks[blob_count][1];
+    struct evr_writing_blob wbs[blob_count];
+    struct evr_writing_blob *blobs[blob_count];
+    for(size_t i = 0; i < blob_count; ++i){
+        assert(snprintf(data[i], sizeof(data[i]), "blob-%03zu", i) == (int)data_size);
+        chunks[i][0] = i == 1 ? big_data : data[i];
+        wbs[i].flags = 0;
+        wbs[i].chunks = chunks[i];
+        wbs[i].size = i == 1 ? sizeof(big_data) : data_size;
+        wbs[i].sync_strategy = evr_sync_strategy_avoid;
+        assert(is_ok(evr_calc_blob_ref(wbs[i].key, wbs[i].size, chunks[i])));
+        blobs[i] = &wbs[i];
+    }
+    int results[blob_count];
+    evr_time last_modified;
+    // the oversized blob in the middle must not fail the others
+    assert(is_err(evr_glacier_append_blobs(write_ctx, blobs, blob_count, results, &last_modified)));
+    assert(is_ok(results[0]));
+    assert(is_err(results[1]));
+    assert(is_ok(results[2]));
+    assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    struct evr_glacier_blob_stat stat;
+    assert(is_ok(evr_glacier_stat_blob(read_ctx, wbs[0].key, &stat)));
+    assert(evr_glacier_stat_blob(read_ctx, wbs[1].key, &stat) == evr_not_found);
+    assert(is_ok(evr_glacier_stat_blob(read_ctx, wbs[2].key, &stat)));
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+void test_append_blobs_to_lanes(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    config->bucket_lanes = 2;
+    const size_t data_size = 8;
+    char data[2][data_size + 1];
+    char *chunks[2][1];
+    struct evr_writing_blob wbs[2];
+    struct evr_writing_blob *blobs[2];
+    for(size_t i = 0; i < 2; ++i){
+        assert(snprintf(data[i], sizeof(data[i]), "lane-%03zu", i) == (int)data_size);
+        chunks[i][0] = data[i];
+        wbs[i].flags = 0;
+        wbs[i].chunks = chunks[i];
+        wbs[i].size = data_size;
+        wbs[i].sync_strategy = evr_sync_strategy_per_blob;
+        assert(is_ok(evr_calc_blob_ref(wbs[i].key, wbs[i].size, chunks[i])));
+        blobs[i] = &wbs[i];
+    }
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, config)));
+    assert(write_ctx);
+    assert(write_ctx->lanes_len == 2);
+    assert(write_ctx->lanes[0].current_bucket_index == 1);
+    assert(write_ctx->lanes[1].current_bucket_index == 2);
+    evr_time first_modified;
+    evr_time second_modified;
+    assert(is_ok(evr_glacier_append_lane_blobs(write_ctx, 1, &blobs[1], 1, NULL, &second_modified)));
+    assert(is_ok(evr_glacier_append_lane_blobs(write_ctx, 0, &blobs[0], 1, NULL, &first_modified)));
+    assert(is_err(evr_glacier_append_lane_blobs(write_ctx, 2, &blobs[0], 1, NULL, &first_modified)));
+    assert(second_modified <= first_modified);
+    assert(wbs[0].pos.bucket_index == 1);
+    assert(wbs[1].pos.bucket_index == 2);
+    assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+    log_info("Reopen glacier with lanes");
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, config)));
+    assert(write_ctx->lanes[0].current_bucket_index == 2);
+    assert(write_ctx->lanes[1].current_bucket_index == 1);
+    assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+    log_info("Reindex glacier with lanes");
+    delete_glacier_index(config);
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    struct evr_glacier_blob_stat stat;
+    for(size_t i = 0; i < 2; ++i){
+        assert(is_ok(evr_glacier_stat_blob(read_ctx, wbs[i].key, &stat)));
+        assert(stat.blob_size == data_size);
+    }
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+int collect_seal_entry(void *ctx, struct evr_glacier_bucket_seal_entry *entry);
+
+void test_stream_blobs(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    const size_t data_size = 1000;
+    // every streamed blob ends up in its own bucket
+    config->max_bucket_size = evr_bucket_header_size + evr_bucket_blob_header_size + data_size + 100;
+    char data[data_size];
+    char next_data[data_size];
+    for(size_t i = 0; i < data_size; ++i){
+        data[i] = (char)(i * 7);
+        next_data[i] = (char)(i * 13);
+    }
+    char *chunks[1] = { data };
+    char *next_chunks[1] = { next_data };
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, config)));
+    struct evr_glacier_bucket_lane *lane = &write_ctx->lanes[0];
+    const size_t start_pos = lane->current_bucket_pos;
+    log_info("Abort blob stream");
+    struct evr_glacier_blob_stream aborted;
+    memset(aborted.blob.key, 9, evr_blob_ref_size);
+    aborted.blob.flags = 0;
+    aborted.blob.size = data_size;
+    aborted.blob.sync_strategy = evr_sync_strategy_per_blob;
+    assert(is_ok(evr_glacier_begin_blob_stream(write_ctx, 0, &aborted)));
+    assert(is_ok(evr_glacier_write_blob_stream(write_ctx, &aborted, data, data_size / 2)));
+    assert(is_ok(evr_glacier_write_blob_stream(write_ctx, &aborted, data, data_size - data_size / 2)));
+    assert(is_err(evr_glacier_write_blob_stream(write_ctx, &aborted, data, 1)));
+    assert(is_ok(evr_glacier_abort_blob_stream(write_ctx, &aborted)));
+    assert(lane->current_bucket_pos == start_pos);
+    assert(lseek(lane->current_bucket_f, 0, SEEK_END) == (off_t)start_pos);
+    log_info("Commit blob stream");
+    struct evr_glacier_blob_stream s;
+    s.blob.flags = 0;
+    s.blob.size = data_size;
+    s.blob.sync_strategy = evr_sync_strategy_per_blob;
+    assert(is_ok(evr_calc_blob_ref(s.blob.key, data_size, chunks)));
+    assert(is_ok(evr_glacier_begin_blob_stream(write_ctx, 0, &s)));
+    const size_t piece_size = 64;
+    for(size_t written = 0; written < data_size; written += piece_size){
+        assert(is_ok(evr_glacier_write_blob_stream(write_ctx, &s, &data[written], min(piece_size, data_size - written))));
+    }
+    evr_time last_modified;
+    assert(is_ok(evr_glacier_commit_blob_stream(write_ctx, &s, &last_modified)));
+    assert(s.blob.pos.bucket_index == lane->current_bucket_index);
+    assert(s.blob.pos.offset == start_pos + evr_bucket_blob_header_size);
+    assert(s.blob.pos.size == data_size);
+    assert(lane->current_bucket_pos == start_pos + evr_bucket_blob_header_size + data_size);
+    assert(lseek(lane->current_bucket_f, 0, SEEK_END) == (off_t)lane->current_bucket_pos);
+    const size_t first_end_offset = lane->current_bucket_pos;
+    log_info("Seal bucket with streamed blob");
+    struct evr_glacier_blob_stream next;
+    next.blob.flags = 0;
+    next.blob.size = data_size;
+    next.blob.sync_strategy = evr_sync_strategy_avoid;
+    assert(is_ok(evr_calc_blob_ref(next.blob.key, data_size, next_chunks)));
+    assert(is_ok(evr_glacier_begin_blob_stream(write_ctx, 0, &next)));
+    assert(lane->current_bucket_index == 2);
+    const size_t path_size = strlen(config->bucket_dir_path) + 30;
+    char bucket_path[path_size];
+    assert(snprintf(bucket_path, path_size, "%s/00001.evb", config->bucket_dir_path) >= 0);
+    struct evr_glacier_bucket_seal_entry entry;
+    entry.size = 0;
+    assert(is_ok(evr_glacier_read_bucket_seal(bucket_path, first_end_offset, collect_seal_entry, &entry)));
+    assert(memcmp(entry.ref, s.blob.key, evr_blob_ref_size) == 0);
+    assert(is_ok(evr_glacier_write_blob_stream(write_ctx, &next, next_data, data_size)));
+    assert(is_ok(evr_glacier_commit_blob_stream(write_ctx, &next, &last_modified)));
+    assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+    // the reindex proves that the streamed blobs' headers and the
+    // bucket end offsets were written
+    delete_glacier_index(config);
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    struct evr_glacier_blob_stat stat;
+    assert(evr_glacier_stat_blob(read_ctx, aborted.blob.key, &stat) == evr_not_found);
+    status_mock_ret = evr_ok;
+    status_mock_expected_exists = 1;
+    status_mock_expected_flags = 0;
+    status_mock_expected_blob_size = data_size;
+    struct dynamic_array *data_buffer = alloc_dynamic_array(128);
+    assert(data_buffer);
+    assert(is_ok(evr_glacier_read_blob(read_ctx, s.blob.key, status_mock, store_into_dynamic_array, &data_buffer)));
+    assert(data_buffer->size_used == data_size);
+    assert(memcmp(data, data_buffer->data, data_size) == 0);
+    free(data_buffer);
+    assert(is_ok(evr_glacier_stat_blob(read_ctx, next.blob.key, &stat)));
+    assert(stat.blob_size == data_size);
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+void test_bucket_io_backends(void){
+    const int backends[] = {
+        evr_bucket_io_backend_syscalls,
+        evr_bucket_io_backend_io_uring,
+    };
+    for(size_t b = 0; b < static_len(backends); ++b){
+        log_info("Use bucket io backend %d", backends[b]);
+        struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+        config->bucket_io_backend = backends[b];
+        const size_t blob_count = 3;
+        const size_t data_size = 1000;
+        char data[blob_count][data_size];
+        char *chunks[blob_count][1];
+        struct evr_writing_blob wbs[blob_count];
+        struct evr_writing_blob *blobs[blob_count];
+        for(size_t i = 0; i < blob_count; ++i){
+            for(size_t j = 0; j < data_size; ++j){
+                data[i][j] = (char)(i * 31 + j);
+            }
+            chunks[i][0] = data[i];
+            wbs[i].flags = 0;
+            wbs[i].chunks = chunks[i];
+            wbs[i].size = data_size;
+            wbs[i].sync_strategy = i == 0 ? evr_sync_strategy_avoid : evr_sync_strategy_per_blob;
+            assert(is_ok(evr_calc_blob_ref(wbs[i].key, wbs[i].size, chunks[i])));
+            blobs[i] = &wbs[i];
+        }
+        struct evr_glacier_write_ctx *write_ctx;
+        assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, config)));
+        evr_time last_modified;
+        assert(is_ok(evr_glacier_append_blobs(write_ctx, blobs, 1, NULL, &last_modified)));
+        assert(write_ctx->lanes[0].current_bucket_sync == 0);
+        assert(is_ok(evr_glacier_append_blobs(write_ctx, &blobs[1], 2, NULL, &last_modified)));
+        assert(write_ctx->lanes[0].current_bucket_sync == 1);
+        assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+        // the reindex proves that the bucket end offset was written
+        delete_glacier_index(config);
+        assert(is_ok(evr_quick_check_glacier(config)));
+        // read buffers smaller than the blobs make the reads
+        // overlap
+        const size_t read_buffer_sizes[] = { 7, 64, 4096 };
+        for(size_t s = 0; s < static_len(read_buffer_sizes); ++s){
+            struct evr_glacier_read_ctx *read_ctx = evr_create_sized_glacier_read_ctx(config, read_buffer_sizes[s]);
+            assert(read_ctx);
+            status_mock_ret = evr_ok;
+            status_mock_expected_exists = 1;
+            status_mock_expected_flags = 0;
+            status_mock_expected_blob_size = data_size;
+            for(size_t i = 0; i < blob_count; ++i){
+                struct dynamic_array *data_buffer = alloc_dynamic_array(128);
+                assert(data_buffer);
+                assert(is_ok(evr_glacier_read_blob(read_ctx, wbs[i].key, status_mock, store_into_dynamic_array, &data_buffer)));
+                assert(data_buffer->size_used == data_size);
+                assert(memcmp(data[i], data_buffer->data, data_size) == 0);
+                free(data_buffer);
+            }
+            assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+        }
+        evr_free_glacier_storage_cfg(config);
+    }
+}
+
+struct paged_blobs_ctx {
+    size_t visited_len;
+    evr_blob_ref visited_keys[8];
+    evr_time visited_last_modified[8];
+    size_t last_blob_count;
+};
+
+int paged_blob_visitor(void *context, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob);
+
+void list_blobs_in_pages(struct evr_glacier_read_ctx *ctx, struct evr_blob_filter *filter, struct paged_blobs_ctx *pctx);
+
+void test_list_blobs_in_pages(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    assert(write_ctx);
+    // all blobs share one last_modified timestamp so the listing must
+    // tell them apart by their keys
+    const size_t blob_count = 7;
+    char data[blob_count][16];
+    char *chunks[blob_count][1];
+    struct evr_writing_blob wbs[blob_count];
+    struct evr_writing_blob *blobs[blob_count];
+    for(size_t i = 0; i < blob_count; ++i){
+        snprintf(data[i], sizeof(data[i]), "paged blob %zu", i);
+        chunks[i][0] = data[i];
+        wbs[i].flags = i % 2 == 0 ? evr_blob_flag_claim : 0;
+        wbs[i].chunks = chunks[i];
+        wbs[i].size = strlen(data[i]);
+        wbs[i].sync_strategy = evr_sync_strategy_per_blob;
+        assert(is_ok(evr_calc_blob_ref(wbs[i].key, wbs[i].size, chunks[i])));
+        blobs[i] = &wbs[i];
+    }
+    evr_time last_modified;
+    assert(is_ok(evr_glacier_append_blobs(write_ctx, blobs, blob_count, NULL, &last_modified)));
+    free_glacier_ctx(write_ctx);
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    int sort_orders[] = {
+        evr_cmd_watch_sort_order_last_modified,
+        evr_cmd_watch_sort_order_ref,
+    };
+    for(size_t o = 0; o < static_len(sort_orders); ++o){
+        struct evr_blob_filter filter;
+        filter.sort_order = sort_orders[o];
+        filter.flags_filter = 0;
+        filter.last_modified_after = 0;
+        struct paged_blobs_ctx pctx;
+        list_blobs_in_pages(read_ctx, &filter, &pctx);
+        assert(pctx.visited_len == blob_count);
+        for(size_t i = 0; i < pctx.visited_len; ++i){
+            assert(pctx.visited_last_modified[i] == last_modified);
+            if(i > 0){
+                assert(evr_cmp_blob_ref(pctx.visited_keys[i - 1], pctx.visited_keys[i]) < 0);
+            }
+        }
+        filter.flags_filter = evr_blob_flag_claim;
+        list_blobs_in_pages(read_ctx, &filter, &pctx);
+        assert_msg(pctx.visited_len == 4, "visited_len was %zu", pctx.visited_len);
+        filter.flags_filter = evr_blob_flag_index_rule_claim;
+        list_blobs_in_pages(read_ctx, &filter, &pctx);
+        assert(pctx.visited_len == 0);
+        filter.flags_filter = 0;
+        filter.last_modified_after = last_modified + 1;
+        list_blobs_in_pages(read_ctx, &filter, &pctx);
+        assert(pctx.visited_len == 0);
+    }
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+void list_blobs_in_pages(struct evr_glacier_read_ctx *ctx, struct evr_blob_filter *filter, struct paged_blobs_ctx *pctx){
+    pctx->visited_len = 0;
+    pctx->last_blob_count = 0;
+    struct evr_blob_list_cursor cursor;
+    evr_init_blob_list_cursor(&cursor, filter);
+    size_t pages = 0;
+    while(1){
+        int res = evr_glacier_list_blobs_page(ctx, paged_blob_visitor, filter, &cursor, 2, pctx);
+        ++pages;
+        if(res == evr_end){
+            break;
+        }
+        assert(is_ok(res));
+        assert(pctx->last_blob_count == 0);
+    }
+    assert(pages == (pctx->visited_len > 0 ? (pctx->visited_len + 1) / 2 : 1));
+    assert(pctx->last_blob_count == (pctx->visited_len > 0 ? 1 : 0));
+}
+
+int paged_blob_visitor(void *context, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob){
+    struct paged_blobs_ctx *ctx = context;
+    assert(ctx->visited_len < static_len(ctx->visited_keys));
+    memcpy(ctx->visited_keys[ctx->visited_len], key, evr_blob_ref_size);
+    ctx->visited_last_modified[ctx->visited_len] = last_modified;
+    ++ctx->visited_len;
+    if(last_blob){
+        ++ctx->last_blob_count;
+    }
+    return evr_ok;
+}
+
+void test_bucket_preallocation_and_uncached_appends(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    config->bucket_preallocation = evr_bucket_preallocation_fallocate;
+    config->bucket_append_mode = evr_bucket_append_mode_uncached;
+    const size_t blob_count = 3;
+    const size_t data_size = 10000;
+    char data[blob_count][data_size];
+    char *chunks[blob_count][1];
+    struct evr_writing_blob wbs[blob_count];
+    struct evr_writing_blob *blobs[blob_count];
+    for(size_t i = 0; i < blob_count; ++i){
+        for(size_t j = 0; j < data_size; ++j){
+            data[i][j] = (char)(i * 17 + j);
+        }
+        chunks[i][0] = data[i];
+        wbs[i].flags = 0;
+        wbs[i].chunks = chunks[i];
+        wbs[i].size = data_size;
+        wbs[i].sync_strategy = i == 0 ? evr_sync_strategy_avoid : evr_sync_strategy_per_blob;
+        assert(is_ok(evr_calc_blob_ref(wbs[i].key, wbs[i].size, chunks[i])));
+        blobs[i] = &wbs[i];
+    }
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, clone_config(config))));
+    evr_time last_modified;
+    assert(is_ok(evr_glacier_append_blobs(write_ctx, blobs, 1, NULL, &last_modified)));
+    assert(is_ok(evr_glacier_append_blobs(write_ctx, &blobs[1], 2, NULL, &last_modified)));
+    free_glacier_ctx(write_ctx);
+    // the preallocated space must not show up as bucket content
+    {
+        char bucket_path[strlen(config->bucket_dir_path) + 20];
+        assert(snprintf(bucket_path, sizeof(bucket_path), "%s/00001.evb", config->bucket_dir_path) >= 0);
+        struct stat st;
+        assert(stat(bucket_path, &st) == 0);
+        assert((size_t)st.st_size == read_bucket_end_offset(config));
+    }
+    delete_glacier_index(config);
+    assert(is_ok(evr_quick_check_glacier(config)));
+    struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+    assert(read_ctx);
+    status_mock_ret = evr_ok;
+    status_mock_expected_exists = 1;
+    status_mock_expected_flags = 0;
+    status_mock_expected_blob_size = data_size;
+    for(size_t i = 0; i < blob_count; ++i){
+        struct dynamic_array *data_buffer = alloc_dynamic_array(128);
+        assert(data_buffer);
+        assert(is_ok(evr_glacier_read_blob(read_ctx, wbs[i].key, status_mock, store_into_dynamic_array, &data_buffer)));
+        assert(data_buffer->size_used == data_size);
+        assert(memcmp(data[i], data_buffer->data, data_size) == 0);
+        free(data_buffer);
+    }
+    assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+int capture_status(void *arg, int exists, int flags, size_t blob_size);
+
+void test_compressed_blobs(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    config->blob_compression = evr_blob_compression_deflate;
+    const size_t blob_count = 4;
+    struct chunk_set *data[blob_count];
+    // text spanning more than one chunk compresses well
+    data[0] = evr_allocate_chunk_set(2);
+    assert(data[0]);
+    data[0]->size_used = evr_chunk_size + evr_chunk_size / 2;
+    for(size_t i = 0; i < data[0]->size_used; ++i){
+        data[0]->chunks[i / evr_chunk_size][i % evr_chunk_size] = "everarch keeps blobs\n"[i % 21];
+    }
+    // random bytes don't compress
+    data[1] = evr_allocate_chunk_set(1);
+    assert(data[1]);
+    data[1]->size_used = 4096;
+    srand(42);
+    for(size_t i = 0; i < data[1]->size_used; ++i){
+        data[1]->chunks[0][i] = (char)rand();
+    }
+    // gzip files are left alone even if they look compressible
+    data[2] = evr_allocate_chunk_set(1);
+    assert(data[2]);
+    data[2]->size_used = 1024;
+    memset(data[2]->chunks[0], 'x', data[2]->size_used);
+    memcpy(data[2]->chunks[0], "\x1f\x8b", 2);
+    // small blobs are not worth the effort
+    data[3] = evr_allocate_chunk_set(1);
+    assert(data[3]);
+    data[3]->size_used = 16;
+    memset(data[3]->chunks[0], 'y', data[3]->size_used);
+    const int expect_deflated[] = { 1, 0, 0, 0 };
+    struct evr_writing_blob wbs[blob_count];
+    struct evr_writing_blob *blobs[blob_count];
+    for(size_t i = 0; i < blob_count; ++i){
+        wbs[i].flags = evr_blob_flag_claim;
+        wbs[i].chunks = data[i]->chunks;
+        wbs[i].size = data[i]->size_used;
+        wbs[i].sync_strategy = evr_sync_strategy_per_blob;
+        assert(is_ok(evr_calc_blob_ref(wbs[i].key, wbs[i].size, wbs[i].chunks)));
+        blobs[i] = &wbs[i];
+    }
+    struct evr_glacier_write_ctx *write_ctx;
+    assert(is_ok(evr_create_glacier_write_ctx(&write_ctx, config)));
+    evr_time last_modified;
+    assert(is_ok(evr_glacier_append_blobs(write_ctx, blobs, blob_count, NULL, &last_modified)));
+    for(size_t i = 0; i < blob_count; ++i){
+        assert(wbs[i].chunks == data[i]->chunks);
+        assert(wbs[i].size == data[i]->size_used);
+        assert(wbs[i].pos.size == data[i]->size_used);
+        assert(!!(wbs[i].pos.flags & evr_blob_flag_deflated) == expect_deflated[i]);
+    }
+    // the deflated blob must take less bucket space than the raw blob
+    assert(wbs[1].pos.offset - wbs[0].pos.offset < data[0]->size_used / 8);
+    assert(is_ok(evr_free_glacier_write_ctx(write_ctx)));
+    for(int round = 0; round < 2; ++round){
+        if(round == 1){
+            log_info("Reindex glacier with compressed blobs");
+            delete_glacier_index(config);
+            assert(is_ok(evr_quick_check_glacier(config)));
+        }
+        struct evr_glacier_read_ctx *read_ctx = evr_create_glacier_read_ctx(config);
+        assert(read_ctx);
+        for(size_t i = 0; i < blob_count; ++i){
+            struct evr_glacier_blob_stat stat;
+            assert(is_ok(evr_glacier_stat_blob(read_ctx, wbs[i].key, &stat)));
+            assert(stat.flags == evr_blob_flag_claim);
+            assert(stat.blob_size == data[i]->size_used);
+            struct dynamic_array *data_buffer = alloc_dynamic_array(128);
+            assert(data_buffer);
+            status_mock_ret = evr_ok;
+            status_mock_expected_exists = 1;
+            status_mock_expected_flags = evr_blob_flag_claim;
+            status_mock_expected_blob_size = data[i]->size_used;
+            assert(is_ok(evr_glacier_read_blob(read_ctx, wbs[i].key, status_mock, store_into_dynamic_array, &data_buffer)));
+            assert(data_buffer->size_used == data[i]->size_used);
+            for(size_t c = 0; c * evr_chunk_size < data[i]->size_used; ++c){
+                const size_t off = c * evr_chunk_size;
+                assert(memcmp(data[i]->chunks[c], &data_buffer->data[off], min(evr_chunk_size, data[i]->size_used - off)) == 0);
+            }
+            free(data_buffer);
+        }
+        assert(is_ok(evr_free_glacier_read_ctx(read_ctx)));
+    }
+    {
+        struct evr_bucket_fd_cache *cache = evr_create_bucket_fd_cache(config, 1);
+        assert(cache);
+        int p[2];
+        assert(pipe(p) == 0);
+        struct evr_file dest;
+        evr_file_bind_fd(&dest, p[1]);
+        char buf[4096];
+        log_info("Send range across a chunk boundary of a deflated blob");
+        const size_t range_offset = evr_chunk_size - 10;
+        status_mock_expected_flags = evr_blob_flag_claim;
+        status_mock_expected_blob_size = data[0]->size_used;
+        assert(is_ok(evr_glacier_send_blob_range_at(cache, &wbs[0].pos, range_offset, 20, &dest, status_mock, NULL)));
+        assert(read(p[0], buf, sizeof(buf)) == 20);
+        for(size_t i = 0; i < 20; ++i){
+            assert(buf[i] == "everarch keeps blobs\n"[(range_offset + i) % 21]);
+        }
+        assert(is_err(evr_glacier_send_blob_range_at(cache, &wbs[0].pos, data[0]->size_used - 10, 11, &dest, status_mock, NULL)));
+        log_info("Send the stored deflated blob");
+        struct evr_glacier_blob_stat stored;
+        assert(is_ok(evr_glacier_send_stored_blob_at(cache, &wbs[0].pos, &dest, capture_status, &stored)));
+        assert(stored.flags == (evr_blob_flag_claim | evr_blob_flag_deflated));
+        assert(stored.blob_size < sizeof(buf));
+        assert(read(p[0], buf, sizeof(buf)) == (ssize_t)stored.blob_size);
+        char raw[evr_chunk_size];
+        uLongf raw_size = sizeof(raw);
+        // a chunk sized buffer proves the stream inflates to more than
+        // a chunk
+        assert(uncompress((Bytef*)raw, &raw_size, (Bytef*)buf, stored.blob_size) == Z_BUF_ERROR);
+        assert(memcmp(raw, data[0]->chunks[0], sizeof(raw)) == 0);
+        log_info("Send the stored raw blob");
+        assert(is_ok(evr_glacier_send_stored_blob_at(cache, &wbs[3].pos, &dest, capture_status, &stored)));
+        assert(stored.flags == evr_blob_flag_claim);
+        assert(stored.blob_size == data[3]->size_used);
+        assert(read(p[0], buf, sizeof(buf)) == (ssize_t)data[3]->size_used);
+        assert(memcmp(buf, data[3]->chunks[0], data[3]->size_used) == 0);
+        assert(close(p[0]) == 0);
+        assert(dest.close(&dest) == 0);
+        assert(is_ok(evr_free_bucket_fd_cache(cache)));
+    }
+    for(size_t i = 0; i < blob_count; ++i){
+        evr_free_chunk_set(data[i]);
+    }
+    evr_free_glacier_storage_cfg(config);
+}
+
+int capture_status(void *arg, int exists, int flags, size_t blob_size){
+    struct evr_glacier_blob_stat *stat = arg;
+    assert(exists);
+    stat->flags = flags;
+    stat->blob_size = blob_size;
+    return evr_ok;
+}
+
+void test_read_ctx_pool(void){
+    struct evr_glacier_storage_cfg *config = create_temp_evr_glacier_storage_cfg();
+    evr_blob_ref ref;
+    evr_blob_ref second;
+    build_test_glacier(config, ref, second);
+    struct evr_glacier_read_ctx_pool *pool = evr_create_glacier_read_ctx_pool(config, 2, 4);
+    assert(pool);
+    assert(pool->ctxs_created == 0);
+    struct evr_glacier_read_ctx *c1 = evr_glacier_checkout_read_ctx(pool);
+    assert(c1);
+    assert(c1->read_buffer_size == 4);
+    struct evr_glacier_read_ctx *c2 = evr_glacier_checkout_read_ctx(pool);
+    assert(c2);
+    assert(c1 != c2);
+    assert(pool->ctxs_created == 2);
+    struct evr_glacier_blob_stat stat;
+    assert(is_ok(evr_glacier_stat_blob(c2, ref, &stat)));
+    assert(stat.blob_size == strlen(first_blob_data_str));
+    struct dynamic_array *data_buffer = alloc_dynamic_array(128);
+    assert(data_buffer);
+    status_mock_ret = evr_ok;
+    status_mock_expected_exists = 1;
+    status_mock_expected_flags = 0;
+    status_mock_expected_blob_size = strlen(first_blob_data_str);
+    assert(is_ok(evr_glacier_read_blob(c1, ref, status_mock, store_into_dynamic_array, &data_buffer)));
+    assert(data_buffer->size_used == strlen(first_blob_data_str));
+    assert(memcmp(first_blob_data_str, data_buffer->data, data_buffer->size_used) == 0);
+    free(data_buffer);
+    assert(is_ok(evr_glacier_return_read_ctx(pool, c2)));
+    struct evr_glacier_read_ctx *c3 = evr_glacier_checkout_read_ctx(pool);
+    assert(c3 == c2);
+    assert(pool->ctxs_created == 2);
+    assert(is_ok(evr_glacier_return_read_ctx(pool, c3)));
+    assert(is_ok(evr_glacier_return_read_ctx(pool, c1)));
+    assert(is_ok(evr_free_glacier_read_ctx_pool(pool)));
+    evr_free_glacier_storage_cfg(config);
+}
+
+int visit_blob_position(void *ctx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos){
+    struct walk_positions_ctx *wctx = ctx;
+    for(size_t i = 0; i < wctx->blobs_len; ++i){
+        struct evr_writing_blob *b = &wctx->blobs[i];
+        if(evr_cmp_blob_ref(b->key, key) != 0){
+            continue;
+        }
+        assert(b->pos.bucket_index == pos->bucket_index);
+        assert(b->pos.offset == pos->offset);
+        assert(b->pos.size == pos->size);
+        wctx->visited += 1;
+        return evr_ok;
+    }
+    fail();
+    return evr_error;
+}
+
 void corrupt_bucket_at_offset(struct evr_glacier_storage_cfg *config, size_t offset){
     const size_t bucket_dir_path_len = strlen(config->bucket_dir_path);
     const char bucket_file_name[] = "/00001.evb";
@@ -622,6 +1748,16 @@ void delete_glacier_index(struct evr_glacier_storage_cfg *config){
     assert(unlink(index_db_path) == 0);
 }
 
+void exec_index_db_sql(struct evr_glacier_storage_cfg *config, const char *sql){
+    const size_t path_size = strlen(config->bucket_dir_path) + 30;
+    char index_db_path[path_size];
+    assert(snprintf(index_db_path, path_size, "%s/index.db", config->bucket_dir_path) >= 0);
+    sqlite3 *db;
+    assert(sqlite3_open(index_db_path, &db) == SQLITE_OK);
+    assert(sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK);
+    assert(sqlite3_close(db) == SQLITE_OK);
+}
+
 void write_one_blob(struct evr_glacier_write_ctx *ctx, evr_blob_ref ref, char *blob_str, int last_modified){
     char *chunks[] = {
         blob_str,
@@ -648,11 +1784,27 @@ int main(void){
     run_test(test_evr_free_glacier_write_ctx_with_null_ctx);
     run_test(test_open_bucket_with_extra_data_at_end);
     run_test(test_reindex_glacier);
+    run_test(test_reindex_glacier_in_parallel);
+    run_test(test_reindex_glacier_with_spilled_runs);
     run_test(test_reindex_glacier_first_blob_header_corrupt);
     run_test(test_reindex_glacier_first_blob_data_corrupt);
     run_test(test_reindex_glacier_second_blob_header_corrupt);
     run_test(test_reindex_glacier_end_offset_corrupt);
     run_test(test_reindex_and_append_glacier_with_corrupt_bucket_end);
     run_test(test_many_small_buckets);
+    run_test(test_reindex_sealed_buckets);
+    run_test(test_migrate_index_db_v1);
+    run_test(test_check_sampled_blobs);
+    run_test(test_append_blobs_batch);
+    run_test(test_append_blobs_batch_with_oversized_blob);
+    run_test(test_append_blobs_to_lanes);
+    run_test(test_stream_blobs);
+    run_test(test_striped_buckets_round_robin);
+    run_test(test_striped_buckets_free_space);
+    run_test(test_read_ctx_pool);
+    run_test(test_compressed_blobs);
+    run_test(test_bucket_io_backends);
+    run_test(test_bucket_preallocation_and_uncached_appends);
+    run_test(test_list_blobs_in_pages);
     return 0;
 }
@@ -24,11 +24,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <time.h>
 #include <limits.h>
+#include <zlib.h>
 
 #include "errors.h"
 #include "logger.h"
@@ -50,8 +55,22 @@ const size_t evr_max_chunks_per_blob = evr_max_blob_data_size / evr_chunk_size +
 const char *glacier_dir_lock_file_path = "/lock";
 const size_t evr_read_buffer_size = 1*1024*1024;
 #define evr_bucket_file_ext "evb"
+#define evr_bucket_seal_file_ext "evs"
 #define evr_bucket_file_name_fmt "%05lx." evr_bucket_file_ext
 
+/**
+ * evr_deflate_min_size is the minimal blob size in bytes for which
+ * compression is tried. Smaller blobs don't win enough to pay for the
+ * zlib stream's overhead.
+ */
+#define evr_deflate_min_size 128
+
+/**
+ * evr_inflate_buffer_size is the size of the stack buffers used while
+ * inflating blobs.
+ */
+#define evr_inflate_buffer_size (16*1024)
+
 void build_glacier_file_path(char *glacier_file_path, size_t glacier_file_path_size, const char *bucket_dir_path, const char* path_suffix);
 
 int evr_open_index_db(struct evr_glacier_storage_cfg *config, int sqliteFlags, sqlite3 **db);
@@ -60,23 +79,92 @@ int evr_close_index_db(struct evr_glacier_storage_cfg *config, sqlite3 *db);
 
 int evr_create_index_db(struct evr_glacier_write_ctx *ctx);
 
+/**
+ * evr_migrate_index_db_v2_worker copies the version 1 blob_position
+ * rows into blob_position_v2 and swaps the tables. The swapped out
+ * version 1 table is deleted afterwards.
+ *
+ * Every batch is a transaction of its own and holds the write ctx's
+ * index_lock. Appends wait for at most one batch and the WAL stays
+ * small. An interrupted migration continues after the last copied
+ * key on the next start.
+ */
+int evr_migrate_index_db_v2_worker(void *arg);
+
+/**
+ * evr_stop_index_db_migration stops a background migration of the
+ * index db and waits for it.
+ */
+void evr_stop_index_db_migration(struct evr_glacier_write_ctx *ctx);
+
+void evr_glacier_lock_index(struct evr_glacier_write_ctx *ctx);
+
+void evr_glacier_unlock_index(struct evr_glacier_write_ctx *ctx);
+
 int move_to_last_bucket(struct evr_glacier_write_ctx *ctx);
 
-int open_current_bucket(struct evr_glacier_write_ctx *ctx, int create);
+int open_current_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, int create);
+
+/**
+ * evr_continue_lane_bucket makes the existing bucket with index
+ * bucket_index the lane's current bucket. A new bucket is created
+ * instead if the existing bucket's end is marked corrupt.
+ */
+int evr_continue_lane_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, unsigned long bucket_index);
+
+/**
+ * evr_glacier_bucket_dirs_len returns the number of directories
+ * which hold buckets.
+ */
+size_t evr_glacier_bucket_dirs_len(const struct evr_glacier_storage_cfg *config);
+
+/**
+ * evr_glacier_bucket_dir returns the bucket directory with index
+ * dir_index. Index 0 is always config->bucket_dir_path. The stripe
+ * directories follow.
+ */
+const char *evr_glacier_bucket_dir(const struct evr_glacier_storage_cfg *config, size_t dir_index);
+
+/**
+ * evr_glacier_place_bucket chooses the bucket directory in which the
+ * new bucket with index bucket_index is created according to
+ * config->bucket_dir_policy.
+ */
+int evr_glacier_place_bucket(const struct evr_glacier_storage_cfg *config, unsigned long bucket_index, size_t *dir_index);
+
+int evr_open_bucket_in_dir(const char *bucket_dir_path, unsigned long bucket_index, int open_flags);
 
 int evr_open_bucket(const struct evr_glacier_storage_cfg *config, unsigned long bucket_index, int open_flags);
 
-int create_next_bucket(struct evr_glacier_write_ctx *ctx);
+int create_next_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane);
+
+/**
+ * evr_glacier_preallocate_bucket reserves max_bucket_size bytes on
+ * disk for the lane's current bucket.
+ */
+void evr_glacier_preallocate_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane);
+
+/**
+ * evr_glacier_drop_appended_pages writes the appended range back to
+ * disk if it was not synced already and drops it from the page
+ * cache.
+ */
+int evr_glacier_drop_appended_pages(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, off_t offset, size_t size, int synced);
 
-int close_current_bucket(struct evr_glacier_write_ctx *ctx);
+int close_current_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane);
 
 struct evr_glacier_read_ctx *evr_create_glacier_read_ctx(struct evr_glacier_storage_cfg *config){
-    struct evr_glacier_read_ctx *ctx = (struct evr_glacier_read_ctx*)malloc(sizeof(struct evr_glacier_read_ctx) + evr_read_buffer_size);
+    return evr_create_sized_glacier_read_ctx(config, evr_read_buffer_size);
+}
+
+struct evr_glacier_read_ctx *evr_create_sized_glacier_read_ctx(struct evr_glacier_storage_cfg *config, size_t read_buffer_size){
+    struct evr_glacier_read_ctx *ctx = (struct evr_glacier_read_ctx*)malloc(sizeof(struct evr_glacier_read_ctx) + read_buffer_size);
     if(!ctx){
         goto fail;
     }
     ctx->config = config;
     ctx->read_buffer = (char*)(ctx + 1);
+    ctx->read_buffer_size = read_buffer_size;
     ctx->db = NULL;
     ctx->find_blob_stmt = NULL;
     ctx->list_blobs_stmt_order_last_modified = NULL;
@@ -87,10 +175,10 @@ struct evr_glacier_read_ctx *evr_create_glacier_read_ctx(struct evr_glacier_stor
     if(evr_prepare_stmt(ctx->db, "select flags, bucket_index, bucket_blob_offset, blob_size from blob_position where key = ?", &(ctx->find_blob_stmt))){
         goto fail_with_db;
     }
-    if(evr_prepare_stmt(ctx->db, "select key, flags, last_modified from blob_position where last_modified >= ? order by last_modified", &(ctx->list_blobs_stmt_order_last_modified))){
+    if(evr_prepare_stmt(ctx->db, "select key, flags, last_modified from blob_position where (last_modified, key) > (?1, ?2) and (flags & ?3) = ?3 order by last_modified, key limit ?4", &(ctx->list_blobs_stmt_order_last_modified))){
         goto fail_with_db;
     }
-    if(evr_prepare_stmt(ctx->db, "select key, flags, last_modified from blob_position where last_modified >= ? order by key", &(ctx->list_blobs_stmt_order_blob_ref))){
+    if(evr_prepare_stmt(ctx->db, "select key, flags, last_modified from blob_position where key > ?2 and last_modified >= ?1 and (flags & ?3) = ?3 order by key limit ?4", &(ctx->list_blobs_stmt_order_blob_ref))){
         goto fail_with_db;
     }
     return ctx;
@@ -130,6 +218,109 @@ int evr_free_glacier_read_ctx(struct evr_glacier_read_ctx *ctx){
     return ret;
 }
 
+struct evr_glacier_read_ctx_pool *evr_create_glacier_read_ctx_pool(struct evr_glacier_storage_cfg *config, size_t ctxs_len, size_t read_buffer_size){
+    char *buf = malloc(sizeof(struct evr_glacier_read_ctx_pool) + ctxs_len * sizeof(struct evr_glacier_read_ctx*));
+    if(!buf){
+        goto out;
+    }
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    struct evr_glacier_read_ctx_pool *pool;
+    evr_map_struct(&bp, pool);
+    if(mtx_init(&pool->lock, mtx_plain) != thrd_success){
+        goto out_with_free_buf;
+    }
+    if(cnd_init(&pool->ctx_returned) != thrd_success){
+        goto out_with_destroy_lock;
+    }
+    pool->config = config;
+    pool->read_buffer_size = read_buffer_size;
+    pool->ctxs_len = ctxs_len;
+    pool->ctxs_created = 0;
+    pool->idle_ctxs_len = 0;
+    pool->idle_ctxs = (struct evr_glacier_read_ctx**)bp.pos;
+    return pool;
+ out_with_destroy_lock:
+    mtx_destroy(&pool->lock);
+ out_with_free_buf:
+    free(buf);
+ out:
+    return NULL;
+}
+
+int evr_free_glacier_read_ctx_pool(struct evr_glacier_read_ctx_pool *pool){
+    if(!pool){
+        return evr_ok;
+    }
+    int ret = evr_ok;
+    if(pool->idle_ctxs_len != pool->ctxs_created){
+        evr_panic("Read ctx pool is freed while %zu read contexts are still checked out", pool->ctxs_created - pool->idle_ctxs_len);
+        ret = evr_error;
+    }
+    struct evr_glacier_read_ctx **end = &pool->idle_ctxs[pool->idle_ctxs_len];
+    for(struct evr_glacier_read_ctx **it = pool->idle_ctxs; it != end; ++it){
+        if(evr_free_glacier_read_ctx(*it) != evr_ok){
+            ret = evr_error;
+        }
+    }
+    cnd_destroy(&pool->ctx_returned);
+    mtx_destroy(&pool->lock);
+    free(pool);
+    return ret;
+}
+
+struct evr_glacier_read_ctx *evr_glacier_checkout_read_ctx(struct evr_glacier_read_ctx_pool *pool){
+    struct evr_glacier_read_ctx *ctx = NULL;
+    if(mtx_lock(&pool->lock) != thrd_success){
+        evr_panic("Unable to lock read ctx pool");
+        return NULL;
+    }
+    while(pool->idle_ctxs_len == 0 && pool->ctxs_created == pool->ctxs_len){
+        if(cnd_wait(&pool->ctx_returned, &pool->lock) != thrd_success){
+            goto out_with_unlock;
+        }
+    }
+    if(pool->idle_ctxs_len > 0){
+        pool->idle_ctxs_len -= 1;
+        ctx = pool->idle_ctxs[pool->idle_ctxs_len];
+        goto out_with_unlock;
+    }
+    // the read ctx is created while the pool is locked. this
+    // serializes the creation of read contexts which only happens
+    // ctxs_len times during the pool's lifetime.
+    ctx = evr_create_sized_glacier_read_ctx(pool->config, pool->read_buffer_size);
+    if(ctx){
+        pool->ctxs_created += 1;
+    }
+ out_with_unlock:
+    if(mtx_unlock(&pool->lock) != thrd_success){
+        evr_panic("Unable to unlock read ctx pool");
+        return NULL;
+    }
+    return ctx;
+}
+
+int evr_glacier_return_read_ctx(struct evr_glacier_read_ctx_pool *pool, struct evr_glacier_read_ctx *ctx){
+    int ret = evr_error;
+    if(mtx_lock(&pool->lock) != thrd_success){
+        evr_panic("Unable to lock read ctx pool");
+        goto out;
+    }
+    pool->idle_ctxs[pool->idle_ctxs_len] = ctx;
+    pool->idle_ctxs_len += 1;
+    if(cnd_signal(&pool->ctx_returned) != thrd_success){
+        goto out_with_unlock;
+    }
+    ret = evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&pool->lock) != thrd_success){
+        evr_panic("Unable to unlock read ctx pool");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
 int evr_glacier_stat_blob(struct evr_glacier_read_ctx *ctx, const evr_blob_ref key, struct evr_glacier_blob_stat *stat){
     int ret = evr_error;
     if(sqlite3_bind_blob(ctx->find_blob_stmt, 1, key, evr_blob_ref_size, SQLITE_TRANSIENT) != SQLITE_OK){
@@ -143,7 +334,7 @@ int evr_glacier_stat_blob(struct evr_glacier_read_ctx *ctx, const evr_blob_ref k
     if(step_result != SQLITE_ROW){
         goto end_with_find_reset;
     }
-    stat->flags = sqlite3_column_int(ctx->find_blob_stmt, 0);
+    stat->flags = evr_blob_public_flags(sqlite3_column_int(ctx->find_blob_stmt, 0));
     stat->blob_size = sqlite3_column_int(ctx->find_blob_stmt, 3);
     ret = evr_ok;
  end_with_find_reset:
@@ -156,6 +347,31 @@ int evr_glacier_stat_blob(struct evr_glacier_read_ctx *ctx, const evr_blob_ref k
 int evr_validate_bucket_magic_number(int f);
 int evr_write_bucket_magic_number(int f);
 
+/**
+ * evr_glacier_pipe_blob passes the blob at pos within bucket_f to
+ * status and on_data. bucket_f is read using pread so it can be
+ * shared between threads. io may be NULL.
+ */
+int evr_glacier_pipe_blob(int bucket_f, const struct evr_glacier_blob_pos *pos, char *read_buffer, size_t read_buffer_size, int (*status)(void *arg, int exists, int flags, size_t blob_size), int (*on_data)(void *arg, const char *data, size_t data_size), void *arg);
+
+/**
+ * evr_glacier_inflate_blob inflates the zlib stream of stored_size
+ * bytes which starts at offset within bucket_f and passes the
+ * inflated data to on_data. in_buf is used to pread the stream from
+ * bucket_f. No bytes behind the stream are read.
+ *
+ * on_data may return evr_end to stop inflating early. In that case
+ * evr_end is returned. raw_size is set to the number of inflated
+ * bytes if it is not NULL.
+ */
+int evr_glacier_inflate_blob(int bucket_f, size_t offset, size_t stored_size, char *in_buf, size_t in_buf_size, int (*on_data)(void *arg, const char *data, size_t data_size), void *arg, size_t *raw_size);
+
+/**
+ * evr_glacier_read_stored_size reads the number of bytes the blob at
+ * pos occupies within bucket_f from the blob's header.
+ */
+int evr_glacier_read_stored_size(int bucket_f, const struct evr_glacier_blob_pos *pos, size_t *stored_size);
+
 int evr_glacier_read_blob(struct evr_glacier_read_ctx *ctx, const evr_blob_ref key, int (*status)(void *arg, int exists, int flags, size_t blob_size), int (*on_data)(void *arg, const char *data, size_t data_size), void *arg){
     int ret = evr_error;
     if(sqlite3_bind_blob(ctx->find_blob_stmt, 1, key, evr_blob_ref_size, SQLITE_TRANSIENT) != SQLITE_OK){
@@ -175,231 +391,898 @@ int evr_glacier_read_blob(struct evr_glacier_read_ctx *ctx, const evr_blob_ref k
     if(step_result != SQLITE_ROW){
         goto end_with_find_reset;
     }
-    int flags = sqlite3_column_int(ctx->find_blob_stmt, 0);
-    unsigned long bucket_index = sqlite3_column_int64(ctx->find_blob_stmt, 1);
-    size_t bucket_blob_offset = sqlite3_column_int(ctx->find_blob_stmt, 2);
-    size_t blob_size = sqlite3_column_int(ctx->find_blob_stmt, 3);
-    int bucket_f = evr_open_bucket(ctx->config, bucket_index, O_RDONLY);
+    struct evr_glacier_blob_pos pos;
+    pos.flags = sqlite3_column_int(ctx->find_blob_stmt, 0);
+    pos.bucket_index = sqlite3_column_int64(ctx->find_blob_stmt, 1);
+    pos.offset = sqlite3_column_int(ctx->find_blob_stmt, 2);
+    pos.size = sqlite3_column_int(ctx->find_blob_stmt, 3);
+    int bucket_f = evr_open_bucket(ctx->config, pos.bucket_index, O_RDONLY);
     if(bucket_f == -1){
         goto end_with_find_reset;
     }
     if(evr_validate_bucket_magic_number(bucket_f) != evr_ok){
         goto end_with_open_bucket;
     }
-    if(lseek(bucket_f, bucket_blob_offset, SEEK_SET) == -1){
-        goto end_with_open_bucket;
+    ret = evr_glacier_pipe_blob(bucket_f, &pos, ctx->read_buffer, ctx->read_buffer_size, status, on_data, arg);
+ end_with_open_bucket:
+    if(close(bucket_f)){
+        ret = evr_error;
+    }
+ end_with_find_reset:
+    if(sqlite3_reset(ctx->find_blob_stmt) != SQLITE_OK){
+        ret = evr_error;
     }
-    int status_res = status(arg, 1, flags, blob_size);
+    return ret;
+}
+
+int evr_glacier_pipe_blob(int bucket_f, const struct evr_glacier_blob_pos *pos, char *read_buffer, size_t read_buffer_size, int (*status)(void *arg, int exists, int flags, size_t blob_size), int (*on_data)(void *arg, const char *data, size_t data_size), void *arg){
+    int status_res = status(arg, 1, evr_blob_public_flags(pos->flags), pos->size);
     if(status_res == evr_end){
-        ret = evr_end;
-        goto end_with_open_bucket;
+        return evr_end;
     } else if(status_res != evr_ok){
-        ret = evr_error;
-        goto end_with_open_bucket;
+        return evr_error;
     }
-    for(size_t bytes_read = 0; bytes_read < blob_size;){
-        ssize_t buffer_bytes_read = read(bucket_f, ctx->read_buffer, min(evr_read_buffer_size, blob_size - bytes_read));
-        if(buffer_bytes_read == -1){
-            goto end_with_open_bucket;
+    if(pos->flags & evr_blob_flag_deflated){
+        size_t stored_size;
+        if(evr_glacier_read_stored_size(bucket_f, pos, &stored_size) != evr_ok){
+            return evr_error;
+        }
+        size_t raw_size;
+        if(evr_glacier_inflate_blob(bucket_f, pos->offset, stored_size, read_buffer, read_buffer_size, on_data, arg, &raw_size) != evr_ok){
+            return evr_error;
         }
-        if(on_data(arg, ctx->read_buffer, buffer_bytes_read)){
-            goto end_with_open_bucket;
+        if(raw_size != pos->size){
+            log_error("Inflated blob in bucket " evr_bucket_file_name_fmt " at offset %zu has %zu bytes instead of %zu", pos->bucket_index, pos->offset, raw_size, pos->size);
+            return evr_error;
         }
-        bytes_read += buffer_bytes_read;
+        return evr_ok;
     }
-    ret = evr_ok;
- end_with_open_bucket:
-    if(close(bucket_f)){
-        ret = evr_error;
+    return evr_bucket_io_read(bucket_f, pos->offset, pos->size, read_buffer, read_buffer_size, on_data, arg);
+}
+
+int evr_glacier_read_blob_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, char *read_buffer, size_t read_buffer_size, int (*status)(void *arg, int exists, int flags, size_t blob_size), int (*on_data)(void *arg, const char *data, size_t data_size), void *arg){
+    int ret = evr_error;
+    int bucket_f = evr_bucket_fd_cache_acquire(cache, pos->bucket_index);
+    if(bucket_f < 0){
+        goto out;
     }
- end_with_find_reset:
-    if(sqlite3_reset(ctx->find_blob_stmt) != SQLITE_OK){
+    ret = evr_glacier_pipe_blob(bucket_f, pos, read_buffer, read_buffer_size, status, on_data, arg);
+    if(evr_bucket_fd_cache_release(cache, pos->bucket_index, bucket_f) != evr_ok){
         ret = evr_error;
     }
+ out:
     return ret;
 }
 
-int evr_glacier_list_blobs(struct evr_glacier_read_ctx *ctx, int (*visit)(void *vctx, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob), struct evr_blob_filter *filter, void *vctx){
+/**
+ * evr_glacier_send_inflated_range inflates the deflated blob at pos
+ * and writes the range's bytes into dest.
+ */
+int evr_glacier_send_inflated_range(int bucket_f, const struct evr_glacier_blob_pos *pos, size_t range_offset, size_t range_size, struct evr_file *dest);
+
+int evr_glacier_send_blob_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, struct evr_file *dest, int (*status)(void *arg, int exists, int flags, size_t blob_size), void *arg){
+    return evr_glacier_send_blob_range_at(cache, pos, 0, pos->size, dest, status, arg);
+}
+
+int evr_glacier_send_blob_range_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, size_t range_offset, size_t range_size, struct evr_file *dest, int (*status)(void *arg, int exists, int flags, size_t blob_size), void *arg){
     int ret = evr_error;
-    if(filter->last_modified_after > LLONG_MAX){
-        // sqlite3 api only provides bind for signed int64. so we must
-        // make sure that value does not overflow.
+    if(range_offset > pos->size || range_size > pos->size - range_offset){
+        log_error("Range %zu+%zu exceeds blob with size %zu", range_offset, range_size, pos->size);
         goto out;
     }
-    sqlite3_stmt *list_stmt;
-    switch(filter->sort_order){
-    default:
-        log_error("Unknown sort-order 0x%02x requested", filter->sort_order);
+    int bucket_f = evr_bucket_fd_cache_acquire(cache, pos->bucket_index);
+    if(bucket_f < 0){
         goto out;
-    case evr_cmd_watch_sort_order_last_modified:
-        list_stmt = ctx->list_blobs_stmt_order_last_modified;
-        break;
-    case evr_cmd_watch_sort_order_ref:
-        list_stmt = ctx->list_blobs_stmt_order_blob_ref;
-        break;
     }
-    if(sqlite3_bind_int64(list_stmt, 1, filter->last_modified_after) != SQLITE_OK){
-        goto out_with_reset_stmt;
+    int status_res = status(arg, 1, evr_blob_public_flags(pos->flags), pos->size);
+    if(status_res == evr_end){
+        ret = evr_end;
+        goto out_with_release_bucket_f;
+    } else if(status_res != evr_ok){
+        goto out_with_release_bucket_f;
     }
-    int has_found_key = 0;
-    evr_blob_ref found_key;
-    int flags;
-    evr_time last_modified;
-    while(1){
-        int step_ret = evr_step_stmt(ctx->db, list_stmt);
-        if(step_ret == SQLITE_DONE){
-            if(has_found_key){
-                if(visit(vctx, found_key, flags, last_modified, 1) != evr_ok){
-                    goto out_with_reset_stmt;
-                }
-            }
-            break;
-        }
-        if(step_ret != SQLITE_ROW){
-            goto out;
-        }
-        int new_flags = sqlite3_column_int(list_stmt, 1);
-        if((new_flags & filter->flags_filter) != filter->flags_filter){
-            continue;
-        }
-        if(has_found_key){
-            if(visit(vctx, found_key, flags, last_modified, 0) != evr_ok){
-                goto out_with_reset_stmt;
-            }
-        }
-        int key_col_size = sqlite3_column_bytes(list_stmt, 0);
-        if(key_col_size != evr_blob_ref_size){
-            goto out_with_reset_stmt;
-        }
-        has_found_key = 1;
-        flags = new_flags;
-        const void *sqkey = sqlite3_column_blob(list_stmt, 0);
-        memcpy(found_key, sqkey, evr_blob_ref_size);
-        last_modified = sqlite3_column_int64(list_stmt, 2);
+    if(pos->flags & evr_blob_flag_deflated){
+        ret = evr_glacier_send_inflated_range(bucket_f, pos, range_offset, range_size, dest);
+        goto out_with_release_bucket_f;
     }
-    ret = evr_ok;
- out_with_reset_stmt:
-    if(sqlite3_reset(list_stmt) != SQLITE_OK){
-        evr_panic("Unable to reset list_stmt for sort-order 0x%02x", filter->sort_order);
+    ret = sendfile_n(dest, bucket_f, pos->offset + range_offset, range_size);
+ out_with_release_bucket_f:
+    if(evr_bucket_fd_cache_release(cache, pos->bucket_index, bucket_f) != evr_ok){
         ret = evr_error;
     }
  out:
     return ret;
 }
 
-int evr_read_bucket_end_offset(int f, size_t *end_offset);
-int evr_write_bucket_end_offset(int f, size_t end_offset, int sync);
+/**
+ * struct evr_glacier_range_sink writes the part of the inflated data
+ * which belongs to a range into dest.
+ */
+struct evr_glacier_range_sink {
+    struct evr_file *dest;
+    size_t skip;
+    size_t remaining;
+    int write_res;
+};
 
-int evr_create_glacier_write_ctx(struct evr_glacier_write_ctx **context, struct evr_glacier_storage_cfg *config){
-    int ret = evr_error;
-    if(!config){
-        goto fail;
+int evr_glacier_write_range(void *arg, const char *data, size_t data_size){
+    struct evr_glacier_range_sink *sink = arg;
+    if(data_size <= sink->skip){
+        sink->skip -= data_size;
+        return evr_ok;
     }
-    struct evr_glacier_write_ctx *ctx = malloc(sizeof(struct evr_glacier_write_ctx));
-    if(!ctx){
-        goto fail;
+    data += sink->skip;
+    data_size -= sink->skip;
+    sink->skip = 0;
+    const size_t write_size = min(data_size, sink->remaining);
+    sink->write_res = write_n(sink->dest, data, write_size);
+    if(sink->write_res != evr_ok){
+        return evr_error;
     }
-    ctx->config = config;
-    ctx->current_bucket_index = 0;
-    ctx->current_bucket_f = -1;
-    ctx->current_bucket_pos = 0;
-    ctx->current_bucket_sync = 1;
-    ctx->db = NULL;
-    ctx->insert_blob_stmt = NULL;
-    ctx->insert_bucket_stmt = NULL;
-    ctx->update_bucket_end_offset_stmt = NULL;
-    ctx->find_bucket_end_offset_stmt = NULL;
-    {
-        // this block trims trailing '/' from bucket_dir_path
-        size_t len = strlen(config->bucket_dir_path);
-        char *end = &(config->bucket_dir_path[len - 1]);
-        for(; end >= config->bucket_dir_path; end--){
-            if(*end != '/'){
-                *(end+1) = '\0';
-                break;
-            }
-        }
+    sink->remaining -= write_size;
+    return sink->remaining == 0 ? evr_end : evr_ok;
+}
+
+int evr_glacier_send_inflated_range(int bucket_f, const struct evr_glacier_blob_pos *pos, size_t range_offset, size_t range_size, struct evr_file *dest){
+    if(range_size == 0){
+        return evr_ok;
     }
-    // TODO :bdircre: build bucket dir if not existing
-    size_t glacier_file_path_max_size = strlen(config->bucket_dir_path) + 10;
-    char *glacier_file_path = alloca(glacier_file_path_max_size);
-    {
-        // aquire lock file
-        build_glacier_file_path(glacier_file_path, glacier_file_path_max_size, config->bucket_dir_path, glacier_dir_lock_file_path);
-        if(glacier_file_path[0] == '\0'){
-            goto fail_free;
-        }
-        if(evr_acquire_process_lock(&ctx->lock_fd, glacier_file_path) != evr_ok){
-            goto fail_free;
-        }
+    size_t stored_size;
+    if(evr_glacier_read_stored_size(bucket_f, pos, &stored_size) != evr_ok){
+        return evr_error;
     }
-    if(evr_open_index_db(config, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &(ctx->db))){
-        ret = evr_glacier_index_db_corrupt;
-        goto fail_with_db;
+    char in_buf[evr_inflate_buffer_size];
+    struct evr_glacier_range_sink sink;
+    sink.dest = dest;
+    sink.skip = range_offset;
+    sink.remaining = range_size;
+    sink.write_res = evr_ok;
+    int inflate_res = evr_glacier_inflate_blob(bucket_f, pos->offset, stored_size, in_buf, sizeof(in_buf), evr_glacier_write_range, &sink, NULL);
+    if(sink.write_res != evr_ok){
+        return sink.write_res;
+    }
+    if(inflate_res == evr_error || sink.remaining != 0){
+        return evr_error;
     }
-    if(evr_create_index_db(ctx)){
-        goto fail_with_db;
+    return evr_ok;
+}
+
+int evr_glacier_send_stored_blob_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, struct evr_file *dest, int (*status)(void *arg, int exists, int flags, size_t blob_size), void *arg){
+    int ret = evr_error;
+    int bucket_f = evr_bucket_fd_cache_acquire(cache, pos->bucket_index);
+    if(bucket_f < 0){
+        goto out;
     }
-    if(evr_prepare_stmt(ctx->db, "insert into blob_position (key, flags, bucket_index, bucket_blob_offset, blob_size, last_modified) values (?, ?, ?, ?, ?, ?)", &ctx->insert_blob_stmt) != evr_ok){
-        goto fail_with_db;
+    size_t stored_size = pos->size;
+    if(pos->flags & evr_blob_flag_deflated){
+        if(evr_glacier_read_stored_size(bucket_f, pos, &stored_size) != evr_ok){
+            goto out_with_release_bucket_f;
+        }
     }
-    if(evr_prepare_stmt(ctx->db, "insert into bucket (bucket_index) values (?)", &ctx->insert_bucket_stmt) != evr_ok){
-        goto fail_with_db;
+    int status_res = status(arg, 1, pos->flags, stored_size);
+    if(status_res == evr_end){
+        ret = evr_end;
+        goto out_with_release_bucket_f;
+    } else if(status_res != evr_ok){
+        goto out_with_release_bucket_f;
     }
-    if(evr_prepare_stmt(ctx->db, "update bucket set end_offset = ? where bucket_index = ?", &ctx->update_bucket_end_offset_stmt) != evr_ok){
-        goto fail_with_db;
+    ret = sendfile_n(dest, bucket_f, pos->offset, stored_size);
+ out_with_release_bucket_f:
+    if(evr_bucket_fd_cache_release(cache, pos->bucket_index, bucket_f) != evr_ok){
+        ret = evr_error;
     }
-    if(evr_prepare_stmt(ctx->db, "select end_offset from bucket where bucket_index = ?", &ctx->find_bucket_end_offset_stmt) != evr_ok){
-        goto fail_with_db;
+ out:
+    return ret;
+}
+
+int evr_glacier_read_stored_size(int bucket_f, const struct evr_glacier_blob_pos *pos, size_t *stored_size){
+    // the blob header ends with the stored size followed by the
+    // header's checksum
+    char buf[sizeof(uint32_t)];
+    if(pread(bucket_f, buf, sizeof(buf), pos->offset - sizeof(uint32_t) - sizeof(uint8_t)) != sizeof(buf)){
+        log_error("Unable to read stored size of blob in bucket " evr_bucket_file_name_fmt " at offset %zu", pos->bucket_index, pos->offset);
+        return evr_error;
     }
-    if(move_to_last_bucket(ctx)){
-        goto fail_with_db;
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_pull_map(&bp, stored_size, uint32_t, be32toh);
+    return evr_ok;
+}
+
+int evr_glacier_inflate_blob(int bucket_f, size_t offset, size_t stored_size, char *in_buf, size_t in_buf_size, int (*on_data)(void *arg, const char *data, size_t data_size), void *arg, size_t *raw_size){
+    int ret = evr_error;
+    char out_buf[evr_inflate_buffer_size];
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    zs.next_in = Z_NULL;
+    zs.avail_in = 0;
+    if(inflateInit(&zs) != Z_OK){
+        log_error("Unable to initialize zlib inflate stream");
+        goto out;
     }
-    if(ctx->current_bucket_index == 0){
-        if(create_next_bucket(ctx)){
-            goto fail_with_db;
-        }
-    } else {
-        if(open_current_bucket(ctx, 0) != evr_ok){
-            goto fail_with_db;
-        }
-        if(evr_validate_bucket_magic_number(ctx->current_bucket_f) != evr_ok){
-            goto fail_with_open_bucket;
+    size_t read_offset = offset;
+    const size_t end_offset = offset + stored_size;
+    int zres = Z_OK;
+    while(zres != Z_STREAM_END){
+        if(zs.avail_in == 0){
+            const size_t read_size = min(in_buf_size, end_offset - read_offset);
+            if(read_size == 0){
+                log_error("Deflated blob at bucket offset %zu exceeds its stored size %zu", offset, stored_size);
+                goto out_with_end_inflate;
+            }
+            ssize_t bytes_read = pread(bucket_f, in_buf, read_size, read_offset);
+            if(bytes_read <= 0){
+                log_error("Deflated blob at bucket offset %zu ends unexpectedly", offset);
+                goto out_with_end_inflate;
+            }
+            read_offset += bytes_read;
+            zs.next_in = (Bytef*)in_buf;
+            zs.avail_in = bytes_read;
         }
-        if(evr_read_bucket_end_offset(ctx->current_bucket_f, &ctx->current_bucket_pos) != evr_ok){
-            goto fail_with_open_bucket;
+        zs.next_out = (Bytef*)out_buf;
+        zs.avail_out = sizeof(out_buf);
+        zres = inflate(&zs, Z_NO_FLUSH);
+        if(zres != Z_OK && zres != Z_STREAM_END && zres != Z_BUF_ERROR){
+            log_error("Unable to inflate blob at bucket offset %zu: zlib error %d", offset, zres);
+            goto out_with_end_inflate;
         }
-        if(ctx->current_bucket_pos == evr_bucket_end_offset_corrupt){
-            log_debug("Skipping bucket " evr_bucket_file_name_fmt " because end offset indicates corrupt bucket end", ctx->current_bucket_index);
-            if(create_next_bucket(ctx)){
-                goto fail_with_open_bucket;
+        const size_t out_size = sizeof(out_buf) - zs.avail_out;
+        if(out_size > 0){
+            int data_res = on_data(arg, out_buf, out_size);
+            if(data_res == evr_end){
+                ret = evr_end;
+                goto out_with_end_inflate;
+            } else if(data_res != evr_ok){
+                goto out_with_end_inflate;
             }
         }
     }
+    if(raw_size){
+        *raw_size = zs.total_out;
+    }
     ret = evr_ok;
-    *context = ctx;
+ out_with_end_inflate:
+    inflateEnd(&zs);
+ out:
     return ret;
- fail_with_open_bucket:
-    if(close(ctx->current_bucket_f) != 0){
-        evr_panic("Unable to close current bucket file.");
-    }
- fail_with_db:
-    sqlite3_finalize(ctx->find_bucket_end_offset_stmt);
-    sqlite3_finalize(ctx->update_bucket_end_offset_stmt);
-    sqlite3_finalize(ctx->insert_bucket_stmt);
-    sqlite3_finalize(ctx->insert_blob_stmt);
-    sqlite3_close(ctx->db);
-    if(evr_release_process_lock(ctx->lock_fd) != evr_ok){
+}
+
+struct evr_bucket_fd_cache_entry **evr_bucket_fd_cache_slot(struct evr_bucket_fd_cache *cache, unsigned long bucket_index);
+
+struct evr_bucket_fd_cache_entry *evr_bucket_fd_cache_find(struct evr_bucket_fd_cache *cache, unsigned long bucket_index);
+
+void evr_bucket_fd_cache_remove_from_table(struct evr_bucket_fd_cache *cache, struct evr_bucket_fd_cache_entry *e);
+
+/**
+ * evr_bucket_fd_cache_push_idle puts e at the head of the idle list
+ * if head is true. Otherwise at the tail.
+ */
+void evr_bucket_fd_cache_push_idle(struct evr_bucket_fd_cache *cache, struct evr_bucket_fd_cache_entry *e, int head);
+
+void evr_bucket_fd_cache_unlink_idle(struct evr_bucket_fd_cache *cache, struct evr_bucket_fd_cache_entry *e);
+
+/**
+ * evr_bucket_fd_cache_open opens the bucket and validates its magic
+ * number. Returns -1 on error.
+ */
+int evr_bucket_fd_cache_open(struct evr_bucket_fd_cache *cache, unsigned long bucket_index);
+
+struct evr_bucket_fd_cache *evr_create_bucket_fd_cache(struct evr_glacier_storage_cfg *config, size_t entries_len){
+    size_t table_len = 1;
+    while(table_len < entries_len){
+        table_len <<= 1;
+    }
+    char *buf = malloc(sizeof(struct evr_bucket_fd_cache) + entries_len * sizeof(struct evr_bucket_fd_cache_entry) + table_len * sizeof(struct evr_bucket_fd_cache_entry*));
+    if(!buf){
+        return NULL;
+    }
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    struct evr_bucket_fd_cache *cache;
+    evr_map_struct(&bp, cache);
+    if(mtx_init(&cache->lock, mtx_plain) != thrd_success){
+        goto out_with_free;
+    }
+    if(cnd_init(&cache->opened) != thrd_success){
+        goto out_with_destroy_lock;
+    }
+    cache->config = config;
+    cache->entries_len = entries_len;
+    evr_map_struct_n(&bp, cache->entries, entries_len);
+    cache->table_len = table_len;
+    evr_map_struct_n(&bp, cache->table, table_len);
+    memset(cache->table, 0, table_len * sizeof(struct evr_bucket_fd_cache_entry*));
+    cache->idle_head = NULL;
+    cache->idle_tail = NULL;
+    struct evr_bucket_fd_cache_entry *end = &cache->entries[entries_len];
+    for(struct evr_bucket_fd_cache_entry *it = cache->entries; it != end; ++it){
+        it->fd = -1;
+        it->refs = 0;
+        it->table_next = NULL;
+        evr_bucket_fd_cache_push_idle(cache, it, 0);
+    }
+    return cache;
+ out_with_destroy_lock:
+    mtx_destroy(&cache->lock);
+ out_with_free:
+    free(buf);
+    return NULL;
+}
+
+int evr_free_bucket_fd_cache(struct evr_bucket_fd_cache *cache){
+    if(!cache){
+        return evr_ok;
+    }
+    int ret = evr_ok;
+    struct evr_bucket_fd_cache_entry *end = &cache->entries[cache->entries_len];
+    for(struct evr_bucket_fd_cache_entry *it = cache->entries; it != end; ++it){
+        if(it->refs != 0){
+            evr_panic("Bucket fd cache is freed while bucket " evr_bucket_file_name_fmt " is still in use", it->bucket_index);
+            ret = evr_error;
+        }
+        if(it->fd < 0){
+            continue;
+        }
+        if(close(it->fd) != 0){
+            ret = evr_error;
+        }
+    }
+    cnd_destroy(&cache->opened);
+    mtx_destroy(&cache->lock);
+    free(cache);
+    return ret;
+}
+
+int evr_bucket_fd_cache_acquire(struct evr_bucket_fd_cache *cache, unsigned long bucket_index){
+    int ret = -1;
+    if(mtx_lock(&cache->lock) != thrd_success){
+        evr_panic("Unable to lock bucket fd cache");
+        return -1;
+    }
+    struct evr_bucket_fd_cache_entry *e;
+    while(1){
+        e = evr_bucket_fd_cache_find(cache, bucket_index);
+        if(!e || e->fd >= 0){
+            break;
+        }
+        // another thread is opening the bucket right now
+        if(cnd_wait(&cache->opened, &cache->lock) != thrd_success){
+            evr_panic("Unable to wait for bucket " evr_bucket_file_name_fmt " to be opened", bucket_index);
+            goto out_with_unlock;
+        }
+    }
+    if(e){
+        if(e->refs == 0){
+            evr_bucket_fd_cache_unlink_idle(cache, e);
+        }
+        e->refs += 1;
+        ret = e->fd;
+        goto out_with_unlock;
+    }
+    // the least recently used idle entry is reserved for the bucket
+    // so that concurrent acquires wait for this open instead of
+    // opening the bucket again. if every cached fd is in use the fd
+    // is handed out uncached and closed again by
+    // evr_bucket_fd_cache_release.
+    int evicted_fd = -1;
+    e = cache->idle_head;
+    if(e){
+        evr_bucket_fd_cache_unlink_idle(cache, e);
+        if(e->fd >= 0){
+            evr_bucket_fd_cache_remove_from_table(cache, e);
+            evicted_fd = e->fd;
+            e->fd = -1;
+        }
+        e->bucket_index = bucket_index;
+        e->refs = 1;
+        struct evr_bucket_fd_cache_entry **slot = evr_bucket_fd_cache_slot(cache, bucket_index);
+        e->table_next = *slot;
+        *slot = e;
+    }
+    if(mtx_unlock(&cache->lock) != thrd_success){
+        evr_panic("Unable to unlock bucket fd cache");
+        return -1;
+    }
+    if(evicted_fd >= 0 && close(evicted_fd) != 0){
+        evr_panic("Unable to close evicted bucket fd %d", evicted_fd);
+    }
+    int f = evr_bucket_fd_cache_open(cache, bucket_index);
+    if(!e){
+        return f;
+    }
+    if(mtx_lock(&cache->lock) != thrd_success){
+        evr_panic("Unable to lock bucket fd cache");
+        return -1;
+    }
+    if(f < 0){
+        evr_bucket_fd_cache_remove_from_table(cache, e);
+        e->refs = 0;
+        evr_bucket_fd_cache_push_idle(cache, e, 1);
+    } else {
+        e->fd = f;
+    }
+    if(cnd_broadcast(&cache->opened) != thrd_success){
+        evr_panic("Unable to signal opened bucket " evr_bucket_file_name_fmt, bucket_index);
+    }
+    ret = f;
+ out_with_unlock:
+    if(mtx_unlock(&cache->lock) != thrd_success){
+        evr_panic("Unable to unlock bucket fd cache");
+        return -1;
+    }
+    return ret;
+}
+
+int evr_bucket_fd_cache_release(struct evr_bucket_fd_cache *cache, unsigned long bucket_index, int fd){
+    if(mtx_lock(&cache->lock) != thrd_success){
+        evr_panic("Unable to lock bucket fd cache");
+        return evr_error;
+    }
+    int cached = 0;
+    struct evr_bucket_fd_cache_entry *e = evr_bucket_fd_cache_find(cache, bucket_index);
+    if(e && e->fd == fd){
+        cached = 1;
+        e->refs -= 1;
+        if(e->refs == 0){
+            evr_bucket_fd_cache_push_idle(cache, e, 0);
+        }
+    }
+    if(mtx_unlock(&cache->lock) != thrd_success){
+        evr_panic("Unable to unlock bucket fd cache");
+        return evr_error;
+    }
+    if(!cached && close(fd) != 0){
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+struct evr_bucket_fd_cache_entry **evr_bucket_fd_cache_slot(struct evr_bucket_fd_cache *cache, unsigned long bucket_index){
+    // bucket indexes are handed out sequentially so they spread
+    // evenly over the table without further hashing
+    return &cache->table[bucket_index & (cache->table_len - 1)];
+}
+
+struct evr_bucket_fd_cache_entry *evr_bucket_fd_cache_find(struct evr_bucket_fd_cache *cache, unsigned long bucket_index){
+    for(struct evr_bucket_fd_cache_entry *e = *evr_bucket_fd_cache_slot(cache, bucket_index); e; e = e->table_next){
+        if(e->bucket_index == bucket_index){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void evr_bucket_fd_cache_remove_from_table(struct evr_bucket_fd_cache *cache, struct evr_bucket_fd_cache_entry *e){
+    for(struct evr_bucket_fd_cache_entry **it = evr_bucket_fd_cache_slot(cache, e->bucket_index); *it; it = &(*it)->table_next){
+        if(*it == e){
+            *it = e->table_next;
+            return;
+        }
+    }
+}
+
+void evr_bucket_fd_cache_push_idle(struct evr_bucket_fd_cache *cache, struct evr_bucket_fd_cache_entry *e, int head){
+    if(head){
+        e->prev = NULL;
+        e->next = cache->idle_head;
+        if(cache->idle_head){
+            cache->idle_head->prev = e;
+        } else {
+            cache->idle_tail = e;
+        }
+        cache->idle_head = e;
+    } else {
+        e->prev = cache->idle_tail;
+        e->next = NULL;
+        if(cache->idle_tail){
+            cache->idle_tail->next = e;
+        } else {
+            cache->idle_head = e;
+        }
+        cache->idle_tail = e;
+    }
+}
+
+void evr_bucket_fd_cache_unlink_idle(struct evr_bucket_fd_cache *cache, struct evr_bucket_fd_cache_entry *e){
+    if(e->prev){
+        e->prev->next = e->next;
+    } else {
+        cache->idle_head = e->next;
+    }
+    if(e->next){
+        e->next->prev = e->prev;
+    } else {
+        cache->idle_tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+int evr_bucket_fd_cache_open(struct evr_bucket_fd_cache *cache, unsigned long bucket_index){
+    int f = evr_open_bucket(cache->config, bucket_index, O_RDONLY);
+    if(f < 0){
+        log_error("Unable to open bucket " evr_bucket_file_name_fmt " for reading", bucket_index);
+        return -1;
+    }
+    if(evr_validate_bucket_magic_number(f) != evr_ok){
+        if(close(f) != 0){
+            evr_panic("Unable to close bucket " evr_bucket_file_name_fmt, bucket_index);
+        }
+        return -1;
+    }
+    return f;
+}
+
+int evr_glacier_walk_blob_positions(struct evr_glacier_read_ctx *ctx, int (*visit)(void *vctx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos), void *vctx){
+    int ret = evr_error;
+    sqlite3_stmt *stmt;
+    if(evr_prepare_stmt(ctx->db, "select key, flags, bucket_index, bucket_blob_offset, blob_size from blob_position", &stmt) != evr_ok){
+        goto out;
+    }
+    struct evr_glacier_blob_pos pos;
+    while(1){
+        int step_res = evr_step_stmt(ctx->db, stmt);
+        if(step_res == SQLITE_DONE){
+            break;
+        }
+        if(step_res != SQLITE_ROW){
+            goto out_with_finalize_stmt;
+        }
+        const uint8_t *key = sqlite3_column_blob(stmt, 0);
+        int key_size = sqlite3_column_bytes(stmt, 0);
+        if(key_size != evr_blob_ref_size){
+            goto out_with_finalize_stmt;
+        }
+        pos.flags = sqlite3_column_int(stmt, 1);
+        pos.bucket_index = sqlite3_column_int64(stmt, 2);
+        pos.offset = sqlite3_column_int(stmt, 3);
+        pos.size = sqlite3_column_int(stmt, 4);
+        if(visit(vctx, key, &pos) != evr_ok){
+            goto out_with_finalize_stmt;
+        }
+    }
+    ret = evr_ok;
+ out_with_finalize_stmt:
+    if(sqlite3_finalize(stmt) != SQLITE_OK){
+        evr_panic("Unable to finalize walk blob positions statement");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_glacier_list_blobs(struct evr_glacier_read_ctx *ctx, int (*visit)(void *vctx, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob), struct evr_blob_filter *filter, void *vctx){
+    struct evr_blob_list_cursor cursor;
+    evr_init_blob_list_cursor(&cursor, filter);
+    while(1){
+        int page_res = evr_glacier_list_blobs_page(ctx, visit, filter, &cursor, evr_blob_list_default_page_len, vctx);
+        if(page_res == evr_end){
+            return evr_ok;
+        } else if(page_res != evr_ok){
+            return evr_error;
+        }
+    }
+}
+
+void evr_init_blob_list_cursor(struct evr_blob_list_cursor *cursor, struct evr_blob_filter *filter){
+    cursor->last_modified = filter->last_modified_after;
+    cursor->key_len = 0;
+}
+
+int evr_glacier_list_blobs_page(struct evr_glacier_read_ctx *ctx, int (*visit)(void *vctx, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob), struct evr_blob_filter *filter, struct evr_blob_list_cursor *cursor, size_t page_len, void *vctx){
+    int ret = evr_error;
+    if(page_len == 0){
+        log_error("Blob list page length must not be 0");
+        goto out;
+    }
+    if(filter->last_modified_after > LLONG_MAX || cursor->last_modified > LLONG_MAX){
+        // sqlite3 api only provides bind for signed int64. so we must
+        // make sure that value does not overflow.
+        goto out;
+    }
+    if(filter->flags_filter != evr_blob_public_flags(filter->flags_filter)){
+        // no blob shows flags which are not public
+        ret = evr_end;
+        goto out;
+    }
+    sqlite3_stmt *list_stmt;
+    evr_time lower_last_modified;
+    switch(filter->sort_order){
+    default:
+        log_error("Unknown sort-order 0x%02x requested", filter->sort_order);
+        goto out;
+    case evr_cmd_watch_sort_order_last_modified:
+        list_stmt = ctx->list_blobs_stmt_order_last_modified;
+        lower_last_modified = cursor->last_modified;
+        break;
+    case evr_cmd_watch_sort_order_ref:
+        list_stmt = ctx->list_blobs_stmt_order_blob_ref;
+        lower_last_modified = filter->last_modified_after;
+        break;
+    }
+    if(sqlite3_bind_int64(list_stmt, 1, lower_last_modified) != SQLITE_OK){
+        goto out_with_reset_stmt;
+    }
+    // a cursor without key binds an empty blob which sorts before
+    // every key
+    if(sqlite3_bind_blob(list_stmt, 2, cursor->key, cursor->key_len, SQLITE_TRANSIENT) != SQLITE_OK){
+        goto out_with_reset_stmt;
+    }
+    if(sqlite3_bind_int(list_stmt, 3, filter->flags_filter) != SQLITE_OK){
+        goto out_with_reset_stmt;
+    }
+    // the additional row tells if the page's last blob is the last
+    // blob of the whole listing
+    if(sqlite3_bind_int64(list_stmt, 4, page_len + 1) != SQLITE_OK){
+        goto out_with_reset_stmt;
+    }
+    int has_found_key = 0;
+    evr_blob_ref found_key;
+    int flags;
+    evr_time last_modified = 0;
+    for(size_t rows = 0;; ++rows){
+        int step_ret = evr_step_stmt(ctx->db, list_stmt);
+        if(step_ret == SQLITE_DONE){
+            if(has_found_key){
+                if(visit(vctx, found_key, flags, last_modified, 1) != evr_ok){
+                    goto out_with_reset_stmt;
+                }
+            }
+            ret = evr_end;
+            goto out_with_reset_stmt;
+        }
+        if(step_ret != SQLITE_ROW){
+            goto out_with_reset_stmt;
+        }
+        if(has_found_key){
+            if(visit(vctx, found_key, flags, last_modified, 0) != evr_ok){
+                goto out_with_reset_stmt;
+            }
+        }
+        if(rows == page_len){
+            break;
+        }
+        int key_col_size = sqlite3_column_bytes(list_stmt, 0);
+        if(key_col_size != evr_blob_ref_size){
+            goto out_with_reset_stmt;
+        }
+        has_found_key = 1;
+        flags = evr_blob_public_flags(sqlite3_column_int(list_stmt, 1));
+        const void *sqkey = sqlite3_column_blob(list_stmt, 0);
+        memcpy(found_key, sqkey, evr_blob_ref_size);
+        last_modified = sqlite3_column_int64(list_stmt, 2);
+    }
+    memcpy(cursor->key, found_key, evr_blob_ref_size);
+    cursor->key_len = evr_blob_ref_size;
+    cursor->last_modified = last_modified;
+    ret = evr_ok;
+ out_with_reset_stmt:
+    if(sqlite3_reset(list_stmt) != SQLITE_OK){
+        evr_panic("Unable to reset list_stmt for sort-order 0x%02x", filter->sort_order);
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_read_bucket_end_offset(int f, size_t *end_offset);
+int evr_write_bucket_end_offset(int f, size_t end_offset, int sync);
+
+int evr_create_glacier_write_ctx(struct evr_glacier_write_ctx **context, struct evr_glacier_storage_cfg *config){
+    int ret = evr_error;
+    if(!config){
+        goto fail;
+    }
+    struct evr_glacier_write_ctx *ctx = malloc(sizeof(struct evr_glacier_write_ctx));
+    if(!ctx){
+        goto fail;
+    }
+    ctx->config = config;
+    ctx->lanes_len = config->bucket_lanes;
+    if(ctx->lanes_len == 0){
+        log_error("Glacier needs at least one bucket lane");
+        goto fail_free;
+    }
+    ctx->lanes = malloc(ctx->lanes_len * sizeof(struct evr_glacier_bucket_lane));
+    if(!ctx->lanes){
+        goto fail_free;
+    }
+    for(size_t i = 0; i < ctx->lanes_len; ++i){
+        struct evr_glacier_bucket_lane *lane = &ctx->lanes[i];
+        lane->current_bucket_index = 0;
+        lane->current_bucket_f = -1;
+        lane->current_bucket_pos = 0;
+        lane->current_bucket_sync = 1;
+        lane->io = NULL;
+        lane->seal_entries = NULL;
+        lane->seal_crc = 0;
+        if(config->bucket_io_backend == evr_bucket_io_backend_io_uring){
+            lane->io = evr_create_bucket_io();
+        }
+    }
+    ctx->last_bucket_index = 0;
+    ctx->next_commit_ticket = 0;
+    ctx->served_commit_ticket = 0;
+    if(mtx_init(&ctx->index_lock, mtx_plain) != thrd_success){
+        goto fail_free_lanes_io;
+    }
+    if(cnd_init(&ctx->commit_turn) != thrd_success){
+        goto fail_destroy_index_lock;
+    }
+    ctx->migrate_index_db = 0;
+    ctx->stop_index_db_migration = 0;
+    ctx->db = NULL;
+    ctx->insert_blob_stmt = NULL;
+    ctx->insert_bucket_stmt = NULL;
+    ctx->update_bucket_end_offset_stmt = NULL;
+    ctx->find_bucket_end_offset_stmt = NULL;
+    ctx->begin_stmt = NULL;
+    ctx->commit_stmt = NULL;
+    ctx->rollback_stmt = NULL;
+    {
+        // this block trims trailing '/' from bucket_dir_path
+        size_t len = strlen(config->bucket_dir_path);
+        char *end = &(config->bucket_dir_path[len - 1]);
+        for(; end >= config->bucket_dir_path; end--){
+            if(*end != '/'){
+                *(end+1) = '\0';
+                break;
+            }
+        }
+    }
+    // TODO :bdircre: build bucket dir if not existing
+    size_t glacier_file_path_max_size = strlen(config->bucket_dir_path) + 10;
+    char *glacier_file_path = alloca(glacier_file_path_max_size);
+    {
+        // aquire lock file
+        build_glacier_file_path(glacier_file_path, glacier_file_path_max_size, config->bucket_dir_path, glacier_dir_lock_file_path);
+        if(glacier_file_path[0] == '\0'){
+            goto fail_destroy_commit_turn;
+        }
+        if(evr_acquire_process_lock(&ctx->lock_fd, glacier_file_path) != evr_ok){
+            goto fail_destroy_commit_turn;
+        }
+    }
+    if(evr_open_index_db(config, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &(ctx->db))){
+        ret = evr_glacier_index_db_corrupt;
+        goto fail_with_db;
+    }
+    if(evr_create_index_db(ctx)){
+        goto fail_with_db;
+    }
+    if(evr_prepare_stmt(ctx->db, "insert into blob_position (key, flags, bucket_index, bucket_blob_offset, blob_size, last_modified) values (?, ?, ?, ?, ?, ?)", &ctx->insert_blob_stmt) != evr_ok){
+        goto fail_with_db;
+    }
+    // existing buckets are ignored so a reindex can insert buckets
+    // which the lanes created before the reindex started.
+    if(evr_prepare_stmt(ctx->db, "insert or ignore into bucket (bucket_index) values (?)", &ctx->insert_bucket_stmt) != evr_ok){
+        goto fail_with_db;
+    }
+    if(evr_prepare_stmt(ctx->db, "update bucket set end_offset = ? where bucket_index = ?", &ctx->update_bucket_end_offset_stmt) != evr_ok){
+        goto fail_with_db;
+    }
+    if(evr_prepare_stmt(ctx->db, "select end_offset from bucket where bucket_index = ?", &ctx->find_bucket_end_offset_stmt) != evr_ok){
+        goto fail_with_db;
+    }
+    if(evr_prepare_stmt(ctx->db, "begin", &ctx->begin_stmt) != evr_ok){
+        goto fail_with_db;
+    }
+    if(evr_prepare_stmt(ctx->db, "commit", &ctx->commit_stmt) != evr_ok){
+        goto fail_with_db;
+    }
+    if(evr_prepare_stmt(ctx->db, "rollback", &ctx->rollback_stmt) != evr_ok){
+        goto fail_with_db;
+    }
+    if(move_to_last_bucket(ctx)){
+        goto fail_with_db;
+    }
+    {
+        // the lanes continue the buckets with the highest indices
+        const unsigned long existing_last_bucket_index = ctx->last_bucket_index;
+        for(size_t i = 0; i < ctx->lanes_len; ++i){
+            int lane_res;
+            if(i < existing_last_bucket_index){
+                lane_res = evr_continue_lane_bucket(ctx, &ctx->lanes[i], existing_last_bucket_index - i);
+            } else {
+                lane_res = create_next_bucket(ctx, &ctx->lanes[i]);
+            }
+            if(lane_res != evr_ok){
+                goto fail_with_open_buckets;
+            }
+        }
+    }
+    if(ctx->migrate_index_db && thrd_create(&ctx->index_db_migration, evr_migrate_index_db_v2_worker, ctx) != thrd_success){
+        ctx->migrate_index_db = 0;
+        goto fail_with_open_buckets;
+    }
+    ret = evr_ok;
+    *context = ctx;
+    return ret;
+ fail_with_open_buckets:
+    for(size_t i = 0; i < ctx->lanes_len; ++i){
+        if(ctx->lanes[i].current_bucket_f != -1 && close(ctx->lanes[i].current_bucket_f) != 0){
+            evr_panic("Unable to close current bucket file.");
+        }
+    }
+ fail_with_db:
+    sqlite3_finalize(ctx->rollback_stmt);
+    sqlite3_finalize(ctx->commit_stmt);
+    sqlite3_finalize(ctx->begin_stmt);
+    sqlite3_finalize(ctx->find_bucket_end_offset_stmt);
+    sqlite3_finalize(ctx->update_bucket_end_offset_stmt);
+    sqlite3_finalize(ctx->insert_bucket_stmt);
+    sqlite3_finalize(ctx->insert_blob_stmt);
+    sqlite3_close(ctx->db);
+    if(evr_release_process_lock(ctx->lock_fd) != evr_ok){
         evr_panic("Unable to release lock file handle %d", ctx->lock_fd);
         ret = evr_error;
     }
+ fail_destroy_commit_turn:
+    cnd_destroy(&ctx->commit_turn);
+ fail_destroy_index_lock:
+    mtx_destroy(&ctx->index_lock);
+ fail_free_lanes_io:
+    for(size_t i = 0; i < ctx->lanes_len; ++i){
+        evr_free_bucket_io(ctx->lanes[i].io);
+        free(ctx->lanes[i].seal_entries);
+    }
+    free(ctx->lanes);
  fail_free:
     free(ctx);
  fail:
     return ret;
 }
 
+#define glacier_index_db_version 2
+
+/**
+ * evr_glacier_index_db_has sets exists to 1 if the index db has a
+ * schema object of the given type and name which belongs to the
+ * table tbl_name. Tables belong to themselves.
+ */
+int evr_glacier_index_db_has(sqlite3 *db, const char *type, const char *name, const char *tbl_name, int *exists);
+
+/**
+ * evr_prepare_index_db_v2_migration prepares moving the blob_position
+ * rows of a version 1 index db into a WITHOUT ROWID table.
+ *
+ * Only empty tables and a trigger are created here so the glacier
+ * starts right away. blob_position stays the version 1 table and
+ * keeps serving reads and appends until
+ * evr_migrate_index_db_v2_worker swapped the tables.
+ */
+int evr_prepare_index_db_v2_migration(struct evr_glacier_write_ctx *ctx);
+
+/**
+ * evr_create_last_modified_index creates the index which lets
+ * watches resume listing blobs by last_modified without a full table
+ * scan and sort.
+ */
+int evr_create_last_modified_index(sqlite3 *db);
+
+#define evr_migrate_index_db_batch_len 4096
+
 int evr_create_index_db(struct evr_glacier_write_ctx *ctx){
+    int exists;
+    if(evr_glacier_index_db_has(ctx->db, "table", "v" to_string(glacier_index_db_version), "v" to_string(glacier_index_db_version), &exists) != evr_ok){
+        return evr_error;
+    }
+    if(exists){
+        // a swapped out version 1 table may still wait for its
+        // deletion
+        if(evr_glacier_index_db_has(ctx->db, "table", "blob_position_v1", "blob_position_v1", &ctx->migrate_index_db) != evr_ok){
+            return evr_error;
+        }
+    } else {
+        if(evr_glacier_index_db_has(ctx->db, "table", "blob_position", "blob_position", &exists) != evr_ok){
+            return evr_error;
+        }
+        if(exists){
+            return evr_prepare_index_db_v2_migration(ctx);
+        }
+    }
     char *sql[] = {
         // the following structure_sql creates the structure of the
         // sqlite index db used to quickly lookup blob positions. the
@@ -413,8 +1296,14 @@ int evr_create_index_db(struct evr_glacier_write_ctx *ctx){
         //   which the blob data begins.
         // - blob_size is the size of the blob in bytes
         // - last_modified last modified timestamp in unix epoch format.
-        "create table if not exists blob_position (key blob primary key not null, flags integer not null, bucket_index integer not null, bucket_blob_offset integer not null, blob_size integer not null, last_modified integer not null)",
+        //
+        // blob_position has no rowid so the key is only stored once
+        // in the table's b-tree and not again in a primary key index.
+        "create table if not exists blob_position (key blob primary key not null, flags integer not null, bucket_index integer not null, bucket_blob_offset integer not null, blob_size integer not null, last_modified integer not null) without rowid",
         "create table if not exists bucket (bucket_index integer primary key not null, end_offset integer not null default " to_string(evr_bucket_header_size)  ")",
+        // the existence of the v2 table marks the index db as
+        // version 2.
+        "create table if not exists v" to_string(glacier_index_db_version) " (x integer)",
         NULL,
     };
     char *error;
@@ -425,33 +1314,436 @@ int evr_create_index_db(struct evr_glacier_write_ctx *ctx){
             return evr_error;
         }
     }
+    return evr_create_last_modified_index(ctx->db);
+}
+
+int evr_create_last_modified_index(sqlite3 *db){
+    // sqlite can't rename indexes. so a migrated index db keeps the
+    // name its last_modified index got during the migration.
+    int migrated_index;
+    if(evr_glacier_index_db_has(db, "index", "blob_position_v2_last_modified", "blob_position", &migrated_index) != evr_ok){
+        return evr_error;
+    }
+    if(migrated_index){
+        return evr_ok;
+    }
+    char *error;
+    if(sqlite3_exec(db, "create index if not exists blob_position_last_modified on blob_position (last_modified, key)", NULL, NULL, &error) != SQLITE_OK){
+        log_error("Failed to create blob_position_last_modified index: %s", error);
+        sqlite3_free(error);
+        return evr_error;
+    }
     return evr_ok;
 }
 
-int evr_move_to_last_bucket_visitor(void *context, unsigned long bucket_index, char *bucket_file_name);
+int evr_glacier_index_db_has(sqlite3 *db, const char *type, const char *name, const char *tbl_name, int *exists){
+    int ret = evr_error;
+    sqlite3_stmt *stmt;
+    if(evr_prepare_stmt(db, "select 1 from sqlite_master where type = ? and name = ? and tbl_name = ?", &stmt) != evr_ok){
+        goto out;
+    }
+    if(sqlite3_bind_text(stmt, 1, type, -1, NULL) != SQLITE_OK){
+        goto out_with_finalize_stmt;
+    }
+    if(sqlite3_bind_text(stmt, 2, name, -1, NULL) != SQLITE_OK){
+        goto out_with_finalize_stmt;
+    }
+    if(sqlite3_bind_text(stmt, 3, tbl_name, -1, NULL) != SQLITE_OK){
+        goto out_with_finalize_stmt;
+    }
+    int step_res = evr_step_stmt(db, stmt);
+    if(step_res != SQLITE_ROW && step_res != SQLITE_DONE){
+        goto out_with_finalize_stmt;
+    }
+    *exists = step_res == SQLITE_ROW;
+    ret = evr_ok;
+ out_with_finalize_stmt:
+    if(sqlite3_finalize(stmt) != SQLITE_OK){
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+/**
+ * evr_index_db_v2_migration_sql creates blob_position_v2 and what
+ * the migration needs besides it. The cursor holds the last copied
+ * key. The trigger copies blob positions which are appended
+ * while the migration runs. The glacier never updates or deletes
+ * blob positions so inserts are the only changes to copy.
+ */
+#define evr_index_db_v2_migration_sql \
+    "create table if not exists blob_position_v2 (key blob primary key not null, flags integer not null, bucket_index integer not null, bucket_blob_offset integer not null, blob_size integer not null, last_modified integer not null) without rowid;" \
+    "create index if not exists blob_position_v2_last_modified on blob_position_v2 (last_modified, key);" \
+    "create table if not exists blob_position_v2_cursor (last_key blob not null);" \
+    "insert into blob_position_v2_cursor (last_key) select x'' where not exists (select 1 from blob_position_v2_cursor);" \
+    "create trigger if not exists blob_position_v2_copy after insert on blob_position begin insert or replace into blob_position_v2 (key, flags, bucket_index, bucket_blob_offset, blob_size, last_modified) values (new.key, new.flags, new.bucket_index, new.bucket_blob_offset, new.blob_size, new.last_modified); end;"
+
+int evr_prepare_index_db_v2_migration(struct evr_glacier_write_ctx *ctx){
+    int ret = evr_error;
+    char *error = NULL;
+    // the version 1 table keeps its last_modified index until it is
+    // swapped out so listings don't fall back to full table scans
+    // while the migration runs.
+    if(sqlite3_exec(ctx->db, "begin;" evr_index_db_v2_migration_sql "commit", NULL, NULL, &error) != SQLITE_OK){
+        goto out_with_rollback;
+    }
+    ctx->migrate_index_db = 1;
+    log_info("Migrating index db of glacier %s to version " to_string(glacier_index_db_version) " in the background", ctx->config->bucket_dir_path);
+    ret = evr_ok;
+    goto out;
+ out_with_rollback:
+    if(!sqlite3_get_autocommit(ctx->db) && sqlite3_exec(ctx->db, "rollback", NULL, NULL, NULL) != SQLITE_OK){
+        evr_panic("Unable to rollback index db migration for glacier %s", ctx->config->bucket_dir_path);
+    }
+    log_error("Failed to prepare index db migration of glacier %s: %s", ctx->config->bucket_dir_path, error);
+ out:
+    if(error){
+        sqlite3_free(error);
+    }
+    return ret;
+}
+
+/**
+ * evr_migrate_index_db_pause is the time between two migration
+ * batches in which appends get hold of the index_lock.
+ */
+static const struct timespec evr_migrate_index_db_pause = {
+    0,
+    10000000
+};
+
+/**
+ * evr_begin_index_db_migration_batch locks ctx->index_lock and
+ * begins a transaction on db.
+ *
+ * Returns evr_end without holding the lock if the migration should
+ * stop.
+ */
+int evr_begin_index_db_migration_batch(struct evr_glacier_write_ctx *ctx, sqlite3 *db);
+
+/**
+ * evr_end_index_db_migration_batch commits the batch's transaction if
+ * commit is not zero and rolls it back otherwise. ctx->index_lock is
+ * unlocked afterwards.
+ */
+int evr_end_index_db_migration_batch(struct evr_glacier_write_ctx *ctx, sqlite3 *db, int commit);
+
+/**
+ * evr_copy_blob_positions_v1 copies the version 1 blob_position rows
+ * into blob_position_v2 and swaps the tables with the last batch. The
+ * version 1 table is renamed to blob_position_v1.
+ */
+int evr_copy_blob_positions_v1(struct evr_glacier_write_ctx *ctx, sqlite3 *db);
+
+/**
+ * evr_copy_blob_positions_v1_batch copies the next batch of blob
+ * positions.
+ *
+ * Returns evr_end if the last batch was copied and the tables got
+ * swapped.
+ */
+int evr_copy_blob_positions_v1_batch(sqlite3 *db, sqlite3_stmt *end_key_stmt, sqlite3_stmt *copy_stmt, sqlite3_stmt *update_cursor_stmt, size_t *copied);
+
+/**
+ * evr_delete_blob_positions_v1 deletes the swapped out version 1
+ * table in batches. Dropping the filled table at once would walk all
+ * of its pages within one transaction.
+ */
+int evr_delete_blob_positions_v1(struct evr_glacier_write_ctx *ctx, sqlite3 *db);
+
+int evr_migrate_index_db_v2_worker(void *arg){
+    struct evr_glacier_write_ctx *ctx = arg;
+    int ret = evr_error;
+    sqlite3 *db;
+    if(evr_open_index_db(ctx->config, SQLITE_OPEN_READWRITE, &db) != evr_ok){
+        goto out;
+    }
+    int migrated;
+    if(evr_glacier_index_db_has(db, "table", "v" to_string(glacier_index_db_version), "v" to_string(glacier_index_db_version), &migrated) != evr_ok){
+        goto out_with_close_db;
+    }
+    int migrate_res = migrated ? evr_ok : evr_copy_blob_positions_v1(ctx, db);
+    if(migrate_res == evr_ok){
+        migrate_res = evr_delete_blob_positions_v1(ctx, db);
+    }
+    if(migrate_res == evr_ok || migrate_res == evr_end){
+        ret = evr_ok;
+    }
+ out_with_close_db:
+    if(evr_close_index_db(ctx->config, db) != evr_ok){
+        ret = evr_error;
+    }
+ out:
+    if(ret != evr_ok){
+        log_error("Failed to migrate index db of glacier %s to version " to_string(glacier_index_db_version) ". The migration continues on the next start.", ctx->config->bucket_dir_path);
+    }
+    return ret;
+}
+
+int evr_begin_index_db_migration_batch(struct evr_glacier_write_ctx *ctx, sqlite3 *db){
+    evr_glacier_lock_index(ctx);
+    if(ctx->stop_index_db_migration){
+        evr_glacier_unlock_index(ctx);
+        return evr_end;
+    }
+    if(sqlite3_exec(db, "begin immediate", NULL, NULL, NULL) != SQLITE_OK){
+        log_error("Failed to begin index db migration batch: %s", sqlite3_errmsg(db));
+        evr_glacier_unlock_index(ctx);
+        return evr_error;
+    }
+    return evr_ok;
+}
 
-int evr_walk_buckets(struct evr_glacier_write_ctx *wctx, int (*visit)(void *ctx, unsigned long bucket_index, char *bucket_file_name), void *ctx);
+int evr_end_index_db_migration_batch(struct evr_glacier_write_ctx *ctx, sqlite3 *db, int commit){
+    int ret = evr_ok;
+    if(sqlite3_exec(db, commit ? "commit" : "rollback", NULL, NULL, NULL) != SQLITE_OK){
+        log_error("Failed to end index db migration batch: %s", sqlite3_errmsg(db));
+        if(!sqlite3_get_autocommit(db) && sqlite3_exec(db, "rollback", NULL, NULL, NULL) != SQLITE_OK){
+            evr_panic("Unable to rollback index db migration batch");
+        }
+        ret = evr_error;
+    }
+    evr_glacier_unlock_index(ctx);
+    return ret;
+}
+
+int evr_copy_blob_positions_v1(struct evr_glacier_write_ctx *ctx, sqlite3 *db){
+    int ret = evr_error;
+    sqlite3_stmt *end_key_stmt;
+    if(evr_prepare_stmt(db, "select key from blob_position where key > (select last_key from blob_position_v2_cursor) order by key limit 1 offset " to_string(evr_migrate_index_db_batch_len) " - 1", &end_key_stmt) != evr_ok){
+        goto out;
+    }
+    sqlite3_stmt *copy_stmt;
+    // an unbound end key copies all remaining rows
+    if(evr_prepare_stmt(db, "insert or ignore into blob_position_v2 (key, flags, bucket_index, bucket_blob_offset, blob_size, last_modified) select key, flags, bucket_index, bucket_blob_offset, blob_size, last_modified from blob_position where key > (select last_key from blob_position_v2_cursor) and (?1 is null or key <= ?1)", &copy_stmt) != evr_ok){
+        goto out_with_finalize_end_key_stmt;
+    }
+    sqlite3_stmt *update_cursor_stmt;
+    if(evr_prepare_stmt(db, "update blob_position_v2_cursor set last_key = ?", &update_cursor_stmt) != evr_ok){
+        goto out_with_finalize_copy_stmt;
+    }
+    size_t copied = 0;
+    while(1){
+        int begin_res = evr_begin_index_db_migration_batch(ctx, db);
+        if(begin_res != evr_ok){
+            ret = begin_res;
+            goto out_with_finalize_update_cursor_stmt;
+        }
+        int batch_res = evr_copy_blob_positions_v1_batch(db, end_key_stmt, copy_stmt, update_cursor_stmt, &copied);
+        if(evr_end_index_db_migration_batch(ctx, db, batch_res != evr_error) != evr_ok){
+            goto out_with_finalize_update_cursor_stmt;
+        }
+        if(batch_res == evr_end){
+            break;
+        } else if(batch_res != evr_ok){
+            goto out_with_finalize_update_cursor_stmt;
+        }
+        log_debug("Migrated %zu blob positions", copied);
+        if(thrd_sleep(&evr_migrate_index_db_pause, NULL) != 0){
+            goto out_with_finalize_update_cursor_stmt;
+        }
+    }
+    log_info("Migrated %zu blob positions of glacier %s to version " to_string(glacier_index_db_version), copied, ctx->config->bucket_dir_path);
+    ret = evr_ok;
+ out_with_finalize_update_cursor_stmt:
+    if(sqlite3_finalize(update_cursor_stmt) != SQLITE_OK){
+        ret = evr_error;
+    }
+ out_with_finalize_copy_stmt:
+    if(sqlite3_finalize(copy_stmt) != SQLITE_OK){
+        ret = evr_error;
+    }
+ out_with_finalize_end_key_stmt:
+    if(sqlite3_finalize(end_key_stmt) != SQLITE_OK){
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_copy_blob_positions_v1_batch(sqlite3 *db, sqlite3_stmt *end_key_stmt, sqlite3_stmt *copy_stmt, sqlite3_stmt *update_cursor_stmt, size_t *copied){
+    int ret = evr_error;
+    evr_blob_ref end_key;
+    size_t end_key_len = 0;
+    int last_batch = 0;
+    int step_res = evr_step_stmt(db, end_key_stmt);
+    if(step_res == SQLITE_ROW){
+        end_key_len = sqlite3_column_bytes(end_key_stmt, 0);
+        if(end_key_len > sizeof(end_key)){
+            log_error("Unexpected blob key size %zu in blob_position", end_key_len);
+            goto out_with_reset_end_key_stmt;
+        }
+        memcpy(end_key, sqlite3_column_blob(end_key_stmt, 0), end_key_len);
+    } else if(step_res == SQLITE_DONE){
+        last_batch = 1;
+    } else {
+        goto out_with_reset_end_key_stmt;
+    }
+    if(sqlite3_reset(end_key_stmt) != SQLITE_OK){
+        goto out;
+    }
+    int bind_res = last_batch ? sqlite3_bind_null(copy_stmt, 1) : sqlite3_bind_blob(copy_stmt, 1, end_key, end_key_len, SQLITE_TRANSIENT);
+    if(bind_res != SQLITE_OK){
+        goto out;
+    }
+    if(evr_step_stmt(db, copy_stmt) != SQLITE_DONE){
+        goto out_with_reset_copy_stmt;
+    }
+    if(sqlite3_reset(copy_stmt) != SQLITE_OK){
+        goto out;
+    }
+    *copied += sqlite3_changes(db);
+    if(last_batch){
+        char *error;
+        if(sqlite3_exec(db, "drop trigger blob_position_v2_copy; drop table blob_position_v2_cursor; alter table blob_position rename to blob_position_v1; alter table blob_position_v2 rename to blob_position; create table v" to_string(glacier_index_db_version) " (x integer)", NULL, NULL, &error) != SQLITE_OK){
+            log_error("Failed to replace blob_position table: %s", error);
+            sqlite3_free(error);
+            goto out;
+        }
+        ret = evr_end;
+        goto out;
+    }
+    if(sqlite3_bind_blob(update_cursor_stmt, 1, end_key, end_key_len, SQLITE_TRANSIENT) != SQLITE_OK){
+        goto out;
+    }
+    if(evr_step_stmt(db, update_cursor_stmt) != SQLITE_DONE){
+        goto out_with_reset_update_cursor_stmt;
+    }
+    ret = evr_ok;
+ out_with_reset_update_cursor_stmt:
+    if(sqlite3_reset(update_cursor_stmt) != SQLITE_OK){
+        ret = evr_error;
+    }
+    goto out;
+ out_with_reset_copy_stmt:
+    if(sqlite3_reset(copy_stmt) != SQLITE_OK){
+        evr_panic("Unable to reset copy blob positions statement");
+    }
+    goto out;
+ out_with_reset_end_key_stmt:
+    if(sqlite3_reset(end_key_stmt) != SQLITE_OK){
+        evr_panic("Unable to reset migration end key statement");
+    }
+ out:
+    return ret;
+}
+
+int evr_delete_blob_positions_v1(struct evr_glacier_write_ctx *ctx, sqlite3 *db){
+    int ret = evr_error;
+    int exists;
+    if(evr_glacier_index_db_has(db, "table", "blob_position_v1", "blob_position_v1", &exists) != evr_ok){
+        goto out;
+    }
+    if(!exists){
+        ret = evr_ok;
+        goto out;
+    }
+    sqlite3_stmt *delete_stmt;
+    if(evr_prepare_stmt(db, "delete from blob_position_v1 where rowid in (select rowid from blob_position_v1 limit " to_string(evr_migrate_index_db_batch_len) ")", &delete_stmt) != evr_ok){
+        goto out;
+    }
+    while(1){
+        int begin_res = evr_begin_index_db_migration_batch(ctx, db);
+        if(begin_res != evr_ok){
+            ret = begin_res;
+            goto out_with_finalize_delete_stmt;
+        }
+        int batch_res = evr_error;
+        if(evr_step_stmt(db, delete_stmt) == SQLITE_DONE){
+            batch_res = evr_ok;
+            if(sqlite3_changes(db) == 0){
+                // the emptied table has hardly any pages left to walk
+                batch_res = sqlite3_exec(db, "drop table blob_position_v1", NULL, NULL, NULL) == SQLITE_OK ? evr_end : evr_error;
+            }
+        }
+        if(sqlite3_reset(delete_stmt) != SQLITE_OK){
+            batch_res = evr_error;
+        }
+        if(evr_end_index_db_migration_batch(ctx, db, batch_res != evr_error) != evr_ok){
+            goto out_with_finalize_delete_stmt;
+        }
+        if(batch_res == evr_end){
+            break;
+        } else if(batch_res != evr_ok){
+            goto out_with_finalize_delete_stmt;
+        }
+        if(thrd_sleep(&evr_migrate_index_db_pause, NULL) != 0){
+            goto out_with_finalize_delete_stmt;
+        }
+    }
+    log_info("Deleted version 1 blob positions of glacier %s. The space is reused for new blobs. Run vacuum on the index db to give it back to the file system.", ctx->config->bucket_dir_path);
+    ret = evr_ok;
+ out_with_finalize_delete_stmt:
+    if(sqlite3_finalize(delete_stmt) != SQLITE_OK){
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_glacier_join_index_db_migration(struct evr_glacier_write_ctx *ctx){
+    if(!ctx->migrate_index_db){
+        return evr_ok;
+    }
+    int worker_res;
+    if(thrd_join(ctx->index_db_migration, &worker_res) != thrd_success){
+        evr_panic("Unable to join index db migration of glacier %s", ctx->config->bucket_dir_path);
+        return evr_error;
+    }
+    ctx->migrate_index_db = 0;
+    return worker_res;
+}
+
+void evr_stop_index_db_migration(struct evr_glacier_write_ctx *ctx){
+    evr_glacier_lock_index(ctx);
+    ctx->stop_index_db_migration = 1;
+    evr_glacier_unlock_index(ctx);
+    // the worker logged its failures already
+    evr_glacier_join_index_db_migration(ctx);
+}
+
+int evr_move_to_last_bucket_visitor(void *context, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name);
+
+/**
+ * evr_walk_buckets visits every bucket file in all bucket
+ * directories.
+ */
+int evr_walk_buckets(struct evr_glacier_write_ctx *wctx, int (*visit)(void *ctx, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name), void *ctx);
+
+int evr_walk_bucket_dir(const char *bucket_dir_path, int (*visit)(void *ctx, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name), void *ctx);
 
 int move_to_last_bucket(struct evr_glacier_write_ctx *ctx){
-    ctx->current_bucket_index = 0;
+    ctx->last_bucket_index = 0;
     if(evr_walk_buckets(ctx, evr_move_to_last_bucket_visitor, ctx) != evr_ok){
         return evr_error;
     }
     return evr_ok;
 }
 
-int evr_move_to_last_bucket_visitor(void *context, unsigned long bucket_index, char *bucket_file_name){
+int evr_move_to_last_bucket_visitor(void *context, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name){
     struct evr_glacier_write_ctx *ctx = context;
-    if(bucket_index > ctx->current_bucket_index){
-        ctx->current_bucket_index = bucket_index;
+    if(bucket_index > ctx->last_bucket_index){
+        ctx->last_bucket_index = bucket_index;
+    }
+    return evr_ok;
+}
+
+int evr_walk_buckets(struct evr_glacier_write_ctx *wctx, int (*visit)(void *ctx, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name), void *ctx){
+    const size_t dirs_len = evr_glacier_bucket_dirs_len(wctx->config);
+    for(size_t i = 0; i < dirs_len; ++i){
+        if(evr_walk_bucket_dir(evr_glacier_bucket_dir(wctx->config, i), visit, ctx) != evr_ok){
+            return evr_error;
+        }
     }
     return evr_ok;
 }
 
-int evr_walk_buckets(struct evr_glacier_write_ctx *wctx, int (*visit)(void *ctx, unsigned long bucket_index, char *bucket_file_name), void *ctx){
+int evr_walk_bucket_dir(const char *bucket_dir_path, int (*visit)(void *ctx, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name), void *ctx){
     int ret = evr_error;
-    DIR *dir = opendir(wctx->config->bucket_dir_path);
+    DIR *dir = opendir(bucket_dir_path);
     if(!dir){
+        log_error("Unable to open bucket directory %s", bucket_dir_path);
         goto out;
     }
     int readdir_errno;
@@ -481,8 +1773,8 @@ int evr_walk_buckets(struct evr_glacier_write_ctx *wctx, int (*visit)(void *ctx,
         if(sscanf(file_name, "%lx", &index) != 1){
             continue;
         }
-        if(visit(ctx, index, d->d_name) != evr_ok){
-            log_error("Unable to visit bucket file %s", d->d_name);
+        if(visit(ctx, index, bucket_dir_path, d->d_name) != evr_ok){
+            log_error("Unable to visit bucket file %s in %s", d->d_name, bucket_dir_path);
             goto out_with_close_dir;
         }
     }
@@ -496,37 +1788,138 @@ int evr_walk_buckets(struct evr_glacier_write_ctx *wctx, int (*visit)(void *ctx,
     return ret;
 }
 
-int open_current_bucket(struct evr_glacier_write_ctx *ctx, int create) {
+int open_current_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, int create) {
     int open_flags = O_RDWR | (create ? (O_CREAT | O_EXCL) : 0);
-    ctx->current_bucket_f = evr_open_bucket(ctx->config, ctx->current_bucket_index, open_flags);
-    if(ctx->current_bucket_f == -1){
-        log_error("Unable to open bucket " evr_bucket_file_name_fmt " file", ctx->current_bucket_index);
+    lane->current_bucket_f = evr_open_bucket(ctx->config, lane->current_bucket_index, open_flags);
+    if(lane->current_bucket_f == -1){
+        log_error("Unable to open bucket " evr_bucket_file_name_fmt " file", lane->current_bucket_index);
         return evr_error;
     }
-    return evr_ok;
+    return evr_ok;
+}
+
+int evr_continue_lane_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, unsigned long bucket_index){
+    lane->current_bucket_index = bucket_index;
+    // the blobs which are already in a continued bucket are unknown
+    // to the lane. so the continued bucket is never sealed.
+    free(lane->seal_entries);
+    lane->seal_entries = NULL;
+    if(open_current_bucket(ctx, lane, 0) != evr_ok){
+        return evr_error;
+    }
+    if(evr_validate_bucket_magic_number(lane->current_bucket_f) != evr_ok){
+        return evr_error;
+    }
+    if(evr_read_bucket_end_offset(lane->current_bucket_f, &lane->current_bucket_pos) != evr_ok){
+        return evr_error;
+    }
+    if(lane->current_bucket_pos == evr_bucket_end_offset_corrupt){
+        log_debug("Skipping bucket " evr_bucket_file_name_fmt " because end offset indicates corrupt bucket end", lane->current_bucket_index);
+        if(create_next_bucket(ctx, lane) != evr_ok){
+            return evr_error;
+        }
+    }
+    return evr_ok;
+}
+
+size_t evr_glacier_bucket_dirs_len(const struct evr_glacier_storage_cfg *config){
+    size_t len = 1;
+    for(struct evr_llbuf *it = config->stripe_dir_paths; it; it = it->next){
+        ++len;
+    }
+    return len;
+}
+
+const char *evr_glacier_bucket_dir(const struct evr_glacier_storage_cfg *config, size_t dir_index){
+    if(dir_index == 0){
+        return config->bucket_dir_path;
+    }
+    struct evr_llbuf *it = config->stripe_dir_paths;
+    for(size_t i = 1; i < dir_index; ++i){
+        it = it->next;
+    }
+    return it->data;
+}
+
+int evr_glacier_place_bucket(const struct evr_glacier_storage_cfg *config, unsigned long bucket_index, size_t *dir_index){
+    const size_t dirs_len = evr_glacier_bucket_dirs_len(config);
+    *dir_index = bucket_index % dirs_len;
+    if(config->bucket_dir_policy != evr_bucket_dir_policy_free_space || dirs_len == 1){
+        return evr_ok;
+    }
+    // free space is weighted in MiB so the sum of all directories
+    // can't overflow.
+    uint64_t free_space[dirs_len];
+    uint64_t free_space_sum = 0;
+    for(size_t i = 0; i < dirs_len; ++i){
+        struct statvfs st;
+        const char *dir = evr_glacier_bucket_dir(config, i);
+        if(statvfs(dir, &st) != 0){
+            log_error("Unable to get free space of bucket directory %s", dir);
+            return evr_error;
+        }
+        free_space[i] = ((uint64_t)st.f_bavail * st.f_frsize) >> 20;
+        free_space_sum += free_space[i];
+    }
+    if(free_space_sum == 0){
+        // all disks are full. stay with round robin and let the
+        // write fail in the directory's own way.
+        return evr_ok;
+    }
+    // the bucket index is scrambled so consecutive buckets are
+    // distributed over the directories like random numbers would be.
+    uint64_t pick = (uint64_t)bucket_index * UINT64_C(0x9e3779b97f4a7c15);
+    pick = (pick ^ (pick >> 29)) % free_space_sum;
+    for(size_t i = 0; i < dirs_len; ++i){
+        if(pick < free_space[i]){
+            *dir_index = i;
+            break;
+        }
+        pick -= free_space[i];
+    }
+    return evr_ok;
+}
+
+int evr_open_bucket(const struct evr_glacier_storage_cfg *config, unsigned long bucket_index, int open_flags){
+    const size_t dirs_len = evr_glacier_bucket_dirs_len(config);
+    if(open_flags & O_CREAT){
+        size_t dir_index;
+        if(evr_glacier_place_bucket(config, bucket_index, &dir_index) != evr_ok){
+            return -1;
+        }
+        return evr_open_bucket_in_dir(evr_glacier_bucket_dir(config, dir_index), bucket_index, open_flags);
+    }
+    // existing buckets are searched in all bucket directories
+    // starting with the round robin directory. so buckets are found
+    // even after they were moved to another directory or the
+    // placement policy changed.
+    for(size_t i = 0; i < dirs_len; ++i){
+        const char *dir = evr_glacier_bucket_dir(config, (bucket_index + i) % dirs_len);
+        int f = evr_open_bucket_in_dir(dir, bucket_index, open_flags);
+        if(f >= 0 || errno != ENOENT){
+            return f;
+        }
+    }
+    return -1;
 }
 
-int evr_open_bucket(const struct evr_glacier_storage_cfg *config, unsigned long bucket_index, int open_flags){
+int evr_open_bucket_in_dir(const char *bucket_dir_path, unsigned long bucket_index, int open_flags){
     char *bucket_path;
     {
         // this block builds bucket_path
-        size_t bucket_dir_path_len = strlen(config->bucket_dir_path);
+        size_t bucket_dir_path_len = strlen(bucket_dir_path);
         size_t bucket_path_max_len = bucket_dir_path_len + 30;
         bucket_path = alloca(bucket_path_max_len);
         char *end = bucket_path + bucket_path_max_len - 1;
-        memcpy(bucket_path, config->bucket_dir_path, bucket_dir_path_len);
+        memcpy(bucket_path, bucket_dir_path, bucket_dir_path_len);
         char *s = bucket_path + bucket_dir_path_len;
         *s++ = '/';
         if(snprintf(s, end - bucket_path, evr_bucket_file_name_fmt, bucket_index) < 0){
-            return 1;
+            return -1;
         }
         *end = '\0';
     }
-    int f = open(bucket_path, open_flags, 0644);
-    if(f == -1){
-        return 1;
-    }
-    return f;
+    return open(bucket_path, open_flags, 0644);
 }
 
 int evr_free_glacier_write_ctx(struct evr_glacier_write_ctx *ctx){
@@ -534,7 +1927,19 @@ int evr_free_glacier_write_ctx(struct evr_glacier_write_ctx *ctx){
         return 0;
     }
     int ret = 1;
-    if(close_current_bucket(ctx)){
+    evr_stop_index_db_migration(ctx);
+    for(size_t i = 0; i < ctx->lanes_len; ++i){
+        if(close_current_bucket(ctx, &ctx->lanes[i])){
+            goto end;
+        }
+    }
+    if(sqlite3_finalize(ctx->rollback_stmt) != SQLITE_OK){
+        goto end;
+    }
+    if(sqlite3_finalize(ctx->commit_stmt) != SQLITE_OK){
+        goto end;
+    }
+    if(sqlite3_finalize(ctx->begin_stmt) != SQLITE_OK){
         goto end;
     }
     if(sqlite3_finalize(ctx->find_bucket_end_offset_stmt) != SQLITE_OK){
@@ -558,6 +1963,13 @@ int evr_free_glacier_write_ctx(struct evr_glacier_write_ctx *ctx){
     }
     ret = 0;
  end:
+    cnd_destroy(&ctx->commit_turn);
+    mtx_destroy(&ctx->index_lock);
+    for(size_t i = 0; i < ctx->lanes_len; ++i){
+        evr_free_bucket_io(ctx->lanes[i].io);
+        free(ctx->lanes[i].seal_entries);
+    }
+    free(ctx->lanes);
     free(ctx);
     return ret;
 }
@@ -588,6 +2000,24 @@ int evr_open_index_db(struct evr_glacier_storage_cfg *cfg, int sqliteFlags, sqli
     if(sqlite3_exec(_db, "pragma synchronous=off", NULL, NULL, NULL) != SQLITE_OK){
         goto out_with_close_db;
     }
+    {
+        char pragma[64];
+        if(cfg->index_db_cache_size > 0){
+            // negative cache_size values are KiB instead of pages
+            if(snprintf(pragma, sizeof(pragma), "pragma cache_size=-%zu", max(1, cfg->index_db_cache_size >> 10)) >= (int)sizeof(pragma)){
+                goto out_with_close_db;
+            }
+            if(sqlite3_exec(_db, pragma, NULL, NULL, NULL) != SQLITE_OK){
+                goto out_with_close_db;
+            }
+        }
+        if(snprintf(pragma, sizeof(pragma), "pragma mmap_size=%zu", cfg->index_db_mmap_size) >= (int)sizeof(pragma)){
+            goto out_with_close_db;
+        }
+        if(sqlite3_exec(_db, pragma, NULL, NULL, NULL) != SQLITE_OK){
+            goto out_with_close_db;
+        }
+    }
     *db = _db;
     ret = evr_ok;
  out:
@@ -623,118 +2053,603 @@ void build_glacier_file_path(char *glacier_file_path, size_t glacier_file_path_s
     memcpy(p, path_suffix, path_suffix_len+1);
 }
 
-int evr_glacier_add_blob_to_index(struct evr_glacier_write_ctx *ctx, evr_blob_ref ref, int flags, size_t blob_offset, size_t blob_size, evr_time last_modified);
+int evr_glacier_add_blob_to_index(struct evr_glacier_write_ctx *ctx, unsigned long bucket_index, evr_blob_ref ref, int flags, size_t blob_offset, size_t blob_size, evr_time last_modified);
 
 int evr_glacier_append_blob(struct evr_glacier_write_ctx *ctx, struct evr_writing_blob *blob, evr_time *last_modified) {
+    return evr_glacier_append_blobs(ctx, &blob, 1, NULL, last_modified);
+}
+
+/**
+ * evr_glacier_append_blobs_segment writes stored into the lane's
+ * current bucket. stored contains the blobs as they are written to
+ * disk and blobs the blobs as they were appended.
+ */
+int evr_glacier_append_blobs_segment(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, struct evr_writing_blob **blobs, struct evr_writing_blob **stored, size_t blobs_len, evr_time last_modified, unsigned long commit_ticket);
+
+/**
+ * evr_glacier_deflate_blob replaces blob's chunks and size with a
+ * compressed copy if blob looks compressible. The compressed chunks
+ * are put into deflated and must be freed by the caller.
+ *
+ * *deflated is NULL if blob is stored as it is.
+ */
+int evr_glacier_deflate_blob(struct evr_writing_blob *blob, struct chunk_set **deflated);
+
+/**
+ * evr_glacier_looks_compressed guesses if data belongs to an already
+ * compressed blob.
+ */
+int evr_glacier_looks_compressed(const char *data, size_t data_size);
+
+/**
+ * evr_glacier_draw_commit_ticket sets last_modified and returns the
+ * commit ticket which belongs to it.
+ */
+unsigned long evr_glacier_draw_commit_ticket(struct evr_glacier_write_ctx *ctx, evr_time *last_modified);
+
+/**
+ * evr_glacier_wait_for_commit_turn locks ctx->index_lock and waits
+ * until all commit tickets before commit_ticket are served.
+ */
+void evr_glacier_wait_for_commit_turn(struct evr_glacier_write_ctx *ctx, unsigned long commit_ticket);
+
+/**
+ * evr_glacier_serve_commit_ticket marks commit_ticket as served so
+ * the next commit ticket's turn starts.
+ */
+void evr_glacier_serve_commit_ticket(struct evr_glacier_write_ctx *ctx, unsigned long commit_ticket);
+
+int evr_glacier_append_blobs(struct evr_glacier_write_ctx *ctx, struct evr_writing_blob **blobs, size_t blobs_len, int *results, evr_time *last_modified){
+    return evr_glacier_append_lane_blobs(ctx, 0, blobs, blobs_len, results, last_modified);
+}
+
+int evr_glacier_append_lane_blobs(struct evr_glacier_write_ctx *ctx, size_t lane_index, struct evr_writing_blob **blobs, size_t blobs_len, int *results, evr_time *last_modified){
     int ret = evr_error;
-    evr_now(last_modified);
-    uint64_t t64 = (uint64_t)*last_modified;
-    char header_buf[evr_bucket_blob_header_size];
-    const size_t blob_disk_size = evr_bucket_blob_header_size + blob->size;
-    // worst_disk_size is the smallest possible bucket size containing
-    // the given blob.
-    const size_t worst_disk_size = evr_bucket_header_size + blob_disk_size;
+    if(results){
+        for(size_t i = 0; i < blobs_len; ++i){
+            results[i] = evr_error;
+        }
+    }
+    if(lane_index >= ctx->lanes_len){
+        log_error("Glacier has no bucket lane %zu", lane_index);
+        return evr_error;
+    }
+    struct evr_glacier_bucket_lane *lane = &ctx->lanes[lane_index];
+    struct evr_writing_blob stored_blobs[blobs_len];
+    struct chunk_set *deflated[blobs_len];
+    for(size_t i = 0; i < blobs_len; ++i){
+        stored_blobs[i] = *blobs[i];
+        deflated[i] = NULL;
+    }
+    // accepted holds the blobs which are worth trying to persist.
+    // stored holds the accepted blobs as they are written to
+    // disk. accepted_indices maps them back to their index in
+    // blobs. a blob which is rejected here only fails itself and not
+    // the other blobs of the batch.
+    struct evr_writing_blob *accepted[blobs_len];
+    struct evr_writing_blob *stored[blobs_len];
+    size_t accepted_indices[blobs_len];
+    size_t accepted_len = 0;
+    for(size_t i = 0; i < blobs_len; ++i){
+        if(ctx->config->blob_compression == evr_blob_compression_deflate){
+            // blobs are compressed before the commit ticket is drawn
+            // so the other lanes don't wait for the compression.
+            if(evr_glacier_deflate_blob(&stored_blobs[i], &deflated[i]) != evr_ok){
+                continue;
+            }
+        }
+        // worst_disk_size is the smallest possible bucket size
+        // containing the given blob.
+        const size_t worst_disk_size = evr_bucket_header_size + evr_bucket_blob_header_size + stored_blobs[i].size;
+        if(worst_disk_size > ctx->config->max_bucket_size){
+            evr_blob_ref_str fmt_key;
+            evr_fmt_blob_ref(fmt_key, blobs[i]->key);
+            log_error("Can't persist blob for key %s in glacier directory %s with %ld bytes which is bigger than max bucket size %ld", fmt_key, ctx->config->bucket_dir_path, worst_disk_size, ctx->config->max_bucket_size);
+            continue;
+        }
+        accepted[accepted_len] = blobs[i];
+        stored[accepted_len] = &stored_blobs[i];
+        accepted_indices[accepted_len] = i;
+        ++accepted_len;
+    }
+    const unsigned long commit_ticket = evr_glacier_draw_commit_ticket(ctx, last_modified);
+    size_t seg_start = 0;
+    while(seg_start < accepted_len){
+        if(lane->current_bucket_pos + evr_bucket_blob_header_size + stored[seg_start]->size > ctx->config->max_bucket_size){
+            if(create_next_bucket(ctx, lane)){
+                goto out;
+            }
+        }
+        // the segment reaches from seg_start to seg_end and contains
+        // all following blobs which still fit into the current
+        // bucket.
+        size_t seg_end = seg_start;
+        size_t seg_bucket_pos = lane->current_bucket_pos;
+        for(; seg_end < accepted_len; ++seg_end){
+            const size_t blob_disk_size = evr_bucket_blob_header_size + stored[seg_end]->size;
+            if(seg_bucket_pos + blob_disk_size > ctx->config->max_bucket_size){
+                break;
+            }
+            seg_bucket_pos += blob_disk_size;
+        }
+        // every segment is indexed within its own transaction. so the
+        // segments before a failing segment stay persisted. the
+        // segments after a failing segment are not tried because the
+        // lane's current bucket might be in an unknown state.
+        if(evr_glacier_append_blobs_segment(ctx, lane, &accepted[seg_start], &stored[seg_start], seg_end - seg_start, *last_modified, commit_ticket) != evr_ok){
+            goto out;
+        }
+        if(results){
+            for(size_t i = seg_start; i < seg_end; ++i){
+                results[accepted_indices[i]] = evr_ok;
+            }
+        }
+        seg_start = seg_end;
+    }
+    if(accepted_len == blobs_len){
+        ret = evr_ok;
+    }
+ out:
+    evr_glacier_serve_commit_ticket(ctx, commit_ticket);
+    for(size_t i = 0; i < blobs_len; ++i){
+        if(deflated[i]){
+            evr_free_chunk_set(deflated[i]);
+        }
+    }
+    return ret;
+}
+
+int evr_glacier_begin_blob_stream(struct evr_glacier_write_ctx *ctx, size_t lane_index, struct evr_glacier_blob_stream *s){
+    if(lane_index >= ctx->lanes_len){
+        log_error("Glacier has no bucket lane %zu", lane_index);
+        return evr_error;
+    }
+    struct evr_glacier_bucket_lane *lane = &ctx->lanes[lane_index];
+    const size_t worst_disk_size = evr_bucket_header_size + evr_bucket_blob_header_size + s->blob.size;
     if(worst_disk_size > ctx->config->max_bucket_size){
         evr_blob_ref_str fmt_key;
-        evr_fmt_blob_ref(fmt_key, blob->key);
+        evr_fmt_blob_ref(fmt_key, s->blob.key);
         log_error("Can't persist blob for key %s in glacier directory %s with %ld bytes which is bigger than max bucket size %ld", fmt_key, ctx->config->bucket_dir_path, worst_disk_size, ctx->config->max_bucket_size);
-        goto fail;
+        return evr_error;
     }
-    evr_glacier_profile_block_enter(blob_disk_write);
-    if(ctx->current_bucket_pos + blob_disk_size > ctx->config->max_bucket_size){
-        if(create_next_bucket(ctx)){
-            goto fail;
+    if(lane->current_bucket_pos + evr_bucket_blob_header_size + s->blob.size > ctx->config->max_bucket_size){
+        if(create_next_bucket(ctx, lane)){
+            return evr_error;
         }
     }
-    if(lseek(ctx->current_bucket_f, ctx->current_bucket_pos, SEEK_SET) == -1){
-        goto fail;
+    s->blob.chunks = NULL;
+    s->lane = lane_index;
+    s->written = 0;
+    s->crc = crc32(0L, Z_NULL, 0);
+    return evr_ok;
+}
+
+int evr_glacier_write_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s, const char *data, size_t data_size){
+    if(data_size > s->blob.size - s->written){
+        log_error("Blob stream got more than the announced %zu bytes", s->blob.size);
+        return evr_error;
     }
-    struct evr_buf_pos bp;
-    evr_init_buf_pos(&bp, header_buf);
-    evr_push_n(&bp, blob->key, evr_blob_ref_size);
-    evr_push_as(&bp, &blob->flags, uint8_t);
-    evr_push_map(&bp, &t64, uint64_t, htobe64);
-    evr_push_map(&bp, &blob->size, uint32_t, htobe32);
-    evr_push_8bit_checksum(&bp);
-    struct evr_file current_bucket_f;
-    evr_file_bind_fd(&current_bucket_f, ctx->current_bucket_f);
-    if(write_n(&current_bucket_f, header_buf, evr_bucket_blob_header_size) != evr_ok){
-        evr_blob_ref_str fmt_key;
-        evr_fmt_blob_ref(fmt_key, blob->key);
-        log_error("Can't write blob header for key %s in glacier directory %s.", fmt_key, ctx->config->bucket_dir_path);
-        goto fail;
+    struct evr_glacier_bucket_lane *lane = &ctx->lanes[s->lane];
+    const off_t offset = lane->current_bucket_pos + evr_bucket_blob_header_size;
+    while(data_size > 0){
+        ssize_t res = pwrite(lane->current_bucket_f, data, data_size, offset + s->written);
+        if(res < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            log_error("Can't write streamed blob data in glacier directory %s: %s", ctx->config->bucket_dir_path, strerror(errno));
+            return evr_error;
+        }
+        s->crc = crc32(s->crc, (const Bytef*)data, res);
+        data += res;
+        data_size -= res;
+        s->written += res;
+    }
+    return evr_ok;
+}
+
+int evr_glacier_commit_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s, evr_time *last_modified){
+    if(s->written != s->blob.size){
+        log_error("Can't commit blob stream with %zu of %zu bytes written", s->written, s->blob.size);
+        return evr_error;
+    }
+    struct evr_glacier_bucket_lane *lane = &ctx->lanes[s->lane];
+    struct evr_writing_blob *blob = &s->blob;
+    const size_t blob_pos = lane->current_bucket_pos;
+    const unsigned long commit_ticket = evr_glacier_draw_commit_ticket(ctx, last_modified);
+    // the blob is stored as it is. so blob is also its own stored
+    // representation.
+    int ret = evr_glacier_append_blobs_segment(ctx, lane, &blob, &blob, 1, *last_modified, commit_ticket);
+    evr_glacier_serve_commit_ticket(ctx, commit_ticket);
+    if(lane->seal_entries && lane->current_bucket_pos != blob_pos){
+        // the blob's header got added to seal_crc when it was
+        // written. the data follows it.
+        lane->seal_crc = crc32_combine(lane->seal_crc, s->crc, s->blob.size);
+    }
+    return ret;
+}
+
+int evr_glacier_abort_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s){
+    struct evr_glacier_bucket_lane *lane = &ctx->lanes[s->lane];
+    // the end offset check at startup compares the bucket's file size
+    // with the indexed end offset. so the aborted data is cut off
+    // instead of being left for the next append to overwrite.
+    if(ftruncate(lane->current_bucket_f, lane->current_bucket_pos) != 0){
+        log_error("Can't drop aborted blob stream from glacier directory %s: %s", ctx->config->bucket_dir_path, strerror(errno));
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_glacier_deflate_blob(struct evr_writing_blob *blob, struct chunk_set **deflated){
+    int ret = evr_error;
+    *deflated = NULL;
+    if(blob->size < evr_deflate_min_size || evr_glacier_looks_compressed(blob->chunks[0], min(blob->size, evr_chunk_size))){
+        return evr_ok;
+    }
+    // the compressed blob must save at least an eighth of the
+    // blob's size. otherwise the blob is stored as it is.
+    const size_t max_size = blob->size - blob->size / 8;
+    struct chunk_set *cs = evr_allocate_chunk_set(ceil_div(max_size, evr_chunk_size));
+    if(!cs){
+        goto out;
     }
-    char **c = blob->chunks;
-    for(size_t bytes_written = 0; bytes_written < blob->size;){
-        size_t chunk_bytes_len = evr_chunk_size;
-        size_t remaining_blob_bytes = blob->size - bytes_written;
-        if(remaining_blob_bytes < chunk_bytes_len){
-            chunk_bytes_len = remaining_blob_bytes;
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    if(deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK){
+        log_error("Unable to initialize zlib deflate stream");
+        goto out_with_free_cs;
+    }
+    char **in_chunk = blob->chunks;
+    size_t in_remaining = blob->size;
+    size_t out_chunk = 0;
+    zs.next_in = Z_NULL;
+    zs.avail_in = 0;
+    zs.next_out = (Bytef*)cs->chunks[out_chunk];
+    zs.avail_out = min(max_size, evr_chunk_size);
+    int zres = Z_OK;
+    while(zres != Z_STREAM_END){
+        if(zs.avail_in == 0 && in_remaining > 0){
+            zs.next_in = (Bytef*)*in_chunk;
+            zs.avail_in = min(in_remaining, evr_chunk_size);
+            in_remaining -= zs.avail_in;
+            ++in_chunk;
         }
-        if(write_n(&current_bucket_f, *c, chunk_bytes_len) != evr_ok){
-            evr_blob_ref_str fmt_key;
-            evr_fmt_blob_ref(fmt_key, blob->key);
-            log_error("Can't write blob data for key %s in glacier directory %s.", fmt_key, ctx->config->bucket_dir_path);
-            goto fail;
+        if(zs.avail_out == 0){
+            if(zs.total_out >= max_size){
+                // not compressible enough
+                ret = evr_ok;
+                goto out_with_end_deflate;
+            }
+            ++out_chunk;
+            zs.next_out = (Bytef*)cs->chunks[out_chunk];
+            zs.avail_out = min(max_size - zs.total_out, evr_chunk_size);
+        }
+        zres = deflate(&zs, in_remaining == 0 ? Z_FINISH : Z_NO_FLUSH);
+        if(zres != Z_OK && zres != Z_STREAM_END && zres != Z_BUF_ERROR){
+            log_error("Unable to deflate blob: zlib error %d", zres);
+            goto out_with_end_deflate;
         }
-        bytes_written += chunk_bytes_len;
-        c++;
     }
-    evr_glacier_profile_block_enter(blob_fsync);
-    if(blob->sync_strategy == evr_sync_strategy_per_blob){
-        if(fdatasync(ctx->current_bucket_f) != 0){
-            evr_blob_ref_str fmt_key;
-            evr_fmt_blob_ref(fmt_key, blob->key);
-            log_error("Can't fsync blob data for key %s in glacier directory %s.", ctx->config->bucket_dir_path);
-            goto fail;
+    cs->size_used = zs.total_out;
+    blob->chunks = cs->chunks;
+    blob->size = zs.total_out;
+    blob->flags |= evr_blob_flag_deflated;
+    *deflated = cs;
+    ret = evr_ok;
+ out_with_end_deflate:
+    deflateEnd(&zs);
+ out_with_free_cs:
+    if(!*deflated){
+        evr_free_chunk_set(cs);
+    }
+ out:
+    return ret;
+}
+
+int evr_glacier_looks_compressed(const char *data, size_t data_size){
+    static const struct {
+        size_t offset;
+        size_t len;
+        const char *magic;
+    } formats[] = {
+        { 0, 2, "\x1f\x8b" }, // gzip
+        { 0, 4, "\x28\xb5\x2f\xfd" }, // zstd
+        { 0, 3, "BZh" }, // bzip2
+        { 0, 6, "\xfd" "7zXZ\x00" }, // xz
+        { 0, 6, "7z\xbc\xaf\x27\x1c" }, // 7z
+        { 0, 4, "PK\x03\x04" }, // zip and zip based documents
+        { 0, 8, "\x89PNG\r\n\x1a\n" }, // png
+        { 0, 3, "\xff\xd8\xff" }, // jpeg
+        { 0, 4, "GIF8" }, // gif
+        { 0, 4, "OggS" }, // ogg
+        { 0, 4, "fLaC" }, // flac
+        { 0, 3, "ID3" }, // mp3
+        { 4, 4, "ftyp" }, // mp4 and other iso media
+        { 8, 4, "WEBP" }, // webp
+        { 0, 4, "\x1a\x45\xdf\xa3" }, // matroska and webm
+    };
+    for(size_t i = 0; i < static_len(formats); ++i){
+        if(data_size >= formats[i].offset + formats[i].len && memcmp(&data[formats[i].offset], formats[i].magic, formats[i].len) == 0){
+            return 1;
         }
-        ctx->current_bucket_sync = 1;
     }
-    evr_glacier_profile_block_leave(blob_fsync, "", NULL);
-    size_t blob_offset = ctx->current_bucket_pos + evr_bucket_blob_header_size;
-    ctx->current_bucket_pos += evr_bucket_blob_header_size + blob->size;
-    const size_t end_offset = ctx->current_bucket_pos;
-    if(evr_write_bucket_end_offset(ctx->current_bucket_f, ctx->current_bucket_pos, blob->sync_strategy == evr_sync_strategy_per_blob) != evr_ok){
-        goto fail;
+    // compressed and encrypted data uses almost every possible byte
+    // value even in a small sample while text and markup doesn't.
+    const size_t sample_size = min(data_size, 4096);
+    if(sample_size < 1024){
+        return 0;
     }
-    if(blob->sync_strategy == evr_sync_strategy_per_blob){
-        // mark as sync because the previous
-        // evr_write_bucket_end_offset call did an fsync
-        ctx->current_bucket_sync = 1;
-    } else {
-        ctx->current_bucket_sync = 0;
+    unsigned char seen[256] = { 0 };
+    size_t distinct = 0;
+    for(size_t i = 0; i < sample_size; ++i){
+        unsigned char *s = &seen[(unsigned char)data[i]];
+        if(!*s){
+            *s = 1;
+            ++distinct;
+        }
+    }
+    return distinct > 240;
+}
+
+unsigned long evr_glacier_draw_commit_ticket(struct evr_glacier_write_ctx *ctx, evr_time *last_modified){
+    evr_glacier_lock_index(ctx);
+    evr_now(last_modified);
+    unsigned long commit_ticket = ctx->next_commit_ticket++;
+    evr_glacier_unlock_index(ctx);
+    return commit_ticket;
+}
+
+void evr_glacier_wait_for_commit_turn(struct evr_glacier_write_ctx *ctx, unsigned long commit_ticket){
+    evr_glacier_lock_index(ctx);
+    while(ctx->served_commit_ticket != commit_ticket){
+        if(cnd_wait(&ctx->commit_turn, &ctx->index_lock) != thrd_success){
+            evr_panic("Unable to wait for glacier commit turn");
+        }
+    }
+}
+
+void evr_glacier_serve_commit_ticket(struct evr_glacier_write_ctx *ctx, unsigned long commit_ticket){
+    evr_glacier_wait_for_commit_turn(ctx, commit_ticket);
+    ctx->served_commit_ticket += 1;
+    if(cnd_broadcast(&ctx->commit_turn) != thrd_success){
+        evr_panic("Unable to signal glacier commit turn");
+    }
+    evr_glacier_unlock_index(ctx);
+}
+
+void evr_glacier_lock_index(struct evr_glacier_write_ctx *ctx){
+    if(mtx_lock(&ctx->index_lock) != thrd_success){
+        evr_panic("Unable to lock glacier index");
+    }
+}
+
+void evr_glacier_unlock_index(struct evr_glacier_write_ctx *ctx){
+    if(mtx_unlock(&ctx->index_lock) != thrd_success){
+        evr_panic("Unable to unlock glacier index");
+    }
+}
+
+/**
+ * evr_glacier_write_blobs appends blobs to the lane's current bucket
+ * and moves the bucket's end offset behind them.
+ *
+ * Only the header is written for blobs without chunks. Their data
+ * must already be in place behind the header like it is for
+ * committed blob streams.
+ *
+ * The blobs and the end offset are fdatasynced if sync is not zero.
+ */
+int evr_glacier_write_blobs(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, struct evr_writing_blob **blobs, size_t blobs_len, evr_time last_modified, int sync);
+
+int evr_glacier_step_tx_stmt(struct evr_glacier_write_ctx *ctx, sqlite3_stmt *stmt);
+
+/**
+ * evr_glacier_collect_seal_entries adds the seal entries for blobs
+ * written at blob_offset to the lane's seal_entries.
+ */
+void evr_glacier_collect_seal_entries(struct evr_glacier_bucket_lane *lane, struct evr_writing_blob **blobs, struct evr_writing_blob **stored, size_t blobs_len, evr_time last_modified, size_t blob_offset);
+
+int evr_glacier_append_blobs_segment(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, struct evr_writing_blob **blobs, struct evr_writing_blob **stored, size_t blobs_len, evr_time last_modified, unsigned long commit_ticket){
+    int ret = evr_error;
+    int sync = 0;
+    for(size_t i = 0; i < blobs_len; ++i){
+        if(blobs[i]->sync_strategy == evr_sync_strategy_per_blob){
+            sync = 1;
+            break;
+        }
+    }
+    evr_glacier_profile_block_enter(blob_disk_write);
+    if(evr_glacier_write_blobs(ctx, lane, stored, blobs_len, last_modified, sync) != evr_ok){
+        goto out;
+    }
+    size_t blob_offset = lane->current_bucket_pos;
+    if(lane->seal_entries){
+        evr_glacier_collect_seal_entries(lane, blobs, stored, blobs_len, last_modified, blob_offset);
     }
+    for(size_t i = 0; i < blobs_len; ++i){
+        lane->current_bucket_pos += evr_bucket_blob_header_size + stored[i]->size;
+    }
+    const size_t end_offset = lane->current_bucket_pos;
+    lane->current_bucket_sync = sync;
     evr_glacier_profile_block_leave(blob_disk_write, "", NULL);
-    if(evr_glacier_add_blob_to_index(ctx, blob->key, blob->flags, blob_offset, blob->size, *last_modified) != evr_ok){
-        goto fail;
+    evr_glacier_wait_for_commit_turn(ctx, commit_ticket);
+    if(evr_glacier_step_tx_stmt(ctx, ctx->begin_stmt) != evr_ok){
+        goto out_with_unlock_index;
+    }
+    for(size_t i = 0; i < blobs_len; ++i){
+        struct evr_writing_blob *blob = blobs[i];
+        blob_offset += evr_bucket_blob_header_size;
+        if(evr_glacier_add_blob_to_index(ctx, lane->current_bucket_index, blob->key, stored[i]->flags, blob_offset, blob->size, last_modified) != evr_ok){
+            goto out_with_rollback;
+        }
+        blob->pos.flags = stored[i]->flags;
+        blob->pos.bucket_index = lane->current_bucket_index;
+        blob->pos.offset = blob_offset;
+        blob->pos.size = blob->size;
+        blob_offset += stored[i]->size;
     }
     if(sqlite3_bind_int(ctx->update_bucket_end_offset_stmt, 1, end_offset) != SQLITE_OK){
         goto out_with_reset_update_bucket_end_offset_stmt;
     }
-    if(sqlite3_bind_int(ctx->update_bucket_end_offset_stmt, 2, ctx->current_bucket_index) != SQLITE_OK){
+    if(sqlite3_bind_int(ctx->update_bucket_end_offset_stmt, 2, lane->current_bucket_index) != SQLITE_OK){
         goto out_with_reset_update_bucket_end_offset_stmt;
     }
     if(evr_step_stmt(ctx->db, ctx->update_bucket_end_offset_stmt) != SQLITE_DONE){
         goto out_with_reset_update_bucket_end_offset_stmt;
     }
+    if(sqlite3_reset(ctx->update_bucket_end_offset_stmt) != SQLITE_OK){
+        evr_panic("Unable to reset update_bucket_end_offset_stmt");
+        goto out_with_rollback;
+    }
+    if(evr_glacier_step_tx_stmt(ctx, ctx->commit_stmt) != evr_ok){
+        goto out_with_rollback;
+    }
 #ifdef EVR_LOG_DEBUG
-    {
+    for(size_t i = 0; i < blobs_len; ++i){
         evr_blob_ref_str fmt_key;
-        evr_fmt_blob_ref(fmt_key, blob->key);
+        evr_fmt_blob_ref(fmt_key, blobs[i]->key);
         log_debug("Wrote blob with key %s to glacier", fmt_key);
     }
 #endif
     ret = evr_ok;
+    goto out_with_unlock_index;
  out_with_reset_update_bucket_end_offset_stmt:
     if(sqlite3_reset(ctx->update_bucket_end_offset_stmt) != SQLITE_OK){
         evr_panic("Unable to reset update_bucket_end_offset_stmt");
+    }
+ out_with_rollback:
+    if(evr_glacier_step_tx_stmt(ctx, ctx->rollback_stmt) != evr_ok){
+        evr_panic("Unable to rollback index db transaction for glacier %s", ctx->config->bucket_dir_path);
+    }
+ out_with_unlock_index:
+    evr_glacier_unlock_index(ctx);
+ out:
+    return ret;
+}
+
+void evr_glacier_collect_seal_entries(struct evr_glacier_bucket_lane *lane, struct evr_writing_blob **blobs, struct evr_writing_blob **stored, size_t blobs_len, evr_time last_modified, size_t blob_offset){
+    const uint64_t t64 = (uint64_t)last_modified;
+    char entry[evr_bucket_seal_entry_size];
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, entry);
+    for(size_t i = 0; i < blobs_len; ++i){
+        blob_offset += evr_bucket_blob_header_size;
+        evr_reset_buf_pos(&bp);
+        evr_push_n(&bp, blobs[i]->key, evr_blob_ref_size);
+        evr_push_as(&bp, &stored[i]->flags, uint8_t);
+        evr_push_map(&bp, &t64, uint64_t, htobe64);
+        evr_push_map(&bp, &blob_offset, uint32_t, htobe32);
+        evr_push_map(&bp, &stored[i]->size, uint32_t, htobe32);
+        evr_push_map(&bp, &blobs[i]->size, uint32_t, htobe32);
+        evr_push_8bit_checksum(&bp);
+        struct dynamic_array *seal_entries = write_n_dynamic_array(lane->seal_entries, entry, sizeof(entry));
+        if(!seal_entries){
+            log_info("Unable to collect seal entries for bucket " evr_bucket_file_name_fmt ". The bucket will not be sealed.", lane->current_bucket_index);
+            free(lane->seal_entries);
+            lane->seal_entries = NULL;
+            return;
+        }
+        lane->seal_entries = seal_entries;
+        blob_offset += stored[i]->size;
+    }
+}
+
+int evr_glacier_write_blobs(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, struct evr_writing_blob **blobs, size_t blobs_len, evr_time last_modified, int sync){
+    int ret = evr_error;
+    const uint64_t t64 = (uint64_t)last_modified;
+    size_t iov_len = 0;
+    size_t end_offset = lane->current_bucket_pos;
+    for(size_t i = 0; i < blobs_len; ++i){
+        iov_len += 1 + (blobs[i]->chunks ? ceil_div(blobs[i]->size, evr_chunk_size) : 0);
+        end_offset += evr_bucket_blob_header_size + blobs[i]->size;
+    }
+    const uint32_t end_offset_be = htobe32(end_offset);
+    char *buf = malloc(iov_len * sizeof(struct iovec) + blobs_len * evr_bucket_blob_header_size);
+    if(!buf){
+        goto out;
+    }
+    struct iovec *iov = (struct iovec*)buf;
+    char *header = buf + iov_len * sizeof(struct iovec);
+    struct iovec *it = iov;
+    for(size_t i = 0; i < blobs_len; ++i){
+        struct evr_writing_blob *blob = blobs[i];
+        struct evr_buf_pos bp;
+        evr_init_buf_pos(&bp, header);
+        evr_push_n(&bp, blob->key, evr_blob_ref_size);
+        evr_push_as(&bp, &blob->flags, uint8_t);
+        evr_push_map(&bp, &t64, uint64_t, htobe64);
+        evr_push_map(&bp, &blob->size, uint32_t, htobe32);
+        evr_push_8bit_checksum(&bp);
+        it->iov_base = header;
+        it->iov_len = evr_bucket_blob_header_size;
+        ++it;
+        header += evr_bucket_blob_header_size;
+        char **c = blob->chunks;
+        for(size_t remaining = c ? blob->size : 0; remaining > 0;){
+            it->iov_base = *c;
+            it->iov_len = min(remaining, evr_chunk_size);
+            remaining -= it->iov_len;
+            ++it;
+            ++c;
+        }
+    }
+    // iov is modified by evr_bucket_io_append. so the crc is
+    // calculated before.
+    unsigned long seal_crc = lane->seal_crc;
+    if(lane->seal_entries){
+        for(size_t i = 0; i < iov_len; ++i){
+            seal_crc = crc32(seal_crc, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    if(evr_bucket_io_append(lane->io, lane->current_bucket_f, lane->current_bucket_pos, iov, iov_len, &end_offset_be, evr_bucket_end_offset_size, strlen(evr_bucket_magic_number), sync) != evr_ok){
+        log_error("Can't write data of %zu blobs in glacier directory %s.", blobs_len, ctx->config->bucket_dir_path);
+        goto out_with_free_buf;
+    }
+    lane->seal_crc = seal_crc;
+    if(ctx->config->bucket_append_mode == evr_bucket_append_mode_uncached){
+        if(evr_glacier_drop_appended_pages(ctx, lane, lane->current_bucket_pos, end_offset - lane->current_bucket_pos, sync) != evr_ok){
+            goto out_with_free_buf;
+        }
+    }
+    ret = evr_ok;
+ out_with_free_buf:
+    free(buf);
+ out:
+    return ret;
+}
+
+int evr_glacier_drop_appended_pages(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane, off_t offset, size_t size, int synced){
+    if(!synced){
+        // POSIX_FADV_DONTNEED only drops clean pages
+        if(sync_file_range(lane->current_bucket_f, offset, size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0){
+            log_error("Can't write back appended blobs in glacier directory %s: %s", ctx->config->bucket_dir_path, strerror(errno));
+            return evr_error;
+        }
+    }
+    int advise_res = posix_fadvise(lane->current_bucket_f, offset, size, POSIX_FADV_DONTNEED);
+    if(advise_res != 0){
+        log_debug("Unable to drop appended blobs from page cache: %s", strerror(advise_res));
+    }
+    return evr_ok;
+}
+
+int evr_glacier_step_tx_stmt(struct evr_glacier_write_ctx *ctx, sqlite3_stmt *stmt){
+    int ret = evr_error;
+    if(evr_step_stmt(ctx->db, stmt) != SQLITE_DONE){
+        goto out_with_reset;
+    }
+    ret = evr_ok;
+ out_with_reset:
+    if(sqlite3_reset(stmt) != SQLITE_OK){
         ret = evr_error;
     }
- fail:
     return ret;
 }
 
-int evr_glacier_add_blob_to_index(struct evr_glacier_write_ctx *ctx, evr_blob_ref ref, int flags, size_t blob_offset, size_t blob_size, evr_time last_modified){
+int evr_glacier_add_blob_to_index(struct evr_glacier_write_ctx *ctx, unsigned long bucket_index, evr_blob_ref ref, int flags, size_t blob_offset, size_t blob_size, evr_time last_modified){
     int ret = evr_error;
     if(sqlite3_bind_blob(ctx->insert_blob_stmt, 1, ref, evr_blob_ref_size, SQLITE_TRANSIENT) != SQLITE_OK){
         goto out_with_reset;
@@ -742,7 +2657,7 @@ int evr_glacier_add_blob_to_index(struct evr_glacier_write_ctx *ctx, evr_blob_re
     if(sqlite3_bind_int(ctx->insert_blob_stmt, 2, flags) != SQLITE_OK){
         goto out_with_reset;
     }
-    if(sqlite3_bind_int64(ctx->insert_blob_stmt, 3, ctx->current_bucket_index) != SQLITE_OK){
+    if(sqlite3_bind_int64(ctx->insert_blob_stmt, 3, bucket_index) != SQLITE_OK){
         goto out_with_reset;
     }
     if(sqlite3_bind_int(ctx->insert_blob_stmt, 4, blob_offset) != SQLITE_OK){
@@ -781,29 +2696,69 @@ int evr_glacier_add_blob_to_index(struct evr_glacier_write_ctx *ctx, evr_blob_re
     return ret;
 }
 
-int create_next_bucket(struct evr_glacier_write_ctx *ctx){
+void evr_glacier_preallocate_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane){
+    // FALLOC_FL_KEEP_SIZE keeps the file size at the bucket's end so
+    // walking the bucket and the end offset checks are not affected
+    // by the reserved space.
+    if(fallocate(lane->current_bucket_f, FALLOC_FL_KEEP_SIZE, 0, ctx->config->max_bucket_size) != 0){
+        // running out of space here or a file system without
+        // fallocate support is no reason to refuse the bucket. the
+        // bucket just grows with every append then.
+        log_debug("Unable to preallocate bucket " evr_bucket_file_name_fmt ": %s", lane->current_bucket_index, strerror(errno));
+    }
+}
+
+/**
+ * evr_glacier_seal_bucket writes the lane's seal_entries as seal of
+ * the lane's current bucket. The bucket must already be closed and
+ * synced.
+ */
+int evr_glacier_seal_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane);
+
+int create_next_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane){
     int ret = evr_error;
-    if(close_current_bucket(ctx) != evr_ok){
+    const int was_open = lane->current_bucket_f != -1;
+    if(close_current_bucket(ctx, lane) != evr_ok){
         evr_panic("Unable to close current bucket");
         goto out;
     }
-    ctx->current_bucket_index++;
-    if(open_current_bucket(ctx, 1) != evr_ok){
-        ctx->current_bucket_index--;
-        goto out;
+    if(was_open && lane->seal_entries){
+        // a bucket without seal is still read by walking it. so a
+        // failed seal is no reason to stop writing blobs.
+        if(evr_glacier_seal_bucket(ctx, lane) != evr_ok){
+            log_error("Unable to seal bucket " evr_bucket_file_name_fmt " in glacier directory %s", lane->current_bucket_index, ctx->config->bucket_dir_path);
+        }
     }
-    ctx->current_bucket_pos = evr_bucket_header_size;
-    if(evr_write_bucket_magic_number(ctx->current_bucket_f) != evr_ok){
-        goto out;
+    lane->seal_crc = crc32(0L, Z_NULL, 0);
+    if(lane->seal_entries){
+        lane->seal_entries->size_used = 0;
+    } else {
+        lane->seal_entries = alloc_dynamic_array(0);
+        if(!lane->seal_entries){
+            log_info("Unable to allocate seal entries. The next bucket will not be sealed.");
+        }
     }
-    if(evr_write_bucket_end_offset(ctx->current_bucket_f, ctx->current_bucket_pos, 1) != evr_ok){
-        goto out;
+    evr_glacier_lock_index(ctx);
+    lane->current_bucket_index = ctx->last_bucket_index + 1;
+    if(open_current_bucket(ctx, lane, 1) != evr_ok){
+        goto out_with_unlock_index;
+    }
+    ctx->last_bucket_index = lane->current_bucket_index;
+    lane->current_bucket_pos = evr_bucket_header_size;
+    if(evr_write_bucket_magic_number(lane->current_bucket_f) != evr_ok){
+        goto out_with_unlock_index;
+    }
+    if(evr_write_bucket_end_offset(lane->current_bucket_f, lane->current_bucket_pos, 1) != evr_ok){
+        goto out_with_unlock_index;
+    }
+    if(ctx->config->bucket_preallocation == evr_bucket_preallocation_fallocate){
+        evr_glacier_preallocate_bucket(ctx, lane);
     }
-    if(sqlite3_bind_int(ctx->insert_bucket_stmt, 1, ctx->current_bucket_index) != SQLITE_OK){
+    if(sqlite3_bind_int(ctx->insert_bucket_stmt, 1, lane->current_bucket_index) != SQLITE_OK){
         goto out_with_reset_insert_bucket_stmt;
     }
     if(evr_step_stmt(ctx->db, ctx->insert_bucket_stmt) != SQLITE_DONE){
-        log_error("Unable to insert bucket " evr_bucket_file_name_fmt " metadata in index.db", ctx->current_bucket_index);
+        log_error("Unable to insert bucket " evr_bucket_file_name_fmt " metadata in index.db", lane->current_bucket_index);
         goto out_with_reset_insert_bucket_stmt;
     }
     ret = evr_ok;
@@ -812,23 +2767,85 @@ int create_next_bucket(struct evr_glacier_write_ctx *ctx){
         evr_panic("Unable to reset insert_bucket_stmt");
         ret = evr_error;
     }
+ out_with_unlock_index:
+    evr_glacier_unlock_index(ctx);
+ out:
+    return ret;
+}
+
+int evr_glacier_seal_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane){
+    int ret = evr_error;
+    const size_t entries_len = dynamic_array_len(lane->seal_entries, evr_bucket_seal_entry_size);
+    char header[evr_bucket_seal_header_size];
+    {
+        struct evr_buf_pos bp;
+        evr_init_buf_pos(&bp, header);
+        const uint8_t version = evr_bucket_seal_version;
+        evr_push_n(&bp, evr_bucket_seal_magic_number, strlen(evr_bucket_seal_magic_number));
+        evr_push_as(&bp, &version, uint8_t);
+        evr_push_map(&bp, &lane->current_bucket_pos, uint32_t, htobe32);
+        evr_push_map(&bp, &entries_len, uint32_t, htobe32);
+        evr_push_map(&bp, &lane->seal_crc, uint32_t, htobe32);
+    }
+    // the seal is placed next to the bucket. so the bucket's
+    // directory is looked up the same way evr_open_bucket finds
+    // existing buckets.
+    const size_t dirs_len = evr_glacier_bucket_dirs_len(ctx->config);
+    int f = -1;
+    for(size_t i = 0; i < dirs_len; ++i){
+        const char *dir = evr_glacier_bucket_dir(ctx->config, (lane->current_bucket_index + i) % dirs_len);
+        const size_t path_size = strlen(dir) + 30;
+        char bucket_path[path_size];
+        if(snprintf(bucket_path, path_size, "%s/" evr_bucket_file_name_fmt, dir, lane->current_bucket_index) < 0){
+            goto out;
+        }
+        struct stat bucket_stat;
+        if(stat(bucket_path, &bucket_stat) != 0){
+            continue;
+        }
+        char seal_path[path_size];
+        if(snprintf(seal_path, path_size, "%s/%05lx." evr_bucket_seal_file_ext, dir, lane->current_bucket_index) < 0){
+            goto out;
+        }
+        f = open(seal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        break;
+    }
+    if(f < 0){
+        goto out;
+    }
+    struct evr_file fd;
+    evr_file_bind_fd(&fd, f);
+    if(write_n(&fd, header, sizeof(header)) != evr_ok){
+        goto out_with_close_f;
+    }
+    if(write_n(&fd, lane->seal_entries->data, lane->seal_entries->size_used) != evr_ok){
+        goto out_with_close_f;
+    }
+    if(fdatasync(f) != 0){
+        goto out_with_close_f;
+    }
+    ret = evr_ok;
+ out_with_close_f:
+    if(close(f) != 0){
+        ret = evr_error;
+    }
  out:
     return ret;
 }
 
-int close_current_bucket(struct evr_glacier_write_ctx *ctx){
-    if(ctx->current_bucket_f != -1){
-        if(!ctx->current_bucket_sync){
-            if(fdatasync(ctx->current_bucket_f) != 0){
+int close_current_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane){
+    if(lane->current_bucket_f != -1){
+        if(!lane->current_bucket_sync){
+            if(fdatasync(lane->current_bucket_f) != 0){
                 log_error("Can't fsync bucket on close glacier directory %s.", ctx->config->bucket_dir_path);
                 return evr_error;
             }
-            ctx->current_bucket_sync = 1;
+            lane->current_bucket_sync = 1;
         }
-        if(close(ctx->current_bucket_f) != 0){
+        if(close(lane->current_bucket_f) != 0){
             return evr_error;
         }
-        ctx->current_bucket_f = -1;
+        lane->current_bucket_f = -1;
     }
     return evr_ok;
 }
@@ -868,20 +2885,41 @@ int evr_quick_check_glacier(struct evr_glacier_storage_cfg *config){
     }
 }
 
-static const char evr_random_blobs_sql[] = "select key, flags, blob_size from blob_position where key in (select key from blob_position order by RANDOM() limit 1024)";
-
-static const char evr_latest_blobs_sql[] = "select key, flags, blob_size from blob_position order by last_modified desc limit 1024";
+static const char evr_latest_blobs_sql[] = "select key, flags, blob_size from blob_position order by last_modified desc limit " to_string(evr_glacier_quick_check_latest_blobs);
 
 int evr_glacier_check_blobs(struct evr_glacier_write_ctx *ctx, const char *sql);
 
-int evr_glacier_check_index_db(struct evr_glacier_write_ctx *ctx){
+int evr_glacier_check_lane_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane);
+
+int evr_glacier_check_index_db(struct evr_glacier_write_ctx *ctx){
+    int ret = evr_error;
+    int check_res;
+    for(size_t i = 0; i < ctx->lanes_len; ++i){
+        check_res = evr_glacier_check_lane_bucket(ctx, &ctx->lanes[i]);
+        if(check_res != evr_ok){
+            ret = check_res;
+            goto out;
+        }
+    }
+    check_res = evr_glacier_check_blobs(ctx, evr_latest_blobs_sql);
+    if(check_res == evr_glacier_index_db_corrupt){
+        ret = evr_glacier_index_db_corrupt;
+        goto out;
+    } else if(check_res != evr_ok){
+        goto out;
+    }
+    ret = evr_ok;
+ out:
+    return ret;
+}
+
+int evr_glacier_check_lane_bucket(struct evr_glacier_write_ctx *ctx, struct evr_glacier_bucket_lane *lane){
     int ret = evr_error;
-    int blobs_check_res;
-    off_t bucket_end_offset = lseek(ctx->current_bucket_f, 0, SEEK_END);
+    off_t bucket_end_offset = lseek(lane->current_bucket_f, 0, SEEK_END);
     if(bucket_end_offset == -1){
         goto out;
     }
-    if(sqlite3_bind_int(ctx->find_bucket_end_offset_stmt, 1, ctx->current_bucket_index) != SQLITE_OK){
+    if(sqlite3_bind_int(ctx->find_bucket_end_offset_stmt, 1, lane->current_bucket_index) != SQLITE_OK){
         goto out_with_reset_find_bucket_end_offset_stmt;
     }
     int find_offset_res = evr_step_stmt(ctx->db, ctx->find_bucket_end_offset_stmt);
@@ -889,40 +2927,26 @@ int evr_glacier_check_index_db(struct evr_glacier_write_ctx *ctx){
         // no end offset for the current bucket was found in the
         // index.db. that means the index.db is empty and must be
         // populated again.
-        log_error("Missing bucket end offset in index.db for bucket " evr_bucket_file_name_fmt, ctx->current_bucket_index);
+        log_error("Missing bucket end offset in index.db for bucket " evr_bucket_file_name_fmt, lane->current_bucket_index);
         ret = evr_glacier_index_db_corrupt;
         goto out_with_reset_find_bucket_end_offset_stmt;
     } else if(find_offset_res == SQLITE_ROW){
         int db_end_offset = sqlite3_column_int(ctx->find_bucket_end_offset_stmt, 0);
         if(db_end_offset != bucket_end_offset){
-            log_error("End offset from bucket " evr_bucket_file_name_fmt " was %d and did not match end offset %d from index db", ctx->current_bucket_index, bucket_end_offset, db_end_offset);
+            log_error("End offset from bucket " evr_bucket_file_name_fmt " was %d and did not match end offset %d from index db", lane->current_bucket_index, bucket_end_offset, db_end_offset);
             ret = evr_glacier_index_db_corrupt;
             goto out_with_reset_find_bucket_end_offset_stmt;
         }
     } else {
-        log_error("Unable to lookup end offset for bucket " evr_bucket_file_name_fmt " in index db.", ctx->current_bucket_index);
+        log_error("Unable to lookup end offset for bucket " evr_bucket_file_name_fmt " in index db.", lane->current_bucket_index);
         // treat this situation as corrupt index.db because it's the
         // first access to the index.db after opening it. so maybe
         // recreating the index.db will solve the issue.
         ret = evr_glacier_index_db_corrupt;
         goto out_with_reset_find_bucket_end_offset_stmt;
     }
-    if(ctx->current_bucket_pos != (size_t)bucket_end_offset){
-        log_info("Bucket " evr_bucket_file_name_fmt "'s end pointer (%d) and file end offset (%ld) don't match in glacier directory %s. It looks like evr-glacier-storage terminated not gracafully while writing a blob.", ctx->current_bucket_index, ctx->current_bucket_pos, bucket_end_offset, ctx->config->bucket_dir_path);
-    }
-    blobs_check_res = evr_glacier_check_blobs(ctx, evr_latest_blobs_sql);
-    if(blobs_check_res == evr_glacier_index_db_corrupt){
-        ret = evr_glacier_index_db_corrupt;
-        goto out_with_reset_find_bucket_end_offset_stmt;
-    } else if(blobs_check_res != evr_ok){
-        goto out_with_reset_find_bucket_end_offset_stmt;
-    }
-    blobs_check_res = evr_glacier_check_blobs(ctx, evr_random_blobs_sql);
-    if(blobs_check_res == evr_glacier_index_db_corrupt){
-        ret = evr_glacier_index_db_corrupt;
-        goto out_with_reset_find_bucket_end_offset_stmt;
-    } else if(blobs_check_res != evr_ok){
-        goto out_with_reset_find_bucket_end_offset_stmt;
+    if(lane->current_bucket_pos != (size_t)bucket_end_offset){
+        log_info("Bucket " evr_bucket_file_name_fmt "'s end pointer (%d) and file end offset (%ld) don't match in glacier directory %s. It looks like evr-glacier-storage terminated not gracafully while writing a blob.", lane->current_bucket_index, lane->current_bucket_pos, bucket_end_offset, ctx->config->bucket_dir_path);
     }
     ret = evr_ok;
  out_with_reset_find_bucket_end_offset_stmt:
@@ -946,6 +2970,15 @@ int evr_glacier_blob_check_status(void *ctx, int exists, int flags, size_t blob_
 
 int evr_glacier_blob_check_data(void *ctx, const char *data, size_t data_size);
 
+/**
+ * evr_glacier_check_indexed_blob reads the blob ref from its bucket
+ * and verifies that the blob still matches flags, blob_size and ref
+ * from the index db.
+ *
+ * Returns evr_glacier_index_db_corrupt if the blob does not match.
+ */
+int evr_glacier_check_indexed_blob(struct evr_glacier_read_ctx *rctx, const evr_blob_ref ref, int flags, size_t blob_size);
+
 int evr_glacier_check_blobs(struct evr_glacier_write_ctx *wctx, const char *sql){
     int ret = evr_error;
     struct evr_glacier_read_ctx *rctx = evr_create_glacier_read_ctx(wctx->config);
@@ -956,7 +2989,6 @@ int evr_glacier_check_blobs(struct evr_glacier_write_ctx *wctx, const char *sql)
     if(evr_prepare_stmt(wctx->db, sql, &find_blobs_stmt) != evr_ok){
         goto out_with_free_rctx;
     }
-    struct evr_glacier_blob_check_ctx bctx;
     for(;;){
         int step_res = evr_step_stmt(wctx->db, find_blobs_stmt);
         if(step_res == SQLITE_DONE){
@@ -969,40 +3001,11 @@ int evr_glacier_check_blobs(struct evr_glacier_write_ctx *wctx, const char *sql)
             ret = evr_glacier_index_db_corrupt;
             goto out_with_finalize_find_blobs_stmt;
         }
-        const void *sqref = sqlite3_column_blob(find_blobs_stmt, 0);
-        memcpy(bctx.ref, sqref, evr_blob_ref_size);
-        bctx.flags = sqlite3_column_int(find_blobs_stmt, 1);
-        bctx.blob_size = sqlite3_column_int(find_blobs_stmt, 2);
-#ifdef EVR_LOG_DEBUG
-        evr_blob_ref_str ref_str;
-        evr_fmt_blob_ref(ref_str, bctx.ref);
-        log_debug("Checking blob %s", ref_str);
-#endif
-        bctx.ret = evr_error;
-        if(evr_blob_ref_open(&bctx.blob_hd) != evr_ok){
-            goto out_with_finalize_find_blobs_stmt;
-        }
-        if(evr_glacier_read_blob(rctx, bctx.ref, evr_glacier_blob_check_status, evr_glacier_blob_check_data, &bctx) != evr_ok){
-            evr_blob_ref_close(bctx.blob_hd);
-            goto out_with_finalize_find_blobs_stmt;
-        }
-        if(bctx.ret == evr_glacier_index_db_corrupt){
-            ret = evr_glacier_index_db_corrupt;
-            evr_blob_ref_close(bctx.blob_hd);
-            goto out_with_finalize_find_blobs_stmt;
-        } else if(bctx.ret != evr_ok){
-            evr_blob_ref_close(bctx.blob_hd);
-            goto out_with_finalize_find_blobs_stmt;
-        }
-        if(evr_blob_ref_hd_match(bctx.blob_hd, bctx.ref) != evr_ok){
-            evr_blob_ref_str ref_str;
-            evr_fmt_blob_ref(ref_str, bctx.ref);
-            log_error("Blob hash does not match ref for blob with ref %s", ref_str);
-            ret = evr_glacier_index_db_corrupt;
-            evr_blob_ref_close(bctx.blob_hd);
+        int check_res = evr_glacier_check_indexed_blob(rctx, sqlite3_column_blob(find_blobs_stmt, 0), evr_blob_public_flags(sqlite3_column_int(find_blobs_stmt, 1)), sqlite3_column_int(find_blobs_stmt, 2));
+        if(check_res != evr_ok){
+            ret = check_res;
             goto out_with_finalize_find_blobs_stmt;
         }
-        evr_blob_ref_close(bctx.blob_hd);
     }
     ret = evr_ok;
  out_with_finalize_find_blobs_stmt:
@@ -1019,6 +3022,124 @@ int evr_glacier_check_blobs(struct evr_glacier_write_ctx *wctx, const char *sql)
     return ret;
 }
 
+int evr_glacier_check_indexed_blob(struct evr_glacier_read_ctx *rctx, const evr_blob_ref ref, int flags, size_t blob_size){
+    int ret = evr_error;
+    struct evr_glacier_blob_check_ctx bctx;
+    memcpy(bctx.ref, ref, evr_blob_ref_size);
+    bctx.flags = flags;
+    bctx.blob_size = blob_size;
+#ifdef EVR_LOG_DEBUG
+    evr_blob_ref_str ref_str;
+    evr_fmt_blob_ref(ref_str, bctx.ref);
+    log_debug("Checking blob %s", ref_str);
+#endif
+    bctx.ret = evr_error;
+    if(evr_blob_ref_open(&bctx.blob_hd) != evr_ok){
+        goto out;
+    }
+    if(evr_glacier_read_blob(rctx, bctx.ref, evr_glacier_blob_check_status, evr_glacier_blob_check_data, &bctx) != evr_ok){
+        goto out_with_close_blob_hd;
+    }
+    if(bctx.ret != evr_ok){
+        ret = bctx.ret;
+        goto out_with_close_blob_hd;
+    }
+    if(evr_blob_ref_hd_match(bctx.blob_hd, bctx.ref) != evr_ok){
+        evr_blob_ref_str ref_str;
+        evr_fmt_blob_ref(ref_str, bctx.ref);
+        log_error("Blob hash does not match ref for blob with ref %s", ref_str);
+        ret = evr_glacier_index_db_corrupt;
+        goto out_with_close_blob_hd;
+    }
+    ret = evr_ok;
+ out_with_close_blob_hd:
+    evr_blob_ref_close(bctx.blob_hd);
+ out:
+    return ret;
+}
+
+/**
+ * evr_glacier_check_selected_blob checks the blob selected by the
+ * first row of stmt. stmt is finalized.
+ */
+int evr_glacier_check_selected_blob(struct evr_glacier_read_ctx *ctx, sqlite3_stmt *stmt);
+
+int evr_glacier_check_latest_blob(struct evr_glacier_read_ctx *ctx, size_t index){
+    sqlite3_stmt *stmt;
+    if(evr_prepare_stmt(ctx->db, "select key, flags, blob_size from blob_position order by last_modified desc limit 1 offset ?", &stmt) != evr_ok){
+        return evr_error;
+    }
+    if(sqlite3_bind_int64(stmt, 1, index) != SQLITE_OK){
+        sqlite3_finalize(stmt);
+        return evr_error;
+    }
+    return evr_glacier_check_selected_blob(ctx, stmt);
+}
+
+int evr_glacier_check_random_blob(struct evr_glacier_read_ctx *ctx){
+    // blob keys are hashes. so the first key after a random key is a
+    // random blob.
+    evr_blob_ref random_key;
+    gcry_create_nonce(random_key, sizeof(random_key));
+    sqlite3_stmt *stmt;
+    if(evr_prepare_stmt(ctx->db, "select key, flags, blob_size from blob_position where key >= ? order by key limit 1", &stmt) != evr_ok){
+        return evr_error;
+    }
+    if(sqlite3_bind_blob(stmt, 1, random_key, sizeof(random_key), SQLITE_TRANSIENT) != SQLITE_OK){
+        goto fail_with_finalize_stmt;
+    }
+    int step_res = evr_step_stmt(ctx->db, stmt);
+    if(step_res != SQLITE_ROW && step_res != SQLITE_DONE){
+        goto fail_with_finalize_stmt;
+    }
+    if(sqlite3_reset(stmt) != SQLITE_OK){
+        goto fail_with_finalize_stmt;
+    }
+    if(step_res == SQLITE_DONE){
+        // the random key is after the last blob. the empty key wraps
+        // around to the first blob.
+        if(sqlite3_bind_blob(stmt, 1, "", 0, SQLITE_STATIC) != SQLITE_OK){
+            goto fail_with_finalize_stmt;
+        }
+    }
+    return evr_glacier_check_selected_blob(ctx, stmt);
+ fail_with_finalize_stmt:
+    sqlite3_finalize(stmt);
+    return evr_error;
+}
+
+int evr_glacier_check_selected_blob(struct evr_glacier_read_ctx *ctx, sqlite3_stmt *stmt){
+    int ret = evr_error;
+    evr_blob_ref ref;
+    int flags;
+    size_t blob_size;
+    int step_res = evr_step_stmt(ctx->db, stmt);
+    if(step_res == SQLITE_DONE){
+        ret = evr_not_found;
+        goto out_with_finalize_stmt;
+    } else if(step_res != SQLITE_ROW){
+        goto out_with_finalize_stmt;
+    }
+    if(sqlite3_column_bytes(stmt, 0) != evr_blob_ref_size){
+        ret = evr_glacier_index_db_corrupt;
+        goto out_with_finalize_stmt;
+    }
+    memcpy(ref, sqlite3_column_blob(stmt, 0), evr_blob_ref_size);
+    flags = evr_blob_public_flags(sqlite3_column_int(stmt, 1));
+    blob_size = sqlite3_column_int(stmt, 2);
+    // the statement is finalized before the blob is read so the read
+    // transaction does not outlive the row lookup.
+    if(sqlite3_finalize(stmt) != SQLITE_OK){
+        return evr_error;
+    }
+    return evr_glacier_check_indexed_blob(ctx, ref, flags, blob_size);
+ out_with_finalize_stmt:
+    if(sqlite3_finalize(stmt) != SQLITE_OK){
+        ret = evr_error;
+    }
+    return ret;
+}
+
 int evr_glacier_blob_check_status(void *ctx, int exists, int flags, size_t blob_size){
     struct evr_glacier_blob_check_ctx *bctx = ctx;
     if(!exists){
@@ -1061,94 +3182,648 @@ int evr_glacier_recreate_index_db(struct evr_glacier_storage_cfg *cfg){
             db_path = alloca(db_path_max_size);
             build_glacier_file_path(db_path, db_path_max_size, cfg->bucket_dir_path, glacier_dir_index_db_path);
         }
-        if(unlink(db_path) != 0){
-            log_error("Unable to delete %s", db_path);
-            goto out;
+        if(unlink(db_path) != 0){
+            log_error("Unable to delete %s", db_path);
+            goto out;
+        }
+    }
+    struct evr_glacier_write_ctx *ctx;
+    if(evr_create_glacier_write_ctx(&ctx, cfg) != evr_ok){
+        goto out;
+    }
+    if(evr_glacier_reindex(ctx) != evr_ok){
+        log_error("Unable to reindex glacier");
+        goto out_with_free_ctx;
+    }
+    ret = evr_ok;
+ out_with_free_ctx:
+    if(evr_free_glacier_write_ctx(ctx) != evr_ok){
+        evr_panic("Unable to free glacier write context after index recreate");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+/**
+ * evr_reindex_merge_buffer_len is the number of entries read at once
+ * from each spilled run while the runs are merged.
+ */
+#define evr_reindex_merge_buffer_len 4096
+
+struct evr_reindex_entry {
+    evr_blob_ref ref;
+    int flags;
+    unsigned long bucket_index;
+    size_t offset;
+    size_t size;
+    evr_time last_modified;
+};
+
+/**
+ * struct evr_reindex_bucket is one bucket which is scanned by a
+ * reindex worker.
+ */
+struct evr_reindex_bucket {
+    unsigned long bucket_index;
+    char *bucket_path;
+
+    /**
+     * done is set by the worker after the bucket got scanned. The
+     * following fields are valid after that.
+     */
+    int done;
+    int res;
+    int end_offset;
+    struct evr_reindex_entry *entries;
+    size_t entries_len;
+    size_t entries_alloc;
+};
+
+struct evr_reindex_ctx {
+    struct evr_glacier_write_ctx *wctx;
+    struct evr_reindex_bucket *buckets;
+    size_t buckets_len;
+    size_t buckets_alloc;
+
+    /**
+     * lock protects next_bucket, consumed_buckets, abort and the
+     * buckets' done flags.
+     */
+    mtx_t lock;
+    cnd_t changed;
+
+    /**
+     * next_bucket is the next bucket a worker scans.
+     */
+    size_t next_bucket;
+
+    /**
+     * consumed_buckets is the number of buckets which got moved into
+     * the index db. Workers stay at most max_pending_buckets ahead so
+     * the scanned entries don't pile up in memory.
+     */
+    size_t consumed_buckets;
+    size_t max_pending_buckets;
+    int abort;
+};
+
+/**
+ * struct evr_reindex_spilled_run is a sorted run which was written to
+ * a temporary file.
+ */
+struct evr_reindex_spilled_run {
+    int f;
+    size_t entries_len;
+};
+
+struct evr_reindex_run {
+    struct evr_reindex_entry *entries;
+    size_t entries_len;
+    size_t entries_alloc;
+    size_t blobs_count;
+    int tx_open;
+
+    /**
+     * spilled contains the runs which were written to temporary files
+     * because the scanned entries did not fit into one run.
+     */
+    struct evr_reindex_spilled_run *spilled;
+    size_t spilled_len;
+    size_t spilled_alloc;
+};
+
+int evr_glacier_reindex_collect_bucket(void *context, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name);
+
+int evr_glacier_reindex_bucket_cmp(const void *a, const void *b);
+
+int evr_glacier_reindex_worker(void *context);
+
+/**
+ * evr_glacier_reindex_drop_last_modified_index drops the
+ * last_modified index of blob_position under both of its names.
+ */
+int evr_glacier_reindex_drop_last_modified_index(sqlite3 *db);
+
+/**
+ * evr_glacier_reindex_consume moves the scanned buckets into the
+ * index db in bucket index order.
+ */
+int evr_glacier_reindex_consume(struct evr_reindex_ctx *rctx);
+
+int evr_glacier_reindex(struct evr_glacier_write_ctx *ctx){
+    int ret = evr_error;
+    // the reindex scans the buckets of all lanes
+    for(size_t i = 0; i < ctx->lanes_len; ++i){
+        if(close_current_bucket(ctx, &ctx->lanes[i]) != evr_ok){
+            return evr_error;
+        }
+    }
+    struct evr_reindex_ctx rctx;
+    rctx.wctx = ctx;
+    rctx.buckets = NULL;
+    rctx.buckets_len = 0;
+    rctx.buckets_alloc = 0;
+    rctx.next_bucket = 0;
+    rctx.consumed_buckets = 0;
+    rctx.abort = 0;
+    if(evr_walk_buckets(ctx, evr_glacier_reindex_collect_bucket, &rctx) != evr_ok){
+        goto out_with_free_buckets;
+    }
+    qsort(rctx.buckets, rctx.buckets_len, sizeof(struct evr_reindex_bucket), evr_glacier_reindex_bucket_cmp);
+    const size_t workers_len = max(1, min(ctx->config->reindex_threads, rctx.buckets_len));
+    rctx.max_pending_buckets = 2 * workers_len;
+    log_info("Reindex %zu buckets using %zu threads", rctx.buckets_len, workers_len);
+    // the last_modified index is created in one pass after the load
+    // instead of being updated by every insert.
+    if(evr_glacier_reindex_drop_last_modified_index(ctx->db) != evr_ok){
+        goto out_with_free_buckets;
+    }
+    thrd_t *workers = malloc(workers_len * sizeof(thrd_t));
+    if(!workers){
+        goto out_with_free_buckets;
+    }
+    if(mtx_init(&rctx.lock, mtx_plain) != thrd_success){
+        goto out_with_free_workers;
+    }
+    if(cnd_init(&rctx.changed) != thrd_success){
+        goto out_with_destroy_lock;
+    }
+    size_t workers_started = 0;
+    for(; workers_started < workers_len; ++workers_started){
+        if(thrd_create(&workers[workers_started], evr_glacier_reindex_worker, &rctx) != thrd_success){
+            break;
+        }
+    }
+    if(workers_started == workers_len){
+        ret = evr_glacier_reindex_consume(&rctx);
+    }
+    if(ret == evr_ok){
+        log_info("Create last_modified index");
+        ret = evr_create_last_modified_index(ctx->db);
+    }
+    if(ret != evr_ok){
+        if(mtx_lock(&rctx.lock) != thrd_success){
+            evr_panic("Unable to lock reindex");
+        }
+        rctx.abort = 1;
+        if(cnd_broadcast(&rctx.changed) != thrd_success){
+            evr_panic("Unable to signal reindex abort");
+        }
+        if(mtx_unlock(&rctx.lock) != thrd_success){
+            evr_panic("Unable to unlock reindex");
+        }
+    }
+    for(size_t i = 0; i < workers_started; ++i){
+        int worker_res;
+        if(thrd_join(workers[i], &worker_res) != thrd_success){
+            evr_panic("Unable to join reindex worker");
+            ret = evr_error;
+        }
+    }
+    cnd_destroy(&rctx.changed);
+ out_with_destroy_lock:
+    mtx_destroy(&rctx.lock);
+ out_with_free_workers:
+    free(workers);
+ out_with_free_buckets:
+    for(size_t i = 0; i < rctx.buckets_len; ++i){
+        free(rctx.buckets[i].bucket_path);
+        free(rctx.buckets[i].entries);
+    }
+    free(rctx.buckets);
+    return ret;
+}
+
+int evr_glacier_reindex_drop_last_modified_index(sqlite3 *db){
+    char *error;
+    if(sqlite3_exec(db, "drop index if exists blob_position_last_modified; drop index if exists blob_position_v2_last_modified", NULL, NULL, &error) != SQLITE_OK){
+        log_error("Failed to drop last_modified index: %s", error);
+        sqlite3_free(error);
+        return evr_error;
+    }
+    return evr_ok;
+}
+
+int evr_glacier_reindex_bucket_cmp(const void *a, const void *b){
+    const struct evr_reindex_bucket *ba = a;
+    const struct evr_reindex_bucket *bb = b;
+    if(ba->bucket_index < bb->bucket_index){
+        return -1;
+    }
+    return ba->bucket_index > bb->bucket_index;
+}
+
+int evr_glacier_reindex_collect_bucket(void *context, unsigned long bucket_index, const char *bucket_dir_path, char *bucket_file_name){
+    struct evr_reindex_ctx *rctx = context;
+    if(rctx->buckets_len == rctx->buckets_alloc){
+        const size_t new_alloc = max(64, 2 * rctx->buckets_alloc);
+        struct evr_reindex_bucket *new_buckets = realloc(rctx->buckets, new_alloc * sizeof(struct evr_reindex_bucket));
+        if(!new_buckets){
+            return evr_error;
+        }
+        rctx->buckets = new_buckets;
+        rctx->buckets_alloc = new_alloc;
+    }
+    const size_t bucket_dir_path_len = strlen(bucket_dir_path);
+    const size_t bucket_file_name_len = strlen(bucket_file_name);
+    char *bucket_path = malloc(bucket_dir_path_len + 1 + bucket_file_name_len + 1);
+    if(!bucket_path){
+        return evr_error;
+    }
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, bucket_path);
+    evr_push_n(&bp, bucket_dir_path, bucket_dir_path_len);
+    evr_push_n(&bp, "/", 1);
+    evr_push_n(&bp, bucket_file_name, bucket_file_name_len);
+    evr_push_eos(&bp);
+    struct evr_reindex_bucket *b = &rctx->buckets[rctx->buckets_len++];
+    b->bucket_index = bucket_index;
+    b->bucket_path = bucket_path;
+    b->done = 0;
+    b->res = evr_error;
+    b->end_offset = 0;
+    b->entries = NULL;
+    b->entries_len = 0;
+    b->entries_alloc = 0;
+    return evr_ok;
+}
+
+/**
+ * evr_glacier_reindex_scan_bucket collects the valid blobs of b and
+ * writes b's end offset into the bucket file.
+ */
+int evr_glacier_reindex_scan_bucket(struct evr_reindex_bucket *b);
+
+int evr_glacier_reindex_worker(void *context){
+    struct evr_reindex_ctx *rctx = context;
+    while(1){
+        if(mtx_lock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to lock reindex");
+            return evr_error;
+        }
+        while(!rctx->abort && rctx->next_bucket < rctx->buckets_len && rctx->next_bucket - rctx->consumed_buckets >= rctx->max_pending_buckets){
+            if(cnd_wait(&rctx->changed, &rctx->lock) != thrd_success){
+                evr_panic("Unable to wait for reindex progress");
+                return evr_error;
+            }
+        }
+        if(rctx->abort || rctx->next_bucket >= rctx->buckets_len){
+            if(mtx_unlock(&rctx->lock) != thrd_success){
+                evr_panic("Unable to unlock reindex");
+                return evr_error;
+            }
+            return evr_ok;
+        }
+        struct evr_reindex_bucket *b = &rctx->buckets[rctx->next_bucket++];
+        if(mtx_unlock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to unlock reindex");
+            return evr_error;
+        }
+        int scan_res = evr_glacier_reindex_scan_bucket(b);
+        if(mtx_lock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to lock reindex");
+            return evr_error;
+        }
+        b->res = scan_res;
+        b->done = 1;
+        if(cnd_broadcast(&rctx->changed) != thrd_success){
+            evr_panic("Unable to signal reindex progress");
+        }
+        if(mtx_unlock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to unlock reindex");
+            return evr_error;
+        }
+    }
+}
+
+struct evr_reindex_scan_ctx {
+    struct evr_reindex_bucket *bucket;
+    int f;
+};
+
+int evr_glacier_reindex_visit_blob(void *context, struct evr_glacier_bucket_blob_stat *stat);
+
+int evr_glacier_reindex_visit_seal_entry(void *context, struct evr_glacier_bucket_seal_entry *entry);
+
+int evr_glacier_reindex_hash_data(void *ctx, const char *data, size_t data_size);
+
+int evr_glacier_reindex_scan_bucket(struct evr_reindex_bucket *b){
+    int ret = evr_error;
+    log_debug("Reindexing bucket %s", b->bucket_path);
+    struct evr_reindex_scan_ctx scan;
+    scan.bucket = b;
+    scan.f = open(b->bucket_path, O_RDWR);
+    if(scan.f < 0){
+        log_error("Unable to open bucket %s for reindexing", b->bucket_path);
+        goto out;
+    }
+    if(evr_validate_bucket_magic_number(scan.f) != evr_ok){
+        log_error("Reindexing of bucket %s aborted because of invalid magic number. If you are sure the file is a bucket consider setting the first three bytes in the file to " evr_bucket_magic_number " and reindex again.", b->bucket_path);
+        goto out_with_close_f;
+    }
+    {
+        // sealed buckets are reindexed from their seal without
+        // parsing and hashing every blob. a seal is only trusted if
+        // the bucket ends exactly where the seal says and the
+        // bucket's contents match the seal's crc32.
+        size_t end_offset;
+        if(evr_read_bucket_end_offset(scan.f, &end_offset) != evr_ok){
+            goto out_with_close_f;
+        }
+        off_t file_size = lseek(scan.f, 0, SEEK_END);
+        if(file_size == -1){
+            goto out_with_close_f;
+        }
+        if(end_offset != evr_bucket_end_offset_corrupt && (size_t)file_size == end_offset){
+            int seal_res = evr_glacier_read_bucket_seal(b->bucket_path, end_offset, evr_glacier_reindex_visit_seal_entry, b);
+            if(seal_res == evr_ok){
+                log_debug("Reindexed bucket %s from its seal", b->bucket_path);
+                b->end_offset = end_offset;
+                ret = evr_ok;
+                goto out_with_close_f;
+            }
+            if(seal_res != evr_not_found){
+                goto out_with_close_f;
+            }
+        }
+    }
+    int walk_res = evr_glacier_walk_bucket(b->bucket_path, NULL, evr_glacier_reindex_visit_blob, &scan);
+    if(walk_res == evr_end){
+        log_info("Mark bucket " evr_bucket_file_name_fmt " with corrupt end offset", b->bucket_index);
+        b->end_offset = evr_bucket_end_offset_corrupt;
+    } else if(walk_res != evr_ok){
+        log_error("Unable to walk bucket " evr_bucket_file_name_fmt " on reindex", b->bucket_index);
+        goto out_with_close_f;
+    } else {
+        b->end_offset = lseek(scan.f, 0, SEEK_END);
+        if(b->end_offset == -1){
+            goto out_with_close_f;
+        }
+    }
+    if(evr_write_bucket_end_offset(scan.f, b->end_offset, 1) != evr_ok){
+        goto out_with_close_f;
+    }
+    ret = evr_ok;
+ out_with_close_f:
+    if(close(scan.f) != 0){
+        evr_panic("Unable to close bucket %s after reindexing", b->bucket_path);
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_glacier_reindex_visit_seal_entry(void *context, struct evr_glacier_bucket_seal_entry *entry){
+    struct evr_reindex_bucket *b = context;
+    if(b->entries_len == b->entries_alloc){
+        const size_t new_alloc = max(256, 2 * b->entries_alloc);
+        struct evr_reindex_entry *new_entries = realloc(b->entries, new_alloc * sizeof(struct evr_reindex_entry));
+        if(!new_entries){
+            return evr_error;
+        }
+        b->entries = new_entries;
+        b->entries_alloc = new_alloc;
+    }
+    struct evr_reindex_entry *e = &b->entries[b->entries_len++];
+    memcpy(e->ref, entry->ref, evr_blob_ref_size);
+    e->flags = entry->flags;
+    e->bucket_index = b->bucket_index;
+    e->offset = entry->offset;
+    e->size = entry->size;
+    e->last_modified = entry->last_modified;
+    return evr_ok;
+}
+
+int evr_glacier_reindex_hash_data(void *ctx, const char *data, size_t data_size){
+    evr_blob_ref_hd hd = ctx;
+    evr_blob_ref_write(hd, data, data_size);
+    return evr_ok;
+}
+
+int evr_glacier_reindex_visit_blob(void *context, struct evr_glacier_bucket_blob_stat *stat){
+    int ret = evr_error;
+    struct evr_reindex_scan_ctx *scan = context;
+    struct evr_reindex_bucket *b = scan->bucket;
+    if(stat->checksum_valid != evr_ok){
+        log_error("Blob header with invalid checksum detected. Abort reindexing bucket.");
+        ret = evr_end;
+        goto out;
+    }
+    if(lseek(scan->f, stat->offset, SEEK_SET) == -1){
+        log_error("Unable to seek in bucket file to offset %zu during reindexing", (size_t)stat->offset);
+        goto out;
+    }
+    evr_blob_ref_hd hd;
+    if(evr_blob_ref_open(&hd) != evr_ok){
+        goto out;
+    }
+    size_t blob_size = stat->size;
+    if(stat->flags & evr_blob_flag_deflated){
+        char in_buf[evr_inflate_buffer_size];
+        if(evr_glacier_inflate_blob(scan->f, stat->offset, stat->size, in_buf, sizeof(in_buf), evr_glacier_reindex_hash_data, hd, &blob_size) != evr_ok){
+            evr_blob_ref_str ref_str;
+            evr_fmt_blob_ref(ref_str, stat->ref);
+            log_error("Unable to inflate blob %s body during reindexing. Skipping this blob.", ref_str);
+            ret = evr_ok;
+            goto out_with_close_hd;
+        }
+    } else {
+        struct evr_file f;
+        evr_file_bind_fd(&f, scan->f);
+        if(dump_n(&f, stat->size, evr_blob_ref_write_se, hd) != evr_ok){
+            evr_blob_ref_str ref_str;
+            evr_fmt_blob_ref(ref_str, stat->ref);
+            log_error("Unable to read over blob %s body during reindexing", ref_str);
+            goto out_with_close_hd;
         }
     }
-    struct evr_glacier_write_ctx *ctx;
-    if(evr_create_glacier_write_ctx(&ctx, cfg) != evr_ok){
-        goto out;
+    if(evr_blob_ref_hd_match(hd, stat->ref) != evr_ok){
+        evr_blob_ref_str ref_str;
+        evr_fmt_blob_ref(ref_str, stat->ref);
+        log_error("Blob's body no longer matches ref %s. Skipping this blob.", ref_str);
+        ret = evr_ok;
+        goto out_with_close_hd;
     }
-    if(evr_glacier_reindex(ctx) != evr_ok){
-        log_error("Unable to reindex glacier");
-        goto out_with_free_ctx;
+    if(b->entries_len == b->entries_alloc){
+        const size_t new_alloc = max(256, 2 * b->entries_alloc);
+        struct evr_reindex_entry *new_entries = realloc(b->entries, new_alloc * sizeof(struct evr_reindex_entry));
+        if(!new_entries){
+            goto out_with_close_hd;
+        }
+        b->entries = new_entries;
+        b->entries_alloc = new_alloc;
+    }
+    struct evr_reindex_entry *e = &b->entries[b->entries_len++];
+    memcpy(e->ref, stat->ref, evr_blob_ref_size);
+    e->flags = stat->flags;
+    e->bucket_index = b->bucket_index;
+    e->offset = stat->offset;
+    e->size = blob_size;
+    e->last_modified = stat->last_modified;
+#ifdef EVR_LOG_DEBUG
+    {
+        evr_blob_ref_str ref_str;
+        evr_fmt_blob_ref(ref_str, stat->ref);
+        log_debug("Reindexed blob %s", ref_str);
     }
+#endif
     ret = evr_ok;
- out_with_free_ctx:
-    if(evr_free_glacier_write_ctx(ctx) != evr_ok){
-        evr_panic("Unable to free glacier write context after index recreate");
-        ret = evr_error;
-    }
+ out_with_close_hd:
+    evr_blob_ref_close(hd);
  out:
     return ret;
 }
 
-int evr_glacier_reindex_bucket(void *context, unsigned long bucket_index, char *bucket_file_name);
+int evr_glacier_reindex_add_bucket(struct evr_glacier_write_ctx *ctx, struct evr_reindex_bucket *b);
 
-int evr_glacier_reindex(struct evr_glacier_write_ctx *ctx){
-    if(evr_walk_buckets(ctx, evr_glacier_reindex_bucket, ctx) != evr_ok){
-        return evr_error;
-    }
-    return evr_ok;
-}
+int evr_glacier_reindex_append_run(struct evr_reindex_run *run, struct evr_reindex_bucket *b);
 
-int evr_glacier_reindex_visit_blob(void *context, struct evr_glacier_bucket_blob_stat *stat);
+/**
+ * evr_glacier_reindex_flush_run inserts the run's entries sorted by
+ * key and commits the run's transaction.
+ */
+int evr_glacier_reindex_flush_run(struct evr_glacier_write_ctx *ctx, struct evr_reindex_run *run);
+
+/**
+ * evr_glacier_reindex_spill_run writes the run's entries sorted by
+ * key into an unlinked temporary file within the bucket dir and
+ * commits the run's transaction.
+ */
+int evr_glacier_reindex_spill_run(struct evr_glacier_write_ctx *ctx, struct evr_reindex_run *run);
+
+/**
+ * evr_glacier_reindex_merge_runs merges the spilled runs and inserts
+ * their entries in key order.
+ */
+int evr_glacier_reindex_merge_runs(struct evr_glacier_write_ctx *ctx, struct evr_reindex_run *run);
 
-int evr_glacier_reindex_bucket(void *context, unsigned long bucket_index, char *bucket_file_name){
+int evr_glacier_reindex_consume(struct evr_reindex_ctx *rctx){
     int ret = evr_error;
-    struct evr_glacier_write_ctx *ctx = context;
-    log_debug("Reindexing bucket %s", bucket_file_name);
-    const size_t bucket_dir_path_len = strlen(ctx->config->bucket_dir_path);
-    const char sep[] = "/";
-    const size_t bucket_file_name_len = strlen(bucket_file_name);
-    char bucket_path[bucket_dir_path_len + sizeof(sep)-1 + bucket_file_name_len + 1];
-    ctx->current_bucket_index = bucket_index;
-    if(open_current_bucket(ctx, 0) != evr_ok){
-        goto out;
-    }
-    if(evr_validate_bucket_magic_number(ctx->current_bucket_f) != evr_ok){
-        log_error("Reindexing of bucket %s aborted because of invalid magic number. If you are sure the file is a bucket consider setting the first three bytes in the file to " evr_bucket_magic_number " and reindex again.", bucket_file_name);
-        goto out_with_close_bucket;
+    struct evr_glacier_write_ctx *ctx = rctx->wctx;
+    struct evr_reindex_run run;
+    run.entries = NULL;
+    run.entries_len = 0;
+    run.entries_alloc = 0;
+    run.blobs_count = 0;
+    run.tx_open = 0;
+    run.spilled = NULL;
+    run.spilled_len = 0;
+    run.spilled_alloc = 0;
+    size_t scanned_blobs = 0;
+    size_t scanned_bytes = 0;
+    for(size_t i = 0; i < rctx->buckets_len; ++i){
+        struct evr_reindex_bucket *b = &rctx->buckets[i];
+        if(mtx_lock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to lock reindex");
+            goto out_with_rollback;
+        }
+        while(!b->done){
+            if(cnd_wait(&rctx->changed, &rctx->lock) != thrd_success){
+                evr_panic("Unable to wait for reindex progress");
+                goto out_with_rollback;
+            }
+        }
+        if(mtx_unlock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to unlock reindex");
+            goto out_with_rollback;
+        }
+        if(b->res != evr_ok){
+            log_error("Unable to reindex bucket %s", b->bucket_path);
+            goto out_with_rollback;
+        }
+        if(!run.tx_open){
+            if(evr_glacier_step_tx_stmt(ctx, ctx->begin_stmt) != evr_ok){
+                goto out_with_free_run;
+            }
+            run.tx_open = 1;
+        }
+        if(evr_glacier_reindex_add_bucket(ctx, b) != evr_ok){
+            goto out_with_rollback;
+        }
+        if(evr_glacier_reindex_append_run(&run, b) != evr_ok){
+            goto out_with_rollback;
+        }
+        scanned_blobs += b->entries_len;
+        scanned_bytes += b->end_offset;
+        free(b->entries);
+        b->entries = NULL;
+        if(run.entries_len >= ctx->config->reindex_run_len){
+            if(evr_glacier_reindex_spill_run(ctx, &run) != evr_ok){
+                goto out_with_rollback;
+            }
+        }
+        if(mtx_lock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to lock reindex");
+            goto out_with_rollback;
+        }
+        rctx->consumed_buckets = i + 1;
+        if(cnd_broadcast(&rctx->changed) != thrd_success){
+            evr_panic("Unable to signal reindex progress");
+        }
+        if(mtx_unlock(&rctx->lock) != thrd_success){
+            evr_panic("Unable to unlock reindex");
+            goto out_with_rollback;
+        }
+        if((i + 1) * 10 / rctx->buckets_len != i * 10 / rctx->buckets_len){
+            log_info("Reindexed %zu of %zu buckets with %zu blobs and %zu MiB", i + 1, rctx->buckets_len, scanned_blobs, scanned_bytes >> 20);
+        }
     }
-    struct evr_buf_pos bp;
-    evr_init_buf_pos(&bp, bucket_path);
-    evr_push_n(&bp, ctx->config->bucket_dir_path, bucket_dir_path_len);
-    evr_push_n(&bp, sep, sizeof(sep) - 1);
-    evr_push_n(&bp, bucket_file_name, bucket_file_name_len);
-    evr_push_eos(&bp);
-    int walk_res = evr_glacier_walk_bucket(bucket_path, NULL, evr_glacier_reindex_visit_blob, ctx);
-    int end_offset;
-    if(walk_res == evr_end){
-        log_info("Mark bucket " evr_bucket_file_name_fmt " with corrupt end offset", bucket_index);
-        end_offset = evr_bucket_end_offset_corrupt;
-        goto out_with_write_end_offset;
-    } else if(walk_res != evr_ok){
-        log_error("Unable to walk bucket " evr_bucket_file_name_fmt " on reindex", bucket_index);
-        goto out_with_close_bucket;
+    if(run.spilled_len == 0){
+        if(run.tx_open){
+            if(evr_glacier_reindex_flush_run(ctx, &run) != evr_ok){
+                goto out_with_rollback;
+            }
+        }
+    } else {
+        if(run.entries_len > 0 || run.tx_open){
+            if(evr_glacier_reindex_spill_run(ctx, &run) != evr_ok){
+                goto out_with_rollback;
+            }
+        }
+        free(run.entries);
+        run.entries = NULL;
+        run.entries_alloc = 0;
+        if(evr_glacier_reindex_merge_runs(ctx, &run) != evr_ok){
+            goto out_with_rollback;
+        }
     }
-    end_offset = lseek(ctx->current_bucket_f, 0, SEEK_END);
-    if(end_offset == -1){
-        goto out_with_close_bucket;
+    log_info("Reindexed %zu blobs", run.blobs_count);
+    ret = evr_ok;
+ out_with_rollback:
+    if(run.tx_open){
+        if(evr_glacier_step_tx_stmt(ctx, ctx->rollback_stmt) != evr_ok){
+            evr_panic("Unable to rollback index db transaction for glacier %s", ctx->config->bucket_dir_path);
+        }
     }
- out_with_write_end_offset:
-    if(evr_write_bucket_end_offset(ctx->current_bucket_f, end_offset, 1) != evr_ok){
-        goto out_with_close_bucket;
+ out_with_free_run:
+    for(size_t i = 0; i < run.spilled_len; ++i){
+        if(close(run.spilled[i].f) != 0){
+            evr_panic("Unable to close spilled reindex run");
+            ret = evr_error;
+        }
     }
-    if(sqlite3_bind_int(ctx->insert_bucket_stmt, 1, ctx->current_bucket_index) != SQLITE_OK){
+    free(run.spilled);
+    free(run.entries);
+    return ret;
+}
+
+int evr_glacier_reindex_add_bucket(struct evr_glacier_write_ctx *ctx, struct evr_reindex_bucket *b){
+    int ret = evr_error;
+    if(sqlite3_bind_int64(ctx->insert_bucket_stmt, 1, b->bucket_index) != SQLITE_OK){
         goto out_with_reset_insert_stmt;
     }
     if(evr_step_stmt(ctx->db, ctx->insert_bucket_stmt) != SQLITE_DONE){
         goto out_with_reset_insert_stmt;
     }
-    if(sqlite3_bind_int(ctx->update_bucket_end_offset_stmt, 1, end_offset) != SQLITE_OK){
+    if(sqlite3_bind_int(ctx->update_bucket_end_offset_stmt, 1, b->end_offset) != SQLITE_OK){
         goto out_with_reset_update_stmt;
     }
-    if(sqlite3_bind_int(ctx->update_bucket_end_offset_stmt, 2, ctx->current_bucket_index) != SQLITE_OK){
+    if(sqlite3_bind_int64(ctx->update_bucket_end_offset_stmt, 2, b->bucket_index) != SQLITE_OK){
         goto out_with_reset_update_stmt;
     }
     if(evr_step_stmt(ctx->db, ctx->update_bucket_end_offset_stmt) != SQLITE_DONE){
-        log_error("Unable to update bucket " evr_bucket_file_name_fmt " end offset in index DB.", bucket_index);
+        log_error("Unable to update bucket " evr_bucket_file_name_fmt " end offset in index DB.", b->bucket_index);
         goto out_with_reset_update_stmt;
     }
     ret = evr_ok;
@@ -1162,63 +3837,262 @@ int evr_glacier_reindex_bucket(void *context, unsigned long bucket_index, char *
         evr_panic("Unable to reset insert_bucket_stmt");
         ret = evr_error;
     }
- out_with_close_bucket:
-    if(close_current_bucket(ctx) != evr_ok){
-        evr_panic("Unable to close current bucket");
-        goto out;
-    }
- out:
     return ret;
 }
 
-int evr_glacier_reindex_visit_blob(void *context, struct evr_glacier_bucket_blob_stat *stat){
-    int ret = evr_error;
-    struct evr_glacier_write_ctx *ctx = context;
-    if(stat->checksum_valid != evr_ok){
-        log_error("Blob header with invalid checksum detected. Abort reindexing bucket.");
-        ret = evr_end;
-        goto out;
+int evr_glacier_reindex_append_run(struct evr_reindex_run *run, struct evr_reindex_bucket *b){
+    const size_t min_alloc = run->entries_len + b->entries_len;
+    if(min_alloc > run->entries_alloc){
+        size_t new_alloc = max(1024, run->entries_alloc);
+        while(new_alloc < min_alloc){
+            new_alloc *= 2;
+        }
+        struct evr_reindex_entry *new_entries = realloc(run->entries, new_alloc * sizeof(struct evr_reindex_entry));
+        if(!new_entries){
+            return evr_error;
+        }
+        run->entries = new_entries;
+        run->entries_alloc = new_alloc;
     }
-    if(lseek(ctx->current_bucket_f, stat->offset, SEEK_SET) == -1){
-        log_error("Unable to seek in bucket file to offset %zu during reindexing", (size_t)stat->offset);
-        goto out;
+    memcpy(&run->entries[run->entries_len], b->entries, b->entries_len * sizeof(struct evr_reindex_entry));
+    run->entries_len += b->entries_len;
+    return evr_ok;
+}
+
+int evr_glacier_reindex_entry_cmp(const void *a, const void *b){
+    const struct evr_reindex_entry *ea = a;
+    const struct evr_reindex_entry *eb = b;
+    int ref_cmp = memcmp(ea->ref, eb->ref, evr_blob_ref_size);
+    if(ref_cmp != 0){
+        return ref_cmp;
     }
-    evr_blob_ref_hd hd;
-    if(evr_blob_ref_open(&hd) != evr_ok){
-        goto out;
+    // the first copy of a blob within the glacier wins
+    if(ea->bucket_index != eb->bucket_index){
+        return ea->bucket_index < eb->bucket_index ? -1 : 1;
     }
-    struct evr_file f;
-    evr_file_bind_fd(&f, ctx->current_bucket_f);
-    if(dump_n(&f, stat->size, evr_blob_ref_write_se, hd) != evr_ok){
-        evr_blob_ref_str ref_str;
-        evr_fmt_blob_ref(ref_str, stat->ref);
-        log_error("Unable to read over blob %s body during reindexing", ref_str);
-        goto out_with_close_hd;
+    if(ea->offset != eb->offset){
+        return ea->offset < eb->offset ? -1 : 1;
     }
-    if(evr_blob_ref_hd_match(hd, stat->ref) != evr_ok){
-        evr_blob_ref_str ref_str;
-        evr_fmt_blob_ref(ref_str, stat->ref);
-        log_error("Blob's body no longer matches ref %s. Skipping this blob.", ref_str);
-        ret = evr_ok;
-        goto out_with_close_hd;
+    return 0;
+}
+
+int evr_glacier_reindex_flush_run(struct evr_glacier_write_ctx *ctx, struct evr_reindex_run *run){
+    // inserting sorted keys touches every page of the blob_position
+    // key index only once per run.
+    qsort(run->entries, run->entries_len, sizeof(struct evr_reindex_entry), evr_glacier_reindex_entry_cmp);
+    for(size_t i = 0; i < run->entries_len; ++i){
+        struct evr_reindex_entry *e = &run->entries[i];
+        if(evr_glacier_add_blob_to_index(ctx, e->bucket_index, e->ref, e->flags, e->offset, e->size, e->last_modified) != evr_ok){
+            return evr_error;
+        }
     }
-    if(evr_glacier_add_blob_to_index(ctx, stat->ref, stat->flags, stat->offset, stat->size, stat->last_modified) != evr_ok){
-        goto out_with_close_hd;
+    if(evr_glacier_step_tx_stmt(ctx, ctx->commit_stmt) != evr_ok){
+        return evr_error;
     }
-#ifdef EVR_LOG_DEBUG
-    {
-        evr_blob_ref_str ref_str;
-        evr_fmt_blob_ref(ref_str, stat->ref);
-        log_debug("Reindexed blob %s", ref_str);
+    run->tx_open = 0;
+    run->blobs_count += run->entries_len;
+    run->entries_len = 0;
+    return evr_ok;
+}
+
+#define evr_reindex_run_file_path "/reindex-run-XXXXXX"
+
+int evr_glacier_reindex_spill_run(struct evr_glacier_write_ctx *ctx, struct evr_reindex_run *run){
+    if(run->spilled_len == run->spilled_alloc){
+        size_t new_alloc = max(8, 2 * run->spilled_alloc);
+        struct evr_reindex_spilled_run *new_spilled = realloc(run->spilled, new_alloc * sizeof(struct evr_reindex_spilled_run));
+        if(!new_spilled){
+            return evr_error;
+        }
+        run->spilled = new_spilled;
+        run->spilled_alloc = new_alloc;
     }
-#endif
+    size_t run_path_size = strlen(ctx->config->bucket_dir_path) + sizeof(evr_reindex_run_file_path);
+    char *run_path = alloca(run_path_size);
+    build_glacier_file_path(run_path, run_path_size, ctx->config->bucket_dir_path, evr_reindex_run_file_path);
+    int f = mkstemp(run_path);
+    if(f < 0){
+        log_error("Unable to create reindex run file in %s", ctx->config->bucket_dir_path);
+        return evr_error;
+    }
+    // the run file is only reachable through f so it vanishes even if
+    // the reindex gets killed.
+    if(unlink(run_path) != 0){
+        log_error("Unable to unlink reindex run file %s", run_path);
+        goto out_with_close_f;
+    }
+    qsort(run->entries, run->entries_len, sizeof(struct evr_reindex_entry), evr_glacier_reindex_entry_cmp);
+    struct evr_file fd;
+    evr_file_bind_fd(&fd, f);
+    if(write_n(&fd, run->entries, run->entries_len * sizeof(struct evr_reindex_entry)) != evr_ok){
+        log_error("Unable to write reindex run file in %s", ctx->config->bucket_dir_path);
+        goto out_with_close_f;
+    }
+    if(run->tx_open){
+        // commits the bucket rows which were inserted since the last
+        // spill.
+        if(evr_glacier_step_tx_stmt(ctx, ctx->commit_stmt) != evr_ok){
+            goto out_with_close_f;
+        }
+        run->tx_open = 0;
+    }
+    struct evr_reindex_spilled_run *s = &run->spilled[run->spilled_len++];
+    s->f = f;
+    s->entries_len = run->entries_len;
+    run->entries_len = 0;
+    return evr_ok;
+ out_with_close_f:
+    if(close(f) != 0){
+        evr_panic("Unable to close reindex run file");
+    }
+    return evr_error;
+}
+
+struct evr_reindex_run_reader {
+    struct evr_file f;
+    size_t remaining;
+    struct evr_reindex_entry *entries;
+    size_t entries_len;
+    size_t pos;
+};
+
+/**
+ * evr_glacier_reindex_fill_reader reads the next entries of a
+ * spilled run into the reader's buffer.
+ */
+int evr_glacier_reindex_fill_reader(struct evr_reindex_run_reader *r);
+
+/**
+ * evr_glacier_reindex_sift_down restores the min heap property of
+ * heap below index i.
+ */
+void evr_glacier_reindex_sift_down(struct evr_reindex_run_reader **heap, size_t heap_len, size_t i);
+
+int evr_glacier_reindex_merge_runs(struct evr_glacier_write_ctx *ctx, struct evr_reindex_run *run){
+    int ret = evr_error;
+    const size_t readers_len = run->spilled_len;
+    struct evr_reindex_run_reader *readers = malloc(readers_len * (sizeof(struct evr_reindex_run_reader) + sizeof(struct evr_reindex_run_reader*) + evr_reindex_merge_buffer_len * sizeof(struct evr_reindex_entry)));
+    if(!readers){
+        goto out;
+    }
+    struct evr_reindex_run_reader **heap = (struct evr_reindex_run_reader**)&readers[readers_len];
+    struct evr_reindex_entry *buffers = (struct evr_reindex_entry*)&heap[readers_len];
+    size_t heap_len = 0;
+    size_t total = 0;
+    for(size_t i = 0; i < readers_len; ++i){
+        struct evr_reindex_run_reader *r = &readers[i];
+        if(lseek(run->spilled[i].f, 0, SEEK_SET) != 0){
+            log_error("Unable to seek in reindex run file");
+            goto out_with_free_readers;
+        }
+        evr_file_bind_fd(&r->f, run->spilled[i].f);
+        r->remaining = run->spilled[i].entries_len;
+        r->entries = &buffers[i * evr_reindex_merge_buffer_len];
+        r->entries_len = 0;
+        r->pos = 0;
+        total += r->remaining;
+        if(r->remaining == 0){
+            continue;
+        }
+        if(evr_glacier_reindex_fill_reader(r) != evr_ok){
+            goto out_with_free_readers;
+        }
+        heap[heap_len++] = r;
+    }
+    for(size_t i = heap_len / 2; i > 0; --i){
+        evr_glacier_reindex_sift_down(heap, heap_len, i - 1);
+    }
+    log_info("Merge %zu blob positions from %zu runs", total, readers_len);
+    evr_blob_ref last_ref;
+    int has_last_ref = 0;
+    size_t merged = 0;
+    size_t tx_inserts = 0;
+    while(heap_len > 0){
+        struct evr_reindex_run_reader *r = heap[0];
+        struct evr_reindex_entry *e = &r->entries[r->pos];
+        // entries with equal refs are ordered by their position in
+        // the glacier so the first copy of a blob wins.
+        if(!has_last_ref || memcmp(last_ref, e->ref, evr_blob_ref_size) != 0){
+            if(!run->tx_open){
+                if(evr_glacier_step_tx_stmt(ctx, ctx->begin_stmt) != evr_ok){
+                    goto out_with_free_readers;
+                }
+                run->tx_open = 1;
+            }
+            if(evr_glacier_add_blob_to_index(ctx, e->bucket_index, e->ref, e->flags, e->offset, e->size, e->last_modified) != evr_ok){
+                goto out_with_free_readers;
+            }
+            memcpy(last_ref, e->ref, evr_blob_ref_size);
+            has_last_ref = 1;
+            ++tx_inserts;
+        }
+        r->pos += 1;
+        if(r->pos == r->entries_len){
+            if(r->remaining > 0){
+                if(evr_glacier_reindex_fill_reader(r) != evr_ok){
+                    goto out_with_free_readers;
+                }
+            } else {
+                heap[0] = heap[--heap_len];
+            }
+        }
+        evr_glacier_reindex_sift_down(heap, heap_len, 0);
+        if(tx_inserts >= ctx->config->reindex_run_len){
+            if(evr_glacier_step_tx_stmt(ctx, ctx->commit_stmt) != evr_ok){
+                goto out_with_free_readers;
+            }
+            run->tx_open = 0;
+            tx_inserts = 0;
+        }
+        merged += 1;
+        if(merged * 10 / total != (merged - 1) * 10 / total){
+            log_info("Merged %zu of %zu blob positions", merged, total);
+        }
+    }
+    if(run->tx_open){
+        if(evr_glacier_step_tx_stmt(ctx, ctx->commit_stmt) != evr_ok){
+            goto out_with_free_readers;
+        }
+        run->tx_open = 0;
+    }
+    run->blobs_count += merged;
     ret = evr_ok;
- out_with_close_hd:
-    evr_blob_ref_close(hd);
+ out_with_free_readers:
+    free(readers);
  out:
     return ret;
 }
 
+int evr_glacier_reindex_fill_reader(struct evr_reindex_run_reader *r){
+    size_t n = min(r->remaining, evr_reindex_merge_buffer_len);
+    if(read_n(&r->f, (char*)r->entries, n * sizeof(struct evr_reindex_entry), NULL, NULL) != evr_ok){
+        log_error("Unable to read reindex run file");
+        return evr_error;
+    }
+    r->remaining -= n;
+    r->entries_len = n;
+    r->pos = 0;
+    return evr_ok;
+}
+
+void evr_glacier_reindex_sift_down(struct evr_reindex_run_reader **heap, size_t heap_len, size_t i){
+    while(1){
+        size_t smallest = i;
+        for(size_t c = 2 * i + 1; c <= 2 * i + 2 && c < heap_len; ++c){
+            if(evr_glacier_reindex_entry_cmp(&heap[c]->entries[heap[c]->pos], &heap[smallest]->entries[heap[smallest]->pos]) < 0){
+                smallest = c;
+            }
+        }
+        if(smallest == i){
+            return;
+        }
+        struct evr_reindex_run_reader *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
 int evr_glacier_walk_bucket(char *bucket_path, int (*visit_bucket)(void *ctx, size_t end_offset), int (*visit_blob)(void *ctx, struct evr_glacier_bucket_blob_stat *stat), void *ctx){
     int ret = evr_error;
     const size_t header_size = evr_blob_ref_size + sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t);
@@ -1300,6 +4174,160 @@ int evr_glacier_walk_bucket(char *bucket_path, int (*visit_bucket)(void *ctx, si
     return ret;
 }
 
+/**
+ * evr_glacier_pull_seal_entry parses the serialized seal entry at
+ * buf. Returns evr_error if the entry's checksum does not match.
+ */
+int evr_glacier_pull_seal_entry(char *buf, struct evr_glacier_bucket_seal_entry *entry);
+
+/**
+ * evr_glacier_crc_bucket calculates the zlib crc32 of the bucket's
+ * bytes between the bucket header and end_offset.
+ */
+int evr_glacier_crc_bucket(const char *bucket_path, size_t end_offset, unsigned long *crc);
+
+int evr_glacier_read_bucket_seal(const char *bucket_path, size_t end_offset, int (*visit)(void *ctx, struct evr_glacier_bucket_seal_entry *entry), void *ctx){
+    int ret = evr_error;
+    const char bucket_ext[] = "." evr_bucket_file_ext;
+    const size_t bucket_path_len = strlen(bucket_path);
+    if(bucket_path_len < strlen(bucket_ext) || strcmp(&bucket_path[bucket_path_len - strlen(bucket_ext)], bucket_ext) != 0){
+        return evr_not_found;
+    }
+    char seal_path[bucket_path_len + 1];
+    memcpy(seal_path, bucket_path, bucket_path_len - strlen(evr_bucket_file_ext));
+    memcpy(&seal_path[bucket_path_len - strlen(evr_bucket_file_ext)], evr_bucket_seal_file_ext, strlen(evr_bucket_seal_file_ext) + 1);
+    int f = open(seal_path, O_RDONLY);
+    if(f < 0){
+        if(errno == ENOENT){
+            return evr_not_found;
+        }
+        log_error("Unable to open bucket seal %s: %s", seal_path, strerror(errno));
+        return evr_error;
+    }
+    struct stat seal_stat;
+    if(fstat(f, &seal_stat) != 0){
+        goto out_with_close_f;
+    }
+    if((size_t)seal_stat.st_size < evr_bucket_seal_header_size){
+        log_info("Ignoring bucket seal %s because it is too small", seal_path);
+        ret = evr_not_found;
+        goto out_with_close_f;
+    }
+    char *buf = malloc(seal_stat.st_size);
+    if(!buf){
+        goto out_with_close_f;
+    }
+    struct evr_file fd;
+    evr_file_bind_fd(&fd, f);
+    if(read_n(&fd, buf, seal_stat.st_size, NULL, NULL) != evr_ok){
+        goto out_with_free_buf;
+    }
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    char magic[sizeof(evr_bucket_seal_magic_number) - 1];
+    uint8_t version;
+    size_t seal_end_offset, entries_len;
+    unsigned long seal_crc;
+    evr_pull_n(&bp, magic, sizeof(magic));
+    evr_pull_as(&bp, &version, uint8_t);
+    evr_pull_map(&bp, &seal_end_offset, uint32_t, be32toh);
+    evr_pull_map(&bp, &entries_len, uint32_t, be32toh);
+    evr_pull_map(&bp, &seal_crc, uint32_t, be32toh);
+    if(memcmp(magic, evr_bucket_seal_magic_number, sizeof(magic)) != 0 || version != evr_bucket_seal_version){
+        log_info("Ignoring bucket seal %s because of unknown format", seal_path);
+        ret = evr_not_found;
+        goto out_with_free_buf;
+    }
+    if(seal_end_offset != end_offset || (size_t)seal_stat.st_size != evr_bucket_seal_header_size + entries_len * evr_bucket_seal_entry_size){
+        log_info("Ignoring bucket seal %s because it does not cover the bucket", seal_path);
+        ret = evr_not_found;
+        goto out_with_free_buf;
+    }
+    // all entries are validated before the first one is visited so
+    // the caller can still fall back to walking the bucket.
+    struct evr_glacier_bucket_seal_entry entry;
+    char *entries = bp.pos;
+    for(size_t i = 0; i < entries_len; ++i){
+        if(evr_glacier_pull_seal_entry(&entries[i * evr_bucket_seal_entry_size], &entry) != evr_ok || entry.offset < evr_bucket_header_size + evr_bucket_blob_header_size || entry.offset + entry.stored_size > end_offset){
+            log_info("Ignoring bucket seal %s because of an invalid entry", seal_path);
+            ret = evr_not_found;
+            goto out_with_free_buf;
+        }
+    }
+    // the seal replaces hashing every blob. so the bucket's contents
+    // must still be the ones the seal was written for.
+    unsigned long bucket_crc;
+    if(evr_glacier_crc_bucket(bucket_path, end_offset, &bucket_crc) != evr_ok){
+        goto out_with_free_buf;
+    }
+    if(bucket_crc != seal_crc){
+        log_info("Ignoring bucket seal %s because the bucket's contents changed", seal_path);
+        ret = evr_not_found;
+        goto out_with_free_buf;
+    }
+    for(size_t i = 0; i < entries_len; ++i){
+        evr_glacier_pull_seal_entry(&entries[i * evr_bucket_seal_entry_size], &entry);
+        if(visit(ctx, &entry) != evr_ok){
+            goto out_with_free_buf;
+        }
+    }
+    ret = evr_ok;
+ out_with_free_buf:
+    free(buf);
+ out_with_close_f:
+    if(close(f) != 0){
+        evr_panic("Unable to close bucket seal %s", seal_path);
+        ret = evr_error;
+    }
+    return ret;
+}
+
+int evr_glacier_crc_bucket(const char *bucket_path, size_t end_offset, unsigned long *crc){
+    int ret = evr_error;
+    int f = open(bucket_path, O_RDONLY);
+    if(f < 0){
+        log_error("Unable to open bucket %s: %s", bucket_path, strerror(errno));
+        goto out;
+    }
+    const size_t buf_size = 64 << 10;
+    char *buf = malloc(buf_size);
+    if(!buf){
+        goto out_with_close_f;
+    }
+    *crc = crc32(0L, Z_NULL, 0);
+    for(size_t pos = evr_bucket_header_size; pos < end_offset;){
+        ssize_t bytes_read = pread(f, buf, min(buf_size, end_offset - pos), pos);
+        if(bytes_read <= 0){
+            log_error("Unable to read bucket %s at offset %zu", bucket_path, pos);
+            goto out_with_free_buf;
+        }
+        *crc = crc32(*crc, (const Bytef*)buf, bytes_read);
+        pos += bytes_read;
+    }
+    ret = evr_ok;
+ out_with_free_buf:
+    free(buf);
+ out_with_close_f:
+    if(close(f) != 0){
+        evr_panic("Unable to close bucket %s", bucket_path);
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_glacier_pull_seal_entry(char *buf, struct evr_glacier_bucket_seal_entry *entry){
+    struct evr_buf_pos bp;
+    evr_init_buf_pos(&bp, buf);
+    evr_pull_n(&bp, entry->ref, evr_blob_ref_size);
+    evr_pull_as(&bp, &entry->flags, uint8_t);
+    evr_pull_map(&bp, &entry->last_modified, uint64_t, be64toh);
+    evr_pull_map(&bp, &entry->offset, uint32_t, be32toh);
+    evr_pull_map(&bp, &entry->stored_size, uint32_t, be32toh);
+    evr_pull_map(&bp, &entry->size, uint32_t, be32toh);
+    return evr_pull_8bit_checksum(&bp);
+}
+
 int evr_validate_bucket_magic_number(int f){
     char buf[strlen(evr_bucket_magic_number)];
     struct evr_file fd;
@@ -26,11 +26,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sqlite3.h>
+#include <threads.h>
 
 #include "glacier-storage-configuration.h"
 #include "errors.h"
 #include "keys.h"
 #include "basics.h"
+#include "files.h"
+#include "bucket-io.h"
+#include "dyn-mem.h"
 
 #define evr_bucket_magic_number "EVB"
 
@@ -55,16 +59,75 @@
  */
 #define evr_bucket_end_offset_corrupt 0
 
+/**
+ * A bucket seal lists all blobs of a full bucket. It is written next
+ * to the bucket file when the bucket is closed because the next
+ * bucket is created. Seal file names have the bucket's name with the
+ * evs instead of the evb extension.
+ *
+ * The bucket seal starts with the evr_bucket_seal_magic_number, the
+ * uint8_t evr_bucket_seal_version, the uint32_t bucket end offset
+ * covered by the seal, the uint32_t number of entries and the
+ * uint32_t zlib crc32 of the bucket's bytes between the bucket header
+ * and the end offset. Every entry has evr_bucket_seal_entry_size
+ * bytes:
+ *
+ * - evr_blob_ref key
+ * - uint8_t flags
+ * - uint64_t last_modified
+ * - uint32_t offset of the blob's data within the bucket
+ * - uint32_t stored size of the blob's data
+ * - uint32_t blob size, which differs from the stored size for
+ *   deflated blobs
+ * - uint8_t 8bit checksum of the entry
+ *
+ * Buckets without seal are still read by walking their blob headers.
+ */
+#define evr_bucket_seal_magic_number "EVS"
+
+#define evr_bucket_seal_version 2
+
+#define evr_bucket_seal_header_size (3 + sizeof(uint8_t) + 3 * sizeof(uint32_t))
+
+#define evr_bucket_seal_entry_size (evr_blob_ref_size + sizeof(uint8_t) + sizeof(uint64_t) + 3 * sizeof(uint32_t) + sizeof(uint8_t))
+
 #define glacier_dir_index_db_path "/index.db"
 
 extern const size_t evr_max_chunks_per_blob;
 
+/**
+ * evr_glacier_blob_pos locates a blob's data within the buckets.
+ */
+struct evr_glacier_blob_pos {
+    /**
+     * flags are the blob's stored flags. They include
+     * evr_blob_flag_deflated if the blob is stored compressed.
+     */
+    int flags;
+    unsigned long bucket_index;
+    /**
+     * offset is the position of the blob's first data byte within
+     * the bucket file.
+     */
+    size_t offset;
+    /**
+     * size is the blob's uncompressed size.
+     */
+    size_t size;
+};
+
 struct evr_writing_blob {
     evr_blob_ref key;
     int flags;
     size_t size;
     int sync_strategy;
     char **chunks;
+
+    /**
+     * pos is set by evr_glacier_append_blobs after the blob got
+     * persisted.
+     */
+    struct evr_glacier_blob_pos pos;
 };
 
 struct evr_glacier_read_ctx {
@@ -74,6 +137,7 @@ struct evr_glacier_read_ctx {
     sqlite3_stmt *list_blobs_stmt_order_last_modified;
     sqlite3_stmt *list_blobs_stmt_order_blob_ref;
     char *read_buffer;
+    size_t read_buffer_size;
 };
 
 /**
@@ -91,8 +155,68 @@ struct evr_glacier_read_ctx {
  */
 struct evr_glacier_read_ctx *evr_create_glacier_read_ctx(struct evr_glacier_storage_cfg *config);
 
+/**
+ * evr_create_sized_glacier_read_ctx creates a new struct
+ * evr_glacier_read_ctx just like evr_create_glacier_read_ctx but
+ * with a read buffer of read_buffer_size bytes.
+ */
+struct evr_glacier_read_ctx *evr_create_sized_glacier_read_ctx(struct evr_glacier_storage_cfg *config, size_t read_buffer_size);
+
 int evr_free_glacier_read_ctx(struct evr_glacier_read_ctx *ctx);
 
+/**
+ * evr_glacier_read_ctx_pool shares a bounded number of read contexts
+ * between threads.
+ *
+ * Read contexts are created lazily when they are checked out the
+ * first time.
+ */
+struct evr_glacier_read_ctx_pool {
+    struct evr_glacier_storage_cfg *config;
+    size_t read_buffer_size;
+    mtx_t lock;
+    cnd_t ctx_returned;
+    /**
+     * ctxs_len is the maximum number of read contexts.
+     */
+    size_t ctxs_len;
+    size_t ctxs_created;
+    /**
+     * idle_ctxs_len is the number of created read contexts which are
+     * currently not checked out. They are placed at the beginning of
+     * idle_ctxs.
+     */
+    size_t idle_ctxs_len;
+    struct evr_glacier_read_ctx **idle_ctxs;
+};
+
+/**
+ * evr_create_glacier_read_ctx_pool creates a pool which hands out up
+ * to ctxs_len read contexts with read_buffer_size bytes read buffers.
+ *
+ * config must not be modified or freed until
+ * evr_free_glacier_read_ctx_pool is called.
+ */
+struct evr_glacier_read_ctx_pool *evr_create_glacier_read_ctx_pool(struct evr_glacier_storage_cfg *config, size_t ctxs_len, size_t read_buffer_size);
+
+/**
+ * evr_free_glacier_read_ctx_pool frees the pool and all its read
+ * contexts. All checked out read contexts must be returned before.
+ */
+int evr_free_glacier_read_ctx_pool(struct evr_glacier_read_ctx_pool *pool);
+
+/**
+ * evr_glacier_checkout_read_ctx takes a read context from the
+ * pool. Blocks until a read context gets returned if all are checked
+ * out.
+ *
+ * Returns NULL on error. The read context must be handed back using
+ * evr_glacier_return_read_ctx.
+ */
+struct evr_glacier_read_ctx *evr_glacier_checkout_read_ctx(struct evr_glacier_read_ctx_pool *pool);
+
+int evr_glacier_return_read_ctx(struct evr_glacier_read_ctx_pool *pool, struct evr_glacier_read_ctx *ctx);
+
 struct evr_glacier_blob_stat {
     int flags;
     size_t blob_size;
@@ -122,6 +246,139 @@ int evr_glacier_stat_blob(struct evr_glacier_read_ctx *ctx, const evr_blob_ref k
  */
 int evr_glacier_read_blob(struct evr_glacier_read_ctx *ctx, const evr_blob_ref key, int (*status)(void *arg, int exists, int flags, size_t blob_size), int (*on_data)(void *arg, const char *data, size_t data_size), void *arg);
 
+struct evr_bucket_fd_cache_entry {
+    unsigned long bucket_index;
+    /**
+     * fd is -1 if the entry is unused or while
+     * evr_bucket_fd_cache_acquire opens the entry's bucket.
+     */
+    int fd;
+    /**
+     * refs is the number of acquired but not yet released uses of
+     * fd. Entries are only evicted if refs is 0.
+     */
+    unsigned int refs;
+    /**
+     * prev and next chain the entries with refs 0 in the cache's idle
+     * list.
+     */
+    struct evr_bucket_fd_cache_entry *prev;
+    struct evr_bucket_fd_cache_entry *next;
+    struct evr_bucket_fd_cache_entry *table_next;
+};
+
+/**
+ * evr_bucket_fd_cache keeps read only file descriptors of recently
+ * read buckets open.
+ *
+ * The cached file descriptors are shared between threads. They must
+ * only be read using pread.
+ */
+struct evr_bucket_fd_cache {
+    struct evr_glacier_storage_cfg *config;
+    mtx_t lock;
+
+    /**
+     * opened is broadcasted when evr_bucket_fd_cache_acquire finished
+     * opening a bucket outside of lock.
+     */
+    cnd_t opened;
+
+    /**
+     * table is a hash table of the entries which are cached or being
+     * opened. They are chained via table_next. table_len is a power
+     * of 2.
+     */
+    struct evr_bucket_fd_cache_entry **table;
+    size_t table_len;
+
+    /**
+     * idle_head is the least and idle_tail the most recently used
+     * entry with refs 0. Unused entries are put at the head.
+     */
+    struct evr_bucket_fd_cache_entry *idle_head;
+    struct evr_bucket_fd_cache_entry *idle_tail;
+
+    size_t entries_len;
+    struct evr_bucket_fd_cache_entry *entries;
+};
+
+/**
+ * evr_create_bucket_fd_cache creates a cache which keeps up to
+ * entries_len bucket files open.
+ *
+ * config must not be freed until evr_free_bucket_fd_cache is called.
+ */
+struct evr_bucket_fd_cache *evr_create_bucket_fd_cache(struct evr_glacier_storage_cfg *config, size_t entries_len);
+
+int evr_free_bucket_fd_cache(struct evr_bucket_fd_cache *cache);
+
+/**
+ * evr_bucket_fd_cache_acquire returns a read only file descriptor for
+ * the bucket with the given index. The bucket's magic number is
+ * validated when the bucket is opened. The least recently used
+ * unreferenced file descriptor is closed if the cache is full.
+ *
+ * Buckets are opened without holding the cache's lock. Concurrent
+ * acquires of a bucket which is just being opened wait for it.
+ *
+ * The returned file descriptor must be handed back using
+ * evr_bucket_fd_cache_release. Returns -1 on error.
+ */
+int evr_bucket_fd_cache_acquire(struct evr_bucket_fd_cache *cache, unsigned long bucket_index);
+
+int evr_bucket_fd_cache_release(struct evr_bucket_fd_cache *cache, unsigned long bucket_index, int fd);
+
+/**
+ * evr_glacier_read_blob_at reads the blob at pos without consulting
+ * the index db.
+ *
+ * read_buffer with read_buffer_size bytes is used to pass the blob's
+ * data to on_data. status and on_data behave like in
+ * evr_glacier_read_blob except that status is only invoked with
+ * exists 1.
+ */
+int evr_glacier_read_blob_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, char *read_buffer, size_t read_buffer_size, int (*status)(void *arg, int exists, int flags, size_t blob_size), int (*on_data)(void *arg, const char *data, size_t data_size), void *arg);
+
+/**
+ * evr_glacier_send_blob_at writes the data of the blob at pos into
+ * dest using dest's sendfile function.
+ *
+ * status is invoked before the blob's data is written just like in
+ * evr_glacier_read_blob_at.
+ *
+ * Returns evr_end if dest signals an EPIPE.
+ */
+int evr_glacier_send_blob_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, struct evr_file *dest, int (*status)(void *arg, int exists, int flags, size_t blob_size), void *arg);
+
+/**
+ * evr_glacier_send_blob_range_at writes range_size bytes of the blob
+ * at pos starting at range_offset within the blob into dest.
+ *
+ * The range must be located within the blob. status is invoked with
+ * the whole blob's size just like in evr_glacier_send_blob_at.
+ *
+ * Returns evr_end if dest signals an EPIPE.
+ */
+int evr_glacier_send_blob_range_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, size_t range_offset, size_t range_size, struct evr_file *dest, int (*status)(void *arg, int exists, int flags, size_t blob_size), void *arg);
+
+/**
+ * evr_glacier_send_stored_blob_at writes the blob at pos into dest
+ * the way it is stored in the bucket.
+ *
+ * status is invoked with the stored flags and the stored size. The
+ * data is a zlib stream if flags contains evr_blob_flag_deflated.
+ *
+ * Returns evr_end if dest signals an EPIPE.
+ */
+int evr_glacier_send_stored_blob_at(struct evr_bucket_fd_cache *cache, const struct evr_glacier_blob_pos *pos, struct evr_file *dest, int (*status)(void *arg, int exists, int flags, size_t blob_size), void *arg);
+
+/**
+ * evr_glacier_walk_blob_positions visits the position of every blob
+ * in the index db.
+ */
+int evr_glacier_walk_blob_positions(struct evr_glacier_read_ctx *ctx, int (*visit)(void *vctx, const evr_blob_ref key, const struct evr_glacier_blob_pos *pos), void *vctx);
+
 /**
  * evr_cmd_watch_sort_order_last_modified indicates sort by last
  * modified ascending.
@@ -159,8 +416,50 @@ struct evr_blob_filter {
 
 int evr_glacier_list_blobs(struct evr_glacier_read_ctx *ctx, int (*visit)(void *vctx, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob), struct evr_blob_filter *filter, void *vctx);
 
-struct evr_glacier_write_ctx {
-    struct evr_glacier_storage_cfg *config;
+/**
+ * evr_blob_list_default_page_len is the number of blobs
+ * evr_glacier_list_blobs lists per evr_glacier_list_blobs_page call.
+ */
+#define evr_blob_list_default_page_len 4096
+
+/**
+ * struct evr_blob_list_cursor is the position within a blob listing
+ * after which evr_glacier_list_blobs_page continues.
+ *
+ * The cursor only depends on the last listed blob. A listing can
+ * therefore be continued with any read context.
+ */
+struct evr_blob_list_cursor {
+    evr_time last_modified;
+
+    /**
+     * key_len is 0 until the first blob got listed.
+     */
+    size_t key_len;
+    evr_blob_ref key;
+};
+
+void evr_init_blob_list_cursor(struct evr_blob_list_cursor *cursor, struct evr_blob_filter *filter);
+
+/**
+ * evr_glacier_list_blobs_page visits at most page_len blobs which
+ * pass filter and follow cursor. cursor is moved behind the visited
+ * blobs.
+ *
+ * The index db seeks right to the cursor's position so continuing a
+ * listing does not scan the already listed blobs again.
+ *
+ * Returns evr_ok if more blobs follow. Returns evr_end if the last
+ * blob got visited. The last blob is visited with last_blob set.
+ */
+int evr_glacier_list_blobs_page(struct evr_glacier_read_ctx *ctx, int (*visit)(void *vctx, const evr_blob_ref key, int flags, evr_time last_modified, int last_blob), struct evr_blob_filter *filter, struct evr_blob_list_cursor *cursor, size_t page_len, void *vctx);
+
+/**
+ * struct evr_glacier_bucket_lane is one current bucket of a struct
+ * evr_glacier_write_ctx. Blobs can be appended to different lanes
+ * from different threads in parallel.
+ */
+struct evr_glacier_bucket_lane {
     unsigned long current_bucket_index;
     int current_bucket_f;
     size_t current_bucket_pos;
@@ -170,12 +469,80 @@ struct evr_glacier_write_ctx {
      * been fdatasynced yet. 1 means the bucket is sync.
      */
     int current_bucket_sync;
+
+    /**
+     * io appends to the current bucket. NULL if plain syscalls are
+     * used.
+     */
+    struct evr_bucket_io *io;
+
+    /**
+     * seal_entries collects the bucket seal entries of all blobs in
+     * the current bucket. NULL if the current bucket can't be sealed
+     * because it was not created by this write ctx.
+     */
+    struct dynamic_array *seal_entries;
+
+    /**
+     * seal_crc is the zlib crc32 of the current bucket's bytes behind
+     * the bucket header. It is only maintained while seal_entries is
+     * not NULL.
+     */
+    unsigned long seal_crc;
+};
+
+struct evr_glacier_write_ctx {
+    struct evr_glacier_storage_cfg *config;
+
+    /**
+     * lanes contains config->bucket_lanes current buckets.
+     */
+    struct evr_glacier_bucket_lane *lanes;
+    size_t lanes_len;
+
+    /**
+     * index_lock serializes the access to db and last_bucket_index
+     * between lanes.
+     */
+    mtx_t index_lock;
+
+    /**
+     * last_bucket_index is the highest existing bucket index.
+     */
+    unsigned long last_bucket_index;
+
+    /**
+     * Appends to different lanes draw a commit ticket together with
+     * their last_modified timestamp. The index db transactions are
+     * committed in ticket order so blobs show up in the index db in
+     * the order of their last_modified timestamps. Watchers and
+     * list cursors rely on that order. Only the index db
+     * transactions are serialized this way. The bucket writes and
+     * their fdatasyncs still run in parallel.
+     */
+    cnd_t commit_turn;
+    unsigned long next_commit_ticket;
+    unsigned long served_commit_ticket;
+
+    /**
+     * migrate_index_db is set while index_db_migration moves a
+     * version 1 index db to the current version in the
+     * background. stop_index_db_migration is protected by
+     * index_lock.
+     */
+    int migrate_index_db;
+    thrd_t index_db_migration;
+    int stop_index_db_migration;
+
     int lock_fd;
     sqlite3 *db;
     sqlite3_stmt *insert_blob_stmt;
     sqlite3_stmt *insert_bucket_stmt;
     sqlite3_stmt *update_bucket_end_offset_stmt;
     sqlite3_stmt *find_bucket_end_offset_stmt;
+    sqlite3_stmt *begin_stmt;
+    sqlite3_stmt *commit_stmt;
+    sqlite3_stmt *rollback_stmt;
 };
 
 /**
@@ -190,6 +557,16 @@ int evr_create_glacier_write_ctx(struct evr_glacier_write_ctx **ctx, struct evr_
 
 int evr_free_glacier_write_ctx(struct evr_glacier_write_ctx *ctx);
 
+/**
+ * evr_glacier_join_index_db_migration waits until the background
+ * migration of a version 1 index db is finished. Returns evr_ok
+ * right away if no migration runs.
+ *
+ * evr_free_glacier_write_ctx stops a running migration instead of
+ * waiting for it. The migration continues with the next write ctx.
+ */
+int evr_glacier_join_index_db_migration(struct evr_glacier_write_ctx *ctx);
+
 #define evr_sync_strategy_default 0x00
 #define evr_sync_strategy_per_blob 0x01
 #define evr_sync_strategy_avoid 0x02
@@ -209,6 +586,102 @@ int evr_free_glacier_write_ctx(struct evr_glacier_write_ctx *ctx);
  */
 int evr_glacier_append_blob(struct evr_glacier_write_ctx *ctx, struct evr_writing_blob *blob, evr_time *last_modified);
 
+/**
+ * evr_glacier_append_blobs appends a batch of blobs to the current
+ * bucket.
+ *
+ * All blobs which fit into the current bucket are written with one
+ * writev call and fdatasynced at most once. The index db updates for
+ * the whole batch are performed within one transaction. A new
+ * current bucket is created if the remaining blobs don't fit into the
+ * current bucket anymore.
+ *
+ * The batch is fdatasynced if at least one blob in blobs requests
+ * evr_sync_strategy_per_blob.
+ *
+ * The blobs which fit into one bucket are indexed within one
+ * transaction. So if evr_error is returned the blobs from buckets
+ * before the failing one might already be persisted. A blob which is
+ * bigger than the max bucket size is rejected without affecting the
+ * other blobs.
+ *
+ * results may be NULL. Otherwise results[i] is set to evr_ok if
+ * blobs[i] got persisted and to evr_error if not.
+ *
+ * last_modified is set to the last modified timestamp shared by all
+ * blobs in the batch after the function returns.
+ *
+ * Returns evr_ok if all blobs got persisted. Otherwise evr_error.
+ */
+int evr_glacier_append_blobs(struct evr_glacier_write_ctx *ctx, struct evr_writing_blob **blobs, size_t blobs_len, int *results, evr_time *last_modified);
+
+/**
+ * evr_glacier_append_lane_blobs works like evr_glacier_append_blobs
+ * but appends the blobs to the current bucket of the lane with index
+ * lane. Different lanes may be appended to from different threads at
+ * the same time.
+ */
+int evr_glacier_append_lane_blobs(struct evr_glacier_write_ctx *ctx, size_t lane, struct evr_writing_blob **blobs, size_t blobs_len, int *results, evr_time *last_modified);
+
+/**
+ * struct evr_glacier_blob_stream is a blob which is written into a
+ * lane's current bucket piece by piece instead of being buffered in
+ * chunks.
+ *
+ * The caller fills blob's key, flags, size and sync_strategy before
+ * evr_glacier_begin_blob_stream. blob's chunks are not used.
+ */
+struct evr_glacier_blob_stream {
+    struct evr_writing_blob blob;
+    size_t lane;
+    size_t written;
+
+    /**
+     * crc is the zlib crc32 of the written data. It is added to the
+     * lane's seal_crc when the stream is committed.
+     */
+    unsigned long crc;
+};
+
+/**
+ * evr_glacier_begin_blob_stream reserves room for the stream's blob
+ * behind the end of the current bucket of the lane with index
+ * lane. A new current bucket is created if the blob does not fit
+ * into the current bucket anymore.
+ *
+ * The caller must own the lane until the stream is committed or
+ * aborted. No blobs may be appended to the lane in the meantime.
+ *
+ * Streamed blobs are stored uncompressed.
+ */
+int evr_glacier_begin_blob_stream(struct evr_glacier_write_ctx *ctx, size_t lane, struct evr_glacier_blob_stream *s);
+
+/**
+ * evr_glacier_write_blob_stream writes the next data_size bytes of
+ * the stream's blob.
+ *
+ * The written data is not visible in the bucket until the stream is
+ * committed.
+ */
+int evr_glacier_write_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s, const char *data, size_t data_size);
+
+/**
+ * evr_glacier_commit_blob_stream writes the stream's blob header,
+ * moves the bucket's end offset behind the blob and indexes the blob
+ * like evr_glacier_append_blob does. All of the blob's bytes must
+ * have been written.
+ *
+ * The stream's blob pos is set after the function returns
+ * successfully.
+ */
+int evr_glacier_commit_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s, evr_time *last_modified);
+
+/**
+ * evr_glacier_abort_blob_stream drops the data written by the stream
+ * from the lane's current bucket.
+ */
+int evr_glacier_abort_blob_stream(struct evr_glacier_write_ctx *ctx, struct evr_glacier_blob_stream *s);
+
 /**
  * evr_glacier_add_watcher registers a callback which fires after a
  * blob got modified.
@@ -225,12 +698,45 @@ int evr_glacier_add_watcher(struct evr_glacier_write_ctx *ctx, void (*watcher)(v
  */
 int evr_glacier_rm_watcher(struct evr_glacier_write_ctx *ctx, int wd);
 
+/**
+ * evr_glacier_quick_check_latest_blobs is the number of most recently
+ * modified blobs which evr_quick_check_glacier verifies. These blobs
+ * are at the tail of the current buckets where an unclean shutdown
+ * leaves damage.
+ */
+#define evr_glacier_quick_check_latest_blobs 64
+
 /**
  * evr_quick_check_glacier performs a quick sanity check of the
  * persisted glacier and creates it if not existing.
+ *
+ * Only the current buckets' end offsets and the
+ * evr_glacier_quick_check_latest_blobs latest blobs are
+ * checked. Older blobs can be sampled afterwards using
+ * evr_glacier_check_latest_blob and evr_glacier_check_random_blob.
  */
 int evr_quick_check_glacier(struct evr_glacier_storage_cfg *config);
 
+/**
+ * evr_glacier_check_latest_blob verifies the index-th most recently
+ * modified blob against its bucket. index 0 is the latest blob.
+ *
+ * Returns evr_not_found if there is no index-th blob and
+ * evr_glacier_index_db_corrupt if the bucket does not hold the blob
+ * the index db points to.
+ */
+int evr_glacier_check_latest_blob(struct evr_glacier_read_ctx *ctx, size_t index);
+
+/**
+ * evr_glacier_check_random_blob verifies a randomly picked blob
+ * against its bucket.
+ *
+ * Returns evr_not_found if the glacier has no blobs and
+ * evr_glacier_index_db_corrupt if the bucket does not hold the blob
+ * the index db points to.
+ */
+int evr_glacier_check_random_blob(struct evr_glacier_read_ctx *ctx);
+
 struct evr_glacier_bucket_blob_stat {
     evr_blob_ref ref;
     int flags;
@@ -243,4 +749,26 @@ struct evr_glacier_bucket_blob_stat {
 
 int evr_glacier_walk_bucket(char *bucket_path, int (*visit_bucket)(void *ctx, size_t end_offset), int (*visit_blob)(void *ctx, struct evr_glacier_bucket_blob_stat *stat), void *ctx);
 
+struct evr_glacier_bucket_seal_entry {
+    evr_blob_ref ref;
+    int flags;
+    evr_time last_modified;
+    size_t offset;
+    size_t stored_size;
+    size_t size;
+};
+
+/**
+ * evr_glacier_read_bucket_seal visits the entries of the seal next to
+ * the bucket file at bucket_path.
+ *
+ * end_offset is the bucket's end offset. Seals covering another end
+ * offset are ignored. So are seals whose crc32 does not match the
+ * bucket's contents. The whole bucket is read to verify the crc32.
+ *
+ * Returns evr_not_found if the bucket has no valid seal. visit is
+ * only called if the whole seal is valid.
+ */
+int evr_glacier_read_bucket_seal(const char *bucket_path, size_t end_offset, int (*visit)(void *ctx, struct evr_glacier_bucket_seal_entry *entry), void *ctx);
+
 #endif
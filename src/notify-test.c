@@ -41,8 +41,36 @@ void test_notify_send(void){
     evr_free_notify_ctx(nt);
 }
 
+void test_notify_many_observers(void){
+    const size_t observers_len = 100;
+    struct evr_notify_ctx *nt = evr_create_notify_ctx(observers_len, 1, 1);
+    assert(nt);
+    struct evr_queue *msgs[observers_len];
+    for(size_t i = 0; i < observers_len; ++i){
+        msgs[i] = evr_notify_register(nt, NULL);
+        assert(msgs[i]);
+    }
+    assert(!evr_notify_register(nt, NULL));
+    assert(is_ok(evr_notify_unregister(nt, msgs[42])));
+    msgs[42] = evr_notify_register(nt, NULL);
+    assert(msgs[42]);
+    char send = 's';
+    assert(is_ok(evr_notify_send(nt, &send, NULL, NULL)));
+    assert(is_ok(evr_notify_send(nt, &send, NULL, NULL)));
+    char receive = 'r';
+    for(size_t i = 0; i < observers_len; ++i){
+        // the second message overflowed the queues
+        assert(evr_queue_take(msgs[i], &receive) == evr_temporary_occupied);
+        assert(is_ok(evr_queue_reset(msgs[i])));
+        assert(evr_queue_take_nowait(msgs[i], &receive) == evr_not_found);
+        assert(is_ok(evr_notify_unregister(nt, msgs[i])));
+    }
+    evr_free_notify_ctx(nt);
+}
+
 int main(void){
     evr_init_basics();
     run_test(test_notify_send);
+    run_test(test_notify_many_observers);
     return 0;
 }
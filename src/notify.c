@@ -24,29 +24,22 @@
 #include "errors.h"
 #include "logger.h"
 
-struct evr_notify_ctx *evr_create_notify_ctx(size_t observers_len, size_t msgs_len_exp, size_t msg_size){
-    char *buf = malloc(sizeof(struct evr_notify_ctx) + observers_len * sizeof(struct evr_observer));
-    if(!buf){
+struct evr_notify_ctx *evr_create_notify_ctx(size_t max_observers, size_t msgs_len_exp, size_t msg_size){
+    struct evr_notify_ctx *nt = malloc(sizeof(struct evr_notify_ctx));
+    if(!nt){
         return NULL;
     }
-    struct evr_buf_pos bp;
-    evr_init_buf_pos(&bp, buf);
-    struct evr_notify_ctx *nt;
-    evr_map_struct(&bp, nt);
     if(mtx_init(&nt->lock, mtx_plain) != thrd_success){
         goto out_with_free;
     }
-    nt->observers_len = observers_len;
-    nt->observers = (struct evr_observer*)bp.pos;
+    nt->max_observers = max_observers;
+    nt->observers_len = 0;
+    nt->observers = NULL;
     nt->msgs_len_exp = msgs_len_exp;
     nt->msg_size = msg_size;
-    struct evr_observer *end = &nt->observers[observers_len];
-    for(struct evr_observer *it = nt->observers; it != end; ++it){
-        it->messages = NULL;
-    }
     return nt;
  out_with_free:
-    free(buf);
+    free(nt);
     return NULL;
 }
 
@@ -88,6 +81,7 @@ int evr_free_notify_ctx(struct evr_notify_ctx *nt){
         ret = evr_error;
     }
     mtx_destroy(&nt->lock);
+    free(nt->observers);
     free(nt);
  out:
     return ret;
@@ -121,24 +115,36 @@ int evr_notify_send(struct evr_notify_ctx *nt, void *entry, int (*filter)(void *
     return ret;
 }
 
+/**
+ * evr_notify_grow_observers doubles the allocated observers up to
+ * max_observers. nt->lock must be locked.
+ *
+ * Returns evr_temporary_occupied if max_observers are already
+ * allocated.
+ */
+int evr_notify_grow_observers(struct evr_notify_ctx *nt);
+
 struct evr_queue *evr_notify_register(struct evr_notify_ctx *nt, void *ctx){
     struct evr_queue *ret = NULL;
     if(mtx_lock(&nt->lock) != thrd_success){
         goto out;
     }
-    struct evr_observer *end = &nt->observers[nt->observers_len];
-    for(struct evr_observer *it = nt->observers; it != end; ++it){
-        if(it->messages){
-            continue;
-        }
-        it->messages = evr_create_queue(nt->msgs_len_exp, nt->msg_size);
-        if(!it->messages){
-            goto out_with_free_lock;
+    size_t i = 0;
+    for(; i < nt->observers_len; ++i){
+        if(!nt->observers[i].messages){
+            break;
         }
-        it->ctx = ctx;
-        ret = it->messages;
-        break;
     }
+    if(i == nt->observers_len && evr_notify_grow_observers(nt) != evr_ok){
+        goto out_with_free_lock;
+    }
+    struct evr_observer *obs = &nt->observers[i];
+    obs->messages = evr_create_queue(nt->msgs_len_exp, nt->msg_size);
+    if(!obs->messages){
+        goto out_with_free_lock;
+    }
+    obs->ctx = ctx;
+    ret = obs->messages;
  out_with_free_lock:
     if(mtx_unlock(&nt->lock) != thrd_success){
         evr_panic("Unable to unlock notify lock");
@@ -147,6 +153,23 @@ struct evr_queue *evr_notify_register(struct evr_notify_ctx *nt, void *ctx){
     return ret;
 }
 
+int evr_notify_grow_observers(struct evr_notify_ctx *nt){
+    if(nt->observers_len >= nt->max_observers){
+        return evr_temporary_occupied;
+    }
+    size_t new_len = min(max(nt->observers_len * 2, 8), nt->max_observers);
+    struct evr_observer *new_observers = realloc(nt->observers, new_len * sizeof(struct evr_observer));
+    if(!new_observers){
+        return evr_error;
+    }
+    for(size_t i = nt->observers_len; i < new_len; ++i){
+        new_observers[i].messages = NULL;
+    }
+    nt->observers = new_observers;
+    nt->observers_len = new_len;
+    return evr_ok;
+}
+
 int evr_notify_unregister(struct evr_notify_ctx *nt, struct evr_queue *messages){
     int ret = evr_error;
     if(!messages){
@@ -44,6 +44,13 @@ struct evr_observer {
 
 struct evr_notify_ctx {
     mtx_t lock;
+
+    /**
+     * observers grows on demand up to max_observers
+     * entries. observers_len is the number of allocated observers
+     * entries.
+     */
+    size_t max_observers;
     size_t observers_len;
     struct evr_observer *observers;
     size_t msgs_len_exp;
@@ -54,11 +61,15 @@ struct evr_notify_ctx {
  * evr_create_notify_ctx creates a new context for performing
  * notifications.
  *
+ * max_observers is the number of observers which can be registered
+ * at the same time. Memory for observers is only allocated when they
+ * register.
+ *
  * msgs_len_exp defines is the exponent to the base of 2 which defines
  * how many messages can be kept in the notifications context for each
  * observer at max.
  */
-struct evr_notify_ctx *evr_create_notify_ctx(size_t observers_len, size_t msgs_len_exp, size_t msg_size);
+struct evr_notify_ctx *evr_create_notify_ctx(size_t max_observers, size_t msgs_len_exp, size_t msg_size);
 
 int evr_free_notify_ctx(struct evr_notify_ctx *nt);
 
@@ -66,7 +77,8 @@ int evr_free_notify_ctx(struct evr_notify_ctx *nt);
  * evr_notify_send puts entry into observer queues.
  *
  * Returns evr_ok even if one of the observer queues had no more
- * capacity.
+ * capacity. The overflowed queue reports evr_temporary_occupied to
+ * its consumer, which must recover the lost messages.
  */
 int evr_notify_send(struct evr_notify_ctx *nt, void *entry, int (*filter)(void *ctx, void *obs_ctx, void *entry), void *ctx);
 
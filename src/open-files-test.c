@@ -18,16 +18,61 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "assert.h"
 #include "test.h"
 #include "open-files.h"
 #include "evr-glacier-client.h"
+#include "file-mem.h"
+#include "logger.h"
 
 // mock
 int evr_req_cmd_get_blob(struct evr_file *f, evr_blob_ref key, struct evr_resp_header *resp){
     return evr_error;
 }
 
+/**
+ * slice_data is served by the evr_req_cmd_get_blob_range mock for the
+ * slice whose key starts with the slice's index.
+ */
+char *slice_data[] = {
+    "0123456789",
+    "abcdefghij",
+};
+
+#define max_requested_ranges 4
+
+struct evr_blob_range requested_ranges[max_requested_ranges];
+size_t requested_ranges_len = 0;
+
+/**
+ * range_resp_missing_bytes makes the mock respond less bytes than
+ * requested.
+ */
+size_t range_resp_missing_bytes = 0;
+
+// mock
+int evr_req_cmd_get_blob_range(struct evr_file *f, struct evr_blob_range *range, struct evr_resp_header *resp, struct evr_stat_blob_resp *stat){
+    assert(requested_ranges_len < max_requested_ranges);
+    requested_ranges[requested_ranges_len++] = *range;
+    const char *data = slice_data[(size_t)range->key[0]];
+    assert(range->offset + range->size <= strlen(data));
+    const size_t resp_size = range->size - range_resp_missing_bytes;
+    // the response's range bytes are prepared in the glacier
+    // connection's memory so they can be read from it afterwards.
+    struct evr_file_mem *fm = f->ctx.p;
+    fm->used_size = 0;
+    fm->offset = 0;
+    assert(is_ok(write_n(f, &data[range->offset], resp_size)));
+    fm->offset = 0;
+    resp->status_code = evr_status_code_ok;
+    resp->body_size = evr_stat_blob_resp_n_size + resp_size;
+    stat->flags = 0;
+    stat->blob_size = strlen(data);
+    return evr_ok;
+}
+
 void test_open_close_many_files_sequentially(void){
     struct evr_open_file_set set;
     assert(is_ok(evr_init_open_file_set(&set)));
@@ -53,9 +98,56 @@ void test_open_close_two_files_parallel(void){
     assert(is_ok(evr_empty_open_file_set(&set)));
 }
 
+void test_read_trusted_ranges(void){
+    struct evr_file_mem fm;
+    assert(is_ok(evr_init_file_mem(&fm, 64, 64)));
+    struct evr_file_slice slices[static_len(slice_data)];
+    for(size_t i = 0; i < static_len(slice_data); ++i){
+        memset(slices[i].ref, i, evr_blob_ref_size);
+        slices[i].size = strlen(slice_data[i]);
+    }
+    struct evr_file_claim claim;
+    memset(&claim, 0, sizeof(claim));
+    claim.slices_len = static_len(slices);
+    claim.slices = slices;
+    struct evr_open_file f;
+    f.open = 1;
+    assert(mtx_init(&f.lock, mtx_plain) == thrd_success);
+    evr_file_bind_file_mem(&f.gc, &fm);
+    f.claim = &claim;
+    f.trust_ranges = 1;
+    f.cached_slice_buf = NULL;
+    requested_ranges_len = 0;
+    range_resp_missing_bytes = 0;
+    char buf[6];
+    size_t size = sizeof(buf);
+    // the read spans the end of the first and the start of the
+    // second slice.
+    assert(is_ok(evr_open_file_read(&f, buf, &size, 7)));
+    assert_msg(size == sizeof(buf), "But was %zu", size);
+    assert(memcmp(buf, "789abc", sizeof(buf)) == 0);
+    assert(requested_ranges_len == 2);
+    assert(requested_ranges[0].key[0] == 0);
+    assert(requested_ranges[0].offset == 7);
+    assert(requested_ranges[0].size == 3);
+    assert(requested_ranges[1].key[0] == 1);
+    assert(requested_ranges[1].offset == 0);
+    assert(requested_ranges[1].size == 3);
+    // ranges are not cached
+    assert(f.cached_slice_buf == NULL);
+    log_info("Read a range which the glacier answers incomplete");
+    range_resp_missing_bytes = 1;
+    size = 2;
+    assert(is_err(evr_open_file_read(&f, buf, &size, 2)));
+    range_resp_missing_bytes = 0;
+    mtx_destroy(&f.lock);
+    evr_destroy_file_mem(&fm);
+}
+
 int main(void){
     evr_init_basics();
     run_test(test_open_close_many_files_sequentially);
     run_test(test_open_close_two_files_parallel);
+    run_test(test_read_trusted_ranges);
     return 0;
 }
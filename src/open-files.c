@@ -24,6 +24,7 @@
 #include "evr-glacier-client.h"
 
 int evr_open_file_cache_slice(struct evr_open_file *f, size_t si);
+int evr_open_file_read_slice_range(struct evr_open_file *f, size_t si, char *buf, size_t off, size_t size);
 
 int evr_open_file_read(struct evr_open_file *f, char *buf, size_t *size, off_t off){
     int ret = evr_error;
@@ -35,18 +36,26 @@ int evr_open_file_read(struct evr_open_file *f, char *buf, size_t *size, off_t o
     for(size_t si = 0; si < f->claim->slices_len; ++si){
         struct evr_file_slice *s = &f->claim->slices[si];
         if((size_t)off < slices_off + s->size){
-            if(f->cached_slice_buf == NULL || f->cached_slice_index != si){
-                log_debug("Loading slice %zu into cache", si);
-                if(evr_open_file_cache_slice(f, si) != evr_ok){
-                    log_error("Unable to load slice %zu into cache", si);
-                    goto out_with_unlock;
-                }
-            }
             off_t s_off = slices_off >= off ? 0 : off - slices_off;
             size_t remaining_bytes = *size - buf_bytes_written;
             size_t s_size = remaining_bytes >= (s->size - s_off) ? (s->size - s_off) : remaining_bytes;
-            log_debug("Read %zu bytes at offset %zu from slice %zu", s_size, (size_t)s_off, si);
-            memcpy(&buf[buf_bytes_written], &f->cached_slice_buf[s_off], s_size);
+            if(f->trust_ranges && (f->cached_slice_buf == NULL || f->cached_slice_index != si)){
+                log_debug("Read %zu bytes at offset %zu from slice %zu range", s_size, (size_t)s_off, si);
+                if(evr_open_file_read_slice_range(f, si, &buf[buf_bytes_written], s_off, s_size) != evr_ok){
+                    log_error("Unable to read range of slice %zu", si);
+                    goto out_with_unlock;
+                }
+            } else {
+                if(f->cached_slice_buf == NULL || f->cached_slice_index != si){
+                    log_debug("Loading slice %zu into cache", si);
+                    if(evr_open_file_cache_slice(f, si) != evr_ok){
+                        log_error("Unable to load slice %zu into cache", si);
+                        goto out_with_unlock;
+                    }
+                }
+                log_debug("Read %zu bytes at offset %zu from slice %zu", s_size, (size_t)s_off, si);
+                memcpy(&buf[buf_bytes_written], &f->cached_slice_buf[s_off], s_size);
+            }
             buf_bytes_written += s_size;
             if(buf_bytes_written == *size){
                 break;
@@ -125,6 +134,40 @@ int evr_open_file_cache_slice(struct evr_open_file *f, size_t si){
     return evr_error;
 }
 
+int evr_open_file_read_slice_range(struct evr_open_file *f, size_t si, char *buf, size_t off, size_t size){
+    struct evr_file_slice *s = &f->claim->slices[si];
+    struct evr_blob_range range;
+    memcpy(range.key, s->ref, evr_blob_ref_size);
+    range.offset = off;
+    range.size = size;
+    struct evr_resp_header rhdr;
+    struct evr_stat_blob_resp stat;
+    if(evr_req_cmd_get_blob_range(&f->gc, &range, &rhdr, &stat) != evr_ok){
+        goto fail_with_close_gc;
+    }
+    if(rhdr.status_code != evr_status_code_ok){
+        if(dump_n(&f->gc, rhdr.body_size, NULL, NULL) != evr_ok){
+            goto fail_with_close_gc;
+        }
+        return evr_error;
+    }
+    size_t range_size = rhdr.body_size - evr_stat_blob_resp_n_size;
+    if(range_size != size){
+        log_error("Glacier responded %zu bytes for a slice range of %zu bytes", range_size, size);
+        goto fail_with_close_gc;
+    }
+    if(read_n(&f->gc, buf, size, NULL, NULL) != evr_ok){
+        goto fail_with_close_gc;
+    }
+    return evr_ok;
+ fail_with_close_gc:
+    log_error("Failed to communicate with glacier");
+    if(f->gc.close(&f->gc) != 0){
+        evr_panic("Unable to close glacier connection");
+    }
+    return evr_error;
+}
+
 int evr_init_open_file_set(struct evr_open_file_set *ofs){
     if(mtx_init(&ofs->files_lock, mtx_plain) != thrd_success){
         goto fail;
@@ -143,6 +186,7 @@ int evr_init_open_file_set(struct evr_open_file_set *ofs){
         }
         evr_file_bind_fd(&f->gc, 0);
         f->claim = NULL;
+        f->trust_ranges = 0;
         f->cached_slice_buf = NULL;
     }
     return evr_ok;
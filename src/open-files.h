@@ -38,6 +38,13 @@ struct evr_open_file {
 
     struct evr_file_claim *claim;
 
+    /**
+     * trust_ranges indicates that reads of not cached slices fetch
+     * only the read range from the glacier. The fetched range is not
+     * verified against the slice's key and not cached.
+     */
+    int trust_ranges;
+
     size_t cached_slice_index;
     char *cached_slice_buf;
 };
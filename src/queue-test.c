@@ -18,6 +18,10 @@
 
 #include "config.h"
 
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include "queue.h"
 #include "test.h"
 #include "assert.h"
@@ -44,6 +48,8 @@ void test_overflow_queue(void){
     assert(q->status == evr_temporary_occupied);
     assert(evr_queue_put(q, &a) == evr_temporary_occupied);
     assert(q->status == evr_temporary_occupied);
+    char b = 'x';
+    assert(evr_queue_take_nowait(q, &b) == evr_temporary_occupied);
     evr_queue_end_producing(q);
     int status = evr_ok;
     assert(is_ok(evr_free_queue(q, &status)));
@@ -64,10 +70,55 @@ void test_put_take_queue(void){
     assert(is_ok(evr_free_queue(q, NULL)));
 }
 
+void test_take_nowait_with_signal_fd(void){
+    struct evr_queue *q = evr_create_queue(2, 1);
+    assert(q);
+    int efd = eventfd(0, EFD_NONBLOCK);
+    assert(efd >= 0);
+    assert(is_ok(evr_queue_set_signal_fd(q, efd)));
+    char b = 'x';
+    assert(evr_queue_take_nowait(q, &b) == evr_not_found);
+    uint64_t signals;
+    assert(read(efd, &signals, sizeof(signals)) == -1);
+    char a = 'a';
+    assert(is_ok(evr_queue_put(q, &a)));
+    assert(is_ok(evr_queue_put(q, &a)));
+    assert(read(efd, &signals, sizeof(signals)) == sizeof(signals));
+    assert(signals == 2);
+    assert(is_ok(evr_queue_take_nowait(q, &b)));
+    assert(b == 'a');
+    assert(is_ok(evr_queue_take_nowait(q, &b)));
+    assert(evr_queue_take_nowait(q, &b) == evr_not_found);
+    evr_queue_end_producing(q);
+    assert(is_ok(evr_free_queue(q, NULL)));
+    assert(close(efd) == 0);
+}
+
+void test_reset_overflowed_queue(void){
+    struct evr_queue *q = evr_create_queue(1, 1);
+    assert(q);
+    char a = 'a';
+    assert(is_ok(evr_queue_put(q, &a)));
+    assert(evr_queue_put(q, &a) == evr_temporary_occupied);
+    assert(is_ok(evr_queue_reset(q)));
+    char b = 'x';
+    assert(evr_queue_take_nowait(q, &b) == evr_not_found);
+    b = 'b';
+    assert(is_ok(evr_queue_put(q, &b)));
+    assert(is_ok(evr_queue_take_nowait(q, &a)));
+    assert(a == 'b');
+    evr_queue_end_producing(q);
+    int status = evr_error;
+    assert(is_ok(evr_free_queue(q, &status)));
+    assert(is_ok(status));
+}
+
 int main(void){
     evr_init_basics();
     run_test(test_empty_queue_wait);
     run_test(test_overflow_queue);
     run_test(test_put_take_queue);
+    run_test(test_take_nowait_with_signal_fd);
+    run_test(test_reset_overflowed_queue);
     return 0;
 }
@@ -20,6 +20,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "basics.h"
 #include "errors.h"
@@ -47,6 +49,7 @@ struct evr_queue *evr_create_queue(size_t items_len_exp, size_t item_size){
     q->items_len = items_len;
     q->item_size = item_size;
     q->items_buf = bp.pos;
+    q->signal_fd = -1;
     if(mtx_init(&q->producing, mtx_plain) != thrd_success){
         goto out_with_free_fill;
     }
@@ -98,15 +101,33 @@ int evr_free_queue(struct evr_queue *q, int *status){
     return ret;
 }
 
+int evr_queue_take_within(struct evr_queue *q, void *entry, int wait);
+
 int evr_queue_take(struct evr_queue *q, void *entry){
+    return evr_queue_take_within(q, entry, 1);
+}
+
+int evr_queue_take_nowait(struct evr_queue *q, void *entry){
+    return evr_queue_take_within(q, entry, 0);
+}
+
+int evr_queue_take_within(struct evr_queue *q, void *entry, int wait){
     int ret = evr_error;
     if(mtx_lock(&q->lock) != thrd_success){
         goto out;
     }
+    if(q->status == evr_temporary_occupied){
+        ret = evr_temporary_occupied;
+        goto out_with_unlock;
+    }
     if(q->status != evr_ok){
         goto out_with_unlock;
     }
     if(q->writing_i == q->reading_i){
+        if(!wait){
+            ret = evr_not_found;
+            goto out_with_unlock;
+        }
         time_t t;
         time(&t);
         struct timespec timeout;
@@ -161,6 +182,13 @@ int evr_queue_put(struct evr_queue *q, void *entry){
         evr_panic("Unable to signal queue filled");
         ret = evr_error;
     }
+    if(q->signal_fd >= 0){
+        uint64_t one = 1;
+        if(write(q->signal_fd, &one, sizeof(one)) != sizeof(one)){
+            evr_panic("Unable to signal queue filled via eventfd");
+            ret = evr_error;
+        }
+    }
  out_with_unlock:
     if(mtx_unlock(&q->lock) != thrd_success){
         evr_panic("Failed to unlock queue lock");
@@ -169,3 +197,35 @@ int evr_queue_put(struct evr_queue *q, void *entry){
  out:
     return ret;
 }
+
+int evr_queue_reset(struct evr_queue *q){
+    int ret = evr_error;
+    if(mtx_lock(&q->lock) != thrd_success){
+        goto out;
+    }
+    if(q->status != evr_ok && q->status != evr_temporary_occupied){
+        goto out_with_unlock;
+    }
+    q->reading_i = q->writing_i;
+    q->status = evr_ok;
+    ret = evr_ok;
+ out_with_unlock:
+    if(mtx_unlock(&q->lock) != thrd_success){
+        evr_panic("Unable to unlock queue lock");
+        ret = evr_error;
+    }
+ out:
+    return ret;
+}
+
+int evr_queue_set_signal_fd(struct evr_queue *q, int fd){
+    if(mtx_lock(&q->lock) != thrd_success){
+        return evr_error;
+    }
+    q->signal_fd = fd;
+    if(mtx_unlock(&q->lock) != thrd_success){
+        evr_panic("Unable to unlock queue lock");
+        return evr_error;
+    }
+    return evr_ok;
+}
@@ -72,6 +72,11 @@ struct evr_queue {
     size_t item_size;
     char *items_buf;
     mtx_t producing;
+    /**
+     * signal_fd is an eventfd which is written every time an entry
+     * is put into the queue. -1 if no eventfd is set.
+     */
+    int signal_fd;
 };
 
 /**
@@ -92,10 +97,34 @@ int evr_queue_get_status(struct evr_queue *q);
  * evr_queue_take blocks for a moment and retrieves and removes the
  * next entry from the queue.
  *
- * Returns evr_not_found if no entry was available.
+ * Returns evr_not_found if no entry was available. Returns
+ * evr_temporary_occupied if the queue overflowed and entries got
+ * lost. No more entries can be taken until evr_queue_reset is called.
  */
 int evr_queue_take(struct evr_queue *q, void *entry);
 
+/**
+ * evr_queue_take_nowait works like evr_queue_take but returns
+ * evr_not_found right away if no entry is available.
+ */
+int evr_queue_take_nowait(struct evr_queue *q, void *entry);
+
+/**
+ * evr_queue_reset drops all entries from an overflowed queue so
+ * entries can be put and taken again.
+ *
+ * The consumer must recover the dropped entries from somewhere else.
+ */
+int evr_queue_reset(struct evr_queue *q);
+
+/**
+ * evr_queue_set_signal_fd sets an eventfd which is written every time
+ * an entry is put into the queue. This allows consumers to wait for
+ * entries using poll or epoll instead of evr_queue_take. The eventfd
+ * is not closed by the queue.
+ */
+int evr_queue_set_signal_fd(struct evr_queue *q, int fd);
+
 /**
  * evr_queue_put puts the given entry into the queue.
  *